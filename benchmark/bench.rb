@@ -0,0 +1,246 @@
+# Benchmarks one RocketAMF implementation against the spec fixtures and a set
+# of synthetic workloads. Run it through rake:
+#
+#   rake bench                          # Both implementations, as a table
+#   rake bench IMPL=ext FILTER=wide     # Just the extension, matching names
+#   rake bench FORMAT=json OUT=new.json # JSON lines, one per result
+#   rake bench:compare OLD=old.json NEW=new.json
+#
+# or directly, with the extension on the load path for ext:
+#
+#   ruby -Ilib -Iext benchmark/bench.rb ext
+#   ruby -Ilib benchmark/bench.rb pure
+#
+# TIME is the minimum seconds spent on each case and SCALE multiplies the size
+# of the synthetic workloads.
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'rocketamf'
+require 'rocketamf/pure/io_helpers'
+require 'benchmark'
+
+module RocketAMF
+  module Bench
+    ROOT = File.expand_path('../..', __FILE__)
+
+    class Point
+      attr_accessor :x, :y, :label
+    end
+
+    # Matches the class in the externalizable fixture
+    class Externalizable
+      include RocketAMF::Pure::ReadIOHelpers
+      include RocketAMF::Pure::WriteIOHelpers
+      attr_accessor :one, :two
+
+      def encode_amf serializer
+        serializer.write_object(self, nil, {:class_name => 'ExternalizableTest', :dynamic => false, :externalizable => true, :members => []})
+      end
+
+      def read_external des
+        @one = read_double(des.source)
+        @two = read_double(des.source)
+      end
+
+      def write_external ser
+        ser.stream << pack_double(@one)
+        ser.stream << pack_double(@two)
+      end
+    end
+
+    def self.binread path
+      data = File.open(path, 'rb') {|f| f.read }
+      data.force_encoding("ASCII-8BIT") if data.respond_to?(:force_encoding)
+      data
+    end
+
+    def self.allocations
+      GC.stat[:total_allocated_objects] if GC.respond_to?(:stat) && GC.stat.has_key?(:total_allocated_objects)
+    end
+
+    # Runs the block until at least min_time has passed, after a warm up call,
+    # and returns iteration count, elapsed time, allocations and GC time
+    def self.measure min_time
+      yield
+      profiler = defined?(GC::Profiler) && GC::Profiler.respond_to?(:total_time)
+      if profiler
+        GC::Profiler.enable
+        GC::Profiler.clear
+      end
+      allocs = allocations
+      iterations = 0
+      elapsed = Benchmark.realtime do
+        start = Time.now
+        begin
+          yield
+          iterations += 1
+        end while Time.now - start < min_time
+      end
+      result = {:iterations => iterations, :elapsed => elapsed}
+      result[:allocs] = allocations - allocs if allocs
+      if profiler
+        result[:gc_time] = GC::Profiler.total_time
+        GC::Profiler.disable
+      end
+      result
+    end
+
+    # Returns [name, version, object] for each synthetic workload
+    def self.synthetic scale
+      n = lambda {|count| [(count * scale).to_i, 1].max }
+
+      deep = nil
+      n.call(200).times {|i| deep = {"level" => i, "child" => [deep, "leaf #{i % 10}"]} }
+
+      points = Array.new(n.call(10_000)) do |i|
+        point = Point.new
+        point.x, point.y, point.label = i, i * 0.5, "point #{i % 100}"
+        point
+      end
+
+      words = Array.new(100) {|i| "repeated string number #{i}" }
+      strings = Array.new(n.call(20_000)) {|i| i % 50 == 0 ? "long #{i} " * 100 : words[i % words.length] }
+
+      wide = {}
+      n.call(10_000).times {|i| wide["key_#{i}"] = i }
+
+      ints = Array.new(n.call(1_000_000)) {|i| i }
+      doubles = Array.new(n.call(1_000_000)) {|i| i * 0.25 }
+
+      workloads = []
+      [0, 3].each do |version|
+        workloads << ["wide_hash", version, wide]
+        workloads << ["deep_nesting", version, deep]
+        workloads << ["typed_objects", version, points]
+        workloads << ["repeated_strings", version, strings]
+      end
+      workloads << ["int_array", 3, ints]
+      workloads << ["double_array", 3, doubles]
+      workloads << ["double_vector", 3, RocketAMF::Values::Vector.new(:double, doubles)]
+      workloads
+    end
+
+    # Returns [name, op, bytes, proc] for every case
+    def self.cases scale
+      list = []
+      Dir[File.join(ROOT, 'spec', 'fixtures', 'objects', '*.bin')].sort.each do |path|
+        data = binread(path)
+        name = "fixture/#{File.basename(path, '.bin')}"
+        version = name =~ /amf3/ ? 3 : 0
+        obj = begin
+          RocketAMF.deserialize(data, version)
+        rescue Exception => e
+          warn "#{name}: #{e.class} - skipped"
+          next
+        end
+        list << [name, "deserialize", data.length, lambda { RocketAMF.deserialize(data, version) }]
+        list << [name, "serialize", data.length, lambda { RocketAMF.serialize(obj, version) }]
+      end
+
+      Dir[File.join(ROOT, 'spec', 'fixtures', 'request', '*.bin')].sort.each do |path|
+        data = binread(path)
+        name = "request/#{File.basename(path, '.bin')}"
+        list << [name, "round_trip", data.length, lambda {
+          env = RocketAMF::Envelope.new.populate_from_stream(data)
+          env.messages.each {|m| m.data }
+          env.serialize
+        }]
+      end
+
+      synthetic(scale).each do |name, version, obj|
+        data = RocketAMF.serialize(obj, version)
+        name = "synthetic/#{name}-amf#{version}"
+        list << [name, "deserialize", data.length, lambda { RocketAMF.deserialize(data, version) }]
+        list << [name, "serialize", data.length, lambda { RocketAMF.serialize(obj, version) }]
+      end
+      list
+    end
+
+    def self.run impl, opts
+      expected = impl == 'ext' ? 'RocketAMF::Ext::Deserializer' : 'RocketAMF::Pure::Deserializer'
+      if RocketAMF::Deserializer.name != expected
+        abort "Asked for #{impl}, but RocketAMF loaded #{RocketAMF::Deserializer.name}"
+      end
+      RocketAMF::ClassMapper.define do |m|
+        m.map :as => 'bench.Point', :ruby => 'RocketAMF::Bench::Point'
+        m.map :as => 'ExternalizableTest', :ruby => 'RocketAMF::Bench::Externalizable'
+      end
+
+      ruby = "#{RUBY_VERSION}p#{defined?(RUBY_PATCHLEVEL) ? RUBY_PATCHLEVEL : 0}"
+      if opts[:format] == 'text'
+        printf "%-44s %-12s %-4s %12s %10s %12s %10s\n", "case", "op", "impl", "ops/sec", "MB/s", "allocs/op", "gc ms/op"
+      end
+      cases(opts[:scale]).each do |name, op, bytes, block|
+        next if opts[:filter] && name !~ opts[:filter]
+        r = measure(opts[:time], &block)
+        ops = r[:iterations] / r[:elapsed]
+        row = {
+          :impl => impl, :ruby => ruby, :name => name, :op => op, :bytes => bytes,
+          :iterations => r[:iterations], :ops_per_sec => ops, :mb_per_sec => ops * bytes / 1048576.0,
+          :allocs_per_op => r[:allocs] && r[:allocs] / r[:iterations],
+          :gc_ms_per_op => r[:gc_time] && r[:gc_time] * 1000 / r[:iterations]
+        }
+        if opts[:format] == 'json'
+          puts json(row)
+        else
+          printf "%-44s %-12s %-4s %12.1f %10.2f %12s %10s\n", name, op, impl, row[:ops_per_sec], row[:mb_per_sec],
+                 row[:allocs_per_op] || '-', row[:gc_ms_per_op] ? '%.3f' % row[:gc_ms_per_op] : '-'
+        end
+        $stdout.flush
+      end
+    end
+
+    # Just enough JSON for flat rows of strings and numbers, so it runs on
+    # rubies without the json library
+    def self.json row
+      '{' + row.map {|k, v|
+        value = case v
+                when nil then 'null'
+                when String then '"' + v.gsub(/["\\]/) {|c| "\\" + c } + '"'
+                when Float then v.finite? ? ('%.6g' % v) : 'null'
+                else v.to_s
+                end
+        "\"#{k}\":#{value}"
+      }.join(',') + '}'
+    end
+
+    def self.parse_json line
+      row = {}
+      line.scan(/"(\w+)":("(?:[^"\\]|\\.)*"|[^,}]+)/) do |k, v|
+        row[k] = v[0, 1] == '"' ? v[1..-2].gsub(/\\(.)/, '\1') : (v == 'null' ? nil : v.to_f)
+      end
+      row
+    end
+
+    # Prints the ops/sec ratio of every case found in both result files
+    def self.compare old_path, new_path
+      load_rows = lambda do |path|
+        rows = {}
+        File.readlines(path).each do |line|
+          row = parse_json(line)
+          rows[[row['impl'], row['name'], row['op']]] = row if row['name']
+        end
+        rows
+      end
+      old_rows, new_rows = load_rows.call(old_path), load_rows.call(new_path)
+      printf "%-44s %-12s %-4s %12s %12s %8s\n", "case", "op", "impl", "old ops/s", "new ops/s", "change"
+      new_rows.keys.sort.each do |key|
+        next unless old = old_rows[key]
+        new = new_rows[key]
+        printf "%-44s %-12s %-4s %12.1f %12.1f %+7.1f%%\n", key[1], key[2], key[0], old['ops_per_sec'], new['ops_per_sec'],
+               (new['ops_per_sec'] / old['ops_per_sec'] - 1) * 100
+      end
+    end
+  end
+end
+
+if __FILE__ == $0
+  if ARGV[0] == 'compare'
+    RocketAMF::Bench.compare(ARGV[1], ARGV[2])
+  else
+    RocketAMF::Bench.run(ARGV[0] || 'ext',
+      :format => ENV['FORMAT'] || 'text',
+      :filter => ENV['FILTER'] && Regexp.new(ENV['FILTER']),
+      :time => (ENV['TIME'] || 1).to_f,
+      :scale => (ENV['SCALE'] || 1).to_f)
+  end
+end
@@ -0,0 +1,275 @@
+#include "byte_array.h"
+#include <string.h>
+
+extern VALUE mRocketAMFExt;
+VALUE cByteArray;
+
+static void ba_mark(AMF_BYTE_ARRAY *ba) {
+    if(!ba) return;
+    rb_gc_mark(ba->str);
+}
+
+static void ba_free(AMF_BYTE_ARRAY *ba) {
+    xfree(ba);
+}
+
+static VALUE ba_alloc(VALUE klass) {
+    AMF_BYTE_ARRAY *ba = ALLOC(AMF_BYTE_ARRAY);
+    ba->str = rb_str_new(NULL, 0);
+    ba->pos = 0;
+    return Data_Wrap_Struct(klass, ba_mark, ba_free, ba);
+}
+
+AMF_BYTE_ARRAY *byte_array_get(VALUE self) {
+    AMF_BYTE_ARRAY *ba;
+    Data_Get_Struct(self, AMF_BYTE_ARRAY, ba);
+    return ba;
+}
+
+/*
+ * Wraps str without copying it, for the deserializer and slices
+ */
+VALUE byte_array_new(VALUE str) {
+    VALUE self = ba_alloc(cByteArray);
+    byte_array_get(self)->str = str;
+    return self;
+}
+
+/*
+ * Returns len bytes of str from offset, sharing its buffer where ruby can
+ */
+static VALUE ba_subseq(VALUE str, long offset, long len) {
+#ifdef HAVE_RB_STR_SUBSEQ
+    return rb_str_subseq(str, offset, len);
+#else
+    return rb_str_substr(str, offset, len); // Strings are bytes before 1.9
+#endif
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Values::ByteArray.new(str="") => byte_array
+ *
+ * Creates a byte array over str, which is used as is rather than copied, the
+ * same way StringIO.new does. AMF3 byte arrays are deserialized into these,
+ * and these and plain StringIOs are serialized as byte arrays.
+ */
+static VALUE ba_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    VALUE str;
+    rb_scan_args(argc, argv, "01", &str);
+    if(str != Qnil) {
+        StringValue(str);
+        ba->str = str;
+    }
+    ba->pos = 0;
+    return self;
+}
+
+/*
+ * Shares the string and copies the position, like StringIO#dup
+ */
+static VALUE ba_initialize_copy(VALUE self, VALUE orig) {
+    if(self == orig) return self;
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    AMF_BYTE_ARRAY *from = byte_array_get(orig);
+    ba->str = from->str;
+    ba->pos = from->pos;
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ba.string => str
+ */
+static VALUE ba_string(VALUE self) {
+    return byte_array_get(self)->str;
+}
+
+/*
+ * call-seq:
+ *   ba.string = str
+ *
+ * Switches to the bytes of str and rewinds
+ */
+static VALUE ba_set_string(VALUE self, VALUE str) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    StringValue(str);
+    ba->str = str;
+    ba->pos = 0;
+    return str;
+}
+
+/*
+ * call-seq:
+ *   ba.size => int
+ *
+ * Returns the length in bytes
+ */
+static VALUE ba_size(VALUE self) {
+    return LONG2NUM(RSTRING_LEN(byte_array_get(self)->str));
+}
+
+/*
+ * call-seq:
+ *   ba.pos => int
+ */
+static VALUE ba_pos(VALUE self) {
+    return LONG2NUM(byte_array_get(self)->pos);
+}
+
+/*
+ * call-seq:
+ *   ba.pos = int
+ *
+ * Moves to the given byte offset. Deserializers start reading from here and
+ * leave it after the last value they read.
+ */
+static VALUE ba_set_pos(VALUE self, VALUE pos) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    long p = NUM2LONG(pos);
+    if(p < 0) rb_raise(rb_eArgError, "negative position");
+    ba->pos = p;
+    return pos;
+}
+
+/*
+ * call-seq:
+ *   ba.rewind => 0
+ */
+static VALUE ba_rewind(VALUE self) {
+    byte_array_get(self)->pos = 0;
+    return INT2FIX(0);
+}
+
+/*
+ * call-seq:
+ *   ba.eof? => true or false
+ */
+static VALUE ba_eof(VALUE self) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    return ba->pos >= RSTRING_LEN(ba->str) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   ba.read => str
+ *   ba.read(length) => str or nil
+ *
+ * Copies out up to length bytes, or the rest of the bytes, the same way
+ * StringIO#read does
+ */
+static VALUE ba_read(int argc, VALUE *argv, VALUE self) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    VALUE length;
+    rb_scan_args(argc, argv, "01", &length);
+
+    long size = RSTRING_LEN(ba->str);
+    long left = ba->pos < size ? size - ba->pos : 0;
+    long len = left;
+    if(length != Qnil) {
+        len = NUM2LONG(length);
+        if(len < 0) rb_raise(rb_eArgError, "negative length %ld given", len);
+        if(len > 0 && left == 0) return Qnil;
+        if(len > left) len = left;
+    }
+    VALUE str = rb_str_new(RSTRING_PTR(ba->str) + ba->pos, len);
+    ba->pos += len;
+    return str;
+}
+
+/*
+ * call-seq:
+ *   ba.getbyte => 0..255 or nil
+ */
+static VALUE ba_getbyte(VALUE self) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    if(ba->pos >= RSTRING_LEN(ba->str)) return Qnil;
+    return INT2FIX((unsigned char)RSTRING_PTR(ba->str)[ba->pos++]);
+}
+
+/*
+ * call-seq:
+ *   ba.readbyte => 0..255
+ *
+ * Like getbyte, but raises EOFError at the end
+ */
+static VALUE ba_readbyte(VALUE self) {
+    VALUE byte = ba_getbyte(self);
+    if(byte == Qnil) rb_raise(rb_eEOFError, "end of file reached");
+    return byte;
+}
+
+/*
+ * call-seq:
+ *   ba.write(str) => int
+ *   ba << str => ba
+ *
+ * Writes the bytes of str at the current position, overwriting what's there
+ * and growing the string as needed, and returns how many were written. A
+ * position past the end is padded with zeros first.
+ */
+static VALUE ba_write(VALUE self, VALUE data) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    if(TYPE(data) != T_STRING) data = rb_obj_as_string(data);
+    long len = RSTRING_LEN(data);
+    if(len == 0) return INT2FIX(0);
+    if(data == ba->str) data = rb_str_new(RSTRING_PTR(data), len);
+
+    VALUE str = ba->str;
+    rb_str_modify(str);
+    long size = RSTRING_LEN(str);
+    if(ba->pos + len > size) {
+        rb_str_resize(str, ba->pos + len);
+        if(ba->pos > size) memset(RSTRING_PTR(str) + size, 0, ba->pos - size);
+    }
+    memcpy(RSTRING_PTR(str) + ba->pos, RSTRING_PTR(data), len);
+    ba->pos += len;
+    return LONG2NUM(len);
+}
+
+static VALUE ba_append(VALUE self, VALUE data) {
+    ba_write(self, data);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ba.slice(offset, length) => byte_array
+ *
+ * Returns a new byte array over length bytes of this one, starting at offset.
+ * Long slices share the bytes with this one rather than copying them, until
+ * either is written to.
+ */
+static VALUE ba_slice(VALUE self, VALUE offset, VALUE length) {
+    AMF_BYTE_ARRAY *ba = byte_array_get(self);
+    long off = NUM2LONG(offset);
+    long len = NUM2LONG(length);
+    long size = RSTRING_LEN(ba->str);
+    if(off < 0 || len < 0 || off > size) rb_raise(rb_eRangeError, "slice out of range");
+    if(len > size - off) len = size - off;
+    return byte_array_new(ba_subseq(ba->str, off, len));
+}
+
+void Init_rocket_amf_byte_array() {
+    cByteArray = rb_define_class_under(mRocketAMFExt, "ByteArray", rb_cObject);
+    rb_define_alloc_func(cByteArray, ba_alloc);
+    rb_define_method(cByteArray, "initialize", ba_initialize, -1);
+    rb_define_method(cByteArray, "initialize_copy", ba_initialize_copy, 1);
+    rb_define_method(cByteArray, "string", ba_string, 0);
+    rb_define_method(cByteArray, "string=", ba_set_string, 1);
+    rb_define_method(cByteArray, "size", ba_size, 0);
+    rb_define_method(cByteArray, "length", ba_size, 0);
+    rb_define_method(cByteArray, "pos", ba_pos, 0);
+    rb_define_method(cByteArray, "tell", ba_pos, 0);
+    rb_define_method(cByteArray, "pos=", ba_set_pos, 1);
+    rb_define_method(cByteArray, "rewind", ba_rewind, 0);
+    rb_define_method(cByteArray, "eof?", ba_eof, 0);
+    rb_define_method(cByteArray, "eof", ba_eof, 0);
+    rb_define_method(cByteArray, "read", ba_read, -1);
+    rb_define_method(cByteArray, "getbyte", ba_getbyte, 0);
+    rb_define_method(cByteArray, "readbyte", ba_readbyte, 0);
+    rb_define_method(cByteArray, "write", ba_write, 1);
+    rb_define_method(cByteArray, "<<", ba_append, 1);
+    rb_define_method(cByteArray, "slice", ba_slice, 2);
+}
@@ -0,0 +1,15 @@
+#include <ruby.h>
+
+/*
+ * An AMF3 ByteArray. The bytes are the slice of the source they were read
+ * from, held as a string that shares the source's buffer where the
+ * deserializer could share it, and the serializer writes them straight out of
+ * here. The position lives here rather than in a StringIO.
+ */
+typedef struct {
+    VALUE str;
+    long pos;
+} AMF_BYTE_ARRAY;
+
+AMF_BYTE_ARRAY *byte_array_get(VALUE self);
+VALUE byte_array_new(VALUE str);
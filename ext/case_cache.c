@@ -0,0 +1,193 @@
+#include "case_cache.h"
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/encoding.h>
+#endif
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+#include <ruby/ractor.h>
+#endif
+#include "ref_table.h"
+#include "str_table.h"
+
+#define CASE_CACHE_MAX 4096 // Entries per direction
+
+typedef struct {
+    STR_TABLE camel_by_str; // snake_case bytes => index into camel_values
+    REF_TABLE camel_by_sym; // snake_case symbol => index into camel_values
+    VALUE camel_values;     // Frozen camelCase strings
+    STR_TABLE snake_by_str; // camelCase bytes => pair index into snake_values
+    VALUE snake_values;     // Frozen snake_case string and its symbol (or nil) pairs
+} CASE_CACHE;
+
+static ID id_to_s;
+
+static void case_cache_mark(void *ptr) {
+    CASE_CACHE *cache = (CASE_CACHE *)ptr;
+    rb_gc_mark(cache->camel_values);
+    rb_gc_mark(cache->snake_values);
+    ref_table_mark(&cache->camel_by_sym);
+}
+
+static void case_cache_setup(CASE_CACHE *cache) {
+    str_table_init(&cache->camel_by_str);
+    ref_table_init(&cache->camel_by_sym);
+    str_table_init(&cache->snake_by_str);
+    cache->camel_values = rb_ary_new();
+    cache->snake_values = rb_ary_new();
+}
+
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+// Each ractor gets its own tables, since the arrays can't be shared
+static void case_cache_free(void *ptr) {
+    CASE_CACHE *cache = (CASE_CACHE *)ptr;
+    str_table_free(&cache->camel_by_str);
+    ref_table_free(&cache->camel_by_sym);
+    str_table_free(&cache->snake_by_str);
+    xfree(cache);
+}
+
+static const struct rb_ractor_local_storage_type case_cache_type = {case_cache_mark, case_cache_free};
+static rb_ractor_local_key_t case_cache_key;
+
+static CASE_CACHE *case_cache_get() {
+    CASE_CACHE *cache = (CASE_CACHE *)rb_ractor_local_storage_ptr(case_cache_key);
+    if(cache) return cache;
+
+    // Register it before the arrays are made, so they're marked from the start
+    cache = ALLOC(CASE_CACHE);
+    memset(cache, 0, sizeof(CASE_CACHE));
+    cache->camel_values = Qnil;
+    cache->snake_values = Qnil;
+    rb_ractor_local_storage_ptr_set(case_cache_key, cache);
+    case_cache_setup(cache);
+    return cache;
+}
+#else
+static CASE_CACHE main_cache;
+static VALUE case_cache; // Keeps main_cache alive
+
+static CASE_CACHE *case_cache_get() {
+    return &main_cache;
+}
+#endif
+
+/*
+ * Drop underscores and capitalize the letter following them
+ */
+static VALUE camelize_str(VALUE snake_str) {
+    const char *str = RSTRING_PTR(snake_str);
+    long i, len = RSTRING_LEN(snake_str), camel_len = 0;
+    VALUE camel = rb_str_new(0, len);
+    char *camel_str = RSTRING_PTR(camel);
+    int up = 0;
+
+    for(i = 0; i < len; i++) {
+        char c = str[i];
+        if(c == '_') {
+            up = 1;
+        } else if(up) {
+            up = 0;
+            camel_str[camel_len++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+        } else {
+            camel_str[camel_len++] = c;
+        }
+    }
+    rb_str_set_len(camel, camel_len);
+#ifdef HAVE_RB_STR_ENCODE
+    rb_enc_copy(camel, snake_str);
+#endif
+    RB_GC_GUARD(snake_str);
+    OBJ_FREEZE(camel);
+    return camel;
+}
+
+/*
+ * Replace capital letters with an underscore and the lower case letter
+ */
+static VALUE underscore_bytes(const char *str, long len) {
+    long i, snake_len = 0;
+    VALUE snake = rb_str_new(0, len * 2);
+    char *snake_str = RSTRING_PTR(snake);
+
+    for(i = 0; i < len; i++) {
+        char c = str[i];
+        if(c >= 'A' && c <= 'Z') {
+            snake_str[snake_len++] = '_';
+            snake_str[snake_len++] = c - 'A' + 'a';
+        } else {
+            snake_str[snake_len++] = c;
+        }
+    }
+    rb_str_set_len(snake, snake_len);
+#ifdef HAVE_RB_STR_ENCODE
+    rb_enc_associate(snake, rb_utf8_encoding());
+#endif
+    OBJ_FREEZE(snake);
+    return snake;
+}
+
+/*
+ * Returns the frozen camelCase string for a snake_case string or symbol key
+ */
+VALUE case_camelize(VALUE key) {
+    CASE_CACHE *cache = case_cache_get();
+    long index;
+    if(SYMBOL_P(key)) {
+        if(ref_table_lookup(&cache->camel_by_sym, key, &index)) return RARRAY_PTR(cache->camel_values)[index];
+        VALUE camel = camelize_str(rb_funcall(key, id_to_s, 0));
+        if(RARRAY_LEN(cache->camel_values) < CASE_CACHE_MAX) {
+            ref_table_add(&cache->camel_by_sym, key, RARRAY_LEN(cache->camel_values));
+            rb_ary_push(cache->camel_values, camel);
+        }
+        return camel;
+    } else if(TYPE(key) == T_STRING) {
+        unsigned long hash = str_table_hash(RSTRING_PTR(key), RSTRING_LEN(key));
+        if(str_table_lookup(&cache->camel_by_str, RSTRING_PTR(key), RSTRING_LEN(key), hash, &index)) return RARRAY_PTR(cache->camel_values)[index];
+        VALUE camel = camelize_str(key);
+        if(RARRAY_LEN(cache->camel_values) < CASE_CACHE_MAX) {
+            str_table_add(&cache->camel_by_str, RSTRING_PTR(key), RSTRING_LEN(key), hash, RARRAY_LEN(cache->camel_values));
+            rb_ary_push(cache->camel_values, camel);
+        }
+        return camel;
+    } else {
+        return camelize_str(rb_obj_as_string(key));
+    }
+}
+
+/*
+ * Returns the frozen snake_case string, or its symbol if to_sym is set, for the
+ * given camelCase bytes
+ */
+VALUE case_underscore(const char *str, long len, int to_sym) {
+    CASE_CACHE *cache = case_cache_get();
+    long index;
+    unsigned long hash = str_table_hash(str, len);
+    if(str_table_lookup(&cache->snake_by_str, str, len, hash, &index)) {
+        if(!to_sym) return RARRAY_PTR(cache->snake_values)[index];
+        VALUE sym = RARRAY_PTR(cache->snake_values)[index+1];
+        if(NIL_P(sym)) {
+            sym = rb_str_intern(RARRAY_PTR(cache->snake_values)[index]);
+            rb_ary_store(cache->snake_values, index+1, sym);
+        }
+        return sym;
+    }
+
+    VALUE snake = underscore_bytes(str, len);
+    VALUE sym = to_sym ? rb_str_intern(snake) : Qnil;
+    if(RARRAY_LEN(cache->snake_values) < CASE_CACHE_MAX * 2) {
+        str_table_add(&cache->snake_by_str, str, len, hash, RARRAY_LEN(cache->snake_values));
+        rb_ary_push(cache->snake_values, snake);
+        rb_ary_push(cache->snake_values, sym);
+    }
+    return to_sym ? sym : snake;
+}
+
+void case_cache_init() {
+    id_to_s = rb_intern("to_s");
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+    case_cache_key = rb_ractor_local_storage_ptr_newkey(&case_cache_type);
+#else
+    case_cache_setup(&main_cache);
+    case_cache = Data_Wrap_Struct(rb_cObject, case_cache_mark, 0, &main_cache);
+    rb_global_variable(&case_cache);
+#endif
+}
@@ -0,0 +1,12 @@
+#include <ruby.h>
+
+/*
+ * Memo tables for the translate_case option, kept for the life of the process,
+ * with one set per ractor where ruby has them. Property names repeat constantly, so each distinct key
+ * is converted and allocated once and then shared. The tables are capped,
+ * after which keys are converted without being remembered, so hostile input
+ * can't grow them without bound.
+ */
+void case_cache_init();
+VALUE case_camelize(VALUE key);
+VALUE case_underscore(const char *str, long len, int to_sym);
@@ -5,67 +5,137 @@
 #include <st.h>
 #endif
 #include "utility.h"
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+#include <ruby/ractor.h>
+#endif
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
 VALUE cFastMappingSet;
+VALUE cFastClassMapping;
 VALUE cTypedHash;
 ID id_hashset;
 
+// How populate_ruby_obj sets a property, packed with the setter ID into the
+// populate plan's table values
+#define SETTER_NONE    0
+#define SETTER_CALL    1
+#define SETTER_HASHSET 2
+#define SETTER_KIND(v) ((v) & 3)
+#define SETTER_ID(v)   ((ID)((v) >> 2))
+
 typedef struct {
     VALUE mapset;
     st_table* prop_cache;
+    st_table* populate_plans; // Ruby class => st_table of property ID => setter
 } CLASS_MAPPING;
 
 typedef struct {
     st_table* as_mappings;
     st_table* rb_mappings;
+    st_table* class_cache; // Ruby class name string from as_mappings => resolved class
 } MAPSET;
 
+static void mapset_mark(MAPSET *set);
+static void mapset_free(MAPSET *set);
+static void mapping_mark(CLASS_MAPPING *map);
+static void mapping_free(CLASS_MAPPING *map);
+
+// Frozen mappings can be shared between ractors where the ruby allows it.
+// Nothing writes to a frozen mapping's tables, so they're safe to read from
+// several at once.
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+static const rb_data_type_t mapset_type = {
+    "RocketAMF::Ext::FastMappingSet",
+    {(RUBY_DATA_FUNC)mapset_mark, (RUBY_DATA_FUNC)mapset_free, 0},
+    0, 0, RUBY_TYPED_FROZEN_SHAREABLE
+};
+static const rb_data_type_t mapping_type = {
+    "RocketAMF::Ext::FastClassMapping",
+    {(RUBY_DATA_FUNC)mapping_mark, (RUBY_DATA_FUNC)mapping_free, 0},
+    0, 0, RUBY_TYPED_FROZEN_SHAREABLE
+};
+#define MAPSET_WRAP(klass, set) TypedData_Wrap_Struct(klass, &mapset_type, set)
+#define MAPSET_GET(obj, set) TypedData_Get_Struct(obj, MAPSET, &mapset_type, set)
+#define MAPPING_WRAP(klass, map) TypedData_Wrap_Struct(klass, &mapping_type, map)
+#define MAPPING_GET(obj, map) TypedData_Get_Struct(obj, CLASS_MAPPING, &mapping_type, map)
+#else
+#define MAPSET_WRAP(klass, set) Data_Wrap_Struct(klass, mapset_mark, mapset_free, set)
+#define MAPSET_GET(obj, set) Data_Get_Struct(obj, MAPSET, set)
+#define MAPPING_WRAP(klass, map) Data_Wrap_Struct(klass, mapping_mark, mapping_free, map)
+#define MAPPING_GET(obj, map) Data_Get_Struct(obj, CLASS_MAPPING, map)
+#endif
+
+/*
+ * Deep freezes a value kept in a frozen mapping's tables
+ */
+static VALUE mapping_share(VALUE obj) {
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+    return rb_ractor_make_shareable(obj);
+#else
+    return rb_obj_freeze(obj);
+#endif
+}
+
 /*
- * Mark the as_mappings and rb_mappings hashes
+ * Mark the as_mappings and rb_mappings hashes, and the resolved classes
  */
 static void mapset_mark(MAPSET *set) {
     if(!set) return;
     rb_mark_tbl(set->as_mappings);
     rb_mark_tbl(set->rb_mappings);
+    rb_mark_tbl(set->class_cache);
+}
+
+static int mapset_free_key_iter(st_data_t key, st_data_t val, st_data_t arg) {
+    free((char *)key);
+    return ST_CONTINUE;
 }
 
 /*
- * Free the mapping tables and struct
+ * Free the mapping tables, their keys and the struct
  */
 static void mapset_free(MAPSET *set) {
+    st_foreach(set->as_mappings, mapset_free_key_iter, 0);
+    st_foreach(set->rb_mappings, mapset_free_key_iter, 0);
     st_free_table(set->as_mappings);
     st_free_table(set->rb_mappings);
+    st_free_table(set->class_cache);
     xfree(set);
 }
 
+/*
+ * Maps a class name to a frozen copy of the given name. Keys are owned by the
+ * table, so the one being replaced is freed.
+ */
+static void mapset_insert(st_table *table, const char *key, VALUE name) {
+    st_data_t old_key = (st_data_t)key;
+    if(st_delete(table, &old_key, 0)) free((char *)old_key);
+    st_insert(table, (st_data_t)strdup(key), (st_data_t)rb_str_new_frozen(name));
+}
+
 /*
  * Allocate mapset and populate mappings with built-in mappings
  */
 static VALUE mapset_alloc(VALUE klass) {
     MAPSET *set = ALLOC(MAPSET);
     memset(set, 0, sizeof(MAPSET));
-    VALUE self = Data_Wrap_Struct(klass, mapset_mark, mapset_free, set);
+    VALUE self = MAPSET_WRAP(klass, set);
 
     // Initialize internal data
     set->as_mappings = st_init_strtable();
     set->rb_mappings = st_init_strtable();
+    set->class_cache = st_init_numtable();
 
     // Populate with built-in mappings
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.AbstractMessage", rb_str_new2("RocketAMF::Values::AbstractMessage"));
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.RemotingMessage", rb_str_new2("RocketAMF::Values::RemotingMessage"));
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.AsyncMessage", rb_str_new2("RocketAMF::Values::AsyncMessage"));
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.CommandMessage", rb_str_new2("RocketAMF::Values::CommandMessage"));
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.AcknowledgeMessage", rb_str_new2("RocketAMF::Values::AcknowledgeMessage"));
-    st_add_direct(set->as_mappings, (st_data_t)"flex.messaging.messages.ErrorMessage", rb_str_new2("RocketAMF::Values::ErrorMessage"));
-
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::AbstractMessage", rb_str_new2("flex.messaging.messages.AbstractMessage"));
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::RemotingMessage", rb_str_new2("flex.messaging.messages.RemotingMessage"));
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::AsyncMessage", rb_str_new2("flex.messaging.messages.AsyncMessage"));
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::CommandMessage", rb_str_new2("flex.messaging.messages.CommandMessage"));
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::AcknowledgeMessage", rb_str_new2("flex.messaging.messages.AcknowledgeMessage"));
-    st_add_direct(set->rb_mappings, (st_data_t)"RocketAMF::Values::ErrorMessage", rb_str_new2("flex.messaging.messages.ErrorMessage"));
+    static const char *messages[] = {"AbstractMessage", "RemotingMessage", "AsyncMessage", "CommandMessage", "AcknowledgeMessage", "ErrorMessage"};
+    long i;
+    for(i = 0; i < 6; i++) {
+        VALUE as_class = rb_str_plus(rb_str_new2("flex.messaging.messages."), rb_str_new2(messages[i]));
+        VALUE rb_class = rb_str_plus(rb_str_new2("RocketAMF::Values::"), rb_str_new2(messages[i]));
+        mapset_insert(set->as_mappings, RSTRING_PTR(as_class), rb_class);
+        mapset_insert(set->rb_mappings, RSTRING_PTR(rb_class), as_class);
+    }
 
     return self;
 }
@@ -75,15 +145,23 @@ static VALUE mapset_alloc(VALUE klass) {
  *   m.map :as => 'com.example.Date', :ruby => "Example::Date'
  *
  * Map a given AS class to a ruby class. Use fully qualified names for both.
+ * Raises if the set has been frozen.
  */
 static VALUE mapset_map(VALUE self, VALUE mapping) {
     MAPSET *set;
-    Data_Get_Struct(self, MAPSET, set);
+    MAPSET_GET(self, set);
+    rb_check_frozen(self);
 
     VALUE as_class = rb_hash_aref(mapping, ID2SYM(rb_intern("as")));
     VALUE rb_class = rb_hash_aref(mapping, ID2SYM(rb_intern("ruby")));
-    st_insert(set->as_mappings, (st_data_t)strdup(RSTRING_PTR(as_class)), rb_class);
-    st_insert(set->rb_mappings, (st_data_t)strdup(RSTRING_PTR(rb_class)), as_class);
+    StringValue(as_class);
+    StringValue(rb_class);
+    mapset_insert(set->as_mappings, RSTRING_PTR(as_class), rb_class);
+    mapset_insert(set->rb_mappings, RSTRING_PTR(rb_class), as_class);
+
+    // A replaced name string could be collected and its address reused, so
+    // drop every resolved class rather than just this mapping's
+    st_clear(set->class_cache);
 
     return Qnil;
 }
@@ -94,7 +172,7 @@ static VALUE mapset_map(VALUE self, VALUE mapping) {
  */
 static VALUE mapset_as_lookup(VALUE self, const char* class_name) {
     MAPSET *set;
-    Data_Get_Struct(self, MAPSET, set);
+    MAPSET_GET(self, set);
 
     VALUE as_name;
     if(st_lookup(set->rb_mappings, (st_data_t)class_name, &as_name)) {
@@ -110,7 +188,7 @@ static VALUE mapset_as_lookup(VALUE self, const char* class_name) {
  */
 static VALUE mapset_rb_lookup(VALUE self, const char* class_name) {
     MAPSET *set;
-    Data_Get_Struct(self, MAPSET, set);
+    MAPSET_GET(self, set);
 
     VALUE rb_name;
     if(st_lookup(set->as_mappings, (st_data_t)class_name, &rb_name)) {
@@ -121,19 +199,123 @@ static VALUE mapset_rb_lookup(VALUE self, const char* class_name) {
 }
 
 /*
- * Mark the mapset object and property lookup cache
+ * Looks up the class for a "::" separated name, starting from Kernel. Resolved
+ * classes are cached in class_cache by name string, unless the set is frozen.
+ */
+static VALUE mapset_resolve_class(VALUE self, VALUE name) {
+    MAPSET *set;
+    MAPSET_GET(self, set);
+
+    VALUE klass;
+    if(st_lookup(set->class_cache, (st_data_t)name, (st_data_t *)&klass)) return klass;
+
+    klass = rb_mKernel;
+    const char *ptr = RSTRING_PTR(name);
+    const char *end = ptr + RSTRING_LEN(name);
+    const char *sep;
+    while((sep = strstr(ptr, "::")) && sep < end) {
+        klass = rb_const_get(klass, rb_to_id(rb_str_new(ptr, sep - ptr)));
+        ptr = sep + 2;
+    }
+    klass = rb_const_get(klass, rb_to_id(rb_str_new(ptr, end - ptr)));
+
+    if(!OBJ_FROZEN(self)) st_insert(set->class_cache, (st_data_t)name, (st_data_t)klass);
+    return klass;
+}
+
+static VALUE mapset_resolve_protected(VALUE args) {
+    return mapset_resolve_class(RARRAY_PTR(args)[0], RARRAY_PTR(args)[1]);
+}
+
+static int mapset_resolve_iter(st_data_t key, st_data_t name, st_data_t self) {
+    int error = 0;
+    rb_protect(mapset_resolve_protected, rb_assoc_new((VALUE)self, (VALUE)name), &error);
+    if(error) rb_set_errinfo(Qnil);
+    return ST_CONTINUE;
+}
+
+static int mapset_share_iter(st_data_t key, st_data_t name, st_data_t arg) {
+    mapping_share((VALUE)name);
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   m.freeze => m
+ *
+ * Freezes the set, resolving every mapped ruby class that exists now. Classes
+ * that don't are looked up each time they're needed instead.
+ */
+static VALUE mapset_freeze(VALUE self) {
+    MAPSET *set;
+    MAPSET_GET(self, set);
+    if(OBJ_FROZEN(self)) return self;
+
+    st_foreach(set->as_mappings, mapset_resolve_iter, (st_data_t)self);
+    st_foreach(set->as_mappings, mapset_share_iter, 0);
+    st_foreach(set->rb_mappings, mapset_share_iter, 0);
+    return rb_call_super(0, NULL);
+}
+
+static int mapset_copy_iter(st_data_t key, st_data_t name, st_data_t table) {
+    st_insert((st_table *)table, (st_data_t)strdup((const char *)key), name);
+    return ST_CONTINUE;
+}
+
+/*
+ * Returns an unfrozen set with the same mappings
+ */
+static VALUE mapset_copy(VALUE self) {
+    MAPSET *set, *copy_set;
+    MAPSET_GET(self, set);
+    VALUE copy = rb_obj_alloc(CLASS_OF(self));
+    MAPSET_GET(copy, copy_set);
+
+    st_foreach(copy_set->as_mappings, mapset_free_key_iter, 0);
+    st_foreach(copy_set->rb_mappings, mapset_free_key_iter, 0);
+    st_clear(copy_set->as_mappings);
+    st_clear(copy_set->rb_mappings);
+    st_foreach(set->as_mappings, mapset_copy_iter, (st_data_t)copy_set->as_mappings);
+    st_foreach(set->rb_mappings, mapset_copy_iter, (st_data_t)copy_set->rb_mappings);
+    return copy;
+}
+
+static int mapping_plan_mark_iter(st_data_t klass, st_data_t plan, st_data_t arg) {
+    rb_gc_mark((VALUE)klass);
+    return ST_CONTINUE;
+}
+
+/*
+ * Mark the mapset object, property lookup cache and the classes with populate
+ * plans
  */
 static void mapping_mark(CLASS_MAPPING *map) {
     if(!map) return;
     rb_gc_mark(map->mapset);
     rb_mark_tbl(map->prop_cache);
+    st_foreach(map->populate_plans, mapping_plan_mark_iter, 0);
+}
+
+static int mapping_plan_free_iter(st_data_t klass, st_data_t plan, st_data_t arg) {
+    st_free_table((st_table *)plan);
+    return ST_DELETE;
 }
 
 /*
- * Free prop cache table and struct
+ * Drop the populate plans, which hold the results of respond_to? checks and
+ * so must be rebuilt whenever mappings change
+ */
+static void mapping_clear_plans(CLASS_MAPPING *map) {
+    st_foreach(map->populate_plans, mapping_plan_free_iter, 0);
+}
+
+/*
+ * Free prop cache table, populate plans and struct
  */
 static void mapping_free(CLASS_MAPPING *map) {
     st_free_table(map->prop_cache);
+    mapping_clear_plans(map);
+    st_free_table(map->populate_plans);
     xfree(map);
 }
 
@@ -143,9 +325,10 @@ static void mapping_free(CLASS_MAPPING *map) {
 static VALUE mapping_alloc(VALUE klass) {
     CLASS_MAPPING *map = ALLOC(CLASS_MAPPING);
     memset(map, 0, sizeof(CLASS_MAPPING));
-    VALUE self = Data_Wrap_Struct(klass, mapping_mark, mapping_free, map);
-    map->mapset = rb_class_new_instance(0, NULL, cFastMappingSet);
     map->prop_cache = st_init_numtable();
+    map->populate_plans = st_init_numtable();
+    VALUE self = MAPPING_WRAP(klass, map);
+    map->mapset = rb_class_new_instance(0, NULL, cFastMappingSet);
     return self;
 }
 
@@ -154,6 +337,7 @@ static VALUE mapping_alloc(VALUE klass) {
  */
 static VALUE mapping_init(VALUE self) {
     rb_ivar_set(self, rb_intern("@use_array_collection"), Qfalse);
+    return self;
 }
 
 /*
@@ -165,11 +349,13 @@ static VALUE mapping_init(VALUE self) {
  */
 static VALUE mapping_define(VALUE self) {
     CLASS_MAPPING *map;
-    Data_Get_Struct(self, CLASS_MAPPING, map);
+    MAPPING_GET(self, map);
+    rb_check_frozen(self);
 
 	if (rb_block_given_p()) {
 	    rb_yield(map->mapset);
 	}
+	mapping_clear_plans(map);
 
 	return Qnil;
 }
@@ -179,9 +365,11 @@ static VALUE mapping_define(VALUE self) {
  */
 static VALUE mapping_reset(VALUE self) {
     CLASS_MAPPING *map;
-    Data_Get_Struct(self, CLASS_MAPPING, map);
+    MAPPING_GET(self, map);
+    rb_check_frozen(self);
 
     map->mapset = rb_class_new_instance(0, NULL, cFastMappingSet);
+    mapping_clear_plans(map);
 
     return Qnil;
 }
@@ -195,7 +383,7 @@ static VALUE mapping_reset(VALUE self) {
  */
 static VALUE mapping_as_class_name(VALUE self, VALUE obj) {
     CLASS_MAPPING *map;
-    Data_Get_Struct(self, CLASS_MAPPING, map);
+    MAPPING_GET(self, map);
 
     int type = TYPE(obj);
     const char* class_name;
@@ -228,7 +416,7 @@ static VALUE mapping_as_class_name(VALUE self, VALUE obj) {
  */
 static VALUE mapping_get_ruby_obj(VALUE self, VALUE name) {
     CLASS_MAPPING *map;
-    Data_Get_Struct(self, CLASS_MAPPING, map);
+    MAPPING_GET(self, map);
 
     VALUE argv[1];
     VALUE ruby_class_name = mapset_rb_lookup(map->mapset, RSTRING_PTR(name));
@@ -236,30 +424,16 @@ static VALUE mapping_get_ruby_obj(VALUE self, VALUE name) {
         argv[0] = name;
         return rb_class_new_instance(1, argv, cTypedHash);
     } else {
-        VALUE base_const = rb_mKernel;
-        char* endptr;
-        char* ptr = RSTRING_PTR(ruby_class_name);
-        while(endptr = strstr(ptr,"::")) {
-            endptr[0] = '\0'; // NULL terminate to make string ops work
-            base_const = rb_const_get(base_const, rb_intern(ptr));
-            endptr[0] = ':'; // Restore correct char
-            ptr = endptr + 2;
-        }
-        return rb_class_new_instance(0, NULL, rb_const_get(base_const, rb_intern(ptr)));
+        return rb_class_new_instance(0, NULL, mapset_resolve_class(map->mapset, ruby_class_name));
     }
 }
 
 /*
- * st_table iterator for populating a given object from a property hash
+ * Works out how to set the given property on instances of the object's class:
+ * through its setter, through []=, or not at all
  */
-static int mapping_populate_iter(VALUE key, VALUE val, VALUE obj) {
-    if(TYPE(obj) == T_HASH) {
-        rb_hash_aset(obj, key, val);
-        return ST_CONTINUE;
-    }
-
-    if(TYPE(key) != T_SYMBOL) rb_raise(rb_eArgError, "Invalid type for property key: %d", TYPE(key));
-    const char* key_str = rb_id2name(SYM2ID(key));
+static st_data_t mapping_plan_setter(VALUE obj, ID key) {
+    const char* key_str = rb_id2name(key);
     long len = strlen(key_str);
     char* setter = ALLOC_N(char, len+2);
     memcpy(setter, key_str, len);
@@ -269,9 +443,47 @@ static int mapping_populate_iter(VALUE key, VALUE val, VALUE obj) {
     xfree(setter);
 
     if(rb_respond_to(obj, id_setter)) {
-        rb_funcall(obj, id_setter, 1, val);
+        return ((st_data_t)id_setter << 2) | SETTER_CALL;
     } else if(rb_respond_to(obj, id_hashset)) {
-        rb_funcall(obj, id_hashset, 2, key, val);
+        return SETTER_HASHSET;
+    }
+    return SETTER_NONE;
+}
+
+typedef struct {
+    VALUE obj;
+    st_table *plan;
+    int frozen; // Don't add to the plan, since it belongs to a frozen mapping
+} POPULATE_ARGS;
+
+/*
+ * st_table iterator for populating a given object from a property hash
+ */
+static int mapping_populate_iter(st_data_t key_data, st_data_t val_data, st_data_t arg) {
+    VALUE key = (VALUE)key_data;
+    VALUE val = (VALUE)val_data;
+    POPULATE_ARGS *args = (POPULATE_ARGS *)arg;
+    VALUE obj = args->obj;
+    if(TYPE(obj) == T_HASH) {
+        rb_hash_aset(obj, key, val);
+        return ST_CONTINUE;
+    }
+
+    if(TYPE(key) != T_SYMBOL) rb_raise(rb_eArgError, "Invalid type for property key: %d", TYPE(key));
+    ID id_key = SYM2ID(key);
+    st_data_t setter;
+    if(!args->plan || !st_lookup(args->plan, (st_data_t)id_key, &setter)) {
+        setter = mapping_plan_setter(obj, id_key);
+        if(args->plan && !args->frozen) st_insert(args->plan, (st_data_t)id_key, setter);
+    }
+
+    switch(SETTER_KIND(setter)) {
+        case SETTER_CALL:
+            rb_funcall(obj, SETTER_ID(setter), 1, val);
+            break;
+        case SETTER_HASHSET:
+            rb_funcall(obj, id_hashset, 2, key, val);
+            break;
     }
 
     return ST_CONTINUE;
@@ -282,21 +494,60 @@ static int mapping_populate_iter(VALUE key, VALUE val, VALUE obj) {
  *   mapper.populate_ruby_obj(obj, props, dynamic_props=nil) => obj
  *
  * Populates the ruby object using the given properties. Property hashes MUST
- * have symbol keys, or it will raise an exception.
+ * have symbol keys, or it will raise an exception. How each property is set is
+ * worked out once per class and kept until the mappings are next changed or
+ * reset, so methods defined on a class after its first object is populated
+ * are not picked up until then. Frozen mappings keep the plans they were
+ * frozen with, and work out the rest every time.
  */
 static VALUE mapping_populate(int argc, VALUE *argv, VALUE self) {
+    CLASS_MAPPING *map;
+    MAPPING_GET(self, map);
+
     // Check args
     VALUE obj, props, dynamic_props;
     rb_scan_args(argc, argv, "21", &obj, &props, &dynamic_props);
 
-    st_foreach(RHASH_TBL(props), mapping_populate_iter, obj);
+    POPULATE_ARGS args;
+    args.obj = obj;
+    args.plan = NULL;
+    args.frozen = OBJ_FROZEN(self);
+    if(TYPE(obj) != T_HASH) {
+        VALUE klass = CLASS_OF(obj);
+        if(!st_lookup(map->populate_plans, (st_data_t)klass, (st_data_t *)&args.plan)) {
+            args.plan = args.frozen ? NULL : st_init_numtable();
+            if(args.plan) st_insert(map->populate_plans, (st_data_t)klass, (st_data_t)args.plan);
+        }
+    }
+
+    st_foreach(RHASH_TBL(props), mapping_populate_iter, (st_data_t)&args);
     if(dynamic_props != Qnil) {
-        st_foreach(RHASH_TBL(dynamic_props), mapping_populate_iter, obj);
+        st_foreach(RHASH_TBL(dynamic_props), mapping_populate_iter, (st_data_t)&args);
     }
 
     return obj;
 }
 
+/*
+ * Finds the properties of instances of the given class: its public zero-arity
+ * instance methods not on Object
+ */
+static VALUE mapping_prop_list(VALUE klass) {
+    VALUE props_ary = rb_ary_new();
+    VALUE all_methods = rb_class_public_instance_methods(0, NULL, klass);
+    VALUE object_methods = rb_class_public_instance_methods(0, NULL, rb_cObject);
+    VALUE possible_methods = rb_funcall(all_methods, rb_intern("-"), 1, object_methods);
+    long i, len = RARRAY_LEN(possible_methods);
+    for(i = 0; i < len; i++) {
+        VALUE meth = rb_funcall(klass, rb_intern("instance_method"), 1, RARRAY_PTR(possible_methods)[i]);
+        VALUE arity = rb_funcall(meth, rb_intern("arity"), 0);
+        if(FIX2INT(arity) == 0) {
+            rb_ary_push(props_ary, RARRAY_PTR(possible_methods)[i]);
+        }
+    }
+    return props_ary;
+}
+
 /*
  * call-seq:
  *   mapper.props_for_serialization(obj) => hash
@@ -305,11 +556,12 @@ static VALUE mapping_populate(int argc, VALUE *argv, VALUE self) {
  * them in a hash. For performance purposes, property detection is only performed
  * once for a given class instance, and then cached for all instances of that
  * class. IF YOU'RE ADDING AND REMOVING PROPERTIES FROM CLASS INSTANCES YOU
- * CANNOT USE THE FAST CLASS MAPPER.
+ * CANNOT USE THE FAST CLASS MAPPER. Frozen mappings only have the classes
+ * they were frozen with cached.
  */
 static VALUE mapping_props(VALUE self, VALUE obj) {
     CLASS_MAPPING *map;
-    Data_Get_Struct(self, CLASS_MAPPING, map);
+    MAPPING_GET(self, map);
 
     if(TYPE(obj) == T_HASH) {
         return obj;
@@ -320,23 +572,8 @@ static VALUE mapping_props(VALUE self, VALUE obj) {
     VALUE klass = CLASS_OF(obj);
     long i, len;
     if(!st_lookup(map->prop_cache, klass, &props_ary)) {
-        props_ary = rb_ary_new();
-
-        // Build props array
-        VALUE all_methods = rb_class_public_instance_methods(0, NULL, klass);
-        VALUE object_methods = rb_class_public_instance_methods(0, NULL, rb_cObject);
-        VALUE possible_methods = rb_funcall(all_methods, rb_intern("-"), 1, object_methods);
-        len = RARRAY_LEN(possible_methods);
-        for(i = 0; i < len; i++) {
-            VALUE meth = rb_obj_method(obj, RARRAY_PTR(possible_methods)[i]);
-            VALUE arity = rb_funcall(meth, rb_intern("arity"), 0);
-            if(FIX2INT(arity) == 0) {
-                rb_ary_push(props_ary, RARRAY_PTR(possible_methods)[i]);
-            }
-        }
-
-        // Store it
-        st_add_direct(map->prop_cache, klass, props_ary);
+        props_ary = mapping_prop_list(klass);
+        if(!OBJ_FROZEN(self)) st_add_direct(map->prop_cache, klass, props_ary);
     }
 
     // Build properties hash using list of properties
@@ -349,14 +586,107 @@ static VALUE mapping_props(VALUE self, VALUE obj) {
     return props;
 }
 
+/*
+ * call-seq:
+ *   mapper.get_as_option(class_name, option) => nil
+ *   mapper.get_ruby_option(obj, option) => nil
+ *
+ * The fast class mapper has no per-class options, so translate_case is always
+ * off
+ */
+static VALUE mapping_no_option(VALUE self, VALUE obj, VALUE name) {
+    return Qnil;
+}
+
+static int mapping_cache_props_iter(st_data_t name, st_data_t klass, st_data_t map) {
+    st_table *prop_cache = ((CLASS_MAPPING *)map)->prop_cache;
+    if(!st_lookup(prop_cache, klass, 0)) st_add_direct(prop_cache, klass, mapping_prop_list((VALUE)klass));
+    return ST_CONTINUE;
+}
+
+static int mapping_share_props_iter(st_data_t klass, st_data_t props_ary, st_data_t arg) {
+    mapping_share((VALUE)props_ary);
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   mapper.freeze => mapper
+ *
+ * Freezes the mapper and its mapping set. The property lists for every mapped
+ * class are worked out first, and nothing is cached after, so a frozen mapper
+ * can be used from several threads, or shared between ractors, without
+ * locking. Classes it hasn't seen have their properties and setters looked up
+ * every time.
+ */
+static VALUE mapping_freeze(VALUE self) {
+    CLASS_MAPPING *map;
+    MAPPING_GET(self, map);
+    if(OBJ_FROZEN(self)) return self;
+
+    MAPSET *set;
+    rb_funcall(map->mapset, rb_intern("freeze"), 0);
+    MAPSET_GET(map->mapset, set);
+    st_foreach(set->class_cache, mapping_cache_props_iter, (st_data_t)map);
+    st_foreach(map->prop_cache, mapping_share_props_iter, 0);
+    return rb_call_super(0, NULL);
+}
+
+static int mapping_copy_plan_iter(st_data_t klass, st_data_t plan, st_data_t plans) {
+    st_insert((st_table *)plans, klass, (st_data_t)st_copy((st_table *)plan));
+    return ST_CONTINUE;
+}
+
+static int mapping_copy_props_iter(st_data_t klass, st_data_t props_ary, st_data_t prop_cache) {
+    st_insert((st_table *)prop_cache, klass, (st_data_t)rb_ary_dup((VALUE)props_ary));
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   mapper.snapshot => frozen_mapper
+ *
+ * Returns a frozen copy of the mapper, keeping everything it has cached so
+ * far. Pass it to serializers and deserializers as <tt>:class_mapper</tt>
+ * to use it from other ractors, or to keep using these mappings while the
+ * original is changed:
+ *
+ *   MAPPER = RocketAMF::ClassMapper.snapshot
+ *   Ractor.new { RocketAMF::AMF3Serializer.new(:class_mapper => MAPPER).serialize(obj) }
+ */
+static VALUE mapping_snapshot(VALUE self) {
+    CLASS_MAPPING *map, *copy_map;
+    MAPPING_GET(self, map);
+    VALUE copy = rb_obj_alloc(CLASS_OF(self));
+    MAPPING_GET(copy, copy_map);
+
+    copy_map->mapset = mapset_copy(map->mapset);
+    MAPSET *set, *copy_set;
+    MAPSET_GET(map->mapset, set);
+    MAPSET_GET(copy_map->mapset, copy_set);
+    st_free_table(copy_set->class_cache);
+    copy_set->class_cache = st_copy(set->class_cache);
+    st_foreach(map->prop_cache, mapping_copy_props_iter, (st_data_t)copy_map->prop_cache);
+    st_foreach(map->populate_plans, mapping_copy_plan_iter, (st_data_t)copy_map->populate_plans);
+    rb_ivar_set(copy, rb_intern("@use_array_collection"), rb_ivar_get(self, rb_intern("@use_array_collection")));
+
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+    rb_funcall(copy, rb_intern("freeze"), 0);
+    return rb_ractor_make_shareable(copy);
+#else
+    return rb_funcall(copy, rb_intern("freeze"), 0);
+#endif
+}
+
 void Init_rocket_amf_fast_class_mapping() {
     // Define map set
     cFastMappingSet = rb_define_class_under(mRocketAMFExt, "FastMappingSet", rb_cObject);
     rb_define_alloc_func(cFastMappingSet, mapset_alloc);
     rb_define_method(cFastMappingSet, "map", mapset_map, 1);
+    rb_define_method(cFastMappingSet, "freeze", mapset_freeze, 0);
 
     // Define FastClassMapping
-    VALUE cFastClassMapping = rb_define_class_under(mRocketAMFExt, "FastClassMapping", rb_cObject);
+    cFastClassMapping = rb_define_class_under(mRocketAMFExt, "FastClassMapping", rb_cObject);
     rb_define_alloc_func(cFastClassMapping, mapping_alloc);
     rb_attr(cFastClassMapping, rb_intern("use_array_collection"), 1, 1, Qtrue);
     rb_define_method(cFastClassMapping, "initialize", mapping_init, 0);
@@ -366,6 +696,10 @@ void Init_rocket_amf_fast_class_mapping() {
     rb_define_method(cFastClassMapping, "get_ruby_obj", mapping_get_ruby_obj, 1);
     rb_define_method(cFastClassMapping, "populate_ruby_obj", mapping_populate, -1);
     rb_define_method(cFastClassMapping, "props_for_serialization", mapping_props, 1);
+    rb_define_method(cFastClassMapping, "get_as_option", mapping_no_option, 2);
+    rb_define_method(cFastClassMapping, "get_ruby_option", mapping_no_option, 2);
+    rb_define_method(cFastClassMapping, "freeze", mapping_freeze, 0);
+    rb_define_method(cFastClassMapping, "snapshot", mapping_snapshot, 0);
 
     // Cache values
     cTypedHash = rb_const_get(rb_const_get(mRocketAMF, rb_intern("Values")), rb_intern("TypedHash"));
@@ -32,6 +32,10 @@
 #define AMF3_OBJECT_MARKER        0x0A
 #define AMF3_XML_MARKER           0x0B
 #define AMF3_BYTE_ARRAY_MARKER    0x0C
+#define AMF3_VECTOR_INT_MARKER    0x0D
+#define AMF3_VECTOR_UINT_MARKER   0x0E
+#define AMF3_VECTOR_DOUBLE_MARKER 0x0F
+#define AMF3_VECTOR_OBJECT_MARKER 0x10
 #define AMF3_DICT_MARKER          0x11
 
 // Other AMF3 Markers
@@ -40,9 +44,19 @@
 #define AMF3_CLOSE_DYNAMIC_OBJECT  0x01
 #define AMF3_CLOSE_DYNAMIC_ARRAY   0x01
 
+// Fragment reference kinds, matching RocketAMF::Fragment
+#define FRAGMENT_STRING_REF      0
+#define FRAGMENT_TRAIT_REF       1
+#define FRAGMENT_OBJECT_REF      2
+#define FRAGMENT_AMF0_OBJECT_REF 3
+
 // Other Constants
 #define MAX_INTEGER  268435455
 #define MIN_INTEGER  -268435456
 #define INITIAL_STREAM_LENGTH 128 // Initial buffer length for serializer output
 #define MAX_STREAM_LENGTH 10*1024*1024 // Let's cap it at 10MB for now
-#define MAX_ARRAY_PREALLOC 100000
\ No newline at end of file
+#define DEFAULT_CHUNK_LENGTH 64*1024 // Chunk size for serializers writing to an IO
+#define MAX_ARRAY_PREALLOC 100000
+#define MIN_SHARED_STRING_LENGTH 1024 // Smallest string the deserializer will share with its source
+#define VECTOR_CHUNK_ELEMENTS 512 // Vector elements byte swapped per write
+#define UNIX_EPOCH_JD 2440588 // Julian day number of 1970-01-01
\ No newline at end of file
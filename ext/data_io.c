@@ -0,0 +1,377 @@
+#include "deserializer.h"
+#include "serializer.h"
+
+/*
+ * Flash's IDataInput and IDataOutput, for read_external and write_external.
+ * The deserializer or serializer handed to them reads and writes its own
+ * buffer with these, so externalizable objects don't need a StringIO or
+ * unpack. All numbers are big-endian, as in a Flash ByteArray.
+ */
+
+extern VALUE cDeserializer;
+extern VALUE cAMF3Deserializer;
+extern VALUE cAMF3Serializer;
+static ID id_pos;
+static ID id_pos_set;
+
+/*
+ * Returns the deserializer, checking it's part way through a source. If
+ * read_external also took des.source, reading starts from wherever that was
+ * left.
+ */
+static AMF_DESERIALIZER *din_get(VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    if(des->depth == 0 || !des->stream) rb_raise(rb_eRuntimeError, "can only read from a deserializer while it is deserializing");
+    if(des->src_lent) des->pos = NUM2LONG(rb_funcall(des->src, id_pos, 0));
+    return des;
+}
+
+/*
+ * Puts des.source back in step after a read, if read_external took it
+ */
+static VALUE din_done(AMF_DESERIALIZER *des, VALUE ret) {
+    if(des->src_lent) rb_funcall(des->src, id_pos_set, 1, LONG2NUM(des->pos));
+    return ret;
+}
+
+/*
+ * call-seq:
+ *   des.readBoolean => true or false
+ */
+static VALUE din_read_boolean(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, des_read_byte(des) ? Qtrue : Qfalse);
+}
+
+/*
+ * call-seq:
+ *   des.readByte => -128..127
+ */
+static VALUE din_read_byte(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, INT2FIX((signed char)des_read_byte(des)));
+}
+
+/*
+ * call-seq:
+ *   des.readUnsignedByte => 0..255
+ */
+static VALUE din_read_unsigned_byte(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, INT2FIX((unsigned char)des_read_byte(des)));
+}
+
+/*
+ * call-seq:
+ *   des.readShort => -32768..32767
+ */
+static VALUE din_read_short(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, INT2FIX((short)des_read_uint16(des)));
+}
+
+/*
+ * call-seq:
+ *   des.readUnsignedShort => 0..65535
+ */
+static VALUE din_read_unsigned_short(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, INT2FIX(des_read_uint16(des)));
+}
+
+/*
+ * call-seq:
+ *   des.readInt => int
+ *
+ * Reads a signed 32 bit integer
+ */
+static VALUE din_read_int(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    unsigned long u = (unsigned long)des_read_uint32(des) & 0xffffffffUL;
+    long num = u >= 0x80000000UL ? -(long)(0xffffffffUL - u) - 1 : (long)u;
+    return din_done(des, LONG2NUM(num));
+}
+
+/*
+ * call-seq:
+ *   des.readUnsignedInt => int
+ */
+static VALUE din_read_unsigned_int(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, ULONG2NUM((unsigned long)des_read_uint32(des) & 0xffffffffUL));
+}
+
+/*
+ * call-seq:
+ *   des.readFloat => float
+ *
+ * Reads a 32 bit IEEE 754 float
+ */
+static VALUE din_read_float(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    union {
+        float fval;
+        unsigned int ival;
+    } f;
+    f.ival = (unsigned int)(des_read_uint32(des) & 0xffffffffUL);
+    return din_done(des, rb_float_new(f.fval));
+}
+
+/*
+ * call-seq:
+ *   des.readDouble => float
+ */
+static VALUE din_read_double(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return din_done(des, rb_float_new(des_read_double(des)));
+}
+
+/*
+ * call-seq:
+ *   des.readUTF => str
+ *
+ * Reads a UTF-8 string prefixed with its length as an unsigned short
+ */
+static VALUE din_read_utf(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    long len = des_read_uint16(des);
+    return din_done(des, des_read_string(des, len));
+}
+
+/*
+ * call-seq:
+ *   des.readUTFBytes(length) => str
+ */
+static VALUE din_read_utf_bytes(VALUE self, VALUE length) {
+    AMF_DESERIALIZER *des = din_get(self);
+    long len = NUM2LONG(length);
+    if(len < 0) rb_raise(rb_eArgError, "negative length %ld given", len);
+    return din_done(des, des_read_string(des, len));
+}
+
+/*
+ * call-seq:
+ *   des.readBytes(length) => str
+ *
+ * Reads length bytes into a binary string
+ */
+static VALUE din_read_bytes(VALUE self, VALUE length) {
+    AMF_DESERIALIZER *des = din_get(self);
+    long len = NUM2LONG(length);
+    if(len < 0) rb_raise(rb_eArgError, "negative length %ld given", len);
+    return din_done(des, des_read_bytes(des, len));
+}
+
+/*
+ * call-seq:
+ *   des.readObject => obj
+ *
+ * Reads an AMF3 value, sharing the reference tables of the object being read
+ */
+static VALUE din_read_object(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    VALUE obj;
+    if(des->version == 3 || rb_obj_is_kind_of(self, cAMF3Deserializer) == Qtrue) {
+        obj = des3_deserialize(self);
+    } else {
+        obj = des0_deserialize(self, des_read_byte(des));
+    }
+    return din_done(des, obj);
+}
+
+/*
+ * call-seq:
+ *   des.bytesAvailable => int
+ *
+ * Returns how many bytes are left in the source
+ */
+static VALUE din_bytes_available(VALUE self) {
+    AMF_DESERIALIZER *des = din_get(self);
+    return LONG2NUM(des->size - des->pos);
+}
+
+static AMF_SERIALIZER *dout_get(VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    return ser;
+}
+
+/*
+ * call-seq:
+ *   ser.writeBoolean(value) => ser
+ */
+static VALUE dout_write_boolean(VALUE self, VALUE value) {
+    ser_write_byte(dout_get(self), RTEST(value) ? 1 : 0);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeByte(int) => ser
+ *
+ * Writes the low 8 bits
+ */
+static VALUE dout_write_byte(VALUE self, VALUE num) {
+    ser_write_byte(dout_get(self), (char)(NUM2LONG(num) & 0xff));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeShort(int) => ser
+ *
+ * Writes the low 16 bits
+ */
+static VALUE dout_write_short(VALUE self, VALUE num) {
+    ser_write_uint16(dout_get(self), NUM2LONG(num) & 0xffff);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeInt(int) => ser
+ *
+ * Writes a signed 32 bit integer
+ */
+static VALUE dout_write_int(VALUE self, VALUE num) {
+    long n = NUM2LONG(num);
+    if(n < -2147483647L - 1 || n > 2147483647L) rb_raise(rb_eRangeError, "int %ld out of range", n);
+    ser_write_uint32(dout_get(self), (long)((unsigned long)n & 0xffffffffUL));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeUnsignedInt(int) => ser
+ */
+static VALUE dout_write_unsigned_int(VALUE self, VALUE num) {
+    unsigned long n = NUM2ULONG(num);
+    if(n > 0xffffffffUL) rb_raise(rb_eRangeError, "int %lu out of range", n);
+    AMF_SERIALIZER *ser = dout_get(self);
+    char tmp[4] = {(n >> 24) & 0xff, (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff};
+    ser_write_bytes(ser, tmp, 4);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeFloat(num) => ser
+ *
+ * Writes a 32 bit IEEE 754 float
+ */
+static VALUE dout_write_float(VALUE self, VALUE num) {
+    union {
+        float fval;
+        unsigned int ival;
+    } f;
+    f.fval = (float)NUM2DBL(num);
+    char tmp[4] = {(f.ival >> 24) & 0xff, (f.ival >> 16) & 0xff, (f.ival >> 8) & 0xff, f.ival & 0xff};
+    ser_write_bytes(dout_get(self), tmp, 4);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeDouble(num) => ser
+ */
+static VALUE dout_write_double(VALUE self, VALUE num) {
+    ser_write_double(dout_get(self), NUM2DBL(num));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeUTF(str) => ser
+ *
+ * Writes the string as UTF-8 prefixed with its length as an unsigned short
+ */
+static VALUE dout_write_utf(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser = dout_get(self);
+    char *str;
+    long len;
+    VALUE src = ser_get_string(obj, Qtrue, &str, &len);
+    if(len > 0xffff) rb_raise(rb_eRangeError, "string of %ld bytes is too long for writeUTF", len);
+    ser_write_uint16(ser, len);
+    ser_write_bytes(ser, str, len);
+    RB_GC_GUARD(src);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeUTFBytes(str) => ser
+ *
+ * Writes the string as UTF-8 without a length
+ */
+static VALUE dout_write_utf_bytes(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser = dout_get(self);
+    char *str;
+    long len;
+    VALUE src = ser_get_string(obj, Qtrue, &str, &len);
+    ser_write_bytes(ser, str, len);
+    RB_GC_GUARD(src);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeBytes(str) => ser
+ *
+ * Writes the string's bytes as they are
+ */
+static VALUE dout_write_bytes(VALUE self, VALUE str) {
+    StringValue(str);
+    ser_write_bytes(dout_get(self), RSTRING_PTR(str), RSTRING_LEN(str));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.writeObject(obj) => ser
+ *
+ * Writes an AMF3 value, sharing the reference tables of the object being
+ * written
+ */
+static VALUE dout_write_object(VALUE self, VALUE obj) {
+    ser3_serialize(self, obj);
+    return self;
+}
+
+void Init_rocket_amf_data_io() {
+    VALUE des_classes[2] = {cDeserializer, cAMF3Deserializer};
+    int i;
+    for(i = 0; i < 2; i++) {
+        // AMF0 deserializers read externalizable objects inside AMF3 bodies
+        VALUE klass = des_classes[i];
+        rb_define_method(klass, "readBoolean", din_read_boolean, 0);
+        rb_define_method(klass, "readByte", din_read_byte, 0);
+        rb_define_method(klass, "readUnsignedByte", din_read_unsigned_byte, 0);
+        rb_define_method(klass, "readShort", din_read_short, 0);
+        rb_define_method(klass, "readUnsignedShort", din_read_unsigned_short, 0);
+        rb_define_method(klass, "readInt", din_read_int, 0);
+        rb_define_method(klass, "readUnsignedInt", din_read_unsigned_int, 0);
+        rb_define_method(klass, "readFloat", din_read_float, 0);
+        rb_define_method(klass, "readDouble", din_read_double, 0);
+        rb_define_method(klass, "readUTF", din_read_utf, 0);
+        rb_define_method(klass, "readUTFBytes", din_read_utf_bytes, 1);
+        rb_define_method(klass, "readBytes", din_read_bytes, 1);
+        rb_define_method(klass, "readObject", din_read_object, 0);
+        rb_define_method(klass, "bytesAvailable", din_bytes_available, 0);
+    }
+
+    rb_define_method(cAMF3Serializer, "writeBoolean", dout_write_boolean, 1);
+    rb_define_method(cAMF3Serializer, "writeByte", dout_write_byte, 1);
+    rb_define_method(cAMF3Serializer, "writeShort", dout_write_short, 1);
+    rb_define_method(cAMF3Serializer, "writeInt", dout_write_int, 1);
+    rb_define_method(cAMF3Serializer, "writeUnsignedInt", dout_write_unsigned_int, 1);
+    rb_define_method(cAMF3Serializer, "writeFloat", dout_write_float, 1);
+    rb_define_method(cAMF3Serializer, "writeDouble", dout_write_double, 1);
+    rb_define_method(cAMF3Serializer, "writeUTF", dout_write_utf, 1);
+    rb_define_method(cAMF3Serializer, "writeUTFBytes", dout_write_utf_bytes, 1);
+    rb_define_method(cAMF3Serializer, "writeBytes", dout_write_bytes, 1);
+    rb_define_method(cAMF3Serializer, "writeObject", dout_write_object, 1);
+
+    id_pos = rb_intern("pos");
+    id_pos_set = rb_intern("pos=");
+}
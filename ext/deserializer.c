@@ -1,64 +1,148 @@
 #include "deserializer.h"
 #include "constants.h"
-
-#define DES_BOUNDS_CHECK(des, i) if(des->pos + (i) > des->size) rb_raise(rb_eRangeError, "reading %ld bytes is beyond end of source: %ld (pos), %ld (size)", (long)(i), des->pos, des->size);
+#include "case_cache.h"
+#include "tape.h"
+#include "messages.h"
+#include "mapped_source.h"
+#include "byte_array.h"
+#include <math.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
 extern VALUE cDeserializer;
 extern VALUE cAMF3Deserializer;
 extern VALUE cStringIO;
-extern VALUE sym_class_name;
-extern VALUE sym_members;
-extern VALUE sym_externalizable;
-extern VALUE sym_dynamic;
+extern VALUE cMappedSource;
+extern VALUE cVector;
+extern VALUE cByteArray;
+extern VALUE sym_int;
+extern VALUE sym_uint;
+extern VALUE sym_double;
+extern VALUE sym_object;
+extern ID id_iv_type;
+extern ID id_iv_fixed;
+extern ID id_iv_class_name;
 ID id_get_ruby_obj;
 ID id_populate_ruby_obj;
 ID id_get_ruby_option;
+ID id_object_populators;
+ID id_shared_source;
+ID id_des_pool;
 
-/*
- * Helper function to convert camelCase to snake_case 
- * Used by the translate_case option
- */
-static VALUE snakecase_str(VALUE camel_str) {
-    char *str = RSTRING_PTR(camel_str);
-    char snake_str[strlen(str)*2];
-    int up = 0, len = 0;
-    char c;
-
-    while (c = *str++) {
-      // If upper case 65-90
-      if (c >= 65 && c <= 90) {
-        snake_str[len++] = *"_";
-        snake_str[len++] = tolower(c);
-      } else {
-        snake_str[len++] = c;
-      }
-    }
-    snake_str[len] = 0;
+static const char array_collection[] = "flex.messaging.io.ArrayCollection";
 
-    return rb_str_new2(snake_str);
-}
+static VALUE des_tape_deserialize(VALUE self, int version);
 
 /*
  * Mark the reader and its source. If caches are populated mark them as well.
  */
 static void des_mark(AMF_DESERIALIZER *des) {
     if(!des) return;
-    rb_gc_mark(des->src);
-    if(des->obj_cache) rb_gc_mark(des->obj_cache);
-    if(des->str_cache) rb_gc_mark(des->str_cache);
-    if(des->trait_cache) rb_gc_mark(des->trait_cache);
+    if(des->src) rb_gc_mark(des->src);
+    if(des->src_string) rb_gc_mark(des->src_string);
+    if(des->share_root) rb_gc_mark(des->share_root);
+    long i, j;
+    for(i = 0; i < des->obj_cache.count; i++) rb_gc_mark(des->obj_cache.items[i]);
+    for(i = 0; i < des->str_cache.count; i++) rb_gc_mark(des->str_cache.items[i]);
+    for(i = 0; i < des->trait_count; i++) {
+        DES_TRAIT *trait = des->traits[i];
+        rb_gc_mark(trait->class_name);
+        if(trait->klass) rb_gc_mark(trait->klass);
+        for(j = 0; j < trait->members_len; j++) {
+            rb_gc_mark(trait->members[j]);
+            if(trait->snake_built) rb_gc_mark(trait->snake_members[j]);
+        }
+    }
+    if(des->feed_buf) rb_gc_mark(des->feed_buf);
+    if(des->class_mapper) rb_gc_mark(des->class_mapper);
 }
 
 /*
- * Free the reader. Don't need to free anything but the struct because we didn't
- * alloc anything - source is from the ruby source object.
+ * Free the reader and its feed scanner. The source itself belongs to the ruby
+ * source object.
  */
 static void des_free(AMF_DESERIALIZER *des) {
+    long i;
+    for(i = 0; i < des->trait_capa; i++) {
+        DES_TRAIT *trait = des->traits[i];
+        if(!trait) continue;
+        if(trait->members) xfree(trait->members);
+        if(trait->snake_members) xfree(trait->snake_members);
+        if(trait->setters) xfree(trait->setters);
+        xfree(trait);
+    }
+    if(des->traits) xfree(des->traits);
+    if(des->obj_cache.items) xfree(des->obj_cache.items);
+    if(des->str_cache.items) xfree(des->str_cache.items);
+    if(des->scanner) scanner_free(des->scanner);
     xfree(des);
 }
 
+static void des_cache_push(DES_CACHE *cache, VALUE obj) {
+    if(cache->count == cache->capa) {
+        cache->capa = cache->capa == 0 ? 32 : cache->capa * 2;
+        REALLOC_N(cache->items, VALUE, cache->capa);
+    }
+    cache->items[cache->count++] = obj;
+}
+
+static VALUE des_cache_get(DES_CACHE *cache, long index, const char *err) {
+    if(index < 0 || index >= cache->count) rb_raise(rb_eRangeError, "%s", err);
+    return cache->items[index];
+}
+
+/*
+ * Adds a newly read value to the object table
+ */
+static void des_cache_obj(AMF_DESERIALIZER *des, VALUE obj) {
+    STATS_INC(&des->stats, object_misses);
+    des_cache_push(&des->obj_cache, obj);
+}
+
+/*
+ * Looks up an AMF3 object reference in the current body's table
+ */
+static VALUE des3_obj_ref(AMF_DESERIALIZER *des, long index) {
+    STATS_INC(&des->stats, object_hits);
+    return des_cache_get(&des->obj_cache, des->obj_base + index, "obj reference index beyond end");
+}
+
+/*
+ * Returns a trait struct for the next trait index, reusing one left over from
+ * an earlier deserialization when there is one
+ */
+static DES_TRAIT *des_new_trait(AMF_DESERIALIZER *des, long members_len) {
+    if(des->trait_count == des->trait_capa) {
+        long i, capa = des->trait_capa == 0 ? 16 : des->trait_capa * 2;
+        REALLOC_N(des->traits, DES_TRAIT *, capa);
+        for(i = des->trait_capa; i < capa; i++) des->traits[i] = NULL;
+        des->trait_capa = capa;
+    }
+    DES_TRAIT *trait = des->traits[des->trait_count];
+    if(!trait) {
+        trait = ALLOC(DES_TRAIT);
+        memset(trait, 0, sizeof(DES_TRAIT));
+        des->traits[des->trait_count] = trait;
+    }
+    if(members_len > trait->members_capa) {
+        REALLOC_N(trait->members, VALUE, members_len);
+        if(trait->snake_members) xfree(trait->snake_members);
+        trait->snake_members = NULL;
+        if(trait->setters) xfree(trait->setters);
+        trait->setters = NULL;
+        trait->members_capa = members_len;
+    }
+    trait->class_name = Qnil;
+    trait->members_len = 0;
+    trait->klass = 0;
+    trait->snake_built = 0;
+    trait->setters_built = 0;
+    return trait;
+}
+
 /*
  * Create new struct and wrap with class
  */
@@ -146,61 +230,350 @@ int des_read_int(AMF_DESERIALIZER *des) {
     return result;
 }
 
+#ifdef HAVE_RB_STR_ENCODE
+#define ASCII_WORD_MASK ((~0UL / 0xff) * 0x80) // High bit of every byte in a long
+
 /*
- * Read a string and then force the encoding to UTF 8 if running ruby 1.9
+ * Classify bytes as 7 bit, valid UTF-8 or broken in one pass. ASCII runs are
+ * checked a word at a time, since most strings in AMF data are ASCII.
  */
-VALUE des_read_string(AMF_DESERIALIZER *des, long len) {
+int des_utf8_coderange(const char *str, long len) {
+    const unsigned char *p = (const unsigned char *)str, *end = p + len;
+    int cr = ENC_CODERANGE_7BIT;
+    while(1) {
+        while(end - p >= 4 * (long)sizeof(unsigned long)) {
+            unsigned long words[4];
+            memcpy(words, p, sizeof(words));
+            if((words[0] | words[1] | words[2] | words[3]) & ASCII_WORD_MASK) break;
+            p += sizeof(words);
+        }
+        while(end - p >= (long)sizeof(unsigned long)) {
+            unsigned long word;
+            memcpy(&word, p, sizeof(word));
+            if(word & ASCII_WORD_MASK) break;
+            p += sizeof(word);
+        }
+        while(p < end && *p < 0x80) p++;
+        if(p == end) return cr;
+
+        // Lead byte picks the sequence length and the range of the second
+        // byte, which rules out overlong forms, surrogates and > U+10FFFF
+        unsigned char c = *p, lo = 0x80, hi = 0xbf;
+        long n, i;
+        if(c >= 0xc2 && c <= 0xdf) n = 1;
+        else if(c == 0xe0) { n = 2; lo = 0xa0; }
+        else if(c == 0xed) { n = 2; hi = 0x9f; }
+        else if(c >= 0xe1 && c <= 0xef) n = 2;
+        else if(c == 0xf0) { n = 3; lo = 0x90; }
+        else if(c >= 0xf1 && c <= 0xf3) n = 3;
+        else if(c == 0xf4) { n = 3; hi = 0x8f; }
+        else return ENC_CODERANGE_BROKEN;
+        if(end - p <= n || p[1] < lo || p[1] > hi) return ENC_CODERANGE_BROKEN;
+        for(i = 2; i <= n; i++) {
+            if((p[i] & 0xc0) != 0x80) return ENC_CODERANGE_BROKEN;
+        }
+        p += n + 1;
+        cr = ENC_CODERANGE_VALID;
+    }
+}
+
+/*
+ * Copy a string while classifying it, so an ASCII string only makes one pass
+ * through the cache. Once a non-ASCII byte turns up the rest is copied and
+ * checked separately.
+ */
+static int des_copy_utf8(char *dst, const char *src, long len) {
+    long i = 0, step = 4 * sizeof(unsigned long);
+    for(; i + step <= len; i += step) {
+        unsigned long words[4];
+        memcpy(words, src + i, step);
+        memcpy(dst + i, words, step);
+        if((words[0] | words[1] | words[2] | words[3]) & ASCII_WORD_MASK) break;
+    }
+    memcpy(dst + i, src + i, len - i);
+    return des_utf8_coderange(src + i, len - i);
+}
+#endif
+
+/*
+ * Read raw bytes into a binary string, shared with the source if it's long
+ * enough and sharing is on
+ */
+VALUE des_read_bytes(AMF_DESERIALIZER *des, long len) {
     DES_BOUNDS_CHECK(des, len);
-    VALUE str = rb_str_new(des->stream + des->pos, len);
-#ifdef HAVE_RB_STR_ENCODE
-    rb_encoding *utf8 = rb_utf8_encoding();
-    rb_enc_associate(str, utf8);
-    ENC_CODERANGE_CLEAR(str);
+    VALUE str;
+#ifdef HAVE_RB_STR_NEW_STATIC
+    if(des->share_root && len >= des->share_threshold) {
+        // Point straight into the frozen source buffer instead of copying it.
+        // The hidden ivar keeps the source alive as long as the string is,
+        // and ruby copies the bytes out itself if the string is ever modified.
+        str = rb_str_new_static(des->stream + des->pos, len);
+        rb_ivar_set(str, id_shared_source, des->share_root);
+    } else
 #endif
+    str = rb_str_new(des->stream + des->pos, len);
     des->pos += len;
     return str;
 }
 
+/*
+ * Read a string and then force the encoding to UTF 8 if running ruby 1.9. The
+ * coderange is worked out here so ruby never has to scan the string again.
+ */
+VALUE des_read_string(AMF_DESERIALIZER *des, long len) {
+#ifdef HAVE_RB_STR_ENCODE
+    DES_BOUNDS_CHECK(des, len);
+    VALUE str;
+    int cr;
+#ifdef HAVE_RB_STR_NEW_STATIC
+    if(des->share_root && len >= des->share_threshold) {
+        cr = des_utf8_coderange(des->stream + des->pos, len);
+        str = des_read_bytes(des, len);
+    } else
+#endif
+    {
+        str = rb_str_new(NULL, len);
+        cr = des_copy_utf8(RSTRING_PTR(str), des->stream + des->pos, len);
+        des->pos += len;
+    }
+    if(cr == ENC_CODERANGE_BROKEN && des->strict_utf8) rb_raise(rb_eEncodingError, "invalid UTF-8 in string at %ld", des->pos - len);
+    rb_enc_associate(str, rb_utf8_encoding());
+    ENC_CODERANGE_SET(str, cr);
+    return str;
+#else
+    return des_read_bytes(des, len);
+#endif
+}
+
 /*
  * Because Ruby 1.8 doesn't have a good optimization for looking up symbols from
  * C strings, this function does the lookup without requiring any additional
- * allocations.
+ * allocations. Newer rubies can intern a length delimited name, which leaves
+ * the source untouched for other threads reading it.
  */
 VALUE des_read_sym(AMF_DESERIALIZER *des, long len) {
     DES_BOUNDS_CHECK(des, len);
+#ifdef HAVE_RB_INTERN2
+    VALUE sym = ID2SYM(rb_intern2(des->stream + des->pos, len));
+    des->pos += len;
+    return sym;
+#else
     char end = des->stream[des->pos+len];
     des->stream[des->pos+len] = '\0';
     VALUE sym = ID2SYM(rb_intern(des->stream + des->pos));
     des->stream[des->pos+len] = end;
     des->pos += len;
     return sym;
+#endif
 }
 
 /*
- * Set the source of the amf reader to a StringIO object, creating a new one to
- * wrap the source if it's only a string
+ * Set the source of the amf reader to a String, StringIO, ByteArray or
+ * MappedSource. Strings are read directly, and only get a StringIO if
+ * something asks for des.source. Byte arrays are read through their string,
+ * and mapped sources through the string over their mapping.
  */
 void des_set_src(AMF_DESERIALIZER *des, VALUE src) {
-    VALUE klass = CLASS_OF(src);
-    if(klass == cStringIO) {
-        VALUE str = rb_funcall(src, rb_intern("string"), 0);
+    VALUE str;
+    if(TYPE(src) == T_STRING) {
+        str = src;
+        des->src = 0;
+        des->pos = 0;
+    } else if(rb_obj_is_kind_of(src, cStringIO) == Qtrue) {
+        str = rb_funcall(src, rb_intern("string"), 0);
         des->src = src;
-        des->stream = RSTRING_PTR(str);
         des->pos = NUM2LONG(rb_funcall(src, rb_intern("pos"), 0));
-        des->size = RSTRING_LEN(str);
-    } else if(klass == rb_cString) {
-        VALUE args[1] = {src};
-        des->src = rb_class_new_instance(1, args, cStringIO);
-        des->stream = RSTRING_PTR(src);
-        des->pos = 0;
-        des->size = RSTRING_LEN(src);
+    } else if(rb_obj_is_kind_of(src, cByteArray) == Qtrue) {
+        AMF_BYTE_ARRAY *ba = byte_array_get(src);
+        str = ba->str;
+        des->src = src;
+        des->pos = ba->pos;
+    } else if(rb_obj_is_kind_of(src, cMappedSource) == Qtrue) {
+        AMF_MAPPED_SOURCE *mapped = mapped_source_get(src);
+        str = mapped->str;
+        des->src = src;
+        des->pos = mapped->pos;
     } else {
         rb_raise(rb_eArgError, "Invalid source type to deserialize from");
     }
+    des->src_string = str;
+    des->src_lent = 0;
+    des->ran_out = 0;
+
+    // Sharing strings needs a buffer that can never change underneath them.
+    // rb_str_new_frozen hands over the existing buffer rather than copying it,
+    // and the caller's string copies on write if they modify it later.
+    des->share_root = 0;
+#ifdef HAVE_RB_STR_NEW_STATIC
+    if(des->share_threshold > 0 && RSTRING_LEN(str) >= des->share_threshold) {
+        str = rb_str_new_frozen(str);
+        des->share_root = str;
+    }
+#endif
+    des->stream = RSTRING_PTR(str);
+    des->size = RSTRING_LEN(str);
 
     if(des->pos >= des->size) rb_raise(rb_eRangeError, "already at the end of the source");
 }
 
+/*
+ * Returns the StringIO for the source, wrapping a String source positioned
+ * where the reader is if it hasn't been asked for before
+ */
+VALUE des_source_io(AMF_DESERIALIZER *des) {
+    if(!des->src && des->src_string) {
+        VALUE args[1] = {des->src_string};
+        des->src = rb_class_new_instance(1, args, cStringIO);
+        rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos));
+    }
+    return des->src ? des->src : Qnil;
+}
+
+#define DES_CACHE_KEEP 4096 // Largest reference table kept between sources
+
+static void des_cache_trim(DES_CACHE *cache) {
+    cache->count = 0;
+    if(cache->capa > DES_CACHE_KEEP) {
+        xfree(cache->items);
+        cache->items = NULL;
+        cache->capa = 0;
+    }
+}
+
+/*
+ * Forget the source and everything read from it, keeping options and the
+ * allocated tables so the deserializer can be reused
+ */
+void des_reset(AMF_DESERIALIZER *des) {
+    des->src = 0;
+    des->src_lent = 0;
+    des->ran_out = 0;
+    des->src_string = 0;
+    des->share_root = 0;
+    des->stream = NULL;
+    des->pos = 0;
+    des->size = 0;
+    des->depth = 0;
+    des->version = 0;
+    des_cache_trim(&des->obj_cache);
+    des_cache_trim(&des->str_cache);
+    des->trait_count = 0;
+    des->obj_base = 0;
+    des->str_base = 0;
+    des->trait_base = 0;
+    des->feed_buf = 0;
+    des->feed_pos = 0;
+    if(des->scanner) scanner_reset(des->scanner);
+}
+
+/*
+ * Takes a deserializer of the given class out of the current thread's pool,
+ * or makes a new one if the pool doesn't have one. Deserializers in use stay
+ * out of the pool, so nested calls get their own.
+ */
+VALUE des_pool_checkout(VALUE klass) {
+    VALUE pool = rb_thread_local_aref(rb_thread_current(), id_des_pool);
+    VALUE des_rb = pool == Qnil ? Qnil : rb_hash_delete(pool, klass);
+    if(des_rb == Qnil) des_rb = rb_class_new_instance(0, NULL, klass);
+    return des_rb;
+}
+
+/*
+ * Resets the deserializer, and any options it was given, and returns it to the
+ * current thread's pool
+ */
+void des_pool_checkin(VALUE des_rb) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(des_rb, AMF_DESERIALIZER, des);
+    des_reset(des);
+    des->class_mapper = 0;
+    des->share_threshold = 0;
+    des->strict_utf8 = 0;
+    des->tape_threshold = 0;
+
+    VALUE pool = rb_thread_local_aref(rb_thread_current(), id_des_pool);
+    if(pool == Qnil) {
+        pool = rb_hash_new();
+        rb_thread_local_aset(rb_thread_current(), id_des_pool, pool);
+    }
+    rb_hash_aset(pool, CLASS_OF(des_rb), des_rb);
+}
+
+/*
+ * Read deserializer options from the given hash. See des_initialize for what
+ * they do.
+ */
+void des_set_options(AMF_DESERIALIZER *des, VALUE opts) {
+    if(opts == Qnil) return;
+    Check_Type(opts, T_HASH);
+
+    VALUE threshold = rb_hash_aref(opts, ID2SYM(rb_intern("shared_string_threshold")));
+    if(threshold != Qnil) {
+        long len = NUM2LONG(threshold);
+        if(len < 0) rb_raise(rb_eArgError, "shared_string_threshold must not be negative");
+        if(len > 0 && len < MIN_SHARED_STRING_LENGTH) len = MIN_SHARED_STRING_LENGTH;
+        des->share_threshold = len;
+    }
+    des->strict_utf8 = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("strict_utf8"))));
+
+    threshold = rb_hash_aref(opts, ID2SYM(rb_intern("release_gvl_threshold")));
+    if(threshold != Qnil) {
+        long len = NUM2LONG(threshold);
+        if(len < 0) rb_raise(rb_eArgError, "release_gvl_threshold must not be negative");
+        des->tape_threshold = len;
+    }
+
+    VALUE class_mapper = rb_hash_aref(opts, ID2SYM(rb_intern("class_mapper")));
+    des->class_mapper = class_mapper == Qnil ? 0 : class_mapper;
+}
+
+/*
+ * Returns the class mapper the deserializer was given, or the one currently
+ * set as RocketAMF::ClassMapper
+ */
+static VALUE des_class_mapper(AMF_DESERIALIZER *des) {
+    if(des->class_mapper) return des->class_mapper;
+    return rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Deserializer.new
+ *   RocketAMF::Deserializer.new(:shared_string_threshold => 65536)
+ *   RocketAMF::Deserializer.new(:strict_utf8 => true)
+ *   RocketAMF::Deserializer.new(:release_gvl_threshold => 256*1024)
+ *   RocketAMF::Deserializer.new(:class_mapper => mapper)
+ *
+ * Creates a deserializer. Strings, long strings and XML of at least
+ * <tt>:shared_string_threshold</tt> bytes are returned as substrings sharing
+ * the source's buffer rather than copies of it. The source is frozen while
+ * deserializing and stays in memory for as long as any of those strings do.
+ * Thresholds below 1024 bytes are rounded up, and 0 (the default) disables
+ * sharing. With <tt>:strict_utf8</tt>, strings that aren't valid UTF-8 raise
+ * an EncodingError instead of coming back with a broken encoding.
+ *
+ * Sources with at least <tt>:release_gvl_threshold</tt> bytes left to read are
+ * decoded in two passes. The first checks the whole value and records its
+ * layout with the GVL released, so other threads can run or decode their own
+ * sources meanwhile, and the second builds the objects from that record. The
+ * source is frozen while it's read, as with shared strings. Values holding
+ * externalizable objects other than ArrayCollection, and broken values, are
+ * read the normal way instead. 0 (the default) always reads the normal way.
+ *
+ * Objects are mapped with <tt>:class_mapper</tt> if given, or with whatever
+ * RocketAMF::ClassMapper is when they're read. Deserializers used from other
+ * ractors need one that's shareable, such as a FastClassMapping snapshot.
+ */
+static VALUE des_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    VALUE opts;
+    rb_scan_args(argc, argv, "01", &opts);
+    des_set_options(des, opts);
+    return self;
+}
+
 /*
  * Check the arguments to a deserialize function and process args
  */
@@ -209,6 +582,7 @@ static void des_check_deserialize_args(AMF_DESERIALIZER *des, int argc, VALUE *a
     rb_scan_args(argc, argv, "01", &src);
     if(des->depth == 0) {
         if(src != Qnil) {
+            des->version = 0;
             des_set_src(des, src);
         } else {
             rb_raise(rb_eArgError, "Missing deserialization source");
@@ -217,42 +591,87 @@ static void des_check_deserialize_args(AMF_DESERIALIZER *des, int argc, VALUE *a
         if(src != Qnil) {
             rb_raise(rb_eArgError, "Already deserializing a source - don't pass a new one");
         } else {
-            // Make sure pos matches src pos in case StringIO source pos changed
-            des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0));
+            // Make sure pos matches src pos in case read_external moved it
+            if(des->src && des->src_lent) des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0));
         }
     }
 }
 
 /*
- * Return the stream for the given deserializer
+ * call-seq:
+ *   des.stats => hash
+ *   des.stats => nil
+ *
+ * Returns this deserializer's counts, in the same form as
+ * RocketAMF::Ext.stats, or nil if the extension was built without
+ * <tt>--enable-stats</tt>
+ */
+static VALUE des_stats(VALUE self) {
+#ifdef COLLECT_STATS
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    return STATS_RESULT(&des->stats, &des->stats_total);
+#else
+    return Qnil;
+#endif
+}
+
+/*
+ * Return the stream for the given deserializer. Asked for while deserializing,
+ * it's moved to where the deserializer is, and read back from once the
+ * read_external that asked for it returns.
  */
 static VALUE des_source(VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
-    return des->src;
+    VALUE src = des_source_io(des);
+    if(des->depth > 0 && src != Qnil) {
+        if(!des->src_lent) rb_funcall(src, rb_intern("pos="), 1, LONG2NUM(des->pos));
+        des->src_lent = 1;
+    }
+    return src;
+}
+
+/*
+ * call-seq:
+ *   des.reset => des
+ *
+ * Forgets the current source and every object read from it, so the
+ * deserializer can be reused for another source without holding on to the
+ * last one. Options and allocated tables are kept.
+ */
+static VALUE des_reset_rb(VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    des_reset(des);
+    return self;
 }
 
 /*
- * Create AMF3 deserializer and copy source data over to it, before calling
- * AMF3 internal deserialize function
+ * Read an AMF3 body in the middle of AMF0 data. AMF3 has its own reference
+ * tables, so they're started above whatever AMF0 has read so far and dropped
+ * again afterwards, leaving the AMF0 references as they were.
  */
-static VALUE des0_read_amf3(AMF_DESERIALIZER *des) {
-    // Create deserializer
-    VALUE amf3_des_val = des_alloc(cAMF3Deserializer);
-    AMF_DESERIALIZER *amf3_des;
-    Data_Get_Struct(amf3_des_val, AMF_DESERIALIZER, amf3_des);
+static VALUE des0_read_amf3(VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
 
-    // Copy over properties
-    amf3_des->src = des->src;
-    amf3_des->stream = des->stream;
-    amf3_des->pos = des->pos;
-    amf3_des->size = des->size;
+    char version = des->version;
+    long obj_base = des->obj_base, str_base = des->str_base, trait_base = des->trait_base;
+    des->version = 3;
+    des->obj_base = des->obj_cache.count;
+    des->str_base = des->str_cache.count;
+    des->trait_base = des->trait_count;
 
-    // Run it
-    VALUE result = des3_deserialize(amf3_des_val);
+    VALUE result = des3_deserialize(self);
 
-    // Copy pos back
-    des->pos = amf3_des->pos;
+    des->obj_cache.count = des->obj_base;
+    des->str_cache.count = des->str_base;
+    des->trait_count = des->trait_base;
+    des->version = version;
+    des->obj_base = obj_base;
+    des->str_base = str_base;
+    des->trait_base = trait_base;
 
     return result;
 }
@@ -271,7 +690,14 @@ static void des0_read_props(VALUE self, VALUE hash, VALUE(*read_key)(AMF_DESERIA
             des_read_byte(des); // Read type byte
             return;
         } else {
-            VALUE key = translate_case ? snakecase_str(read_key(des, len)) : read_key(des, len);
+            VALUE key;
+            if(translate_case) {
+                DES_BOUNDS_CHECK(des, len);
+                key = case_underscore(des->stream + des->pos, len, read_key == des_read_sym);
+                des->pos += len;
+            } else {
+                key = read_key(des, len);
+            }
             char type = des_read_byte(des);
             rb_hash_aset(hash, key, des0_deserialize(self, type));
         }
@@ -283,28 +709,28 @@ static VALUE des0_read_object(VALUE self) {
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
 
     VALUE obj = rb_hash_new();
-    rb_ary_push(des->obj_cache, obj);
+    des_cache_obj(des, obj);
     des0_read_props(self, obj, des_read_sym, 0);
     return obj;
 }
 
 static VALUE des0_read_typed_object(VALUE self) {
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    VALUE class_mapper = des_class_mapper(des);
 
     // Create object and add to cache
     VALUE class_name = des_read_string(des, des_read_uint16(des));
-    VALUE obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, class_name);
-    rb_ary_push(des->obj_cache, obj);
+    VALUE obj;
+    STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, class_name));
+    des_cache_obj(des, obj);
 
     int translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
 
     // Populate object
     VALUE props = rb_hash_new();
     des0_read_props(self, props, des_read_sym, translate_case);
-    rb_funcall(class_mapper, id_populate_ruby_obj, 2, obj, props);
+    STATS_CALL(&des->stats, STATS_POPULATE_RUBY_OBJ, rb_funcall(class_mapper, id_populate_ruby_obj, 2, obj, props));
 
     return obj;
 }
@@ -312,11 +738,10 @@ static VALUE des0_read_typed_object(VALUE self) {
 static VALUE des0_read_hash(VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    VALUE class_mapper = des_class_mapper(des);
 
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
-
-    VALUE obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, rb_str_new2("Hash"));
+    VALUE obj;
+    STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, rb_str_new2("Hash")));
     int translate_case = 0;
     if (obj != Qnil) {
       translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
@@ -325,7 +750,7 @@ static VALUE des0_read_hash(VALUE self) {
     }
 
     des_read_uint32(des); // Hash size, but there's no optimization I can perform with this
-    rb_ary_push(des->obj_cache, obj);
+    des_cache_obj(des, obj);
     des0_read_props(self, obj, des_read_string, translate_case);
     return obj;
 }
@@ -339,7 +764,7 @@ static VALUE des0_read_array(VALUE self) {
     // crash the server
     long len = des_read_uint32(des);
     VALUE ary = rb_ary_new2(len < MAX_ARRAY_PREALLOC ? len : MAX_ARRAY_PREALLOC);
-    rb_ary_push(des->obj_cache, ary);
+    des_cache_obj(des, ary);
 
     long i;
     for(i = 0; i < len; i++) {
@@ -349,12 +774,29 @@ static VALUE des0_read_array(VALUE self) {
     return ary;
 }
 
+/*
+ * Build a Time from milliseconds since the epoch. Splits on floor so negative
+ * times keep their fractional part, and rounds to the nearest microsecond to
+ * avoid drift from the double.
+ */
+VALUE des_time_from_millis(double milli) {
+    double sec = floor(milli / 1000);
+    long usec = (long)((milli - sec * 1000) * 1000 + 0.5);
+    if(usec >= 1000000) {
+        sec += 1;
+        usec -= 1000000;
+    }
+#ifdef HAVE_RB_TIME_NANO_NEW
+    return rb_time_nano_new((time_t)sec, usec * 1000);
+#else
+    return rb_time_new((time_t)sec, usec);
+#endif
+}
+
 static VALUE des0_read_time(AMF_DESERIALIZER *des) {
     double milli = des_read_double(des);
     des_read_uint16(des); // Timezone - unused
-    time_t sec = milli/1000.0;
-    time_t micro = (milli-sec*1000)*1000;
-    return rb_time_new(sec, micro);
+    return des_time_from_millis(milli);
 }
 
 /*
@@ -366,9 +808,12 @@ VALUE des0_deserialize(VALUE self, char type) {
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
 
     if(des->depth == 0) {
-        des->obj_cache = rb_ary_new();
+        des->obj_cache.count = 0;
+        des->version = 0;
     }
     des->depth++;
+    STATS_ENTER(&des->stats);
+    STATS_VALUE(&des->stats, 0, type);
 
     long tmp;
     VALUE ret = Qnil;
@@ -377,7 +822,7 @@ VALUE des0_deserialize(VALUE self, char type) {
             ret = des_read_string(des, des_read_uint16(des));
             break;
         case AMF0_AMF3_MARKER:
-            ret = des0_read_amf3(des);
+            ret = des0_read_amf3(self);
             break;
         case AMF0_NUMBER_MARKER:
             ret = rb_float_new(des_read_double(des));
@@ -404,8 +849,8 @@ VALUE des0_deserialize(VALUE self, char type) {
             break;
         case AMF0_REFERENCE_MARKER:
             tmp = des_read_uint16(des);
-            if(tmp >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "reference index beyond end");
-            ret = RARRAY_PTR(des->obj_cache)[tmp];
+            STATS_INC(&des->stats, object_hits);
+            ret = des_cache_get(&des->obj_cache, tmp, "reference index beyond end");
             break;
         case AMF0_DATE_MARKER:
             ret = des0_read_time(des);
@@ -419,6 +864,7 @@ VALUE des0_deserialize(VALUE self, char type) {
             break;
     }
 
+    STATS_LEAVE(&des->stats);
     des->depth--;
 
     return ret;
@@ -434,8 +880,20 @@ VALUE des0_deserialize(VALUE self, char type) {
 static VALUE des0_deserialize_rb(int argc, VALUE *argv, VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
-    VALUE ret = des0_deserialize(self, des_read_byte(des));
-    rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+    des_check_deserialize_args(des, argc, argv);
+    long start = des->pos;
+    VALUE ret = Qundef;
+    if(des->version == 3) {
+        ret = des3_deserialize(self); // Called from read_external inside an AMF3 body
+    } else {
+        if(des->depth == 0 && des->tape_threshold > 0 && des->size - des->pos >= des->tape_threshold) ret = des_tape_deserialize(self, 0);
+        if(ret == Qundef) ret = des0_deserialize(self, des_read_byte(des));
+    }
+    if(des->src && (des->depth == 0 || des->src_lent)) rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+    if(des->depth == 0) {
+        STATS_ADD(&des->stats, bytes, des->pos - start);
+        STATS_FINISH(&des->stats, &des->stats_total, STATS_DESERIALIZE);
+    }
     return ret;
 }
 
@@ -443,11 +901,14 @@ static VALUE des3_read_string(AMF_DESERIALIZER *des) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->str_cache)) rb_raise(rb_eRangeError, "str reference index beyond end");
-        return RARRAY_PTR(des->str_cache)[header];
+        STATS_INC(&des->stats, string_hits);
+        return des_cache_get(&des->str_cache, des->str_base + header, "str reference index beyond end");
     } else {
         VALUE str = des_read_string(des, header >> 1);
-        if(RSTRING_LEN(str) > 0) rb_ary_push(des->str_cache, str);
+        if(RSTRING_LEN(str) > 0) {
+            STATS_INC(&des->stats, string_misses);
+            des_cache_push(&des->str_cache, str);
+        }
         return str;
     }
 }
@@ -460,94 +921,161 @@ static VALUE des3_read_xml(AMF_DESERIALIZER *des) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
         VALUE str = des_read_string(des, header >> 1);
-        if(RSTRING_LEN(str) > 0) rb_ary_push(des->obj_cache, str);
+        if(RSTRING_LEN(str) > 0) des_cache_obj(des, str);
         return str;
     }
 }
 
+/*
+ * Returns the member keys to populate obj with, underscored if its class has
+ * translate_case on. The option only depends on the class, so it's looked up
+ * once per trait, along with whether the class is a built-in message that can
+ * be populated directly.
+ */
+static VALUE *des3_trait_keys(AMF_DESERIALIZER *des, DES_TRAIT *trait, VALUE obj, int *translate_case) {
+    VALUE class_mapper = des_class_mapper(des);
+    if(CLASS_OF(obj) != trait->klass) {
+        trait->translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
+        trait->klass = CLASS_OF(obj);
+        trait->direct = msg_class_for(trait->klass) && msg_mapper_allows(class_mapper, id_object_populators);
+        trait->setters_built = 0;
+    }
+    *translate_case = trait->translate_case;
+    if(trait->translate_case && !trait->snake_built) {
+        long i;
+        if(!trait->snake_members) trait->snake_members = ALLOC_N(VALUE, trait->members_capa);
+        for(i = 0; i < trait->members_len; i++) {
+            const char *name = rb_id2name(SYM2ID(trait->members[i]));
+            trait->snake_members[i] = case_underscore(name, strlen(name), 1);
+        }
+        trait->snake_built = 1;
+    }
+    return trait->translate_case ? trait->snake_members : trait->members;
+}
+
+/*
+ * Returns the setters for a direct trait's member keys, worked out the first
+ * time an object with the trait is populated
+ */
+static ID *des3_trait_setters(DES_TRAIT *trait, VALUE obj, VALUE *keys) {
+    if(!trait->setters_built) {
+        long i;
+        if(!trait->setters) trait->setters = ALLOC_N(ID, trait->members_capa > 0 ? trait->members_capa : 1);
+        for(i = 0; i < trait->members_len; i++) {
+            trait->setters[i] = msg_setter(obj, keys[i]);
+        }
+        trait->setters_built = 1;
+    }
+    return trait->setters;
+}
+
+/*
+ * Sets a property on a built-in message the way populate_ruby_obj would,
+ * without building property hashes first
+ */
+static void des3_set_direct(VALUE obj, ID setter, VALUE val) {
+    if(setter) rb_funcall(obj, setter, 1, val);
+}
+
 static VALUE des3_read_object(VALUE self) {
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    VALUE class_mapper = des_class_mapper(des);
 
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
-        VALUE externalizable, dynamic, members, class_name, traits;
-        long i, members_len;
+        DES_TRAIT *trait;
+        long i;
 
         // Parse traits
         header >>= 1;
         if((header & 1) == 0) {
             header >>= 1;
-            if(header >= RARRAY_LEN(des->trait_cache)) rb_raise(rb_eRangeError, "trait reference index beyond end");
-            traits = RARRAY_PTR(des->trait_cache)[header];
-            externalizable = rb_hash_aref(traits, sym_externalizable);
-            dynamic = rb_hash_aref(traits, sym_dynamic);
-            members = rb_hash_aref(traits, sym_members);
-            members_len = members == Qnil ? 0 : RARRAY_LEN(members);
-            class_name = rb_hash_aref(traits, sym_class_name);
+            if(header >= des->trait_count - des->trait_base) rb_raise(rb_eRangeError, "trait reference index beyond end");
+            trait = des->traits[des->trait_base + header];
+            STATS_INC(&des->stats, trait_hits);
         } else {
-            externalizable = (header & 2) != 0 ? Qtrue : Qfalse;
-            dynamic = (header & 4) != 0 ? Qtrue : Qfalse;
-            members_len = header >> 3;
-            class_name = des3_read_string(des);
-
-            members = rb_ary_new2(members_len);
-            for(i = 0; i < members_len; i++) rb_ary_push(members, des3_read_string(des));
-
-            traits = rb_hash_new();
-            rb_hash_aset(traits, sym_externalizable, externalizable);
-            rb_hash_aset(traits, sym_dynamic, dynamic);
-            rb_hash_aset(traits, sym_members, members);
-            rb_hash_aset(traits, sym_class_name, class_name);
-            rb_ary_push(des->trait_cache, traits);
+            STATS_INC(&des->stats, trait_misses);
+            // Every member name takes at least a byte, so don't trust the count
+            // further than the source goes
+            long members_len = header >> 3;
+            DES_BOUNDS_CHECK(des, members_len);
+
+            // Added to the table first so the members are marked as they're read
+            trait = des_new_trait(des, members_len);
+            des->trait_count++;
+            trait->externalizable = (header & 2) != 0;
+            trait->dynamic = (header & 4) != 0;
+            trait->class_name = des3_read_string(des);
+            trait->array_collection = RSTRING_LEN(trait->class_name) == sizeof(array_collection) - 1 && memcmp(RSTRING_PTR(trait->class_name), array_collection, sizeof(array_collection) - 1) == 0;
+            for(i = 0; i < members_len; i++) {
+                trait->members[i] = rb_str_intern(des3_read_string(des));
+                trait->members_len++;
+            }
         }
 
         // Optimization for deserializing ArrayCollection
-        if(strcmp(RSTRING_PTR(class_name), "flex.messaging.io.ArrayCollection") == 0) {
+        if(trait->array_collection) {
             VALUE arr = des3_deserialize(self); // Adds ArrayCollection array to object cache automatically
-            rb_ary_push(des->obj_cache, arr); // Add again for ArrayCollection source array
+            des_cache_obj(des, arr); // Add again for ArrayCollection source array
             return arr;
         }
 
-        VALUE obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, class_name);
-        rb_ary_push(des->obj_cache, obj);
-
-        if(externalizable == Qtrue) {
-            rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
-            rb_funcall(obj, rb_intern("read_external"), 1, self);
-            des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0)); // Update from source
+        VALUE obj;
+        STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, trait->class_name));
+        des_cache_obj(des, obj);
+
+        if(trait->externalizable) {
+            // The source only has to be kept in step if read_external asks for
+            // it. The IDataInput methods read straight from the buffer.
+            char lent = des->src_lent;
+            des->src_lent = 0;
+            STATS_CALL(&des->stats, STATS_READ_EXTERNAL, rb_funcall(obj, rb_intern("read_external"), 1, self));
+            if(des->src_lent) des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0)); // Update from source
+            des->src_lent = lent;
+            if(lent) rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Hand back to the outer read_external
             return obj;
         }
 
-        int translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
+        int translate_case;
+        VALUE *keys = des3_trait_keys(des, trait, obj, &translate_case);
+        if(trait->direct) {
+            ID *setters = des3_trait_setters(trait, obj, keys);
+            for(i = 0; i < trait->members_len; i++) {
+                des3_set_direct(obj, setters[i], des3_deserialize(self));
+            }
+            while(trait->dynamic) {
+                VALUE key = des3_read_string(des);
+                if(RSTRING_LEN(key) == 0) break;
+                key = translate_case ? case_underscore(RSTRING_PTR(key), RSTRING_LEN(key), 1) : rb_str_intern(key);
+                des3_set_direct(obj, msg_setter(obj, key), des3_deserialize(self));
+            }
+            return obj;
+        }
 
         VALUE props = rb_hash_new();
-        for(i = 0; i < members_len; i++) {
-            VALUE key = rb_str_intern(translate_case ? snakecase_str(RARRAY_PTR(members)[i]) : RARRAY_PTR(members)[i]);
-            rb_hash_aset(props, key, des3_deserialize(self));
+        for(i = 0; i < trait->members_len; i++) {
+            rb_hash_aset(props, keys[i], des3_deserialize(self));
         }
 
         VALUE dynamic_props = Qnil;
-        if(dynamic == Qtrue) {
+        if(trait->dynamic) {
             dynamic_props = rb_hash_new();
             while(1) {
-                VALUE key = translate_case ? snakecase_str(des3_read_string(des)) : des3_read_string(des);
+                VALUE key = des3_read_string(des);
                 if(RSTRING_LEN(key) == 0) break;
-                rb_hash_aset(dynamic_props, rb_str_intern(key), des3_deserialize(self));
+                key = translate_case ? case_underscore(RSTRING_PTR(key), RSTRING_LEN(key), 1) : rb_str_intern(key);
+                rb_hash_aset(dynamic_props, key, des3_deserialize(self));
             }
         }
 
-        rb_funcall(class_mapper, id_populate_ruby_obj, 3, obj, props, dynamic_props);
+        STATS_CALL(&des->stats, STATS_POPULATE_RUBY_OBJ, rb_funcall(class_mapper, id_populate_ruby_obj, 3, obj, props, dynamic_props));
 
         return obj;
     }
@@ -561,8 +1089,7 @@ static VALUE des3_read_array(VALUE self) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
         header >>= 1;
         VALUE obj;
@@ -570,7 +1097,7 @@ static VALUE des3_read_array(VALUE self) {
         if(key == Qnil) rb_raise(rb_eRangeError, "key is Qnil");
         if(RSTRING_LEN(key) != 0) {
             obj = rb_hash_new();
-            rb_ary_push(des->obj_cache, obj);
+            des_cache_obj(des, obj);
             while(RSTRING_LEN(key) != 0) {
                 rb_hash_aset(obj, key, des3_deserialize(self));
                 key = des3_read_string(des);
@@ -583,7 +1110,7 @@ static VALUE des3_read_array(VALUE self) {
             // rather than just sending a size of 2**32-1 and nothing afterwards to
             // crash the server
             obj = rb_ary_new2(header < MAX_ARRAY_PREALLOC ? header : MAX_ARRAY_PREALLOC);
-            rb_ary_push(des->obj_cache, obj);
+            des_cache_obj(des, obj);
             for(i = 0; i < header; i++) {
                 rb_ary_push(obj, des3_deserialize(self));
             }
@@ -596,14 +1123,10 @@ static VALUE des3_read_time(AMF_DESERIALIZER *des) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
-        double milli = des_read_double(des);
-        time_t sec = milli/1000.0;
-        time_t micro = (milli-sec*1000)*1000;
-        VALUE time = rb_time_new(sec, micro);
-        rb_ary_push(des->obj_cache, time);
+        VALUE time = des_time_from_millis(des_read_double(des));
+        des_cache_obj(des, time);
         return time;
     }
 }
@@ -612,23 +1135,95 @@ static VALUE des3_read_byte_array(AMF_DESERIALIZER *des) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
         header >>= 1;
-        VALUE args[1] = {des_read_string(des, header)};
-#ifdef HAVE_RB_STR_ENCODE
-        // Need to force encoding to ASCII-8BIT
-        rb_encoding *ascii = rb_ascii8bit_encoding();
-        rb_enc_associate(args[0], ascii);
-        ENC_CODERANGE_CLEAR(args[0]);
-#endif
-        VALUE ba = rb_class_new_instance(1, args, cStringIO);
-        rb_ary_push(des->obj_cache, ba);
+        VALUE ba = byte_array_new(des_read_bytes(des, header)); // Already ASCII-8BIT
+        des_cache_obj(des, ba);
         return ba;
     }
 }
 
+/*
+ * Converts the fixed width body of a numeric vector, which is known to be all
+ * there, into vec
+ */
+static void des3_fill_vector(VALUE vec, char type, const unsigned char *str, long len) {
+    long i;
+
+    // The data is known to be there, so size the array up front
+    if(len > 0) rb_ary_store(vec, len - 1, Qnil);
+
+    if(type == AMF3_VECTOR_INT_MARKER) {
+        rb_ivar_set(vec, id_iv_type, sym_int);
+        for(i = 0; i < len; i++, str += 4) {
+            int num = (int)(((unsigned int)str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3]);
+            rb_ary_store(vec, i, INT2NUM(num));
+        }
+    } else if(type == AMF3_VECTOR_UINT_MARKER) {
+        rb_ivar_set(vec, id_iv_type, sym_uint);
+        for(i = 0; i < len; i++, str += 4) {
+            unsigned long num = ((unsigned long)str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3];
+            rb_ary_store(vec, i, ULONG2NUM(num));
+        }
+    } else {
+        rb_ivar_set(vec, id_iv_type, sym_double);
+        union aligned {
+            double dval;
+            char cval[8];
+        } d;
+        for(i = 0; i < len; i++, str += 8) {
+#ifdef WORDS_BIGENDIAN
+            memcpy(d.cval, str, 8);
+#else
+            int j;
+            for(j = 0; j < 8; j++) d.cval[j] = str[7 - j];
+#endif
+            rb_ary_store(vec, i, rb_float_new(d.dval));
+        }
+    }
+}
+
+/*
+ * Reads an AMF3 vector into a RocketAMF::Values::Vector. Numeric vectors are
+ * fixed width, so the whole body is bounds checked once and converted in a
+ * single pass rather than element by element through des3_deserialize.
+ */
+static VALUE des3_read_vector(VALUE self, char type) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    int header = des_read_int(des);
+    if((header & 1) == 0) {
+        header >>= 1;
+        return des3_obj_ref(des, header);
+    }
+
+    long i, len = DES_U29_LENGTH(header);
+    VALUE vec = rb_obj_alloc(cVector);
+    rb_ivar_set(vec, id_iv_fixed, des_read_byte(des) == 0 ? Qfalse : Qtrue);
+    des_cache_obj(des, vec);
+
+    if(type == AMF3_VECTOR_OBJECT_MARKER) {
+        rb_ivar_set(vec, id_iv_type, sym_object);
+        rb_ivar_set(vec, id_iv_class_name, des3_read_string(des));
+        for(i = 0; i < len; i++) {
+            rb_ary_push(vec, des3_deserialize(self));
+        }
+        return vec;
+    }
+    rb_ivar_set(vec, id_iv_class_name, rb_str_new2(""));
+
+    long width = type == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4;
+    if(len > LONG_MAX / width) rb_raise(rb_eRangeError, "vector length %ld is too long", len);
+    DES_BOUNDS_CHECK(des, len * width);
+    const unsigned char *str = (const unsigned char *)des->stream + des->pos;
+    des->pos += len * width;
+
+    des3_fill_vector(vec, type, str, len);
+    return vec;
+}
+
 static VALUE des3_read_dict(VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
@@ -636,13 +1231,12 @@ static VALUE des3_read_dict(VALUE self) {
     int header = des_read_int(des);
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
+        return des3_obj_ref(des, header);
     } else {
         header >>= 1;
 
         VALUE dict = rb_hash_new();
-        rb_ary_push(des->obj_cache, dict);
+        des_cache_obj(des, dict);
 
         des_read_int(des); // Skip - don't know what it does
 
@@ -667,13 +1261,18 @@ VALUE des3_deserialize(VALUE self) {
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
 
     if(des->depth == 0) {
-        des->obj_cache = rb_ary_new();
-        des->str_cache = rb_ary_new();
-        des->trait_cache = rb_ary_new();
+        des->obj_cache.count = 0;
+        des->str_cache.count = 0;
+        des->trait_count = 0;
+        des->obj_base = 0;
+        des->str_base = 0;
+        des->trait_base = 0;
     }
     des->depth++;
+    STATS_ENTER(&des->stats);
 
     char type = des_read_byte(des);
+    STATS_VALUE(&des->stats, 3, type);
     VALUE ret = Qnil;
     switch(type) {
         case AMF3_UNDEFINED_MARKER:
@@ -711,6 +1310,12 @@ VALUE des3_deserialize(VALUE self) {
         case AMF3_BYTE_ARRAY_MARKER:
             ret = des3_read_byte_array(des);
             break;
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+        case AMF3_VECTOR_OBJECT_MARKER:
+            ret = des3_read_vector(self, type);
+            break;
         case AMF3_DICT_MARKER:
             ret = des3_read_dict(self);
             break;
@@ -719,8 +1324,333 @@ VALUE des3_deserialize(VALUE self) {
             break;
     }
 
+    STATS_LEAVE(&des->stats);
+    des->depth--;
+
+    return ret;
+}
+
+/*
+ * Builds a string the tape has already bounds checked and classified
+ */
+static VALUE des_tape_string(AMF_DESERIALIZER *des, const TAPE_ENTRY *e) {
+    des->pos = e->a;
+    VALUE str = des_read_bytes(des, e->v.b);
+#ifdef HAVE_RB_STR_ENCODE
+    int flag = e->flag & TAPE_CR_MASK;
+    if(flag == TAPE_CR_BROKEN && des->strict_utf8) rb_raise(rb_eEncodingError, "invalid UTF-8 in string at %ld", e->a);
+    rb_enc_associate(str, rb_utf8_encoding());
+    ENC_CODERANGE_SET(str, flag == TAPE_CR_7BIT ? ENC_CODERANGE_7BIT : flag == TAPE_CR_VALID ? ENC_CODERANGE_VALID : ENC_CODERANGE_BROKEN);
+#endif
+    return str;
+}
+
+/*
+ * Builds an AMF3 string or looks up a string reference
+ */
+static VALUE des_tape_string3(AMF_DESERIALIZER *des, const TAPE_ENTRY *e) {
+    if(e->kind == TAPE_STR_REF) {
+        STATS_INC(&des->stats, string_hits);
+        return des->str_cache.items[e->a];
+    }
+    VALUE str = des_tape_string(des, e);
+    if(e->flag & TAPE_CACHE) {
+        STATS_INC(&des->stats, string_misses);
+        des_cache_push(&des->str_cache, str);
+    }
+    return str;
+}
+
+static VALUE des_tape_value(VALUE self, AMF_DESERIALIZER *des, AMF_TAPE *tape);
+
+static void des_tape_props(VALUE self, AMF_DESERIALIZER *des, AMF_TAPE *tape, VALUE hash, long count, int sym, int translate_case) {
+    long i;
+    for(i = 0; i < count; i++) {
+        const TAPE_ENTRY *e = &tape->entries[tape->cur++];
+        VALUE key;
+        if(translate_case) {
+            key = case_underscore(des->stream + e->a, e->v.b, sym);
+        } else if(sym) {
+            des->pos = e->a;
+            key = des_read_sym(des, e->v.b);
+        } else {
+            key = des_tape_string(des, e);
+        }
+        rb_hash_aset(hash, key, des_tape_value(self, des, tape));
+    }
+}
+
+/*
+ * Reads traits defined on the tape into the trait table, as des3_read_object
+ * does for traits defined in the source
+ */
+static void des_tape_trait(AMF_DESERIALIZER *des, AMF_TAPE *tape, const TAPE_ENTRY *e) {
+    long i, members_len = e->a;
+    DES_TRAIT *trait = des_new_trait(des, members_len);
+    des->trait_count++;
+    trait->externalizable = (e->flag & TAPE_TRAIT_EXTERNALIZABLE) != 0;
+    trait->dynamic = (e->flag & TAPE_TRAIT_DYNAMIC) != 0;
+    trait->class_name = des_tape_string3(des, &tape->entries[tape->cur++]);
+    trait->array_collection = RSTRING_LEN(trait->class_name) == sizeof(array_collection) - 1 && memcmp(RSTRING_PTR(trait->class_name), array_collection, sizeof(array_collection) - 1) == 0;
+    for(i = 0; i < members_len; i++) {
+        trait->members[i] = rb_str_intern(des_tape_string3(des, &tape->entries[tape->cur++]));
+        trait->members_len++;
+    }
+}
+
+static VALUE des_tape_object3(VALUE self, AMF_DESERIALIZER *des, AMF_TAPE *tape, const TAPE_ENTRY *e) {
+    VALUE class_mapper = des_class_mapper(des);
+    DES_TRAIT *trait = des->traits[e->a];
+    long i;
+
+    if(trait->array_collection) {
+        VALUE arr = des_tape_value(self, des, tape);
+        des_cache_obj(des, arr);
+        return arr;
+    }
+
+    VALUE obj;
+    STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, trait->class_name));
+    des_cache_obj(des, obj);
+
+    int translate_case;
+    VALUE *keys = des3_trait_keys(des, trait, obj, &translate_case);
+    if(trait->direct) {
+        ID *setters = des3_trait_setters(trait, obj, keys);
+        for(i = 0; i < trait->members_len; i++) {
+            des3_set_direct(obj, setters[i], des_tape_value(self, des, tape));
+        }
+        for(i = 0; trait->dynamic && i < e->v.b; i++) {
+            VALUE key = des_tape_string3(des, &tape->entries[tape->cur++]);
+            key = translate_case ? case_underscore(RSTRING_PTR(key), RSTRING_LEN(key), 1) : rb_str_intern(key);
+            des3_set_direct(obj, msg_setter(obj, key), des_tape_value(self, des, tape));
+        }
+        return obj;
+    }
+
+    VALUE props = rb_hash_new();
+    for(i = 0; i < trait->members_len; i++) {
+        rb_hash_aset(props, keys[i], des_tape_value(self, des, tape));
+    }
+
+    VALUE dynamic_props = Qnil;
+    if(trait->dynamic) {
+        dynamic_props = rb_hash_new();
+        for(i = 0; i < e->v.b; i++) {
+            VALUE key = des_tape_string3(des, &tape->entries[tape->cur++]);
+            key = translate_case ? case_underscore(RSTRING_PTR(key), RSTRING_LEN(key), 1) : rb_str_intern(key);
+            rb_hash_aset(dynamic_props, key, des_tape_value(self, des, tape));
+        }
+    }
+
+    STATS_CALL(&des->stats, STATS_POPULATE_RUBY_OBJ, rb_funcall(class_mapper, id_populate_ruby_obj, 3, obj, props, dynamic_props));
+    return obj;
+}
+
+/*
+ * Builds the value at the tape's cursor. Mirrors des0_deserialize and
+ * des3_deserialize, down to the order things go in the reference tables, but
+ * without any checks since the tape has done them all.
+ */
+static VALUE des_tape_value(VALUE self, AMF_DESERIALIZER *des, AMF_TAPE *tape) {
+    VALUE class_mapper = des_class_mapper(des);
+
+    const TAPE_ENTRY *e = &tape->entries[tape->cur++];
+    long i;
+    int translate_case = 0;
+    VALUE obj, tmp;
+    switch(e->kind) {
+        case TAPE_NIL:
+            return Qnil;
+        case TAPE_FALSE:
+            return Qfalse;
+        case TAPE_TRUE:
+            return Qtrue;
+        case TAPE_INT:
+            return INT2FIX(e->a);
+        case TAPE_DOUBLE:
+            return rb_float_new(e->v.d);
+        case TAPE_STRING:
+        case TAPE_STR_REF:
+            return des_tape_string3(des, e);
+        case TAPE_XML:
+            obj = des_tape_string(des, e);
+            if(e->flag & TAPE_CACHE) des_cache_obj(des, obj);
+            return obj;
+        case TAPE_OBJ_REF:
+            STATS_INC(&des->stats, object_hits);
+            return des->obj_cache.items[e->a];
+        case TAPE_DATE:
+            obj = des_time_from_millis(e->v.d);
+            if(e->flag & TAPE_CACHE) des_cache_obj(des, obj);
+            return obj;
+        case TAPE_BYTE_ARRAY:
+            des->pos = e->a;
+            obj = byte_array_new(des_read_bytes(des, e->v.b));
+            des_cache_obj(des, obj);
+            return obj;
+        case TAPE_OBJECT:
+            obj = rb_hash_new();
+            des_cache_obj(des, obj);
+            des_tape_props(self, des, tape, obj, e->a, 1, 0);
+            return obj;
+        case TAPE_TYPED_OBJECT:
+            tmp = des_tape_string(des, &tape->entries[tape->cur++]);
+            STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, tmp));
+            des_cache_obj(des, obj);
+            translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
+            tmp = rb_hash_new();
+            des_tape_props(self, des, tape, tmp, e->a, 1, translate_case);
+            STATS_CALL(&des->stats, STATS_POPULATE_RUBY_OBJ, rb_funcall(class_mapper, id_populate_ruby_obj, 2, obj, tmp));
+            return obj;
+        case TAPE_HASH:
+            STATS_CALL(&des->stats, STATS_GET_RUBY_OBJ, obj = rb_funcall(class_mapper, id_get_ruby_obj, 1, rb_str_new2("Hash")));
+            if(obj != Qnil) {
+                translate_case = rb_funcall(class_mapper, id_get_ruby_option, 2, obj, rb_str_new2("translate_case")) == Qtrue;
+            } else {
+                obj = rb_hash_new();
+            }
+            des_cache_obj(des, obj);
+            des_tape_props(self, des, tape, obj, e->a, 0, translate_case);
+            return obj;
+        case TAPE_ARRAY:
+            obj = rb_ary_new2(e->a < MAX_ARRAY_PREALLOC ? e->a : MAX_ARRAY_PREALLOC);
+            des_cache_obj(des, obj);
+            for(i = 0; i < e->a; i++) {
+                rb_ary_push(obj, des_tape_value(self, des, tape));
+            }
+            return obj;
+        case TAPE_MIXED_ARRAY:
+            obj = rb_hash_new();
+            des_cache_obj(des, obj);
+            for(i = 0; i < e->v.b; i++) {
+                tmp = des_tape_string3(des, &tape->entries[tape->cur++]);
+                rb_hash_aset(obj, tmp, des_tape_value(self, des, tape));
+            }
+            for(i = 0; i < e->a; i++) {
+                rb_hash_aset(obj, rb_fix2str(INT2FIX(i), 10), des_tape_value(self, des, tape));
+            }
+            return obj;
+        case TAPE_TRAIT:
+            des_tape_trait(des, tape, e);
+            return des_tape_object3(self, des, tape, &tape->entries[tape->cur++]);
+        case TAPE_AMF3_OBJECT:
+            return des_tape_object3(self, des, tape, e);
+        case TAPE_VECTOR_OBJECT:
+            obj = rb_obj_alloc(cVector);
+            rb_ivar_set(obj, id_iv_fixed, e->flag ? Qtrue : Qfalse);
+            des_cache_obj(des, obj);
+            rb_ivar_set(obj, id_iv_type, sym_object);
+            rb_ivar_set(obj, id_iv_class_name, des_tape_string3(des, &tape->entries[tape->cur++]));
+            for(i = 0; i < e->a; i++) {
+                rb_ary_push(obj, des_tape_value(self, des, tape));
+            }
+            return obj;
+        case TAPE_VECTOR_INT:
+        case TAPE_VECTOR_UINT:
+        case TAPE_VECTOR_DOUBLE:
+            obj = rb_obj_alloc(cVector);
+            rb_ivar_set(obj, id_iv_fixed, e->flag ? Qtrue : Qfalse);
+            des_cache_obj(des, obj);
+            rb_ivar_set(obj, id_iv_class_name, rb_str_new2(""));
+            des3_fill_vector(obj, e->kind == TAPE_VECTOR_INT ? AMF3_VECTOR_INT_MARKER : e->kind == TAPE_VECTOR_UINT ? AMF3_VECTOR_UINT_MARKER : AMF3_VECTOR_DOUBLE_MARKER, (const unsigned char *)des->stream + e->v.b, e->a);
+            return obj;
+        case TAPE_DICT:
+            obj = rb_hash_new();
+            des_cache_obj(des, obj);
+            for(i = 0; i < e->a; i++) {
+                tmp = des_tape_value(self, des, tape);
+                rb_hash_aset(obj, tmp, des_tape_value(self, des, tape));
+            }
+            return obj;
+        case TAPE_AMF3: {
+            char version = des->version;
+            long obj_base = des->obj_base, str_base = des->str_base, trait_base = des->trait_base;
+            des->version = 3;
+            des->obj_base = des->obj_cache.count;
+            des->str_base = des->str_cache.count;
+            des->trait_base = des->trait_count;
+            obj = des_tape_value(self, des, tape);
+            des->obj_cache.count = des->obj_base;
+            des->str_cache.count = des->str_base;
+            des->trait_count = des->trait_base;
+            des->version = version;
+            des->obj_base = obj_base;
+            des->str_base = str_base;
+            des->trait_base = trait_base;
+            return obj;
+        }
+    }
+    rb_raise(rb_eRuntimeError, "Unknown tape entry: %d", e->kind);
+    return Qnil;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *des_tape_parse_nogvl(void *tape) {
+    return (void *)(long)tape_parse((AMF_TAPE *)tape);
+}
+#endif
+
+typedef struct {
+    VALUE self;
+    AMF_DESERIALIZER *des;
+    AMF_TAPE *tape;
+    char *stream;
+} DES_TAPE_ARGS;
+
+static VALUE des_tape_build(VALUE data) {
+    DES_TAPE_ARGS *args = (DES_TAPE_ARGS *)data;
+    AMF_DESERIALIZER *des = args->des;
+    des->obj_cache.count = 0;
+    des->str_cache.count = 0;
+    des->trait_count = 0;
+    des->obj_base = 0;
+    des->str_base = 0;
+    des->trait_base = 0;
+    des->depth++;
+    VALUE ret = des_tape_value(args->self, des, args->tape);
     des->depth--;
+    des->pos = args->tape->pos;
+    return ret;
+}
+
+static VALUE des_tape_cleanup(VALUE data) {
+    DES_TAPE_ARGS *args = (DES_TAPE_ARGS *)data;
+    tape_free(args->tape);
+    args->des->stream = args->stream;
+    return Qnil;
+}
+
+/*
+ * Two-phase decode of a large source. The tape is parsed with the GVL released
+ * so other threads can run, and parse other sources, in the meantime - the
+ * source is frozen first so nothing can change it underneath the parse. The
+ * objects are then built from the tape. Returns Qundef without having read
+ * anything if the tape can't be built, so the caller can read the source the
+ * normal way and raise whatever error it should.
+ */
+static VALUE des_tape_deserialize(VALUE self, int version) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    volatile VALUE root = des->share_root ? des->share_root : rb_str_new_frozen(des->src_string);
+    DES_TAPE_ARGS args = {self, des, NULL, des->stream};
+    AMF_TAPE tape;
+    tape_init(&tape, RSTRING_PTR(root), des->pos, des->size, version);
+    args.tape = &tape;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    int res = (int)(long)rb_thread_call_without_gvl(des_tape_parse_nogvl, &tape, tape_interrupt, &tape);
+#else
+    int res = tape_parse(&tape);
+#endif
+    if(res != TAPE_OK) {
+        tape_free(&tape);
+        return Qundef;
+    }
 
+    des->stream = RSTRING_PTR(root);
+    VALUE ret = rb_ensure(des_tape_build, (VALUE)&args, des_tape_cleanup, (VALUE)&args);
+    RB_GC_GUARD(root);
     return ret;
 }
 
@@ -735,26 +1665,243 @@ static VALUE des3_deserialize_rb(int argc, VALUE *argv, VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
     des_check_deserialize_args(des, argc, argv);
-    VALUE ret = des3_deserialize(self);
-    rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+    long start = des->pos;
+    VALUE ret = Qundef;
+    if(des->depth == 0 && des->tape_threshold > 0 && des->size - des->pos >= des->tape_threshold) ret = des_tape_deserialize(self, 3);
+    if(ret == Qundef) ret = des3_deserialize(self);
+    if(des->src && (des->depth == 0 || des->src_lent)) rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+    if(des->depth == 0) {
+        STATS_ADD(&des->stats, bytes, des->pos - start);
+        STATS_FINISH(&des->stats, &des->stats_total, STATS_DESERIALIZE);
+    }
     return ret;
 }
 
+typedef struct {
+    VALUE self;
+    AMF_DESERIALIZER *des;
+    VALUE root;
+    long reset_every;
+} DES_EACH_ARGS;
+
+/*
+ * Reads and yields values until the source runs out. Every value starts a new
+ * object table, but the string and trait tables carry on from the values
+ * before it up to the next reset point.
+ */
+static VALUE des3_each_value_read(VALUE data) {
+    DES_EACH_ARGS *args = (DES_EACH_ARGS *)data;
+    AMF_DESERIALIZER *des = args->des;
+    long count = 0;
+    while(des->src_string == args->root && des->pos < des->size) {
+        if(args->reset_every > 0 && count > 0 && count % args->reset_every == 0) {
+            des->str_cache.count = 0;
+            des->trait_count = 0;
+        }
+        des->obj_cache.count = 0;
+        long start = des->pos;
+        VALUE obj = des3_deserialize(args->self);
+        count++;
+        STATS_ADD(&des->stats, bytes, des->pos - start);
+        if(des->src) rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+        rb_yield(obj);
+    }
+    return Qnil;
+}
+
+static VALUE des3_each_value_done(VALUE data) {
+    DES_EACH_ARGS *args = (DES_EACH_ARGS *)data;
+    if(args->des->src_string == args->root) args->des->depth = 0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   des.each_value(str) {|obj| block } => des
+ *   des.each_value(StringIO, :reset_every => 100) {|obj| block } => des
+ *   des.each_value(str) => enumerator
+ *
+ * Reads the values written by AMF3Serializer#serialize_many one at a time,
+ * until the end of the source. Strings and traits read for one value can be
+ * referenced by the ones after it, so <tt>:reset_every</tt> must match what
+ * the serializer was given. The values are read from a frozen copy of the
+ * source, so the block can't change the bytes still to be read.
+ */
+static VALUE des3_each_value(int argc, VALUE *argv, VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "11", &src, &opts);
+    if(des->depth != 0) rb_raise(rb_eRuntimeError, "Already deserializing a source - can't read another");
+
+    DES_EACH_ARGS args;
+    args.self = self;
+    args.des = des;
+    args.reset_every = 0;
+    if(opts != Qnil) {
+        Check_Type(opts, T_HASH);
+        VALUE every = rb_hash_aref(opts, ID2SYM(rb_intern("reset_every")));
+        if(every != Qnil) {
+            args.reset_every = NUM2LONG(every);
+            if(args.reset_every < 0) rb_raise(rb_eArgError, "reset_every can't be negative");
+        }
+    }
+
+    des->version = 0;
+    des_set_src(des, src);
+    args.root = des->src_string = des->share_root ? des->share_root : rb_str_new_frozen(des->src_string);
+    des->stream = RSTRING_PTR(des->src_string);
+
+    // Hold the depth so des3_deserialize leaves the tables alone
+    des->obj_cache.count = 0;
+    des->str_cache.count = 0;
+    des->trait_count = 0;
+    des->obj_base = 0;
+    des->str_base = 0;
+    des->trait_base = 0;
+    des->depth = 1;
+    rb_ensure(des3_each_value_read, (VALUE)&args, des3_each_value_done, (VALUE)&args);
+    RB_GC_GUARD(args.root);
+
+    STATS_FINISH(&des->stats, &des->stats_total, STATS_DESERIALIZE);
+    return self;
+}
+
+/*
+ * Deserialize the complete value at the current feed position
+ */
+static VALUE des_feed_value(VALUE self) {
+    VALUE feed_io = rb_const_get(mRocketAMF, rb_intern("FeedIO"));
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    VALUE args[1] = {des->feed_buf};
+    VALUE io = rb_class_new_instance(1, args, feed_io);
+    rb_funcall(io, rb_intern("pos="), 1, LONG2NUM(des->feed_pos));
+    des->depth = 0; // An earlier value may have raised part way through
+    des_set_src(des, io);
+
+    if(des->scanner->version == 3) return des3_deserialize(self);
+    return des0_deserialize(self, des_read_byte(des));
+}
+
+/*
+ * Running out of data while trial reading an opaque value means it isn't all
+ * there yet. That shows up as our own RangeError from a read past the end, or
+ * as EOFError from the FeedIO when read_external reads the source directly.
+ * Any other error, such as a bad reference, is the data's fault and is raised.
+ */
+static VALUE des_feed_incomplete(VALUE self, VALUE err) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    if(rb_obj_is_kind_of(err, rb_eEOFError) == Qtrue || des->ran_out) return Qundef;
+    rb_exc_raise(err);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   des.feed(chunk) {|obj| block } => nil
+ *   des.feed(chunk) => [obj, ...]
+ *
+ * Push parser for a stream of back to back values, such as a socket or an
+ * upload read in pieces. Appends the chunk to what's left over from earlier
+ * calls and deserializes every value that is now complete, yielding each one
+ * or returning them all if no block is given. Partial values are kept until
+ * the rest arrives. Completeness is found by a scanner that resumes where it
+ * stopped and allocates nothing, so a large value costs one pass no matter how
+ * many chunks it arrives in. Externalizable objects other than ArrayCollection
+ * can only be measured by reading them, so values holding them are retried on
+ * each chunk until they can be read without running out of data.
+ */
+static VALUE des_feed(VALUE self, VALUE chunk) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    StringValue(chunk);
+
+    if(!des->scanner) des->scanner = scanner_new(rb_obj_is_kind_of(self, cAMF3Deserializer) == Qtrue ? 3 : 0);
+    if(des->feed_buf) {
+        rb_str_cat(des->feed_buf, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    } else {
+        des->feed_buf = rb_str_new(RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+        des->feed_pos = 0;
+    }
+
+    // State is re-read from the struct every pass in case the block feeds more
+    VALUE values = rb_block_given_p() ? Qnil : rb_ary_new();
+    while(des->feed_buf && des->feed_pos < RSTRING_LEN(des->feed_buf)) {
+        long start = des->feed_pos;
+        int res = scanner_scan(des->scanner, RSTRING_PTR(des->feed_buf) + start, RSTRING_LEN(des->feed_buf) - start);
+        if(res == SCAN_MORE) break;
+
+        VALUE obj;
+        if(res == SCAN_DONE) {
+            obj = des_feed_value(self);
+            if(des->pos != start + des->scanner->pos) {
+                rb_raise(rb_eRuntimeError, "value read %ld bytes but scanned as %ld", des->pos - start, des->scanner->pos);
+            }
+        } else {
+            obj = rb_rescue2(des_feed_value, self, des_feed_incomplete, self, rb_eRangeError, rb_eEOFError, (VALUE)0);
+            if(obj == Qundef) break;
+        }
+        STATS_ADD(&des->stats, bytes, des->pos - des->feed_pos);
+        STATS_FINISH(&des->stats, &des->stats_total, STATS_DESERIALIZE);
+        des->feed_pos = des->pos;
+        scanner_reset(des->scanner);
+
+        if(values == Qnil) {
+            rb_yield(obj);
+        } else {
+            rb_ary_push(values, obj);
+        }
+    }
+
+    // Drop consumed bytes once they outweigh the partial value being kept, so
+    // each byte is moved a bounded number of times
+    if(des->feed_buf) {
+        long rest = RSTRING_LEN(des->feed_buf) - des->feed_pos;
+        if(rest == 0) {
+            des->feed_buf = 0;
+            des->feed_pos = 0;
+        } else if(des->feed_pos > rest) {
+            des->feed_buf = rb_str_new(RSTRING_PTR(des->feed_buf) + des->feed_pos, rest);
+            des->feed_pos = 0;
+        }
+    }
+
+    return values;
+}
+
 void Init_rocket_amf_deserializer() {
     // Define Deserializer
     cDeserializer = rb_define_class_under(mRocketAMFExt, "Deserializer", rb_cObject);
     rb_define_alloc_func(cDeserializer, des_alloc);
+    rb_define_method(cDeserializer, "initialize", des_initialize, -1);
     rb_define_method(cDeserializer, "source", des_source, 0);
+    rb_define_method(cDeserializer, "stats", des_stats, 0);
     rb_define_method(cDeserializer, "deserialize", des0_deserialize_rb, -1);
+    rb_define_method(cDeserializer, "feed", des_feed, 1);
+    rb_define_method(cDeserializer, "reset", des_reset_rb, 0);
 
     // Define Deserializer
     cAMF3Deserializer = rb_define_class_under(mRocketAMFExt, "AMF3Deserializer", rb_cObject);
     rb_define_alloc_func(cAMF3Deserializer, des_alloc);
+    rb_define_method(cAMF3Deserializer, "initialize", des_initialize, -1);
     rb_define_method(cAMF3Deserializer, "source", des_source, 0);
+    rb_define_method(cAMF3Deserializer, "stats", des_stats, 0);
     rb_define_method(cAMF3Deserializer, "deserialize", des3_deserialize_rb, -1);
+    rb_define_method(cAMF3Deserializer, "each_value", des3_each_value, -1);
+    rb_define_method(cAMF3Deserializer, "feed", des_feed, 1);
+    rb_define_method(cAMF3Deserializer, "reset", des_reset_rb, 0);
 
     // Get refs to commonly used symbols and ids
     id_get_ruby_obj = rb_intern("get_ruby_obj");
     id_populate_ruby_obj = rb_intern("populate_ruby_obj");
+    id_shared_source = rb_intern("__shared_source__");
+    id_des_pool = rb_intern("__rocketamf_deserializers__");
     id_get_ruby_option = rb_intern("get_ruby_option");
+    id_object_populators = rb_intern("object_populators");
 }
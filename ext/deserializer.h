@@ -2,16 +2,82 @@
 #ifdef HAVE_RB_STR_ENCODE
 #include <ruby/encoding.h>
 #endif
+#include "scanner.h"
+#include "stats.h"
 
+#define DES_BOUNDS_CHECK(des, i) do { \
+    if((i) < 0) rb_raise(rb_eRangeError, "invalid length %ld at %ld", (long)(i), des->pos); \
+    if((i) > des->size - des->pos) { \
+        des->ran_out = 1; \
+        rb_raise(rb_eRangeError, "reading %ld bytes is beyond end of source: %ld (pos), %ld (size)", (long)(i), des->pos, des->size); \
+    } \
+} while(0)
+
+// Length of an AMF3 value from its header, which is an unsigned U29 with the
+// low bit flagging an inline value. des_read_int sign-extends it as an integer.
+#define DES_U29_LENGTH(header) ((long)(((unsigned int)(header) & 0x1fffffff) >> 1))
+
+/*
+ * Growable reference table, marked directly by the deserializer
+ */
 typedef struct {
-    VALUE src;
+    VALUE *items;
+    long count;
+    long capa;
+} DES_CACHE;
+
+/*
+ * AMF3 traits, with member names interned once per trait rather than once per
+ * object. The structs are allocated individually and reused between
+ * deserializations, so pointers to them stay valid while nested reads add more.
+ */
+typedef struct {
+    VALUE class_name;
+    VALUE *members;
+    VALUE *snake_members; // Underscored members, built the first time translate_case is on
+    long members_len;
+    long members_capa;
+    VALUE klass; // Class the last object with these traits mapped to
+    char translate_case; // translate_case option for klass
+    char direct; // klass is a built-in message, set straight through its setters
+    char snake_built;
+    ID *setters; // Member setters for direct, or 0 where there isn't one
+    char setters_built;
+    char externalizable;
+    char dynamic;
+    char array_collection;
+} DES_TRAIT;
+
+typedef struct {
+    VALUE src; // StringIO source, created on demand for String sources
+    char src_lent; // read_external asked for des.source, so src's pos is the real one until it returns
+    char ran_out; // A read went past the end of the source, rather than finding bad data
+    VALUE src_string;
+    VALUE share_root;
     char* stream;
     long pos;
     long size;
     long depth;
-    VALUE obj_cache;
-    VALUE str_cache;
-    VALUE trait_cache;
+    char version; // Format being read - AMF0 readers switch to 3 for AMF3 bodies
+    DES_CACHE obj_cache;
+    DES_CACHE str_cache;
+    DES_TRAIT **traits;
+    long trait_count;
+    long trait_capa;
+    long obj_base; // Where the current AMF3 body's tables start
+    long str_base;
+    long trait_base;
+    long share_threshold;
+    char strict_utf8; // Raise on strings that aren't valid UTF-8
+    long tape_threshold; // Source length at which to parse to a tape without the GVL first
+    VALUE class_mapper; // From the :class_mapper option, or 0 to use RocketAMF::ClassMapper
+    VALUE feed_buf;
+    long feed_pos;
+    AMF_SCANNER *scanner;
+#ifdef COLLECT_STATS
+    AMF_STATS stats;
+    AMF_STATS stats_total;
+#endif
 } AMF_DESERIALIZER;
 
 char des_read_byte(AMF_DESERIALIZER *des);
@@ -19,9 +85,19 @@ int des_read_uint16(AMF_DESERIALIZER *des);
 long des_read_uint32(AMF_DESERIALIZER *des);
 double des_read_double(AMF_DESERIALIZER *des);
 int des_read_int(AMF_DESERIALIZER *des);
+VALUE des_read_bytes(AMF_DESERIALIZER *des, long len);
 VALUE des_read_string(AMF_DESERIALIZER *des, long len);
 VALUE des_read_sym(AMF_DESERIALIZER *des, long len);
+VALUE des_time_from_millis(double milli);
+#ifdef HAVE_RB_STR_ENCODE
+int des_utf8_coderange(const char *str, long len);
+#endif
 void des_set_src(AMF_DESERIALIZER *des, VALUE src);
+void des_set_options(AMF_DESERIALIZER *des, VALUE opts);
+VALUE des_source_io(AMF_DESERIALIZER *des);
+void des_reset(AMF_DESERIALIZER *des);
+VALUE des_pool_checkout(VALUE klass);
+void des_pool_checkin(VALUE des_rb);
 
 VALUE des0_deserialize(VALUE self, char type);
 VALUE des3_deserialize(VALUE self);
\ No newline at end of file
@@ -3,6 +3,26 @@ require 'mkmf'
 if enable_config("sort-props", false)
   $defs.push("-DSORT_PROPS") unless $defs.include? "-DSORT_PROPS"
 end
+if enable_config("stats", false)
+  $defs.push("-DCOLLECT_STATS") unless $defs.include? "-DCOLLECT_STATS"
+end
 have_func('rb_str_encode')
+have_func('rb_str_modify_expand')
+have_func('rb_memhash')
+have_func('rb_time_timespec')
+have_func('rb_time_nano_new')
+have_func('rb_str_new_static')
+have_func('rb_str_subseq')
+have_func('rb_intern2')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('clock_gettime', 'time.h')
+have_func('rb_genrand_int32')
+have_header('sys/mman.h')
+have_func('mmap', 'sys/mman.h')
+have_func('madvise', 'sys/mman.h')
+have_func('rb_ext_ractor_safe')
+have_func('rb_ractor_make_shareable', 'ruby/ractor.h')
+have_func('rb_ractor_local_storage_ptr_newkey', 'ruby/ractor.h')
+have_func('rb_ractor_local_storage_value_newkey', 'ruby/ractor.h')
 
 create_makefile('rocketamf_ext')
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include "mapped_source.h"
+#include <errno.h>
+#include <stdio.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_RB_STR_NEW_STATIC)
+#define MAPPED_SOURCE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern VALUE mRocketAMFExt;
+VALUE cMappedSource;
+static ID id_shared_source;
+
+static void ms_mark(AMF_MAPPED_SOURCE *ms) {
+    if(!ms) return;
+    rb_gc_mark(ms->path);
+    rb_gc_mark(ms->str);
+}
+
+static void ms_free(AMF_MAPPED_SOURCE *ms) {
+#ifdef MAPPED_SOURCE_MMAP
+    if(ms->mapped) munmap(ms->ptr, ms->len);
+#endif
+    xfree(ms);
+}
+
+static VALUE ms_alloc(VALUE klass) {
+    AMF_MAPPED_SOURCE *ms = ALLOC(AMF_MAPPED_SOURCE);
+    memset(ms, 0, sizeof(AMF_MAPPED_SOURCE));
+    ms->path = Qnil;
+    ms->str = Qnil;
+    return Data_Wrap_Struct(klass, ms_mark, ms_free, ms);
+}
+
+/*
+ * Returns the source struct, raising IOError if it has been closed
+ */
+AMF_MAPPED_SOURCE *mapped_source_get(VALUE self) {
+    AMF_MAPPED_SOURCE *ms;
+    Data_Get_Struct(self, AMF_MAPPED_SOURCE, ms);
+    if(ms->str == Qnil) rb_raise(rb_eIOError, "uninitialized source");
+    if(ms->closed) rb_raise(rb_eIOError, "closed source");
+    return ms;
+}
+
+#ifdef MAPPED_SOURCE_MMAP
+/*
+ * Maps the whole file, hinting that it will be read front to back so the
+ * kernel reads ahead and drops pages behind
+ */
+static VALUE ms_map(AMF_MAPPED_SOURCE *ms, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) rb_sys_fail(path);
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        rb_sys_fail(path);
+    }
+    if((off_t)(long)st.st_size != st.st_size) {
+        close(fd);
+        rb_raise(rb_eRangeError, "%s is too large to map", path);
+    }
+    if(st.st_size == 0) {
+        close(fd);
+        return rb_str_new(NULL, 0); // mmap refuses empty mappings
+    }
+
+    void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        errno = err;
+        rb_sys_fail(path);
+    }
+#ifdef HAVE_MADVISE
+    madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    ms->ptr = (char *)ptr;
+    ms->len = (long)st.st_size;
+    ms->mapped = 1;
+    return rb_str_new_static(ms->ptr, ms->len);
+}
+#else
+/*
+ * Reads the whole file where it can't be mapped
+ */
+static VALUE ms_map(AMF_MAPPED_SOURCE *ms, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if(!f) rb_sys_fail(path);
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    VALUE str = rb_str_new(NULL, len);
+    long read = (long)fread(RSTRING_PTR(str), 1, len, f);
+    fclose(f);
+    if(read != len) rb_raise(rb_eIOError, "short read from %s", path);
+    return str;
+}
+#endif
+
+/*
+ * call-seq:
+ *   RocketAMF::MappedSource.new(path) => source
+ *
+ * Maps the file at path for reading. Pass the source anywhere a String or
+ * StringIO can be deserialized from, including Envelope#populate_from_stream
+ * and AMF3Deserializer#each_value, and it's read in place without being
+ * copied into the ruby heap. Where mmap isn't available, the file is read into
+ * memory instead.
+ */
+static VALUE ms_initialize(VALUE self, VALUE path) {
+    AMF_MAPPED_SOURCE *ms;
+    Data_Get_Struct(self, AMF_MAPPED_SOURCE, ms);
+    if(ms->str != Qnil) rb_raise(rb_eRuntimeError, "source is already initialized");
+
+    FilePathValue(path);
+    ms->path = rb_str_new_frozen(path);
+    VALUE str = ms_map(ms, RSTRING_PTR(ms->path));
+    ms->len = RSTRING_LEN(str);
+    rb_ivar_set(str, id_shared_source, self);
+    ms->str = rb_obj_freeze(str);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   src.path => str
+ */
+static VALUE ms_path(VALUE self) {
+    AMF_MAPPED_SOURCE *ms;
+    Data_Get_Struct(self, AMF_MAPPED_SOURCE, ms);
+    return ms->path;
+}
+
+/*
+ * call-seq:
+ *   src.size => int
+ *
+ * Returns the length of the file in bytes
+ */
+static VALUE ms_size(VALUE self) {
+    return LONG2NUM(mapped_source_get(self)->len);
+}
+
+/*
+ * call-seq:
+ *   src.pos => int
+ */
+static VALUE ms_pos(VALUE self) {
+    return LONG2NUM(mapped_source_get(self)->pos);
+}
+
+/*
+ * call-seq:
+ *   src.pos = int
+ *
+ * Moves to the given byte offset. Deserializers start reading from here and
+ * leave it after the last value they read.
+ */
+static VALUE ms_set_pos(VALUE self, VALUE pos) {
+    AMF_MAPPED_SOURCE *ms = mapped_source_get(self);
+    long p = NUM2LONG(pos);
+    if(p < 0) rb_raise(rb_eArgError, "negative position");
+    ms->pos = p;
+    return pos;
+}
+
+/*
+ * call-seq:
+ *   src.rewind => 0
+ */
+static VALUE ms_rewind(VALUE self) {
+    mapped_source_get(self)->pos = 0;
+    return INT2FIX(0);
+}
+
+/*
+ * call-seq:
+ *   src.eof? => true or false
+ */
+static VALUE ms_eof(VALUE self) {
+    AMF_MAPPED_SOURCE *ms = mapped_source_get(self);
+    return ms->pos >= ms->len ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   src.read => str
+ *   src.read(length) => str or nil
+ *
+ * Copies out up to length bytes, or the rest of the file, the same way
+ * StringIO#read does. Lets read_external implementations read the source
+ * directly.
+ */
+static VALUE ms_read(int argc, VALUE *argv, VALUE self) {
+    AMF_MAPPED_SOURCE *ms = mapped_source_get(self);
+    VALUE length;
+    rb_scan_args(argc, argv, "01", &length);
+
+    long left = ms->pos < ms->len ? ms->len - ms->pos : 0;
+    long len = left;
+    if(length != Qnil) {
+        len = NUM2LONG(length);
+        if(len < 0) rb_raise(rb_eArgError, "negative length %ld given", len);
+        if(len > 0 && left == 0) return Qnil;
+        if(len > left) len = left;
+    }
+    VALUE str = rb_str_new(RSTRING_PTR(ms->str) + ms->pos, len);
+    ms->pos += len;
+    return str;
+}
+
+/*
+ * call-seq:
+ *   src.mapped? => true or false
+ *
+ * Whether the file is memory-mapped, rather than having been read in because
+ * mmap isn't available or the file is empty
+ */
+static VALUE ms_is_mapped(VALUE self) {
+    return mapped_source_get(self)->mapped ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   src.close => nil
+ *
+ * Releases the pages read so far and stops the source being read again. The
+ * mapping itself stays until the source is collected, since strings shared
+ * from it and deserializers part way through it may still point into it.
+ */
+static VALUE ms_close(VALUE self) {
+    AMF_MAPPED_SOURCE *ms = mapped_source_get(self);
+    ms->closed = 1;
+#if defined(MAPPED_SOURCE_MMAP) && defined(HAVE_MADVISE)
+    if(ms->mapped) madvise(ms->ptr, ms->len, MADV_DONTNEED);
+#endif
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   src.closed? => true or false
+ */
+static VALUE ms_is_closed(VALUE self) {
+    AMF_MAPPED_SOURCE *ms;
+    Data_Get_Struct(self, AMF_MAPPED_SOURCE, ms);
+    return ms->closed ? Qtrue : Qfalse;
+}
+
+void Init_rocket_amf_mapped_source() {
+    cMappedSource = rb_define_class_under(mRocketAMFExt, "MappedSource", rb_cObject);
+    rb_define_alloc_func(cMappedSource, ms_alloc);
+    rb_define_method(cMappedSource, "initialize", ms_initialize, 1);
+    rb_define_method(cMappedSource, "path", ms_path, 0);
+    rb_define_method(cMappedSource, "size", ms_size, 0);
+    rb_define_method(cMappedSource, "pos", ms_pos, 0);
+    rb_define_method(cMappedSource, "pos=", ms_set_pos, 1);
+    rb_define_method(cMappedSource, "rewind", ms_rewind, 0);
+    rb_define_method(cMappedSource, "eof?", ms_eof, 0);
+    rb_define_method(cMappedSource, "read", ms_read, -1);
+    rb_define_method(cMappedSource, "mapped?", ms_is_mapped, 0);
+    rb_define_method(cMappedSource, "close", ms_close, 0);
+    rb_define_method(cMappedSource, "closed?", ms_is_closed, 0);
+
+    id_shared_source = rb_intern("__shared_source__");
+}
@@ -0,0 +1,21 @@
+#include <ruby.h>
+
+/*
+ * A file mapped read-only into memory, for replaying captures too large to
+ * read into a ruby string. The mapping is wrapped in a frozen string that
+ * points straight at it, so the deserializers read it like any other source
+ * string, and a hidden ivar on that string keeps the mapping alive for as long
+ * as anything shares the bytes. The position lives here rather than in a
+ * StringIO.
+ */
+typedef struct {
+    char *ptr; // Start of the mapping, if mapped
+    long len;
+    long pos;
+    char mapped; // ptr came from mmap, rather than the file being read into str
+    char closed;
+    VALUE path;
+    VALUE str;
+} AMF_MAPPED_SOURCE;
+
+AMF_MAPPED_SOURCE *mapped_source_get(VALUE self);
@@ -0,0 +1,173 @@
+#include "messages.h"
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/encoding.h>
+#endif
+
+extern VALUE mRocketAMF;
+extern VALUE mRocketAMFExt;
+ID id_public_instance_methods;
+ID id_instance_method;
+ID id_arity;
+ID id_rand;
+static ID id_encode_amf;
+
+#define MSG_CLASSES 6
+
+static const char *msg_names[MSG_CLASSES] = {
+    "AbstractMessage", "RemotingMessage", "AsyncMessage", "CommandMessage", "AcknowledgeMessage", "ErrorMessage"
+};
+static MSG_CLASS msg_classes[MSG_CLASSES];
+
+/*
+ * Finds the properties the class mapper would write for instances of the
+ * class: its public zero-arity instance methods not on Object, sorted the same
+ * way the pure serializer sorts them
+ */
+static void msg_build_keys(MSG_CLASS *msg) {
+    VALUE ignored = rb_funcall(rb_cObject, id_public_instance_methods, 0);
+    VALUE methods = rb_funcall(rb_funcall(msg->klass, id_public_instance_methods, 0), rb_intern("-"), 1, ignored);
+    VALUE keys = rb_ary_new();
+    long i;
+    for(i = 0; i < RARRAY_LEN(methods); i++) {
+        VALUE name = RARRAY_PTR(methods)[i];
+        VALUE method = rb_funcall(msg->klass, id_instance_method, 1, name);
+        if(rb_funcall(method, id_arity, 0) == INT2FIX(0)) {
+            rb_ary_push(keys, rb_obj_freeze(rb_obj_as_string(name)));
+        }
+    }
+    rb_ary_sort_bang(keys);
+
+    msg->keys_len = RARRAY_LEN(keys);
+    msg->getters = ALLOC_N(ID, msg->keys_len > 0 ? msg->keys_len : 1);
+    for(i = 0; i < msg->keys_len; i++) {
+        msg->getters[i] = rb_to_id(RARRAY_PTR(keys)[i]);
+    }
+    msg->keys = rb_obj_freeze(keys);
+}
+
+/*
+ * Returns the message info for the given class if it's one of the built-in
+ * message classes, or NULL otherwise. Subclasses, and objects with singleton
+ * methods, don't match. The property lists are worked out when the extension
+ * loads and never change after, so every ractor can read them, but attributes
+ * added to the built-in classes later are not picked up.
+ */
+MSG_CLASS *msg_class_for(VALUE klass) {
+    long i;
+    for(i = 0; i < MSG_CLASSES; i++) {
+        MSG_CLASS *msg = &msg_classes[i];
+        if(msg->klass == klass) return msg;
+    }
+    return NULL;
+}
+
+/*
+ * Whether obj's encode_amf isn't the one its built-in class shipped with
+ */
+int msg_encode_overridden(MSG_CLASS *msg, VALUE obj) {
+    if(msg->encode_amf == Qnil) return rb_respond_to(obj, id_encode_amf);
+    if(!rb_respond_to(obj, id_encode_amf)) return 1;
+    VALUE current = rb_funcall(msg->klass, id_instance_method, 1, ID2SYM(id_encode_amf));
+    return !RTEST(rb_equal(current, msg->encode_amf));
+}
+
+/*
+ * Whether the class mapper leaves built-in messages alone: it has no custom
+ * object serializers or populators in the given list, if it has the list at
+ * all
+ */
+int msg_mapper_allows(VALUE mapper, ID custom_list) {
+    if(!rb_respond_to(mapper, custom_list)) return 1;
+    VALUE list = rb_funcall(mapper, custom_list, 0);
+    return TYPE(list) == T_ARRAY && RARRAY_LEN(list) == 0;
+}
+
+/*
+ * Returns the setter for the given property symbol, or 0 if obj doesn't have
+ * one. Built-in messages aren't hash-like, so populate_ruby_obj would drop the
+ * property too.
+ */
+ID msg_setter(VALUE obj, VALUE key) {
+    const char* key_str = rb_id2name(SYM2ID(key));
+    long len = strlen(key_str);
+    char* setter = ALLOC_N(char, len+2);
+    memcpy(setter, key_str, len);
+    setter[len] = '=';
+    setter[len+1] = '\0';
+    ID id_setter = rb_intern(setter);
+    xfree(setter);
+
+    return rb_respond_to(obj, id_setter) ? id_setter : 0;
+}
+
+static unsigned int msg_rand32() {
+#ifdef HAVE_RB_GENRAND_INT32
+    return rb_genrand_int32();
+#else
+    return (unsigned int)NUM2ULONG(rb_funcall(rb_mKernel, id_rand, 1, ULONG2NUM(0xffffffffUL)));
+#endif
+}
+
+/*
+ * call-seq:
+ *   msg.rand_uuid => "1e2d3c4b-..."
+ *
+ * Returns a random identifier in the 8-4-4-4-12 hex form Flex uses for client
+ * and message IDs, drawn from ruby's default random generator
+ */
+static VALUE msg_rand_uuid(VALUE self) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[36];
+    unsigned int bits = 0;
+    int i, left = 0;
+    for(i = 0; i < 36; i++) {
+        if(i == 8 || i == 13 || i == 18 || i == 23) {
+            buf[i] = '-';
+            continue;
+        }
+        if(left == 0) {
+            bits = msg_rand32();
+            left = 8;
+        }
+        buf[i] = hex[bits & 0xf];
+        bits >>= 4;
+        left--;
+    }
+
+    VALUE uuid = rb_str_new(buf, 36);
+#ifdef HAVE_RB_STR_ENCODE
+    rb_enc_associate(uuid, rb_utf8_encoding());
+#endif
+    return uuid;
+}
+
+void Init_rocket_amf_messages() {
+    VALUE mAbstractMessage = rb_define_module_under(mRocketAMFExt, "AbstractMessage");
+    rb_define_protected_method(mAbstractMessage, "rand_uuid", msg_rand_uuid, 0);
+
+    // Get refs to commonly used symbols and ids
+    id_public_instance_methods = rb_intern("public_instance_methods");
+    id_instance_method = rb_intern("instance_method");
+    id_arity = rb_intern("arity");
+    id_rand = rb_intern("rand");
+    id_encode_amf = rb_intern("encode_amf");
+
+    // Look up the built-in classes and the encode_amf they ship with
+    VALUE mValues = rb_const_get(mRocketAMF, rb_intern("Values"));
+    VALUE encode_amf = ID2SYM(rb_intern("encode_amf"));
+    long i;
+    for(i = 0; i < MSG_CLASSES; i++) {
+        MSG_CLASS *msg = &msg_classes[i];
+        msg->klass = rb_const_get(mValues, rb_intern(msg_names[i]));
+        msg->class_name = rb_obj_freeze(rb_str_plus(rb_str_new2("flex.messaging.messages."), rb_str_new2(msg_names[i])));
+        msg->keys = Qnil;
+        msg->getters = NULL;
+        msg->keys_len = 0;
+        msg->encode_amf = RTEST(rb_funcall(msg->klass, rb_intern("method_defined?"), 1, encode_amf)) ? rb_funcall(msg->klass, id_instance_method, 1, encode_amf) : Qnil;
+        rb_global_variable(&msg->klass);
+        rb_global_variable(&msg->class_name);
+        rb_global_variable(&msg->keys);
+        rb_global_variable(&msg->encode_amf);
+        msg_build_keys(msg);
+    }
+}
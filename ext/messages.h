@@ -0,0 +1,23 @@
+#include <ruby.h>
+
+/*
+ * Native paths for the built-in flex.messaging.messages classes in
+ * RocketAMF::Values. Every remoting response carries one of them, so AMF3
+ * serializers write them straight from their getters, and deserializers set
+ * them straight through their setters, instead of round tripping through the
+ * class mapper's property hashes. Both fall back to the class mapper when it
+ * has been customized for them.
+ */
+typedef struct {
+    VALUE klass;
+    VALUE class_name; // Default AS class name
+    VALUE keys; // Frozen property names, sorted, found from the class when the extension loads
+    ID *getters;
+    long keys_len;
+    VALUE encode_amf; // UnboundMethod for the built-in encode_amf, or nil if the class has none
+} MSG_CLASS;
+
+MSG_CLASS *msg_class_for(VALUE klass);
+int msg_encode_overridden(MSG_CLASS *msg, VALUE obj);
+int msg_mapper_allows(VALUE mapper, ID custom_list);
+ID msg_setter(VALUE obj, VALUE key);
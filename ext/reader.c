@@ -0,0 +1,667 @@
+#include "reader.h"
+#include "constants.h"
+
+extern VALUE mRocketAMFExt;
+extern VALUE cStringIO;
+VALUE cReader;
+VALUE sym_skip;
+VALUE sym_ev_null;
+VALUE sym_ev_boolean;
+VALUE sym_ev_integer;
+VALUE sym_ev_double;
+VALUE sym_ev_string;
+VALUE sym_ev_xml;
+VALUE sym_ev_date;
+VALUE sym_ev_byte_array;
+VALUE sym_ev_reference;
+VALUE sym_ev_start_object;
+VALUE sym_ev_end_object;
+VALUE sym_ev_start_hash;
+VALUE sym_ev_end_hash;
+VALUE sym_ev_key;
+VALUE sym_ev_start_array;
+VALUE sym_ev_end_array;
+VALUE sym_ev_start_dict;
+VALUE sym_ev_end_dict;
+
+static const char array_collection[] = "flex.messaging.io.ArrayCollection";
+
+// Call a visitor callback if events are on and the visitor has one. The
+// arguments aren't evaluated otherwise, so they must not read the source.
+#define VISIT(r, emit, cb, ...) ((emit) && (r)->visitor->cb ? (r)->visitor->cb((r)->ctx, __VA_ARGS__) : READ_CONTINUE)
+#define VISIT0(r, emit, cb) ((emit) && (r)->visitor->cb ? (r)->visitor->cb((r)->ctx) : READ_CONTINUE)
+
+static void reader_mark(AMF_READER *reader) {
+    if(!reader) return;
+    rb_gc_mark(reader->des.src);
+    rb_gc_mark(reader->des.src_string);
+}
+
+static void reader_free(AMF_READER *reader) {
+    long i;
+    for(i = 0; i < reader->trait_capa; i++) {
+        if(!reader->traits[i]) continue;
+        if(reader->traits[i]->members) xfree(reader->traits[i]->members);
+        xfree(reader->traits[i]);
+    }
+    if(reader->traits) xfree(reader->traits);
+    if(reader->strings) xfree(reader->strings);
+    xfree(reader);
+}
+
+static VALUE reader_alloc(VALUE klass) {
+    AMF_READER *reader = ALLOC(AMF_READER);
+    memset(reader, 0, sizeof(AMF_READER));
+    return Data_Wrap_Struct(klass, reader_mark, reader_free, reader);
+}
+
+/*
+ * Get a trait struct for the next slot in the trait table. Structs are reused
+ * between walks, and their member arrays only ever grow.
+ */
+static READER_TRAIT *reader_new_trait(AMF_READER *reader, long members_len) {
+    if(reader->trait_count == reader->trait_capa) {
+        long old_capa = reader->trait_capa;
+        reader->trait_capa = old_capa == 0 ? 16 : old_capa * 2;
+        REALLOC_N(reader->traits, READER_TRAIT*, reader->trait_capa);
+        memset(reader->traits + old_capa, 0, (reader->trait_capa - old_capa) * sizeof(READER_TRAIT*));
+    }
+    READER_TRAIT *trait = reader->traits[reader->trait_count];
+    if(!trait) {
+        trait = ALLOC(READER_TRAIT);
+        memset(trait, 0, sizeof(READER_TRAIT));
+        reader->traits[reader->trait_count] = trait;
+    }
+    if(members_len > trait->members_capa) {
+        REALLOC_N(trait->members, long, members_len * 2);
+        trait->members_capa = members_len;
+    }
+    trait->members_len = 0;
+    return trait;
+}
+
+/*
+ * Reads an AMF3 string or string reference, returning where it is in the
+ * source rather than a ruby string
+ */
+static void read3_string(AMF_READER *reader, long *pos, long *len) {
+    AMF_DESERIALIZER *des = &reader->des;
+    int header = des_read_int(des);
+    if((header & 1) == 0) {
+        long index = reader->str_base + (header >> 1);
+        if(index < reader->str_base || index >= reader->str_count) rb_raise(rb_eRangeError, "str reference index beyond end");
+        *pos = reader->strings[index * 2];
+        *len = reader->strings[index * 2 + 1];
+    } else {
+        *len = header >> 1;
+        DES_BOUNDS_CHECK(des, *len);
+        *pos = des->pos;
+        des->pos += *len;
+        if(*len > 0) {
+            if(reader->str_count == reader->str_capa) {
+                reader->str_capa = reader->str_capa == 0 ? 64 : reader->str_capa * 2;
+                REALLOC_N(reader->strings, long, reader->str_capa * 2);
+            }
+            reader->strings[reader->str_count * 2] = *pos;
+            reader->strings[reader->str_count * 2 + 1] = *len;
+            reader->str_count++;
+        }
+    }
+}
+
+/*
+ * Reads the header shared by AMF3 object-table values. Returns 1 if the value
+ * was a reference, which has been reported, and 0 if it's inline, leaving the
+ * rest of the header in *header.
+ */
+static int read3_header(AMF_READER *reader, int emit, int *header) {
+    *header = des_read_int(&reader->des);
+    if((*header & 1) == 0) {
+        long index = *header >> 1;
+        if(index < 0 || reader->obj_base + index >= reader->obj_count) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        VISIT(reader, emit, on_reference, index);
+        return 1;
+    }
+    *header = (int)DES_U29_LENGTH(*header);
+    return 0;
+}
+
+static void read3_value(AMF_READER *reader, int emit);
+
+static void read3_array(AMF_READER *reader, int emit) {
+    AMF_DESERIALIZER *des = &reader->des;
+    int header;
+    if(read3_header(reader, emit, &header)) return;
+    reader->obj_count++;
+
+    long i, key_pos, key_len;
+    read3_string(reader, &key_pos, &key_len);
+    if(key_len != 0) {
+        // Mixed arrays come out of the deserializer as hashes, so they're
+        // reported the same way, with the dense part keyed by index
+        int inner = emit && VISIT0(reader, emit, on_start_hash) != READ_SKIP;
+        while(key_len != 0) {
+            int skip = VISIT(reader, inner, on_key, des->stream + key_pos, key_len, 0) == READ_SKIP;
+            read3_value(reader, inner && !skip);
+            read3_string(reader, &key_pos, &key_len);
+        }
+        for(i = 0; i < header; i++) {
+            char index[24];
+            int len = snprintf(index, sizeof(index), "%ld", i);
+            int skip = VISIT(reader, inner, on_key, index, len, 0) == READ_SKIP;
+            read3_value(reader, inner && !skip);
+        }
+        VISIT0(reader, inner, on_end_hash);
+    } else {
+        int inner = emit && VISIT(reader, emit, on_start_array, header) != READ_SKIP;
+        for(i = 0; i < header; i++) {
+            read3_value(reader, inner);
+        }
+        VISIT0(reader, inner, on_end_array);
+    }
+}
+
+static void read3_object(AMF_READER *reader, int emit) {
+    AMF_DESERIALIZER *des = &reader->des;
+    int header;
+    if(read3_header(reader, emit, &header)) return;
+
+    READER_TRAIT *trait;
+    long i;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header < 0 || header >= reader->trait_count - reader->trait_base) rb_raise(rb_eRangeError, "trait reference index beyond end");
+        trait = reader->traits[reader->trait_base + header];
+    } else {
+        // Every member name takes at least a byte, so don't trust the count
+        // further than the source goes
+        long members_len = header >> 3;
+        DES_BOUNDS_CHECK(des, members_len);
+
+        trait = reader_new_trait(reader, members_len);
+        reader->trait_count++;
+        trait->externalizable = (header & 2) != 0;
+        trait->dynamic = (header & 4) != 0;
+        read3_string(reader, &trait->name_pos, &trait->name_len);
+        trait->array_collection = trait->name_len == sizeof(array_collection) - 1 && memcmp(des->stream + trait->name_pos, array_collection, sizeof(array_collection) - 1) == 0;
+        for(i = 0; i < members_len; i++) {
+            read3_string(reader, &trait->members[i * 2], &trait->members[i * 2 + 1]);
+            trait->members_len++;
+        }
+    }
+
+    // The deserializer hands ArrayCollections back as their source array
+    if(trait->array_collection) {
+        read3_value(reader, emit);
+        reader->obj_count++;
+        return;
+    }
+
+    reader->obj_count++;
+    if(trait->externalizable) {
+        rb_raise(rb_eRuntimeError, "can't read externalizable class %.*s as events", (int)trait->name_len, des->stream + trait->name_pos);
+    }
+
+    // Nested objects can grow the trait table, but member arrays never move
+    long *members = trait->members, members_len = trait->members_len;
+    int dynamic = trait->dynamic;
+    const char *class_name = trait->name_len > 0 ? des->stream + trait->name_pos : NULL;
+    int inner = emit && VISIT(reader, emit, on_start_object, class_name, trait->name_len) != READ_SKIP;
+    for(i = 0; i < members_len; i++) {
+        int skip = VISIT(reader, inner, on_key, des->stream + members[i * 2], members[i * 2 + 1], 1) == READ_SKIP;
+        read3_value(reader, inner && !skip);
+    }
+    if(dynamic) {
+        long key_pos, key_len;
+        while(1) {
+            read3_string(reader, &key_pos, &key_len);
+            if(key_len == 0) break;
+            int skip = VISIT(reader, inner, on_key, des->stream + key_pos, key_len, 1) == READ_SKIP;
+            read3_value(reader, inner && !skip);
+        }
+    }
+    VISIT0(reader, inner, on_end_object);
+}
+
+static void read3_vector(AMF_READER *reader, int emit, char type) {
+    AMF_DESERIALIZER *des = &reader->des;
+    int header;
+    if(read3_header(reader, emit, &header)) return;
+    reader->obj_count++;
+
+    long i, len = header;
+    des_read_byte(des); // Fixed flag
+
+    if(type == AMF3_VECTOR_OBJECT_MARKER) {
+        long name_pos, name_len;
+        read3_string(reader, &name_pos, &name_len);
+        DES_BOUNDS_CHECK(des, len); // Every value takes at least a byte
+        int inner = emit && VISIT(reader, emit, on_start_array, len) != READ_SKIP;
+        for(i = 0; i < len; i++) {
+            read3_value(reader, inner);
+        }
+        VISIT0(reader, inner, on_end_array);
+        return;
+    }
+
+    long width = type == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4;
+    if(len > LONG_MAX / width) rb_raise(rb_eRangeError, "vector length %ld is too long", len);
+    DES_BOUNDS_CHECK(des, len * width);
+    int inner = emit && VISIT(reader, emit, on_start_array, len) != READ_SKIP;
+    if(!inner) {
+        des->pos += len * width;
+        return;
+    }
+    for(i = 0; i < len; i++) {
+        if(type == AMF3_VECTOR_INT_MARKER) {
+            long num = (int)des_read_uint32(des);
+            VISIT(reader, inner, on_int, num);
+        } else if(type == AMF3_VECTOR_UINT_MARKER) {
+            const unsigned char *str = (const unsigned char *)des->stream + des->pos;
+            unsigned long num = ((unsigned long)str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3];
+            des->pos += 4;
+            VISIT(reader, inner, on_uint, num);
+        } else {
+            double num = des_read_double(des);
+            VISIT(reader, inner, on_double, num);
+        }
+    }
+    VISIT0(reader, inner, on_end_array);
+}
+
+static void read3_dict(AMF_READER *reader, int emit) {
+    int header;
+    if(read3_header(reader, emit, &header)) return;
+    reader->obj_count++;
+
+    des_read_int(&reader->des); // Skip - don't know what it does
+
+    long i;
+    int inner = emit && VISIT(reader, emit, on_start_dict, header) != READ_SKIP;
+    for(i = 0; i < header; i++) {
+        read3_value(reader, inner);
+        read3_value(reader, inner);
+    }
+    VISIT0(reader, inner, on_end_dict);
+}
+
+static void read3_value(AMF_READER *reader, int emit) {
+    AMF_DESERIALIZER *des = &reader->des;
+    int header, ival;
+    long pos, len;
+    double num;
+
+    char type = des_read_byte(des);
+    switch(type) {
+        case AMF3_UNDEFINED_MARKER:
+        case AMF3_NULL_MARKER:
+            VISIT0(reader, emit, on_null);
+            break;
+        case AMF3_FALSE_MARKER:
+            VISIT(reader, emit, on_boolean, 0);
+            break;
+        case AMF3_TRUE_MARKER:
+            VISIT(reader, emit, on_boolean, 1);
+            break;
+        case AMF3_INTEGER_MARKER:
+            ival = des_read_int(des);
+            VISIT(reader, emit, on_int, ival);
+            break;
+        case AMF3_DOUBLE_MARKER:
+            num = des_read_double(des);
+            VISIT(reader, emit, on_double, num);
+            break;
+        case AMF3_STRING_MARKER:
+            read3_string(reader, &pos, &len);
+            VISIT(reader, emit, on_string, des->stream + pos, len);
+            break;
+        case AMF3_ARRAY_MARKER:
+            read3_array(reader, emit);
+            break;
+        case AMF3_OBJECT_MARKER:
+            read3_object(reader, emit);
+            break;
+        case AMF3_DATE_MARKER:
+            if(read3_header(reader, emit, &header)) break;
+            reader->obj_count++;
+            num = des_read_double(des);
+            VISIT(reader, emit, on_date, num);
+            break;
+        case AMF3_XML_DOC_MARKER:
+        case AMF3_XML_MARKER:
+            if(read3_header(reader, emit, &header)) break;
+            DES_BOUNDS_CHECK(des, header);
+            if(header > 0) reader->obj_count++;
+            VISIT(reader, emit, on_xml, des->stream + des->pos, header);
+            des->pos += header;
+            break;
+        case AMF3_BYTE_ARRAY_MARKER:
+            if(read3_header(reader, emit, &header)) break;
+            DES_BOUNDS_CHECK(des, header);
+            reader->obj_count++;
+            VISIT(reader, emit, on_byte_array, des->stream + des->pos, header);
+            des->pos += header;
+            break;
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+        case AMF3_VECTOR_OBJECT_MARKER:
+            read3_vector(reader, emit, type);
+            break;
+        case AMF3_DICT_MARKER:
+            read3_dict(reader, emit);
+            break;
+        default:
+            rb_raise(rb_eRuntimeError, "Not supported: %d\n", type);
+            break;
+    }
+}
+
+static void read0_value(AMF_READER *reader, char type, int emit);
+
+/*
+ * Reads AMF0 key/value pairs up to the empty key that ends them
+ */
+static void read0_props(AMF_READER *reader, int emit, int member) {
+    AMF_DESERIALIZER *des = &reader->des;
+    while(1) {
+        long len = des_read_uint16(des);
+        if(len == 0) {
+            des_read_byte(des); // Read type byte
+            return;
+        }
+        DES_BOUNDS_CHECK(des, len);
+        const char *key = des->stream + des->pos;
+        des->pos += len;
+        int skip = VISIT(reader, emit, on_key, key, len, member) == READ_SKIP;
+        read0_value(reader, des_read_byte(des), emit && !skip);
+    }
+}
+
+/*
+ * Reads an AMF3 body inside AMF0 data, with its reference tables stacked
+ * above the ones already in use so they can be dropped afterwards
+ */
+static void read0_amf3(AMF_READER *reader, int emit) {
+    long obj_base = reader->obj_base, str_base = reader->str_base, trait_base = reader->trait_base;
+    reader->obj_base = reader->obj_count;
+    reader->str_base = reader->str_count;
+    reader->trait_base = reader->trait_count;
+
+    read3_value(reader, emit);
+
+    reader->obj_count = reader->obj_base;
+    reader->str_count = reader->str_base;
+    reader->trait_count = reader->trait_base;
+    reader->obj_base = obj_base;
+    reader->str_base = str_base;
+    reader->trait_base = trait_base;
+}
+
+static void read0_value(AMF_READER *reader, char type, int emit) {
+    AMF_DESERIALIZER *des = &reader->des;
+    long i, len;
+    double num;
+    int inner;
+
+    switch(type) {
+        case AMF0_STRING_MARKER:
+        case AMF0_LONG_STRING_MARKER:
+        case AMF0_XML_MARKER:
+            len = type == AMF0_STRING_MARKER ? des_read_uint16(des) : des_read_uint32(des);
+            DES_BOUNDS_CHECK(des, len);
+            if(type == AMF0_XML_MARKER) {
+                VISIT(reader, emit, on_xml, des->stream + des->pos, len);
+            } else {
+                VISIT(reader, emit, on_string, des->stream + des->pos, len);
+            }
+            des->pos += len;
+            break;
+        case AMF0_AMF3_MARKER:
+            read0_amf3(reader, emit);
+            break;
+        case AMF0_NUMBER_MARKER:
+            num = des_read_double(des);
+            VISIT(reader, emit, on_double, num);
+            break;
+        case AMF0_BOOLEAN_MARKER:
+            i = des_read_byte(des);
+            VISIT(reader, emit, on_boolean, i != 0);
+            break;
+        case AMF0_NULL_MARKER:
+        case AMF0_UNDEFINED_MARKER:
+        case AMF0_UNSUPPORTED_MARKER:
+            VISIT0(reader, emit, on_null);
+            break;
+        case AMF0_OBJECT_MARKER:
+            reader->obj_count++;
+            inner = emit && VISIT(reader, emit, on_start_object, NULL, 0) != READ_SKIP;
+            read0_props(reader, inner, 1);
+            VISIT0(reader, inner, on_end_object);
+            break;
+        case AMF0_TYPED_OBJECT_MARKER:
+            len = des_read_uint16(des);
+            DES_BOUNDS_CHECK(des, len);
+            des->pos += len;
+            reader->obj_count++;
+            inner = emit && VISIT(reader, emit, on_start_object, des->stream + des->pos - len, len) != READ_SKIP;
+            read0_props(reader, inner, 1);
+            VISIT0(reader, inner, on_end_object);
+            break;
+        case AMF0_HASH_MARKER:
+            des_read_uint32(des); // Hash size, which the end marker makes redundant
+            reader->obj_count++;
+            inner = emit && VISIT0(reader, emit, on_start_hash) != READ_SKIP;
+            read0_props(reader, inner, 0);
+            VISIT0(reader, inner, on_end_hash);
+            break;
+        case AMF0_STRICT_ARRAY_MARKER:
+            len = des_read_uint32(des);
+            reader->obj_count++;
+            inner = emit && VISIT(reader, emit, on_start_array, len) != READ_SKIP;
+            for(i = 0; i < len; i++) {
+                read0_value(reader, des_read_byte(des), inner);
+            }
+            VISIT0(reader, inner, on_end_array);
+            break;
+        case AMF0_REFERENCE_MARKER:
+            i = des_read_uint16(des);
+            if(i >= reader->obj_count) rb_raise(rb_eRangeError, "reference index beyond end");
+            VISIT(reader, emit, on_reference, i);
+            break;
+        case AMF0_DATE_MARKER:
+            num = des_read_double(des);
+            des_read_uint16(des); // Timezone - unused
+            VISIT(reader, emit, on_date, num);
+            break;
+        default:
+            rb_raise(rb_eRuntimeError, "Not supported: %d\n", type);
+            break;
+    }
+}
+
+/*
+ * Walks one value from the reader's source, starting at its current position,
+ * and reports it to the visitor. AMF0 readers switch to AMF3 as the data does.
+ */
+void reader_walk(AMF_READER *reader, const AMF_VISITOR *visitor, void *ctx) {
+    reader->visitor = visitor;
+    reader->ctx = ctx;
+    reader->str_count = 0;
+    reader->trait_count = 0;
+    reader->obj_count = 0;
+    reader->obj_base = 0;
+    reader->str_base = 0;
+    reader->trait_base = 0;
+
+    if(reader->version == 3) {
+        read3_value(reader, 1);
+    } else {
+        read0_value(reader, des_read_byte(&reader->des), 1);
+    }
+}
+
+/*
+ * Visitor behind Reader#each_event, yielding an event name and value for each
+ * callback. Returning :skip from the block skips the container or property.
+ */
+static VALUE rb_event_str(const char *str, long len) {
+    VALUE ret = rb_str_new(str, len);
+#ifdef HAVE_RB_STR_ENCODE
+    rb_enc_associate(ret, rb_utf8_encoding());
+    ENC_CODERANGE_SET(ret, des_utf8_coderange(str, len));
+#endif
+    return ret;
+}
+
+static int rb_event(VALUE event, VALUE value) {
+    return rb_yield_values(2, event, value) == sym_skip ? READ_SKIP : READ_CONTINUE;
+}
+
+static int rb_on_null(void *ctx) { return rb_event(sym_ev_null, Qnil); }
+static int rb_on_boolean(void *ctx, int value) { return rb_event(sym_ev_boolean, value ? Qtrue : Qfalse); }
+static int rb_on_int(void *ctx, long value) { return rb_event(sym_ev_integer, LONG2NUM(value)); }
+static int rb_on_uint(void *ctx, unsigned long value) { return rb_event(sym_ev_integer, ULONG2NUM(value)); }
+static int rb_on_double(void *ctx, double value) { return rb_event(sym_ev_double, rb_float_new(value)); }
+static int rb_on_string(void *ctx, const char *str, long len) { return rb_event(sym_ev_string, rb_event_str(str, len)); }
+static int rb_on_xml(void *ctx, const char *str, long len) { return rb_event(sym_ev_xml, rb_event_str(str, len)); }
+static int rb_on_date(void *ctx, double millis) { return rb_event(sym_ev_date, des_time_from_millis(millis)); }
+static int rb_on_byte_array(void *ctx, const char *str, long len) { return rb_event(sym_ev_byte_array, rb_str_new(str, len)); }
+static int rb_on_reference(void *ctx, long index) { return rb_event(sym_ev_reference, LONG2NUM(index)); }
+static int rb_on_end_object(void *ctx) { return rb_event(sym_ev_end_object, Qnil); }
+static int rb_on_start_hash(void *ctx) { return rb_event(sym_ev_start_hash, Qnil); }
+static int rb_on_end_hash(void *ctx) { return rb_event(sym_ev_end_hash, Qnil); }
+static int rb_on_start_array(void *ctx, long len) { return rb_event(sym_ev_start_array, LONG2NUM(len)); }
+static int rb_on_end_array(void *ctx) { return rb_event(sym_ev_end_array, Qnil); }
+static int rb_on_start_dict(void *ctx, long len) { return rb_event(sym_ev_start_dict, LONG2NUM(len)); }
+static int rb_on_end_dict(void *ctx) { return rb_event(sym_ev_end_dict, Qnil); }
+
+static int rb_on_start_object(void *ctx, const char *class_name, long len) {
+    return rb_event(sym_ev_start_object, class_name ? rb_event_str(class_name, len) : Qnil);
+}
+
+/*
+ * Object properties are symbols and hash keys strings, the same as the
+ * deserializer produces. Symbols for keys already seen allocate nothing.
+ */
+static int rb_on_key(void *ctx, const char *key, long len, int member) {
+    VALUE name;
+    if(member) {
+#ifdef HAVE_RB_INTERN2
+        name = ID2SYM(rb_intern2(key, len));
+#else
+        name = rb_str_intern(rb_str_new(key, len));
+#endif
+    } else {
+        name = rb_event_str(key, len);
+    }
+    return rb_event(sym_ev_key, name);
+}
+
+static const AMF_VISITOR rb_visitor = {
+    rb_on_null, rb_on_boolean, rb_on_int, rb_on_uint, rb_on_double, rb_on_string,
+    rb_on_xml, rb_on_date, rb_on_byte_array, rb_on_reference, rb_on_start_object,
+    rb_on_end_object, rb_on_start_hash, rb_on_end_hash, rb_on_key,
+    rb_on_start_array, rb_on_end_array, rb_on_start_dict, rb_on_end_dict
+};
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext::Reader.new(amf_version=0)
+ *
+ * Creates a reader for AMF0 or AMF3 data.
+ */
+static VALUE reader_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_READER *reader;
+    Data_Get_Struct(self, AMF_READER, reader);
+
+    VALUE version;
+    rb_scan_args(argc, argv, "01", &version);
+    int v = NIL_P(version) ? 0 : NUM2INT(version);
+    if(v != 0 && v != 3) rb_raise(rb_eArgError, "unsupported version %d", v);
+    reader->version = v;
+
+    return self;
+}
+
+static VALUE reader_walk_rb(VALUE self) {
+    AMF_READER *reader;
+    Data_Get_Struct(self, AMF_READER, reader);
+    reader_walk(reader, &rb_visitor, NULL);
+    return Qnil;
+}
+
+static VALUE reader_walk_done(VALUE self) {
+    AMF_READER *reader;
+    Data_Get_Struct(self, AMF_READER, reader);
+    reader->walking = 0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   reader.each_event(str) {|event, value| ... }
+ *   reader.each_event(StringIO) {|event, value| ... }
+ *
+ * Walks one value from the source, yielding an event for each part of it
+ * without building the object graph. Events are <tt>:null</tt>,
+ * <tt>:boolean</tt>, <tt>:integer</tt>, <tt>:double</tt>, <tt>:string</tt>,
+ * <tt>:xml</tt>, <tt>:date</tt> and <tt>:byte_array</tt> with the value,
+ * <tt>:key</tt> with a property name, <tt>:start_object</tt> with the class
+ * name or nil, <tt>:start_array</tt> and <tt>:start_dictionary</tt> with the
+ * length, <tt>:start_hash</tt>, a matching <tt>:end_*</tt> for each start,
+ * and <tt>:reference</tt> with the index of an object seen earlier.
+ *
+ * Returning <tt>:skip</tt> from the block for a start or key event walks past
+ * that value without yielding or allocating anything for it.
+ */
+static VALUE reader_each_event(int argc, VALUE *argv, VALUE self) {
+    AMF_READER *reader;
+    Data_Get_Struct(self, AMF_READER, reader);
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    VALUE src;
+    rb_scan_args(argc, argv, "1", &src);
+    if(reader->walking) rb_raise(rb_eRuntimeError, "reader is already walking a source");
+
+    // The block can run any code, so read from a frozen copy that nothing
+    // can modify underneath the walk. The copy shares the buffer.
+    des_set_src(&reader->des, src);
+    reader->des.src_string = rb_str_new_frozen(reader->des.src_string);
+    reader->des.stream = RSTRING_PTR(reader->des.src_string);
+
+    reader->walking = 1;
+    rb_ensure(reader_walk_rb, self, reader_walk_done, self);
+    if(reader->des.src) rb_funcall(reader->des.src, rb_intern("pos="), 1, LONG2NUM(reader->des.pos)); // Update source StringIO pos
+    reader->des.src_string = 0;
+    reader->des.src = 0;
+
+    return self;
+}
+
+void Init_rocket_amf_reader() {
+    cReader = rb_define_class_under(mRocketAMFExt, "Reader", rb_cObject);
+    rb_define_alloc_func(cReader, reader_alloc);
+    rb_define_method(cReader, "initialize", reader_initialize, -1);
+    rb_define_method(cReader, "each_event", reader_each_event, -1);
+
+    sym_skip = ID2SYM(rb_intern("skip"));
+    sym_ev_null = ID2SYM(rb_intern("null"));
+    sym_ev_boolean = ID2SYM(rb_intern("boolean"));
+    sym_ev_integer = ID2SYM(rb_intern("integer"));
+    sym_ev_double = ID2SYM(rb_intern("double"));
+    sym_ev_string = ID2SYM(rb_intern("string"));
+    sym_ev_xml = ID2SYM(rb_intern("xml"));
+    sym_ev_date = ID2SYM(rb_intern("date"));
+    sym_ev_byte_array = ID2SYM(rb_intern("byte_array"));
+    sym_ev_reference = ID2SYM(rb_intern("reference"));
+    sym_ev_start_object = ID2SYM(rb_intern("start_object"));
+    sym_ev_end_object = ID2SYM(rb_intern("end_object"));
+    sym_ev_start_hash = ID2SYM(rb_intern("start_hash"));
+    sym_ev_end_hash = ID2SYM(rb_intern("end_hash"));
+    sym_ev_key = ID2SYM(rb_intern("key"));
+    sym_ev_start_array = ID2SYM(rb_intern("start_array"));
+    sym_ev_end_array = ID2SYM(rb_intern("end_array"));
+    sym_ev_start_dict = ID2SYM(rb_intern("start_dictionary"));
+    sym_ev_end_dict = ID2SYM(rb_intern("end_dictionary"));
+}
@@ -0,0 +1,69 @@
+#include <ruby.h>
+#include "deserializer.h"
+
+/*
+ * Event reader that walks AMF data and reports each value to a visitor rather
+ * than building ruby objects. Strings and traits are remembered as offsets into
+ * the source, so nothing is allocated for values the visitor doesn't ask for.
+ */
+
+#define READ_CONTINUE 0
+#define READ_SKIP     1 // Returned from a start or key callback to walk past that value silently
+
+/*
+ * Callbacks for each kind of value. Any of them can be NULL. References to
+ * objects, dates, XML and byte arrays seen earlier are reported by index rather
+ * than resolved, since nothing was built for them. Strings are always resolved.
+ */
+typedef struct {
+    int (*on_null)(void *ctx);
+    int (*on_boolean)(void *ctx, int value);
+    int (*on_int)(void *ctx, long value);
+    int (*on_uint)(void *ctx, unsigned long value);
+    int (*on_double)(void *ctx, double value);
+    int (*on_string)(void *ctx, const char *str, long len);
+    int (*on_xml)(void *ctx, const char *str, long len);
+    int (*on_date)(void *ctx, double millis);
+    int (*on_byte_array)(void *ctx, const char *str, long len);
+    int (*on_reference)(void *ctx, long index);
+    int (*on_start_object)(void *ctx, const char *class_name, long len); // class_name is NULL for anonymous objects
+    int (*on_end_object)(void *ctx);
+    int (*on_start_hash)(void *ctx);
+    int (*on_end_hash)(void *ctx);
+    int (*on_key)(void *ctx, const char *key, long len, int member); // member is set for object properties, clear for hash keys
+    int (*on_start_array)(void *ctx, long len);
+    int (*on_end_array)(void *ctx);
+    int (*on_start_dict)(void *ctx, long len);
+    int (*on_end_dict)(void *ctx);
+} AMF_VISITOR;
+
+typedef struct {
+    long name_pos;
+    long name_len;
+    long *members; // Offset and length pairs
+    long members_len;
+    long members_capa;
+    char externalizable;
+    char dynamic;
+    char array_collection;
+} READER_TRAIT;
+
+typedef struct {
+    AMF_DESERIALIZER des; // Source handling and primitive reads
+    char version;
+    char walking;
+    long *strings; // Offset and length pairs for the AMF3 string table
+    long str_count;
+    long str_capa;
+    READER_TRAIT **traits;
+    long trait_count;
+    long trait_capa;
+    long obj_count; // Objects are only counted, to check references against
+    long obj_base; // Where the current AMF3 body's tables start
+    long str_base;
+    long trait_base;
+    const AMF_VISITOR *visitor;
+    void *ctx;
+} AMF_READER;
+
+void reader_walk(AMF_READER *reader, const AMF_VISITOR *visitor, void *ctx);
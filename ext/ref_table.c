@@ -0,0 +1,102 @@
+#include "ref_table.h"
+
+#define REF_TABLE_MIN_CAPA 64
+
+/*
+ * Object addresses are aligned, so drop the low bits and spread the rest with
+ * a multiplicative hash
+ */
+static inline unsigned long ref_table_hash(VALUE key) {
+    unsigned long h = (unsigned long)(key >> 3) * (unsigned long)0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 16);
+}
+
+/*
+ * Allocate entries and rehash the live entries from the old array
+ */
+static void ref_table_resize(REF_TABLE *table, long capa) {
+    REF_ENTRY *old = table->entries;
+    long i, old_capa = table->capa;
+
+    table->entries = ALLOC_N(REF_ENTRY, capa);
+    MEMZERO(table->entries, REF_ENTRY, capa);
+    table->capa = capa;
+    table->count = 0;
+    if(!old) return;
+
+    for(i = 0; i < old_capa; i++) {
+        if(old[i].gen == table->gen) ref_table_add(table, old[i].key, old[i].index);
+    }
+    xfree(old);
+}
+
+void ref_table_init(REF_TABLE *table) {
+    table->entries = NULL;
+    table->capa = 0;
+    table->count = 0;
+    table->gen = 1;
+}
+
+void ref_table_free(REF_TABLE *table) {
+    if(table->entries) xfree(table->entries);
+    ref_table_init(table);
+}
+
+/*
+ * Mark the objects in the current generation. Their addresses are the keys, so
+ * they must not be collected or moved while they're in the table.
+ */
+void ref_table_mark(REF_TABLE *table) {
+    long i;
+    if(!table->entries || table->count == 0) return;
+    for(i = 0; i < table->capa; i++) {
+        if(table->entries[i].gen == table->gen) rb_gc_mark(table->entries[i].key);
+    }
+}
+
+/*
+ * Empty the table by starting a new generation
+ */
+void ref_table_clear(REF_TABLE *table) {
+    if(table->count == 0) return;
+    table->count = 0;
+    table->gen++;
+    if(table->gen == 0) {
+        // Wrapped around, so old entries could look current again
+        MEMZERO(table->entries, REF_ENTRY, table->capa);
+        table->gen = 1;
+    }
+}
+
+int ref_table_lookup(REF_TABLE *table, VALUE key, long *index) {
+    if(table->count == 0) return 0;
+
+    unsigned long mask = table->capa - 1;
+    unsigned long i = ref_table_hash(key) & mask;
+    while(table->entries[i].gen == table->gen) {
+        if(table->entries[i].key == key) {
+            *index = table->entries[i].index;
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+/*
+ * Adds the key without checking if it's already present. Keeps the load factor
+ * at or below one half so probes stay short.
+ */
+void ref_table_add(REF_TABLE *table, VALUE key, long index) {
+    if((table->count + 1) * 2 > table->capa) {
+        ref_table_resize(table, table->capa ? table->capa * 2 : REF_TABLE_MIN_CAPA);
+    }
+
+    unsigned long mask = table->capa - 1;
+    unsigned long i = ref_table_hash(key) & mask;
+    while(table->entries[i].gen == table->gen) i = (i + 1) & mask;
+    table->entries[i].key = key;
+    table->entries[i].gen = table->gen;
+    table->entries[i].index = index;
+    table->count++;
+}
@@ -0,0 +1,26 @@
+#include <ruby.h>
+
+/*
+ * Open addressing hash table mapping objects to their reference index, keyed
+ * on object identity. Entries from previous generations count as empty, so the
+ * table can be cleared in constant time between top-level serialize calls.
+ */
+typedef struct {
+    VALUE key;
+    unsigned long gen;
+    long index;
+} REF_ENTRY;
+
+typedef struct {
+    REF_ENTRY* entries;
+    long capa;
+    long count;
+    unsigned long gen;
+} REF_TABLE;
+
+void ref_table_init(REF_TABLE *table);
+void ref_table_free(REF_TABLE *table);
+void ref_table_mark(REF_TABLE *table);
+void ref_table_clear(REF_TABLE *table);
+int ref_table_lookup(REF_TABLE *table, VALUE key, long *index);
+void ref_table_add(REF_TABLE *table, VALUE key, long index);
@@ -14,16 +14,37 @@ ID id_amf_version;
 ID id_headers;
 ID id_messages;
 ID id_data;
+ID id_defer_data;
+VALUE sym_defer_bodies;
 
-static VALUE env_populate_from_stream(VALUE self, VALUE src) {
+#define ENV_UNKNOWN_LENGTH 0xFFFFFFFFUL
+
+/*
+ * call-seq:
+ *   env.populate_from_stream(str) => env
+ *   env.populate_from_stream(str, :shared_string_threshold => 65536) => env
+ *   env.populate_from_stream(str, :defer_bodies => false) => env
+ *
+ * Populates the envelope from the given string, StringIO or
+ * RocketAMF::MappedSource. Accepts the same options as the deserializers.
+ * Message bodies are decoded when their data is first read, or right away
+ * with <tt>:defer_bodies => false</tt>. Bodies that come with their length are
+ * sliced off without being looked at, and only the ones sent with an unknown
+ * length of -1 are scanned for where they end.
+ */
+static VALUE env_populate_from_stream(int argc, VALUE *argv, VALUE self) {
     int i;
     VALUE args[3];
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "11", &src, &opts);
 
-    // Create deserializer
-    VALUE des_rb = rb_class_new_instance(0, NULL, cDeserializer);
+    // Borrow a deserializer from the thread's pool
+    VALUE des_rb = des_pool_checkout(cDeserializer);
     AMF_DESERIALIZER *des;
     Data_Get_Struct(des_rb, AMF_DESERIALIZER, des);
+    des_set_options(des, opts);
     des_set_src(des, src);
+    long env_start = des->pos;
 
     // Read amf version
     int amf_ver = des_read_uint16(des);
@@ -49,32 +70,99 @@ static VALUE env_populate_from_stream(VALUE self, VALUE src) {
     for(i = 0; i < message_cnt; i++) {
         VALUE target_uri = des_read_string(des, des_read_uint16(des));
         VALUE response_uri = des_read_string(des, des_read_uint16(des));
-        des_read_uint32(des); // Length is ignored
-        VALUE data = des0_deserialize(des_rb, des_read_byte(des));
+        unsigned long len = (unsigned long)des_read_uint32(des);
 
-        // If they're using the flex remoting APIs, remove array wrapper
-        if(TYPE(data) == T_ARRAY && RARRAY_LEN(data) == 1 && rb_obj_is_kind_of(RARRAY_PTR(data)[0], cRocketAMFAbstractMessage) == Qtrue) {
-            data = RARRAY_PTR(data)[0];
+        // Leave the body for Message#data to decode. Clients often send -1 for
+        // the length, and then the body is scanned for where it ends. Bodies
+        // only read_external can size, and broken ones, are read right away,
+        // which raises the same errors as before for the broken ones.
+        long start = des->pos;
+        VALUE data = Qnil, body = Qnil;
+        if(!des->scanner) des->scanner = scanner_new(0);
+        scanner_reset(des->scanner);
+        if(len != ENV_UNKNOWN_LENGTH && len <= (unsigned long)(des->size - start)) {
+            body = rb_str_substr(des->src_string, start, len);
+            des->pos = start + len;
+        } else if(scanner_scan(des->scanner, des->stream + start, des->size - start) == SCAN_DONE) {
+            body = rb_str_substr(des->src_string, start, des->scanner->pos);
+            des->pos = start + des->scanner->pos;
+        } else {
+            data = des0_deserialize(des_rb, des_read_byte(des));
+
+            // If they're using the flex remoting APIs, remove array wrapper
+            if(TYPE(data) == T_ARRAY && RARRAY_LEN(data) == 1 && rb_obj_is_kind_of(RARRAY_PTR(data)[0], cRocketAMFAbstractMessage) == Qtrue) {
+                data = RARRAY_PTR(data)[0];
+            }
         }
+        scanner_reset(des->scanner);
 
         args[0] = target_uri;
         args[1] = response_uri;
         args[2] = data;
-        rb_ary_push(messages, rb_class_new_instance(3, args, cRocketAMFMessage));
+        VALUE message = rb_class_new_instance(3, args, cRocketAMFMessage);
+        if(body != Qnil) {
+            rb_funcall(message, id_defer_data, 2, body, opts);
+            if(opts != Qnil && rb_hash_aref(opts, sym_defer_bodies) == Qfalse) rb_funcall(message, id_data, 0);
+        }
+        rb_ary_push(messages, message);
     }
 
     // Populate remoting object
     rb_ivar_set(self, id_amf_version, INT2FIX(amf_ver));
     rb_ivar_set(self, id_headers, headers);
     rb_ivar_set(self, id_messages, messages);
+    STATS_ADD(&des->stats, bytes, des->pos - env_start);
+    STATS_FINISH(&des->stats, &des->stats_total, STATS_DESERIALIZE);
+    des_pool_checkin(des_rb);
 
     return self;
 }
 
-static VALUE env_serialize(VALUE self) {
+/*
+ * Writes a placeholder length for the header or body about to be written, and
+ * returns its offset in the output
+ */
+static long env_begin_length(AMF_SERIALIZER *ser) {
+    long pos = ser->flushed + RSTRING_LEN(ser->stream);
+    ser_write_uint32(ser, -1);
+    return pos;
+}
+
+/*
+ * Backpatches the length written at pos with the number of bytes written
+ * since. When streaming output the placeholder may already have been handed to
+ * the IO, and then it stays -1, which readers take as an unknown length.
+ */
+static void env_end_length(AMF_SERIALIZER *ser, long pos) {
+    long offset = pos - ser->flushed;
+    unsigned long len = (unsigned long)(ser->flushed + RSTRING_LEN(ser->stream) - pos - 4);
+    if(offset < 0 || len >= ENV_UNKNOWN_LENGTH) return;
+
+    rb_str_modify(ser->stream);
+    unsigned char *dst = (unsigned char *)RSTRING_PTR(ser->stream) + offset;
+    dst[0] = (len >> 24) & 0xff;
+    dst[1] = (len >> 16) & 0xff;
+    dst[2] = (len >> 8) & 0xff;
+    dst[3] = len & 0xff;
+}
+
+/*
+ * call-seq:
+ *   env.serialize => str
+ *   env.serialize(io, :chunk_size => 65536) => bytes_written
+ *   env.serialize(:chunk_size => 65536) {|chunk| block } => bytes_written
+ *
+ * Serializes the envelope and returns it as a string, or writes it out in
+ * chunks to the given IO or block. Accepts the same options as the
+ * serializers. Headers and bodies are written with their byte lengths, except
+ * those whose length had already been written out in an earlier chunk, which
+ * are sent as -1.
+ */
+static VALUE env_serialize(int argc, VALUE *argv, VALUE self) {
     int i;
     char *str;
     long str_len;
+    VALUE src;
 
     // Get instance variables
     long amf_ver = FIX2LONG(rb_ivar_get(self, id_amf_version));
@@ -89,6 +177,17 @@ static VALUE env_serialize(VALUE self) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(ser_rb, AMF_SERIALIZER, ser);
 
+    // Set up streaming output if requested
+    VALUE io = Qnil, opts = Qnil, block = Qnil;
+    rb_scan_args(argc, argv, "02&", &io, &opts, &block);
+    if(TYPE(io) == T_HASH && opts == Qnil) {
+        opts = io;
+        io = Qnil;
+    }
+    if(io == Qnil) io = block;
+    if(io != Qnil) ser_set_output(ser, io, opts);
+    if(TYPE(opts) == T_HASH) ser->class_mapper = rb_hash_aref(opts, ID2SYM(rb_intern("class_mapper")));
+
     // Write version
     ser_write_uint16(ser, amf_ver);
 
@@ -99,16 +198,18 @@ static VALUE env_serialize(VALUE self) {
         VALUE header = RARRAY_PTR(headers)[i];
 
         // Write header name
-        ser_get_string(rb_funcall(header, rb_intern("name"), 0), Qtrue, &str, &str_len);
+        src = ser_get_string(rb_funcall(header, rb_intern("name"), 0), Qtrue, &str, &str_len);
         ser_write_uint16(ser, str_len);
-        rb_str_buf_cat(ser->stream, str, str_len);
+        ser_write_bytes(ser, str, str_len);
+        RB_GC_GUARD(src);
 
         // Write understand flag
         ser_write_byte(ser, rb_funcall(header, rb_intern("must_understand"), 0) == Qtrue ? 1 : 0);
 
         // Serialize data
-        ser_write_uint32(ser, -1);
+        long len_pos = env_begin_length(ser);
         ser0_serialize(ser_rb, rb_funcall(header, id_data, 0));
+        env_end_length(ser, len_pos);
     }
 
     // Write messages
@@ -118,39 +219,46 @@ static VALUE env_serialize(VALUE self) {
         VALUE message = RARRAY_PTR(messages)[i];
 
         // Write target_uri
-        ser_get_string(rb_funcall(message, rb_intern("target_uri"), 0), Qtrue, &str, &str_len);
+        src = ser_get_string(rb_funcall(message, rb_intern("target_uri"), 0), Qtrue, &str, &str_len);
         ser_write_uint16(ser, str_len);
-        rb_str_buf_cat(ser->stream, str, str_len);
+        ser_write_bytes(ser, str, str_len);
+        RB_GC_GUARD(src);
 
         // Write response_uri
-        ser_get_string(rb_funcall(message, rb_intern("response_uri"), 0), Qtrue, &str, &str_len);
+        src = ser_get_string(rb_funcall(message, rb_intern("response_uri"), 0), Qtrue, &str, &str_len);
         ser_write_uint16(ser, str_len);
-        rb_str_buf_cat(ser->stream, str, str_len);
+        ser_write_bytes(ser, str, str_len);
+        RB_GC_GUARD(src);
 
         // Serialize data
-        ser_write_uint32(ser, -1);
+        long len_pos = env_begin_length(ser);
         if(amf_ver == 3) {
-            ser_write_byte(ser, AMF0_AMF3_MARKER);
+            ser0_write_marker(ser, AMF0_AMF3_MARKER);
             ser3_serialize(ser_rb, rb_funcall(message, id_data, 0));
         } else {
             ser0_serialize(ser_rb, rb_funcall(message, id_data, 0));
         }
+        env_end_length(ser, len_pos);
     }
 
-    return ser->stream;
+    VALUE ret = ser_finish(ser);
+    STATS_FINISH(&ser->stats, &ser->stats_total, STATS_SERIALIZE);
+    return ret;
 }
 
 
 void Init_rocket_amf_remoting() {
     VALUE mEnvelope = rb_define_module_under(mRocketAMFExt, "Envelope");
-    rb_define_method(mEnvelope, "populate_from_stream", env_populate_from_stream, 1);
-    rb_define_method(mEnvelope, "serialize", env_serialize, 0);
+    rb_define_method(mEnvelope, "populate_from_stream", env_populate_from_stream, -1);
+    rb_define_method(mEnvelope, "serialize", env_serialize, -1);
 
     // Get refs to commonly used symbols and ids
     id_amf_version = rb_intern("@amf_version");
     id_headers = rb_intern("@headers");
     id_messages = rb_intern("@messages");
     id_data = rb_intern("data");
+    id_defer_data = rb_intern("defer_data");
+    sym_defer_bodies = ID2SYM(rb_intern("defer_bodies"));
     cRocketAMFHeader = rb_const_get(mRocketAMF, rb_intern("Header"));
     cRocketAMFMessage = rb_const_get(mRocketAMF, rb_intern("Message"));
     cRocketAMFAbstractMessage = rb_const_get(rb_const_get(mRocketAMF, rb_intern("Values")), rb_intern("AbstractMessage"));
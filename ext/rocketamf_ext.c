@@ -1,4 +1,5 @@
 #include <ruby.h>
+#include "case_cache.h"
 
 VALUE mRocketAMF;
 VALUE mRocketAMFExt;
@@ -9,32 +10,70 @@ VALUE cAMF3Serializer;
 VALUE cStringIO;
 VALUE cDate;
 VALUE cDateTime;
+VALUE cVector;
+VALUE cFragment;
+VALUE cClassMapping;
 VALUE sym_class_name;
 VALUE sym_members;
 VALUE sym_externalizable;
 VALUE sym_dynamic;
+VALUE sym_int;
+VALUE sym_uint;
+VALUE sym_double;
+VALUE sym_object;
+ID id_iv_type;
+ID id_iv_fixed;
+ID id_iv_class_name;
 
 void Init_rocket_amf_deserializer();
 void Init_rocket_amf_serializer();
 void Init_rocket_amf_fast_class_mapping();
 void Init_rocket_amf_remoting();
+void Init_rocket_amf_reader();
+void Init_rocket_amf_stats();
+void Init_rocket_amf_messages();
+void Init_rocket_amf_mapped_source();
+void Init_rocket_amf_byte_array();
+void Init_rocket_amf_data_io();
 
 void Init_rocketamf_ext() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    // Nothing here keeps unsynchronized state between ractors, so the
+    // serializers and frozen class mappers can be used from any of them
+    rb_ext_ractor_safe(true);
+#endif
     mRocketAMF = rb_define_module("RocketAMF");
     mRocketAMFExt = rb_define_module_under(mRocketAMF, "Ext");
 
     // Set up classes
+    case_cache_init();
     Init_rocket_amf_deserializer();
     Init_rocket_amf_serializer();
     Init_rocket_amf_fast_class_mapping();
     Init_rocket_amf_remoting();
+    Init_rocket_amf_reader();
+    Init_rocket_amf_stats();
+    Init_rocket_amf_messages();
+    Init_rocket_amf_mapped_source();
+    Init_rocket_amf_byte_array();
+    Init_rocket_amf_data_io();
 
     // Get refs to commonly used symbols and ids
     cStringIO = rb_const_get(rb_cObject, rb_intern("StringIO"));
     cDate = rb_const_get(rb_cObject, rb_intern("Date"));
     cDateTime = rb_const_get(rb_cObject, rb_intern("DateTime"));
+    cFragment = rb_const_get(mRocketAMF, rb_intern("Fragment"));
+    cClassMapping = rb_const_get(mRocketAMF, rb_intern("ClassMapping"));
+    cVector = rb_const_get(rb_const_get(mRocketAMF, rb_intern("Values")), rb_intern("Vector"));
     sym_class_name = ID2SYM(rb_intern("class_name"));
     sym_members = ID2SYM(rb_intern("members"));
     sym_externalizable = ID2SYM(rb_intern("externalizable"));
     sym_dynamic = ID2SYM(rb_intern("dynamic"));
+    sym_int = ID2SYM(rb_intern("int"));
+    sym_uint = ID2SYM(rb_intern("uint"));
+    sym_double = ID2SYM(rb_intern("double"));
+    sym_object = ID2SYM(rb_intern("object"));
+    id_iv_type = rb_intern("@type");
+    id_iv_fixed = rb_intern("@fixed");
+    id_iv_class_name = rb_intern("@class_name");
 }
\ No newline at end of file
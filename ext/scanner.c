@@ -0,0 +1,380 @@
+#include "scanner.h"
+#include "constants.h"
+
+#define SCAN_OK 3 // Internal - token consumed, keep going
+
+#define FRAME_AMF0_VALUES 0 // Fixed number of AMF0 values
+#define FRAME_AMF0_PROPS  1 // AMF0 key/value pairs up to an empty key
+#define FRAME_AMF3_VALUES 2 // Fixed number of AMF3 values
+#define FRAME_AMF3_ASSOC  3 // AMF3 key/value pairs up to an empty key
+
+#define SCAN_REQUIRE(n) do { \
+    if((n) < 0) rb_raise(rb_eRangeError, "invalid length %ld at %ld", (long)(n), *p); \
+    if((n) > len - *p) { s->need = *p + (n); return SCAN_MORE; } \
+} while(0)
+
+static const char array_collection[] = "flex.messaging.io.ArrayCollection";
+
+AMF_SCANNER *scanner_new(int version) {
+    AMF_SCANNER *s = ALLOC(AMF_SCANNER);
+    memset(s, 0, sizeof(AMF_SCANNER));
+    s->version = version;
+    return s;
+}
+
+/*
+ * Get ready to scan the next value. Buffers are kept for reuse.
+ */
+void scanner_reset(AMF_SCANNER *s) {
+    s->started = 0;
+    s->pos = 0;
+    s->need = 0;
+    s->depth = 0;
+    s->str_count = 0;
+    s->trait_count = 0;
+}
+
+void scanner_free(AMF_SCANNER *s) {
+    if(s->frames) xfree(s->frames);
+    if(s->strings) xfree(s->strings);
+    if(s->traits) xfree(s->traits);
+    xfree(s);
+}
+
+static void scan_push(AMF_SCANNER *s, char kind, long remaining) {
+    if(s->depth == s->frames_capa) {
+        s->frames_capa = s->frames_capa == 0 ? 16 : s->frames_capa * 2;
+        REALLOC_N(s->frames, SCAN_FRAME, s->frames_capa);
+    }
+    SCAN_FRAME *f = &s->frames[s->depth++];
+    f->kind = kind;
+    f->expect_key = 1;
+    f->remaining = remaining;
+}
+
+static long scan_uint16(const char *buf, long p) {
+    const unsigned char *str = (const unsigned char *)buf + p;
+    return (str[0] << 8) | str[1];
+}
+
+static long scan_uint32(const char *buf, long p) {
+    const unsigned char *str = (const unsigned char *)buf + p;
+    return ((unsigned long)str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3];
+}
+
+/*
+ * Reads an unsigned AMF3 U29 header
+ */
+static int scan_u29(AMF_SCANNER *s, const char *buf, long len, long *p, long *out) {
+    long result = 0;
+    int i;
+    for(i = 0; i < 4; i++) {
+        SCAN_REQUIRE(1);
+        unsigned char b = buf[(*p)++];
+        if(i < 3) {
+            result = (result << 7) | (b & 0x7f);
+            if((b & 0x80) == 0) break;
+        } else {
+            result = (result << 8) | b;
+        }
+    }
+    *out = result;
+    return SCAN_OK;
+}
+
+/*
+ * Skips a U29 header followed by that many bytes unless it's a reference. Used
+ * for the byte blob types that go in the object table.
+ */
+static int scan3_blob(AMF_SCANNER *s, const char *buf, long len, long *p) {
+    long header;
+    if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+    if(header & 1) {
+        SCAN_REQUIRE(header >> 1);
+        *p += header >> 1;
+    }
+    return SCAN_OK;
+}
+
+/*
+ * Skips an AMF3 string, recording inline strings in the string table so that
+ * class names can be looked up later. Returns the string through off and slen.
+ */
+static int scan3_string(AMF_SCANNER *s, const char *buf, long len, long *p, long *off, long *slen) {
+    long header;
+    if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header >= s->str_count) rb_raise(rb_eRangeError, "str reference index beyond end");
+        *off = s->strings[header * 2];
+        *slen = s->strings[header * 2 + 1];
+        return SCAN_OK;
+    }
+
+    header >>= 1;
+    SCAN_REQUIRE(header);
+    *off = *p;
+    *slen = header;
+    *p += header;
+    if(header > 0) {
+        if(s->str_count == s->str_capa) {
+            s->str_capa = s->str_capa == 0 ? 32 : s->str_capa * 2;
+            REALLOC_N(s->strings, long, s->str_capa * 2);
+        }
+        s->strings[s->str_count * 2] = *off;
+        s->strings[s->str_count * 2 + 1] = header;
+        s->str_count++;
+    }
+    return SCAN_OK;
+}
+
+static int scan3_object(AMF_SCANNER *s, const char *buf, long len, long *p) {
+    long header, i, off, slen;
+    if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+    if((header & 1) == 0) return SCAN_OK;
+
+    SCAN_TRAIT trait;
+    header >>= 1;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header >= s->trait_count) rb_raise(rb_eRangeError, "trait reference index beyond end");
+        trait = s->traits[header];
+    } else {
+        trait.externalizable = (header & 2) != 0;
+        trait.dynamic = (header & 4) != 0;
+        trait.members = header >> 3;
+        if(scan3_string(s, buf, len, p, &off, &slen) == SCAN_MORE) return SCAN_MORE;
+        trait.array_collection = slen == sizeof(array_collection) - 1 && memcmp(buf + off, array_collection, slen) == 0;
+        for(i = 0; i < trait.members; i++) {
+            if(scan3_string(s, buf, len, p, &off, &slen) == SCAN_MORE) return SCAN_MORE;
+        }
+
+        if(s->trait_count == s->trait_capa) {
+            s->trait_capa = s->trait_capa == 0 ? 16 : s->trait_capa * 2;
+            REALLOC_N(s->traits, SCAN_TRAIT, s->trait_capa);
+        }
+        s->traits[s->trait_count++] = trait;
+    }
+
+    // The deserializer reads ArrayCollection as its source array, whatever the
+    // traits say. Anything else externalizable has a format only it knows.
+    if(trait.array_collection) {
+        scan_push(s, FRAME_AMF3_VALUES, 1);
+    } else if(trait.externalizable) {
+        return SCAN_OPAQUE;
+    } else {
+        if(trait.dynamic) scan_push(s, FRAME_AMF3_ASSOC, 0);
+        scan_push(s, FRAME_AMF3_VALUES, trait.members);
+    }
+    return SCAN_OK;
+}
+
+static int scan3_value(AMF_SCANNER *s, const char *buf, long len, long *p) {
+    long header, off, slen;
+    SCAN_REQUIRE(1);
+    char type = buf[(*p)++];
+    switch(type) {
+        case AMF3_UNDEFINED_MARKER:
+        case AMF3_NULL_MARKER:
+        case AMF3_FALSE_MARKER:
+        case AMF3_TRUE_MARKER:
+            return SCAN_OK;
+        case AMF3_INTEGER_MARKER:
+            return scan_u29(s, buf, len, p, &header);
+        case AMF3_DOUBLE_MARKER:
+            SCAN_REQUIRE(8);
+            *p += 8;
+            return SCAN_OK;
+        case AMF3_STRING_MARKER:
+            return scan3_string(s, buf, len, p, &off, &slen);
+        case AMF3_XML_DOC_MARKER:
+        case AMF3_XML_MARKER:
+        case AMF3_BYTE_ARRAY_MARKER:
+            return scan3_blob(s, buf, len, p);
+        case AMF3_DATE_MARKER:
+            if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+            if(header & 1) {
+                SCAN_REQUIRE(8);
+                *p += 8;
+            }
+            return SCAN_OK;
+        case AMF3_ARRAY_MARKER:
+            if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+            if(header & 1) {
+                scan_push(s, FRAME_AMF3_VALUES, header >> 1);
+                scan_push(s, FRAME_AMF3_ASSOC, 0);
+            }
+            return SCAN_OK;
+        case AMF3_OBJECT_MARKER:
+            return scan3_object(s, buf, len, p);
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+        case AMF3_VECTOR_OBJECT_MARKER:
+            if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+            if((header & 1) == 0) return SCAN_OK;
+            header >>= 1;
+            SCAN_REQUIRE(1);
+            *p += 1; // Fixed flag
+            if(type == AMF3_VECTOR_OBJECT_MARKER) {
+                if(scan3_string(s, buf, len, p, &off, &slen) == SCAN_MORE) return SCAN_MORE;
+                scan_push(s, FRAME_AMF3_VALUES, header);
+            } else {
+                long width = type == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4;
+                if(header > (LONG_MAX - *p) / width) rb_raise(rb_eRangeError, "vector length %ld is too long", header);
+                SCAN_REQUIRE(header * width);
+                *p += header * width;
+            }
+            return SCAN_OK;
+        case AMF3_DICT_MARKER:
+            if(scan_u29(s, buf, len, p, &header) == SCAN_MORE) return SCAN_MORE;
+            if((header & 1) == 0) return SCAN_OK;
+            if(scan_u29(s, buf, len, p, &off) == SCAN_MORE) return SCAN_MORE; // Weak keys flag
+            scan_push(s, FRAME_AMF3_VALUES, (header >> 1) * 2);
+            return SCAN_OK;
+        default:
+            rb_raise(rb_eRuntimeError, "Not supported: %d\n", type);
+    }
+    return SCAN_OK;
+}
+
+static int scan0_value(AMF_SCANNER *s, const char *buf, long len, long *p) {
+    SCAN_REQUIRE(1);
+    char type = buf[(*p)++];
+    switch(type) {
+        case AMF0_NUMBER_MARKER:
+            SCAN_REQUIRE(8);
+            *p += 8;
+            break;
+        case AMF0_BOOLEAN_MARKER:
+            SCAN_REQUIRE(1);
+            *p += 1;
+            break;
+        case AMF0_STRING_MARKER:
+            SCAN_REQUIRE(2);
+            SCAN_REQUIRE(2 + scan_uint16(buf, *p));
+            *p += 2 + scan_uint16(buf, *p);
+            break;
+        case AMF0_NULL_MARKER:
+        case AMF0_UNDEFINED_MARKER:
+        case AMF0_UNSUPPORTED_MARKER:
+            break;
+        case AMF0_REFERENCE_MARKER:
+            SCAN_REQUIRE(2);
+            *p += 2;
+            break;
+        case AMF0_OBJECT_MARKER:
+            scan_push(s, FRAME_AMF0_PROPS, 0);
+            break;
+        case AMF0_TYPED_OBJECT_MARKER:
+            SCAN_REQUIRE(2);
+            SCAN_REQUIRE(2 + scan_uint16(buf, *p));
+            *p += 2 + scan_uint16(buf, *p);
+            scan_push(s, FRAME_AMF0_PROPS, 0);
+            break;
+        case AMF0_HASH_MARKER:
+            SCAN_REQUIRE(4);
+            *p += 4;
+            scan_push(s, FRAME_AMF0_PROPS, 0);
+            break;
+        case AMF0_STRICT_ARRAY_MARKER:
+            SCAN_REQUIRE(4);
+            scan_push(s, FRAME_AMF0_VALUES, scan_uint32(buf, *p));
+            *p += 4;
+            break;
+        case AMF0_DATE_MARKER:
+            SCAN_REQUIRE(10);
+            *p += 10;
+            break;
+        case AMF0_XML_MARKER:
+        case AMF0_LONG_STRING_MARKER:
+            SCAN_REQUIRE(4);
+            SCAN_REQUIRE(4 + scan_uint32(buf, *p));
+            *p += 4 + scan_uint32(buf, *p);
+            break;
+        case AMF0_AMF3_MARKER:
+            // Each switch to AMF3 gets a fresh deserializer and fresh tables
+            s->str_count = 0;
+            s->trait_count = 0;
+            scan_push(s, FRAME_AMF3_VALUES, 1);
+            break;
+        default:
+            rb_raise(rb_eRuntimeError, "Not supported: %d\n", type);
+    }
+    return SCAN_OK;
+}
+
+/*
+ * Reads the key of a key/value pair, popping the frame on the empty key
+ */
+static int scan_key(AMF_SCANNER *s, SCAN_FRAME *f, const char *buf, long len, long *p) {
+    long off, slen;
+    if(f->kind == FRAME_AMF0_PROPS) {
+        SCAN_REQUIRE(2);
+        slen = scan_uint16(buf, *p);
+        SCAN_REQUIRE(2 + slen + (slen == 0 ? 1 : 0)); // Empty key is followed by the object end marker
+        *p += 2 + slen + (slen == 0 ? 1 : 0);
+    } else {
+        if(scan3_string(s, buf, len, p, &off, &slen) == SCAN_MORE) return SCAN_MORE;
+    }
+
+    if(slen == 0) {
+        s->depth--;
+    } else {
+        f->expect_key = 0;
+    }
+    return SCAN_OK;
+}
+
+/*
+ * Scans forward from where the last call stopped. buf must start at the first
+ * byte of the value and hold at least everything seen on earlier calls.
+ */
+int scanner_scan(AMF_SCANNER *s, const char *buf, long len) {
+    if(len < s->need) return SCAN_MORE;
+
+    while(!s->started || s->depth > 0) {
+        long p = s->pos;
+        long str_count = s->str_count;
+        long trait_count = s->trait_count;
+        int res;
+
+        if(s->depth == 0) {
+            res = s->version == 3 ? scan3_value(s, buf, len, &p) : scan0_value(s, buf, len, &p);
+            if(res == SCAN_OK) s->started = 1;
+        } else {
+            long parent = s->depth - 1;
+            SCAN_FRAME *f = &s->frames[parent];
+            if((f->kind == FRAME_AMF0_VALUES || f->kind == FRAME_AMF3_VALUES) && f->remaining == 0) {
+                s->depth--;
+                continue;
+            }
+
+            if((f->kind == FRAME_AMF0_PROPS || f->kind == FRAME_AMF3_ASSOC) && f->expect_key) {
+                res = scan_key(s, f, buf, len, &p);
+            } else {
+                char kind = f->kind;
+                res = kind == FRAME_AMF0_VALUES || kind == FRAME_AMF0_PROPS ? scan0_value(s, buf, len, &p) : scan3_value(s, buf, len, &p);
+                if(res == SCAN_OK) {
+                    // Pushing the value's own frame may have moved the stack
+                    f = &s->frames[parent];
+                    if(kind == FRAME_AMF0_VALUES || kind == FRAME_AMF3_VALUES) {
+                        f->remaining--;
+                    } else {
+                        f->expect_key = 1;
+                    }
+                }
+            }
+        }
+
+        if(res != SCAN_OK) {
+            // Nothing from a partial token is kept, so the next call retries it
+            s->str_count = str_count;
+            s->trait_count = trait_count;
+            return res;
+        }
+        s->pos = p;
+    }
+
+    return SCAN_DONE;
+}
@@ -0,0 +1,47 @@
+#include <ruby.h>
+
+/*
+ * A resumable scanner that walks AMF data without building any ruby objects,
+ * to find out where a complete value ends. It keeps a stack of the containers
+ * it is inside, so feeding it more bytes picks up where it left off rather
+ * than starting the value over. Offsets are relative to the start of the value
+ * so the buffer can be compacted between calls.
+ */
+
+#define SCAN_MORE   0 // Ran out of bytes, call again with more
+#define SCAN_DONE   1 // Value is complete and ends at scanner->pos
+#define SCAN_OPAQUE 2 // Value contains data only read_external can size
+
+typedef struct {
+    char kind;
+    char expect_key;
+    long remaining;
+} SCAN_FRAME;
+
+typedef struct {
+    long members;
+    char dynamic;
+    char externalizable;
+    char array_collection;
+} SCAN_TRAIT;
+
+typedef struct {
+    int version;
+    int started;
+    long pos;
+    long need;
+    SCAN_FRAME *frames;
+    long depth;
+    long frames_capa;
+    long *strings; // Offset and length pairs for the AMF3 string table
+    long str_count;
+    long str_capa;
+    SCAN_TRAIT *traits;
+    long trait_count;
+    long trait_capa;
+} AMF_SCANNER;
+
+AMF_SCANNER *scanner_new(int version);
+void scanner_reset(AMF_SCANNER *scanner);
+void scanner_free(AMF_SCANNER *scanner);
+int scanner_scan(AMF_SCANNER *scanner, const char *buf, long len);
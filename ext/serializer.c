@@ -1,6 +1,16 @@
 #include "serializer.h"
 #include "constants.h"
 #include "utility.h"
+#include "case_cache.h"
+#include "messages.h"
+#include "byte_array.h"
+#ifdef SORT_PROPS
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/util.h>
+#else
+#include <util.h>
+#endif
+#endif
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
@@ -9,64 +19,127 @@ extern VALUE cAMF3Serializer;
 extern VALUE cStringIO;
 extern VALUE cDate;
 extern VALUE cDateTime;
+extern VALUE cVector;
+extern VALUE cByteArray;
+extern VALUE cFragment;
+extern VALUE cClassMapping;
+extern VALUE cFastClassMapping;
+extern VALUE cTypedHash;
 extern VALUE sym_class_name;
 extern VALUE sym_members;
 extern VALUE sym_externalizable;
 extern VALUE sym_dynamic;
+extern VALUE sym_int;
+extern VALUE sym_uint;
+extern VALUE sym_double;
+extern ID id_iv_type;
+extern ID id_iv_fixed;
+extern ID id_iv_class_name;
 VALUE cArrayCollection;
 ID id_size;
-ID id_haskey;
 ID id_encode_amf;
 ID id_is_array_collection;
 ID id_use_array_collection;
 ID id_get_as_class_name;
 ID id_props_for_serialization;
-ID id_utc;
-ID id_to_f;
+ID id_jd;
+ID id_to_time;
 ID id_get_as_option;
-
+ID id_string;
+ID id_owner;
+ID id_write;
+ID id_call;
+ID id_serialization_schema;
+ID id_object_serializers;
+ID id_iv_version;
+ID id_iv_bytes;
+ID id_iv_relocations;
+ID id_iv_string_count;
+ID id_iv_trait_count;
+ID id_iv_object_count;
+VALUE sym_getters;
+static VALUE str_translate_case;
+
+// How values of a class are written, cached per class in ser->dispatch
+#define DISPATCH_BUILTIN    0 // Route on the ruby type
+#define DISPATCH_CUSTOM     1 // Has encode_amf
+#define DISPATCH_TIME       2
+#define DISPATCH_DATE       3
+#define DISPATCH_BYTE_ARRAY 4
+#define DISPATCH_VECTOR     5
+#define DISPATCH_FRAGMENT   6
+#define DISPATCH_MESSAGE    7 // Built-in Flex message, written natively in AMF3
+#define DISPATCH_HASH       8 // Plain or typed hash, written natively in AMF3
 
 /*
- * Helper function to convert snake_case to camelCase
- * Used by the translate_case option
+ * st_table iterator that marks a schema class and its contents
  */
-static VALUE camelcase_str(VALUE snake_str) {
-    char *str = RSTRING_PTR(snake_str);
-    char camel_str[strlen(str)];
-    int up = 0, len = 0;
-    char c;
+static int ser_mark_schema_iter(st_data_t klass, st_data_t val, st_data_t arg) {
+    AMF_SCHEMA *schema = (AMF_SCHEMA*)val;
+    rb_gc_mark((VALUE)klass);
+    if(schema) {
+        rb_gc_mark(schema->class_name);
+        rb_gc_mark(schema->members);
+    }
+    return ST_CONTINUE;
+}
 
-    while (c = *str++) {
-        if (c == *"_") {
-          up = 1;
-          continue;
-        } else if (up) {
-          up = 0;
-          camel_str[len++] = toupper(c);
-        } else {
-          camel_str[len++] = c;
-        }
+/*
+ * st_table iterator that frees a compiled schema
+ */
+static int ser_free_schema_iter(st_data_t klass, st_data_t val, st_data_t arg) {
+    AMF_SCHEMA *schema = (AMF_SCHEMA*)val;
+    if(schema) {
+        xfree(schema->getters);
+        xfree(schema);
     }
-    camel_str[len] = '\0';
+    return ST_CONTINUE;
+}
 
-    return rb_str_new(camel_str, len);
+/*
+ * Free all compiled schemas so they're rebuilt from the current mappings
+ */
+static void ser_clear_schemas(AMF_SERIALIZER *ser) {
+    if(!ser->schemas) return;
+    st_foreach(ser->schemas, ser_free_schema_iter, 0);
+    st_free_table(ser->schemas);
+    ser->schemas = NULL;
 }
 
 /*
- * Mark the stream
+ * Mark the stream, output, and everything the caches point at
  */
 static void ser_mark(AMF_SERIALIZER *ser) {
     if(!ser) return;
     rb_gc_mark(ser->stream);
+    rb_gc_mark(ser->output);
+    rb_gc_mark(ser->relocs);
+    rb_gc_mark(ser->class_mapper);
+    ref_table_mark(&ser->obj_cache);
+    ref_table_mark(&ser->str_ids);
+    ref_table_mark(&ser->dispatch);
+    ref_table_mark(&ser->hash_names);
+    rb_gc_mark(ser->hash_info);
+    if(ser->schemas) st_foreach(ser->schemas, ser_mark_schema_iter, 0);
 }
 
 /*
  * Free cache tables, stream and the struct itself
  */
 static void ser_free(AMF_SERIALIZER *ser) {
-    if(ser->str_cache) st_free_table(ser->str_cache);
-    if(ser->trait_cache) st_free_table(ser->trait_cache);
-    if(ser->obj_cache) st_free_table(ser->obj_cache);
+    str_table_free(&ser->str_cache);
+    ref_table_free(&ser->str_ids);
+    str_table_free(&ser->trait_cache);
+    ref_table_free(&ser->obj_cache);
+    ref_table_free(&ser->dispatch);
+    ref_table_free(&ser->hash_names);
+    ser_clear_schemas(ser);
+    long i;
+    for(i = 0; i < ser->member_sets_len; i++) {
+        str_table_free(ser->member_sets[i]);
+        xfree(ser->member_sets[i]);
+    }
+    if(ser->member_sets) xfree(ser->member_sets);
     xfree(ser);
 }
 
@@ -77,16 +150,226 @@ static VALUE ser_alloc(VALUE klass) {
     // Allocate struct
     AMF_SERIALIZER *ser = ALLOC(AMF_SERIALIZER);
     memset(ser, 0, sizeof(AMF_SERIALIZER));
+    str_table_init(&ser->str_cache);
+    ref_table_init(&ser->str_ids);
+    str_table_init(&ser->trait_cache);
+    ref_table_init(&ser->obj_cache);
+    ref_table_init(&ser->dispatch);
+    ref_table_init(&ser->hash_names);
+
+    // Wrap before creating the stream, so that it's marked if creating it
+    // triggers a GC
+    ser->stream = Qnil;
+    ser->output = Qnil;
+    ser->relocs = Qnil;
+    ser->class_mapper = Qnil;
+    ser->hash_info = Qnil;
+    VALUE self = Data_Wrap_Struct(klass, ser_mark, ser_free, ser);
+    ser->stream = rb_str_buf_new(INITIAL_STREAM_LENGTH);
+
+    return self;
+}
+
+/*
+ * Returns the class mapper the serializer was given, or the one currently set
+ * as RocketAMF::ClassMapper
+ */
+static VALUE ser_class_mapper(AMF_SERIALIZER *ser) {
+    if(ser->class_mapper != Qnil) return ser->class_mapper;
+    return rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
+}
+
+/*
+ * Forget which classes are written how, and what the class mapper said about
+ * hashes, so changes to either between top-level calls are picked up
+ */
+static void ser_clear_dispatch(AMF_SERIALIZER *ser) {
+    ref_table_clear(&ser->dispatch);
+    memset(ser->immediates, 0, sizeof(ser->immediates));
+    ref_table_clear(&ser->hash_names);
+    ser->hash_info = Qnil;
+}
+
+/*
+ * Returns the capacity a fresh stream should start with, based on the size
+ * hint and the running average of previous output sizes
+ */
+static long ser_stream_capacity(AMF_SERIALIZER *ser) {
+    long capa = ser->avg_size > ser->size_hint ? ser->avg_size : ser->size_hint;
+    return capa > INITIAL_STREAM_LENGTH ? capa : INITIAL_STREAM_LENGTH;
+}
+
+/*
+ * Fold the length of a finished stream into the running average
+ */
+static void ser_record_size(AMF_SERIALIZER *ser, long len) {
+    if(len == 0) return;
+    ser->avg_size = ser->avg_size == 0 ? len : (ser->avg_size * 7 + len) / 8;
+}
+
+/*
+ * Empty the AMF3 string and trait caches, releasing all interned keys at once
+ */
+static void ser3_clear_caches(AMF_SERIALIZER *ser) {
+    str_table_clear(&ser->str_cache);
+    ref_table_clear(&ser->str_ids);
+    ser->str_index = 0;
+    str_table_clear(&ser->trait_cache);
+    ser->trait_index = 0;
+}
+
+/*
+ * Free the reference caches if a serialization was interrupted and reset the
+ * depth so the serializer can be used again
+ */
+static void ser_reset_state(AMF_SERIALIZER *ser) {
+    ser3_clear_caches(ser);
+    ref_table_clear(&ser->obj_cache);
+    ser_clear_dispatch(ser);
+    ser->obj_index = 0;
+    ser->depth = 0;
+    ser->member_depth = 0;
+    ser->relocs = Qnil;
+}
+
+/*
+ * Returns an empty member set for an object with sealed members, reusing the
+ * one left at this nesting level by earlier objects. Sets are allocated
+ * separately, so the ones held by outer objects don't move when this grows.
+ */
+static STR_TABLE *ser3_push_member_set(AMF_SERIALIZER *ser) {
+    if(ser->member_depth == ser->member_sets_len) {
+        long i, capa = ser->member_sets_len == 0 ? 4 : ser->member_sets_len * 2;
+        REALLOC_N(ser->member_sets, STR_TABLE *, capa);
+        for(i = ser->member_sets_len; i < capa; i++) {
+            ser->member_sets[i] = ALLOC(STR_TABLE);
+            str_table_init(ser->member_sets[i]);
+        }
+        ser->member_sets_len = capa;
+    }
+    STR_TABLE *set = ser->member_sets[ser->member_depth++];
+    str_table_clear(set);
+    return set;
+}
+
+/*
+ * Adds a member name to the set, keyed by its bytes
+ */
+static void ser3_member_set_add(STR_TABLE *set, VALUE name) {
+    char *str;
+    long len;
+    VALUE src = ser_get_string(name, Qfalse, &str, &len);
+    str_table_add(set, str, len, str_table_hash(str, len), 0);
+    RB_GC_GUARD(src);
+}
+
+static int ser3_member_set_has(STR_TABLE *set, VALUE name) {
+    char *str;
+    long len, index;
+    VALUE src = ser_get_string(name, Qfalse, &str, &len);
+    int found = str_table_lookup(set, str, len, str_table_hash(str, len), &index);
+    RB_GC_GUARD(src);
+    return found;
+}
 
-    // Initialize stream
-    ser->stream = rb_str_buf_new(0);
+/*
+ * Hand the buffered bytes to the output IO or block, and empty the buffer
+ */
+static void ser_emit(AMF_SERIALIZER *ser) {
+    long len = RSTRING_LEN(ser->stream);
+    if(len == 0) return;
+    VALUE chunk = rb_str_new(RSTRING_PTR(ser->stream), len);
+    rb_str_set_len(ser->stream, 0);
+    ser->flushed += len;
+    if(rb_obj_is_proc(ser->output) == Qtrue) {
+        rb_funcall(ser->output, id_call, 1, chunk);
+    } else {
+        rb_funcall(ser->output, id_write, 1, chunk);
+    }
+}
+
+/*
+ * Copy bytes into the stream's buffer. Capacity is doubled when it runs out
+ * so appends are amortized O(1). Ruby code can also append to the stream
+ * (write_external), so the string length is always used as the write cursor.
+ */
+static void ser_buffer_bytes(AMF_SERIALIZER *ser, const char *str, long len) {
+#ifdef HAVE_RB_STR_MODIFY_EXPAND
+    VALUE stream = ser->stream;
+    long cur = RSTRING_LEN(stream);
+    long capa = (long)rb_str_capacity(stream);
+    if(cur + len > capa) {
+        long new_capa = capa < INITIAL_STREAM_LENGTH ? INITIAL_STREAM_LENGTH : capa;
+        while(new_capa < cur + len) new_capa <<= 1;
+        rb_str_modify_expand(stream, new_capa - cur);
+        STATS_INC(&ser->stats, reallocs);
+    } else {
+        rb_str_modify(stream);
+    }
+    memcpy(RSTRING_PTR(stream) + cur, str, len);
+    rb_str_set_len(stream, cur + len);
+#else
+    rb_str_buf_cat(ser->stream, str, len);
+#endif
+}
+
+/*
+ * Append bytes to the stream. When writing to an IO, full chunks are emitted
+ * as soon as they're available, so the buffer never holds more than a chunk.
+ */
+void ser_write_bytes(AMF_SERIALIZER *ser, const char *str, long len) {
+    if(ser->max_bytes && ser->flushed + RSTRING_LEN(ser->stream) + len > ser->max_bytes) {
+        rb_raise(rb_eRangeError, "serialized output exceeds %ld bytes", ser->max_bytes);
+    }
 
-    return Data_Wrap_Struct(klass, ser_mark, ser_free, ser);
+    if(ser->output != Qnil) {
+        // Ruby code appending to the stream can take it past a chunk, so send
+        // that out first and there's always room left in the loop
+        if(RSTRING_LEN(ser->stream) >= ser->chunk_size) ser_emit(ser);
+
+        long room;
+        while(len >= (room = ser->chunk_size - RSTRING_LEN(ser->stream))) {
+            ser_buffer_bytes(ser, str, room);
+            STATS_ADD(&ser->stats, bytes, room);
+            ser_emit(ser);
+            str += room;
+            len -= room;
+        }
+    }
+    ser_buffer_bytes(ser, str, len);
+    STATS_ADD(&ser->stats, bytes, len);
+}
+
+/*
+ * Configure the serializer to write to the given IO (or proc) in chunks, and
+ * apply the chunk_size and max_bytes options
+ */
+void ser_set_output(AMF_SERIALIZER *ser, VALUE io, VALUE opts) {
+    ser->output = io;
+    ser->chunk_size = DEFAULT_CHUNK_LENGTH;
+    if(opts != Qnil) {
+        Check_Type(opts, T_HASH);
+        VALUE chunk_size = rb_hash_aref(opts, ID2SYM(rb_intern("chunk_size")));
+        VALUE max_bytes = rb_hash_aref(opts, ID2SYM(rb_intern("max_bytes")));
+        if(chunk_size != Qnil) ser->chunk_size = NUM2LONG(chunk_size);
+        if(max_bytes != Qnil) ser->max_bytes = NUM2LONG(max_bytes);
+    }
+    if(ser->chunk_size <= 0) rb_raise(rb_eArgError, "chunk_size must be positive");
+}
+
+/*
+ * Finish a top-level serialization. When writing to an IO the remaining bytes
+ * are emitted and the total number of bytes written is returned, otherwise
+ * the stream is returned.
+ */
+VALUE ser_finish(AMF_SERIALIZER *ser) {
+    if(ser->output == Qnil || ser->depth != 0) return ser->stream;
+    ser_emit(ser);
+    return LONG2NUM(ser->flushed);
 }
 
 void ser_write_byte(AMF_SERIALIZER *ser, char byte) {
-    char bytes[2] = {byte, '\0'};
-    rb_str_buf_cat(ser->stream, bytes, 1);
+    ser_write_bytes(ser, &byte, 1);
 }
 
 void ser_write_int(AMF_SERIALIZER *ser, int num) {
@@ -116,19 +399,19 @@ void ser_write_int(AMF_SERIALIZER *ser, int num) {
         rb_raise(rb_eRangeError, "int %d out of range", num);
     }
 
-    rb_str_buf_cat(ser->stream, tmp, tmp_len);
+    ser_write_bytes(ser, tmp, tmp_len);
 }
 
 void ser_write_uint16(AMF_SERIALIZER *ser, long num) {
     if(num > 0xffff) rb_raise(rb_eRangeError, "int %ld out of range", num);
     char tmp[2] = {(num >> 8) & 0xff, num & 0xff};
-    rb_str_buf_cat(ser->stream, tmp, 2);
+    ser_write_bytes(ser, tmp, 2);
 }
 
 void ser_write_uint32(AMF_SERIALIZER *ser, long num) {
     if(num > 0xffffffff) rb_raise(rb_eRangeError, "int %ld out of range", num);
-	char tmp[4] = {(num >> 24) & 0xff, (num >> 16) & 0xff, (num >> 8) & 0xff, num & 0xff};
-	rb_str_buf_cat(ser->stream, tmp, 4);
+    char tmp[4] = {(num >> 24) & 0xff, (num >> 16) & 0xff, (num >> 8) & 0xff, num & 0xff};
+    ser_write_bytes(ser, tmp, 4);
 }
 
 void ser_write_double(AMF_SERIALIZER *ser, double num) {
@@ -140,14 +423,46 @@ void ser_write_double(AMF_SERIALIZER *ser, double num) {
 	d.dval = num;
 
 #ifdef WORDS_BIGENDIAN
-    rb_str_buf_cat(ser->stream, number, 8);
+    ser_write_bytes(ser, number, 8);
 #else
     char netnum[8] = {number[7],number[6],number[5],number[4],number[3],number[2],number[1],number[0]};
-    rb_str_buf_cat(ser->stream, netnum, 8);
+    ser_write_bytes(ser, netnum, 8);
 #endif
 }
 
-void ser_get_string(VALUE obj, VALUE encode, char** str, long* len) {
+/*
+ * Writes a reference header of the given kind
+ */
+static void ser_write_ref_bytes(AMF_SERIALIZER *ser, int kind, long index) {
+    if(kind == FRAGMENT_TRAIT_REF) {
+        ser_write_int(ser, index << 2 | 0x01);
+    } else if(kind == FRAGMENT_AMF0_OBJECT_REF) {
+        ser_write_uint16(ser, index);
+    } else {
+        ser_write_int(ser, index << 1);
+    }
+}
+
+/*
+ * Writes a reference header. While capturing a fragment the reference is
+ * recorded instead, so that it can be rebased when the fragment is embedded.
+ */
+static void ser_write_ref(AMF_SERIALIZER *ser, int kind, long index) {
+    if(NIL_P(ser->relocs)) {
+        ser_write_ref_bytes(ser, kind, index);
+    } else {
+        rb_ary_push(ser->relocs, LONG2NUM(RSTRING_LEN(ser->stream) - ser->reloc_start));
+        rb_ary_push(ser->relocs, INT2FIX(kind));
+        rb_ary_push(ser->relocs, LONG2NUM(index));
+    }
+}
+
+/*
+ * Extracts the bytes of a string, symbol or nil, transcoding strings to UTF-8
+ * if encode is Qtrue. Returns the object holding the bytes, which callers must
+ * keep alive while they use str.
+ */
+VALUE ser_get_string(VALUE obj, VALUE encode, char** str, long* len) {
     int type = TYPE(obj);
     if(type == T_STRING) {
 #ifdef HAVE_RB_STR_ENCODE
@@ -169,6 +484,76 @@ void ser_get_string(VALUE obj, VALUE encode, char** str, long* len) {
     } else {
         rb_raise(rb_eArgError, "Invalid type in ser_get_string: %d", type);
     }
+    return obj;
+}
+
+/*
+ * call-seq:
+ *   AMF3Serializer.new => ser
+ *   AMF3Serializer.new(:size_hint => 4096) => ser
+ *   AMF3Serializer.new(:class_mapper => mapper) => ser
+ *   AMF3Serializer.new(io, :chunk_size => 65536, :max_bytes => 1048576) => ser
+ *   AMF3Serializer.new(:chunk_size => 65536) {|chunk| block } => ser
+ *
+ * Create a new serializer. The size hint is the number of bytes reserved up
+ * front for the output stream, and for every stream started by take_stream.
+ *
+ * If given an IO (anything that responds to <tt>write</tt>) or a block, output
+ * is emitted in chunks of <tt>chunk_size</tt> bytes as it's generated, rather
+ * than collected in one string, and serialize returns the number of bytes
+ * written. <tt>max_bytes</tt> caps the total output, raising a RangeError as
+ * soon as it would be exceeded.
+ *
+ * Objects are mapped with <tt>:class_mapper</tt> if given, or with whatever
+ * RocketAMF::ClassMapper is when they're written. Serializers used from other
+ * ractors need one that's shareable, such as a FastClassMapping snapshot.
+ */
+static VALUE ser_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    VALUE io = Qnil, opts = Qnil, block = Qnil;
+    rb_scan_args(argc, argv, "02&", &io, &opts, &block);
+    if(TYPE(io) == T_HASH && opts == Qnil) {
+        opts = io;
+        io = Qnil;
+    }
+    if(io == Qnil) io = block;
+
+    if(opts != Qnil) {
+        Check_Type(opts, T_HASH);
+        VALUE hint = rb_hash_aref(opts, ID2SYM(rb_intern("size_hint")));
+        VALUE max_bytes = rb_hash_aref(opts, ID2SYM(rb_intern("max_bytes")));
+        if(hint != Qnil) ser->size_hint = NUM2LONG(hint);
+        if(max_bytes != Qnil) ser->max_bytes = NUM2LONG(max_bytes);
+        ser->class_mapper = rb_hash_aref(opts, ID2SYM(rb_intern("class_mapper")));
+    }
+    if(io != Qnil) ser_set_output(ser, io, opts);
+
+    if(ser->size_hint > INITIAL_STREAM_LENGTH) {
+        ser->stream = rb_str_buf_new(ser->size_hint);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.stats => hash
+ *   ser.stats => nil
+ *
+ * Returns this serializer's counts, in the same form as
+ * RocketAMF::Ext.stats, or nil if the extension was built without
+ * <tt>--enable-stats</tt>
+ */
+static VALUE ser_stats(VALUE self) {
+#ifdef COLLECT_STATS
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    return STATS_RESULT(&ser->stats, &ser->stats_total);
+#else
+    return Qnil;
+#endif
 }
 
 static VALUE ser_stream(VALUE self) {
@@ -177,6 +562,245 @@ static VALUE ser_stream(VALUE self) {
     return ser->stream;
 }
 
+/*
+ * call-seq:
+ *   ser.reset => ser
+ *
+ * Empties the stream and clears any serialization state, so that the serializer
+ * can be used for a new request. The stream's buffer is kept, unless it grew
+ * far beyond the usual output size.
+ */
+static VALUE ser_reset(VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    ser_reset_state(ser);
+    ser_clear_schemas(ser);
+    ser_record_size(ser, RSTRING_LEN(ser->stream));
+    ser->flushed = 0;
+
+    long capa = ser_stream_capacity(ser);
+    if(OBJ_FROZEN(ser->stream) || (long)rb_str_capacity(ser->stream) > capa * 4) {
+        ser->stream = rb_str_buf_new(capa);
+    } else {
+        rb_str_set_len(ser->stream, 0);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ser.take_stream => str
+ *
+ * Returns the serialized stream and replaces it with a new stream, presized
+ * from the size hint or the running average of previous output sizes.
+ */
+static VALUE ser_take_stream(VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    if(ser->depth != 0) rb_raise(rb_eRuntimeError, "cannot take the stream while serializing");
+
+    VALUE stream = ser->stream;
+    ser_record_size(ser, RSTRING_LEN(stream));
+    ser->stream = rb_str_buf_new(ser_stream_capacity(ser));
+
+    return stream;
+}
+
+/*
+ * Whether a built-in message can skip the class mapper: it has no custom
+ * encode_amf, and the class mapper has no custom serializers or schema for it
+ * and maps it to its default AS class without translate_case
+ */
+static int ser_message_native(AMF_SERIALIZER *ser, VALUE obj, MSG_CLASS *msg) {
+    VALUE class_mapper = ser_class_mapper(ser);
+
+    if(msg_encode_overridden(msg, obj)) return 0;
+    if(!msg_mapper_allows(class_mapper, id_object_serializers)) return 0;
+    if(rb_respond_to(class_mapper, id_serialization_schema) && rb_funcall(class_mapper, id_serialization_schema, 1, msg->klass) != Qnil) return 0;
+    VALUE class_name = rb_funcall(class_mapper, id_get_as_class_name, 1, obj);
+    if(TYPE(class_name) != T_STRING || !rb_str_equal(class_name, msg->class_name)) return 0;
+    return !RTEST(rb_funcall(class_mapper, id_get_as_option, 2, class_name, str_translate_case));
+}
+
+/*
+ * Whether the class mapper's method is the one RocketAMF::ClassMapping or the
+ * fast class mapper ships with
+ */
+static int ser_mapper_builtin(VALUE class_mapper, ID name) {
+    if(!rb_respond_to(class_mapper, name)) return 0;
+    VALUE owner = rb_funcall(rb_obj_method(class_mapper, ID2SYM(name)), id_owner, 0);
+    return owner == cClassMapping || owner == cFastClassMapping;
+}
+
+/*
+ * Whether plain and typed hashes can skip the class mapper's
+ * props_for_serialization: it, and get_as_class_name, are the built-in ones,
+ * and there are no custom object serializers. Those only ever hand back a
+ * hash's own pairs, with the keys as strings, and find the class name from
+ * the class or the type.
+ */
+static int ser_hash_native(AMF_SERIALIZER *ser) {
+    VALUE class_mapper = ser_class_mapper(ser);
+
+    if(!msg_mapper_allows(class_mapper, id_object_serializers)) return 0;
+    return ser_mapper_builtin(class_mapper, id_get_as_class_name) && ser_mapper_builtin(class_mapper, id_props_for_serialization);
+}
+
+/*
+ * Slot in ser->immediates for types whose values all share one class, or -1
+ */
+static int ser_immediate_slot(int type) {
+    switch(type) {
+        case T_FIXNUM: return 0;
+        case T_FLOAT: return 1;
+        case T_NIL: return 2;
+        case T_TRUE: return 3;
+        case T_FALSE: return 4;
+        case T_SYMBOL: return 5;
+        default: return -1;
+    }
+}
+
+/*
+ * Returns how values of obj's class should be written. The answer is cached by
+ * class for the rest of the top-level serialize call, or the current value of
+ * serialize_many, so the encode_amf check runs once per class instead of once
+ * per value. Numbers, nil, booleans and symbols are cached by type, which
+ * skips the table lookup for the commonest values while still honouring an
+ * encode_amf defined on their classes. The cache is dropped between top-level
+ * calls and serialize_many values, so methods defined in between are picked
+ * up, but ones defined while a value is being written are not.
+ */
+static long ser_dispatch_for(AMF_SERIALIZER *ser, VALUE obj, VALUE klass, int type) {
+    long kind;
+    int slot = ser_immediate_slot(type);
+    if(slot >= 0) {
+        if(ser->immediates[slot]) return ser->immediates[slot] - 1;
+    } else if(ref_table_lookup(&ser->dispatch, klass, &kind)) {
+        return kind;
+    }
+
+    MSG_CLASS *msg = type == T_OBJECT ? msg_class_for(klass) : NULL;
+    if(msg && ser_message_native(ser, obj, msg)) {
+        kind = DISPATCH_MESSAGE;
+    } else if(rb_respond_to(obj, id_encode_amf)) {
+        kind = DISPATCH_CUSTOM;
+    } else if(klass == cFragment) {
+        kind = DISPATCH_FRAGMENT;
+    } else if(klass == rb_cTime) {
+        kind = DISPATCH_TIME;
+    } else if(klass == cDate || klass == cDateTime) {
+        kind = DISPATCH_DATE;
+    } else if(klass == cStringIO || klass == cByteArray) {
+        kind = DISPATCH_BYTE_ARRAY;
+    } else if(type == T_ARRAY && RTEST(rb_class_inherited_p(klass, cVector))) {
+        kind = DISPATCH_VECTOR;
+    } else if((klass == rb_cHash || klass == cTypedHash) && ser_hash_native(ser)) {
+        kind = DISPATCH_HASH;
+    } else {
+        kind = DISPATCH_BUILTIN;
+    }
+    if(slot >= 0) {
+        ser->immediates[slot] = (char)(kind + 1);
+    } else {
+        ref_table_add(&ser->dispatch, klass, kind);
+    }
+    return kind;
+}
+
+/*
+ * Copies a RocketAMF::Fragment into the stream, rebasing its references onto
+ * the reference tables in use. An AMF3 fragment in an AMF0 stream goes after
+ * an AMF3 switch, which starts a fresh reference scope, so its references are
+ * written as they were captured.
+ */
+static void ser_write_fragment(AMF_SERIALIZER *ser, VALUE frag, int version) {
+    int frag_version = NUM2INT(rb_ivar_get(frag, id_iv_version));
+    VALUE bytes = rb_ivar_get(frag, id_iv_bytes);
+    VALUE relocs = rb_ivar_get(frag, id_iv_relocations);
+    Check_Type(bytes, T_STRING);
+    Check_Type(relocs, T_ARRAY);
+
+    int fresh_scope = 0;
+    if(version == 0 && frag_version == 3) {
+        ser0_write_marker(ser, AMF0_AMF3_MARKER);
+        fresh_scope = 1;
+    } else if(version != frag_version) {
+        rb_raise(rb_eArgError, "cannot embed an AMF%d fragment in an AMF%d stream", frag_version, version);
+    }
+
+    long base[4] = {ser->str_index, ser->trait_index, ser->obj_index, ser->obj_index};
+    long i, pos = 0, len = RARRAY_LEN(relocs);
+    if(len % 3 != 0) rb_raise(rb_eArgError, "malformed fragment relocations");
+    for(i = 0; i < len; i += 3) {
+        long offset = NUM2LONG(RARRAY_PTR(relocs)[i]);
+        int kind = NUM2INT(RARRAY_PTR(relocs)[i+1]);
+        long index = NUM2LONG(RARRAY_PTR(relocs)[i+2]);
+        if(offset < pos || offset > RSTRING_LEN(bytes) || kind < FRAGMENT_STRING_REF || kind > FRAGMENT_AMF0_OBJECT_REF) {
+            rb_raise(rb_eArgError, "malformed fragment relocations");
+        }
+
+        ser_write_bytes(ser, RSTRING_PTR(bytes) + pos, offset - pos);
+        if(fresh_scope) {
+            ser_write_ref_bytes(ser, kind, index);
+        } else {
+            ser_write_ref(ser, kind, index + base[kind]);
+        }
+        pos = offset;
+    }
+    ser_write_bytes(ser, RSTRING_PTR(bytes) + pos, RSTRING_LEN(bytes) - pos);
+    RB_GC_GUARD(bytes);
+
+    // Account for the entries the fragment added to the reference tables
+    if(!fresh_scope) {
+        ser->str_index += NUM2LONG(rb_ivar_get(frag, id_iv_string_count));
+        ser->trait_index += NUM2LONG(rb_ivar_get(frag, id_iv_trait_count));
+        ser->obj_index += NUM2LONG(rb_ivar_get(frag, id_iv_object_count));
+    }
+}
+
+/*
+ * call-seq:
+ *   ser.capture_fragment(obj) => [bytes, relocations, string_count, trait_count, object_count]
+ *
+ * Serializes obj in a fresh reference scope for RocketAMF::Fragment. Reference
+ * headers are left out of the bytes and returned in relocations as flat
+ * offset, kind, index triples.
+ */
+static VALUE ser_capture_fragment(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    if(ser->depth != 0) rb_raise(rb_eRuntimeError, "cannot capture a fragment while serializing");
+    if(ser->output != Qnil) rb_raise(rb_eRuntimeError, "cannot capture a fragment while writing to an IO");
+
+    ser_reset_state(ser);
+    ser->scope++;
+    ser->relocs = rb_ary_new();
+    ser->reloc_start = RSTRING_LEN(ser->stream);
+
+    // Hold the depth so the tables are still there when the counts are read
+    ser->depth++;
+    if(rb_obj_is_kind_of(self, cAMF3Serializer)) {
+        ser3_serialize(self, obj);
+    } else {
+        ser0_serialize(self, obj);
+    }
+    ser->depth--;
+
+    long len = RSTRING_LEN(ser->stream) - ser->reloc_start;
+    VALUE bytes = rb_str_new(RSTRING_PTR(ser->stream) + ser->reloc_start, len);
+    rb_str_set_len(ser->stream, ser->reloc_start);
+    VALUE ret = rb_ary_new3(5, bytes, ser->relocs, LONG2NUM(ser->str_index), LONG2NUM(ser->trait_index), LONG2NUM(ser->obj_index));
+    ser_reset_state(ser);
+    STATS_FINISH(&ser->stats, &ser->stats_total, STATS_SERIALIZE);
+
+    return ret;
+}
+
 /*
  * call-seq:
  *   ser.version => 0
@@ -188,6 +812,26 @@ static VALUE ser0_version(VALUE self) {
     return INT2FIX(0);
 }
 
+/*
+ * Adds an array, hash or object to the reference cache. The deserializer
+ * counts every complex value, so the index always advances, but AMF0
+ * references are only 16 bits wide and anything past that is never referenced.
+ */
+static void ser0_cache_obj(AMF_SERIALIZER *ser, VALUE obj) {
+    STATS_INC(&ser->stats, object_misses);
+    if(ser->obj_index <= 0xffff) ref_table_add(&ser->obj_cache, obj, ser->obj_index);
+    ser->obj_index++;
+}
+
+/*
+ * Only arrays, hashes and objects are written by reference in AMF0, so skip
+ * the identity lookup for everything else.
+ */
+static int ser0_is_ref_type(int type, VALUE klass) {
+    if(type == T_ARRAY || type == T_HASH || type == T_OBJECT) return 1;
+    return type == T_DATA && klass != rb_cTime && klass != cDate && klass != cDateTime;
+}
+
 /*
  * call-seq:
  *   ser.write_array(ary) => ser
@@ -199,17 +843,17 @@ static VALUE ser0_write_array(VALUE self, VALUE ary) {
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
     // Cache it
-    VALUE obj_id = rb_obj_id(ary);
-    st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-    ser->obj_index++;
+    ser0_cache_obj(ser, ary);
 
     // Write it out
     long i, len = RARRAY_LEN(ary);
-    ser_write_byte(ser, AMF0_STRICT_ARRAY_MARKER);
+    ser0_write_marker(ser, AMF0_STRICT_ARRAY_MARKER);
     ser_write_uint32(ser, len);
+    ser->depth++;
     for(i = 0; i < len; i++) {
         ser0_serialize(self, RARRAY_PTR(ary)[i]);
     }
+    ser->depth--;
 
     return self;
 }
@@ -223,17 +867,18 @@ static void ser0_write_string(AMF_SERIALIZER *ser, VALUE obj, VALUE write_marker
     // Extract char array and length from object
     char* str;
     long len;
-    ser_get_string(obj, Qtrue, &str, &len);
+    VALUE src = ser_get_string(obj, Qtrue, &str, &len);
 
     // Write string
     if(len > 0xffff) {
-        if(write_marker == Qtrue) ser_write_byte(ser, AMF0_LONG_STRING_MARKER);
+        if(write_marker == Qtrue) ser0_write_marker(ser, AMF0_LONG_STRING_MARKER);
         ser_write_uint32(ser, len);
     } else {
-        if(write_marker == Qtrue) ser_write_byte(ser, AMF0_STRING_MARKER);
+        if(write_marker == Qtrue) ser0_write_marker(ser, AMF0_STRING_MARKER);
         ser_write_uint16(ser, len);
     }
-    rb_str_buf_cat(ser->stream, str, len);
+    ser_write_bytes(ser, str, len);
+    RB_GC_GUARD(src);
 }
 
 /*
@@ -245,7 +890,7 @@ static int ser0_hash_iter(VALUE key, VALUE val, ITER_ARGS *args) {
     Data_Get_Struct(args->ser, AMF_SERIALIZER, ser);
 
     // Translate snake_case to camelCase
-    if (args->translate_case == Qtrue) key = camelcase_str(key);
+    if (args->translate_case == Qtrue) key = case_camelize(key);
 
     // Write key and value
     ser0_write_string(ser, key, Qfalse); // Technically incorrect if key length is longer than a 16 bit string, but if you run into that you're screwed anyways
@@ -261,38 +906,36 @@ static int ser0_hash_iter(VALUE key, VALUE val, ITER_ARGS *args) {
  * not pass typically on Ruby 1.8.
  */
 static VALUE ser0_write_object0(VALUE self, VALUE obj, VALUE props) {
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    VALUE class_mapper = ser_class_mapper(ser);
 
     // Cache it
-    VALUE obj_id = rb_obj_id(obj);
-    st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-    ser->obj_index++;
+    ser0_cache_obj(ser, obj);
 
     // Make a request for props hash unless we already have it
     if(props == Qnil) {
-        props = rb_funcall(class_mapper, id_props_for_serialization, 1, obj);
+        STATS_CALL(&ser->stats, STATS_PROPS_FOR_SERIALIZATION, props = rb_funcall(class_mapper, id_props_for_serialization, 1, obj));
     }
 
     // Write header
     VALUE class_name = rb_funcall(class_mapper, id_get_as_class_name, 1, obj);
     if(class_name != Qnil) {
-        ser_write_byte(ser, AMF0_TYPED_OBJECT_MARKER);
+        ser0_write_marker(ser, AMF0_TYPED_OBJECT_MARKER);
         ser0_write_string(ser, class_name, Qfalse);
     } else if(TYPE(obj) == T_HASH) {
         VALUE size = rb_funcall(obj, id_size, 0);
-        ser_write_byte(ser, AMF0_HASH_MARKER);
+        ser0_write_marker(ser, AMF0_HASH_MARKER);
         ser_write_uint32(ser, FIX2LONG(size));
     } else {
-        ser_write_byte(ser, AMF0_OBJECT_MARKER);
+        ser0_write_marker(ser, AMF0_OBJECT_MARKER);
     }
 
     // Write out data
     ITER_ARGS args;
     args.ser = self;
-    args.translate_case = rb_funcall(class_mapper, id_get_as_option, 2, class_name, rb_str_new2("translate_case"));
+    args.translate_case = rb_funcall(class_mapper, id_get_as_option, 2, class_name, str_translate_case);
+    ser->depth++;
 #ifdef SORT_PROPS
     // Sort is required prior to Ruby 1.9 to pass all the tests, as Ruby 1.8 hashes don't store insert order
     VALUE sorted_props = rb_funcall(props, rb_intern("sort"), 0);
@@ -304,6 +947,7 @@ static VALUE ser0_write_object0(VALUE self, VALUE obj, VALUE props) {
 #else
     rb_hash_foreach(props, ser0_hash_iter, (st_data_t)&args);
 #endif
+    ser->depth--;
 
     ser_write_uint16(ser, 0);
     ser_write_byte(ser, AMF0_OBJECT_END_MARKER);
@@ -329,37 +973,53 @@ static VALUE ser0_write_object(int argc, VALUE *argv, VALUE self) {
     return ser0_write_object0(self, obj, props);
 }
 
-static VALUE ser0_write_time(VALUE self, VALUE time) {
+/*
+ * Returns whole milliseconds since the epoch for a Time, read straight from
+ * the Time's internal value
+ */
+static double ser_time_millis(VALUE time) {
+#ifdef HAVE_RB_TIME_TIMESPEC
+    struct timespec ts = rb_time_timespec(time);
+    return (double)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    struct timeval tv = rb_time_timeval(time);
+    return (double)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/*
+ * Returns milliseconds since the epoch for a Date or DateTime. Dates are
+ * midnight UTC on their julian day, which needs no temporary objects. DateTimes
+ * carry an offset and fraction, so they go through the Time path.
+ */
+static double ser_date_millis(VALUE date) {
+    if(CLASS_OF(date) == cDate) {
+        return (double)(NUM2LONG(rb_funcall(date, id_jd, 0)) - UNIX_EPOCH_JD) * 86400000;
+    }
+    return ser_time_millis(rb_funcall(date, id_to_time, 0));
+}
+
+static void ser0_write_time(VALUE self, VALUE time) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
-    ser_write_byte(ser, AMF0_DATE_MARKER);
-
-    // Write time
-    time = rb_obj_dup(time);
-    rb_funcall(time, id_utc, 0);
-    long tmp_num = NUM2DBL(rb_funcall(time, id_to_f, 0)) * 1000;
-    ser_write_double(ser, (double)tmp_num);
+    ser0_write_marker(ser, AMF0_DATE_MARKER);
+    ser_write_double(ser, ser_time_millis(time));
     ser_write_uint16(ser, 0); // Time zone
 }
 
-static VALUE ser0_write_date(VALUE self, VALUE date) {
+static void ser0_write_date(VALUE self, VALUE date) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
-    ser_write_byte(ser, AMF0_DATE_MARKER);
-
-    // Write time
-    double tmp_num = rb_str_to_dbl(rb_funcall(date, rb_intern("strftime"), 1, rb_str_new2("%Q")), Qfalse);
-    ser_write_double(ser, tmp_num);
+    ser0_write_marker(ser, AMF0_DATE_MARKER);
+    ser_write_double(ser, ser_date_millis(date));
     ser_write_uint16(ser, 0); // Time zone
 }
 
 /*
- * call-seq:
- *   ser.serialize(obj) =>str
- *
- * Serializes the object to a string and returns that string
+ * Internal serialize call. Writes the object to the stream and returns the
+ * stream.
  */
 VALUE ser0_serialize(VALUE self, VALUE obj) {
     AMF_SERIALIZER *ser;
@@ -367,56 +1027,61 @@ VALUE ser0_serialize(VALUE self, VALUE obj) {
 
     if(ser->depth == 0) {
         // Initialize caches
-        ser->obj_cache = st_init_numtable();
+        ref_table_clear(&ser->obj_cache);
+        ser_clear_dispatch(ser);
         ser->obj_index = 0;
     }
     ser->depth++;
+    STATS_ENTER(&ser->stats);
 
     int type = TYPE(obj);
-    VALUE klass = Qnil;
-    if(type == T_OBJECT || type == T_DATA) {
-        klass = CLASS_OF(obj);
-    }
-
-    VALUE obj_id = rb_obj_id(obj);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_byte(ser, AMF0_REFERENCE_MARKER);
-        ser_write_uint16(ser, FIX2LONG(obj_index));
-    } else if(rb_respond_to(obj, id_encode_amf)) {
-        rb_funcall(obj, id_encode_amf, 1, self);
+    VALUE klass = CLASS_OF(obj);
+    long dispatch = ser_dispatch_for(ser, obj, klass, type);
+
+    long obj_index;
+    if(ser0_is_ref_type(type, klass) && ref_table_lookup(&ser->obj_cache, obj, &obj_index)) {
+        STATS_INC(&ser->stats, object_hits);
+        ser0_write_marker(ser, AMF0_REFERENCE_MARKER);
+        ser_write_ref(ser, FRAGMENT_AMF0_OBJECT_REF, obj_index);
+    } else if(dispatch == DISPATCH_CUSTOM || (dispatch == DISPATCH_MESSAGE && rb_respond_to(obj, id_encode_amf))) {
+        // Messages are only native in AMF3, so ErrorMessage still writes itself here
+        STATS_CALL(&ser->stats, STATS_ENCODE_AMF, rb_funcall(obj, id_encode_amf, 1, self));
+    } else if(dispatch == DISPATCH_FRAGMENT) {
+        ser_write_fragment(ser, obj, 0);
     } else if(type == T_STRING || type == T_SYMBOL) {
         ser0_write_string(ser, obj, Qtrue);
     } else if(type == T_FIXNUM) {
-        ser_write_byte(ser, AMF0_NUMBER_MARKER);
+        ser0_write_marker(ser, AMF0_NUMBER_MARKER);
         ser_write_double(ser, (double)FIX2LONG(obj));
     } else if(type == T_FLOAT) {
-        ser_write_byte(ser, AMF0_NUMBER_MARKER);
+        ser0_write_marker(ser, AMF0_NUMBER_MARKER);
         ser_write_double(ser, RFLOAT_VALUE(obj));
     } else if(type == T_NIL) {
-        ser_write_byte(ser, AMF0_NULL_MARKER);
+        ser0_write_marker(ser, AMF0_NULL_MARKER);
     } else if(type == T_TRUE || type == T_FALSE) {
-        ser_write_byte(ser, AMF0_BOOLEAN_MARKER);
+        ser0_write_marker(ser, AMF0_BOOLEAN_MARKER);
         ser_write_byte(ser, type == T_TRUE ? 1 : 0);
     } else if(type == T_ARRAY) {
         ser0_write_array(self, obj);
-    } else if(klass == rb_cTime) {
+    } else if(dispatch == DISPATCH_TIME) {
         ser0_write_time(self, obj);
-    } else if(klass == cDate || klass == cDateTime) {
+    } else if(dispatch == DISPATCH_DATE) {
         ser0_write_date(self, obj);
     } else if(type == T_BIGNUM) {
-        ser_write_byte(ser, AMF0_NUMBER_MARKER);
+        ser0_write_marker(ser, AMF0_NUMBER_MARKER);
         ser_write_double(ser, rb_big2dbl(obj));
     } else if(type == T_HASH || type == T_OBJECT) {
         ser0_write_object0(self, obj, Qnil);
     }
 
+    STATS_LEAVE(&ser->stats);
     ser->depth--;
 
     if(ser->depth == 0) {
         // Clean up
-        xfree(ser->obj_cache);
-        ser->obj_cache = NULL;
+        ref_table_clear(&ser->obj_cache);
+        ser_clear_dispatch(ser);
+        ser->obj_index = 0;
     }
     return ser->stream;
 }
@@ -437,23 +1102,71 @@ static VALUE ser3_version(VALUE self) {
  * all the necessary encoding and caching.
  */
 static void ser3_write_utf8vr(AMF_SERIALIZER *ser, VALUE obj) {
+    // Frozen strings and symbols can't change, so check for them by identity
+    // before hashing their contents
+    long str_index;
+    int by_id = SYMBOL_P(obj) || (TYPE(obj) == T_STRING && OBJ_FROZEN(obj));
+    if(by_id && ref_table_lookup(&ser->str_ids, obj, &str_index)) {
+        STATS_INC(&ser->stats, string_hits);
+        ser_write_ref(ser, FRAGMENT_STRING_REF, str_index);
+        return;
+    }
+
     // Extract char array and length from object
     char* str;
     long len;
-    ser_get_string(obj, Qtrue, &str, &len);
+    VALUE src = ser_get_string(obj, Qtrue, &str, &len);
 
     // Write string
-    VALUE str_index;
+    unsigned long hash;
     if(len == 0) {
         ser_write_byte(ser, AMF3_EMPTY_STRING);
-    } else if(st_lookup(ser->str_cache, (st_data_t)str, &str_index)) {
-        ser_write_int(ser, FIX2INT(str_index) << 1);
+    } else if(str_table_lookup(&ser->str_cache, str, len, hash = str_table_hash(str, len), &str_index)) {
+        if(by_id) ref_table_add(&ser->str_ids, obj, str_index);
+        STATS_INC(&ser->stats, string_hits);
+        ser_write_ref(ser, FRAGMENT_STRING_REF, str_index);
     } else {
-        st_add_direct(ser->str_cache, (st_data_t)strdup(str), LONG2FIX(ser->str_index));
+        STATS_INC(&ser->stats, string_misses);
+        str_table_add(&ser->str_cache, str, len, hash, ser->str_index);
+        if(by_id) ref_table_add(&ser->str_ids, obj, ser->str_index);
         ser->str_index++;
 
         ser_write_int(ser, ((int)len) << 1 | 1);
-        rb_str_buf_cat(ser->stream, str, len);
+        ser_write_bytes(ser, str, len);
+    }
+    RB_GC_GUARD(src);
+}
+
+/*
+ * Writes a reference if obj was already written in this serialization, and
+ * returns 1. Otherwise gives it the next object index and returns 0.
+ */
+static int ser3_write_obj_ref(AMF_SERIALIZER *ser, VALUE obj) {
+    long obj_index;
+    if(ref_table_lookup(&ser->obj_cache, obj, &obj_index)) {
+        STATS_INC(&ser->stats, object_hits);
+        ser_write_ref(ser, FRAGMENT_OBJECT_REF, obj_index);
+        return 1;
+    }
+    STATS_INC(&ser->stats, object_misses);
+    ref_table_add(&ser->obj_cache, obj, ser->obj_index);
+    ser->obj_index++;
+    return 0;
+}
+
+/*
+ * Writes a fixnum as an AMF3 integer, falling back to a double when it doesn't
+ * fit in 29 bits
+ */
+static void ser3_write_fixnum(AMF_SERIALIZER *ser, long num) {
+    if(num < MIN_INTEGER || num > MAX_INTEGER) {
+        // Outside range so convert to double and serialize as float
+        ser3_write_marker(ser, AMF3_DOUBLE_MARKER);
+        ser_write_double(ser, (double)num);
+    } else {
+        // Inside valid integer range
+        ser3_write_marker(ser, AMF3_INTEGER_MARKER);
+        ser_write_int(ser, (int)num);
     }
 }
 
@@ -464,10 +1177,9 @@ static void ser3_write_utf8vr(AMF_SERIALIZER *ser, VALUE obj) {
  * Writes the given array using AMF3 notation
  */
 static VALUE ser3_write_array(VALUE self, VALUE ary) {
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    VALUE class_mapper = ser_class_mapper(ser);
 
     // Is it an array collection?
     VALUE is_ac = Qfalse;
@@ -478,33 +1190,29 @@ static VALUE ser3_write_array(VALUE self, VALUE ary) {
     }
 
     // Write type marker
-    ser_write_byte(ser, is_ac ? AMF3_OBJECT_MARKER : AMF3_ARRAY_MARKER);
+    ser3_write_marker(ser, is_ac ? AMF3_OBJECT_MARKER : AMF3_ARRAY_MARKER);
 
     // Write object ref, or cache it
-    VALUE obj_id = rb_obj_id(ary);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return self;
-    } else {
-        st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-        if(is_ac) ser->obj_index++; // The array collection source array
-    }
+    if(ser3_write_obj_ref(ser, ary)) return self;
+    if(is_ac) ser->obj_index++; // The array collection source array
 
     // Write out traits and array marker if it's an array collection
     if(is_ac) {
-        VALUE trait_index;
-        char array_collection_name[34] = "flex.messaging.io.ArrayCollection";
-        if(st_lookup(ser->trait_cache, (st_data_t)array_collection_name, &trait_index)) {
-            ser_write_int(ser, FIX2INT(trait_index) << 2 | 0x01);
+        long trait_index;
+        static const char array_collection_name[] = "flex.messaging.io.ArrayCollection";
+        long name_len = sizeof(array_collection_name) - 1;
+        unsigned long hash = str_table_hash(array_collection_name, name_len);
+        if(str_table_lookup(&ser->trait_cache, array_collection_name, name_len, hash, &trait_index)) {
+            STATS_INC(&ser->stats, trait_hits);
+            ser_write_ref(ser, FRAGMENT_TRAIT_REF, trait_index);
         } else {
-            st_add_direct(ser->trait_cache, (st_data_t)strdup(array_collection_name), LONG2FIX(ser->trait_index));
+            STATS_INC(&ser->stats, trait_misses);
+            str_table_add(&ser->trait_cache, array_collection_name, name_len, hash, ser->trait_index);
             ser->trait_index++;
             ser_write_byte(ser, 0x07); // Trait header
             ser3_write_utf8vr(ser, rb_str_new2(array_collection_name));
         }
-        ser_write_byte(ser, AMF3_ARRAY_MARKER);
+        ser3_write_marker(ser, AMF3_ARRAY_MARKER);
     }
 
     // Write header
@@ -512,27 +1220,138 @@ static VALUE ser3_write_array(VALUE self, VALUE ary) {
     ser_write_int(ser, header);
     ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_ARRAY);
 
-    // Write contents
-    long i, len = RARRAY_LEN(ary);
-    for(i = 0; i < len; i++) {
-        ser3_serialize(self, RARRAY_PTR(ary)[i]);
+    // Write contents. Numbers are written inline, skipping the type dispatch
+    // of ser3_serialize, unless someone has given Integer or Float a custom
+    // encode_amf.
+    int inline_fixnum = ser_dispatch_for(ser, INT2FIX(0), CLASS_OF(INT2FIX(0)), T_FIXNUM) == DISPATCH_BUILTIN;
+    int inline_float = ser_dispatch_for(ser, rb_float_new(0.0), rb_cFloat, T_FLOAT) == DISPATCH_BUILTIN;
+    long i;
+    ser->depth++;
+    for(i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE elem = RARRAY_PTR(ary)[i];
+        if(inline_fixnum && FIXNUM_P(elem)) {
+            ser3_write_fixnum(ser, FIX2LONG(elem));
+        } else if(inline_float && TYPE(elem) == T_FLOAT) {
+            ser3_write_marker(ser, AMF3_DOUBLE_MARKER);
+            ser_write_double(ser, RFLOAT_VALUE(elem));
+        } else {
+            ser3_serialize(self, elem);
+        }
     }
+    ser->depth--;
 
     return self;
 }
 
 /*
- * AMF3 property hash write iterator. Checks the args->extra hash, if given,
- * and skips properties that are keys in that hash.
+ * Stores num in dst in network byte order
+ */
+static void ser_store_uint32(char *dst, unsigned long num) {
+    dst[0] = (num >> 24) & 0xff;
+    dst[1] = (num >> 16) & 0xff;
+    dst[2] = (num >> 8) & 0xff;
+    dst[3] = num & 0xff;
+}
+
+/*
+ * Writes a RocketAMF::Values::Vector. Numeric elements are converted and byte
+ * swapped into a local buffer and written out VECTOR_CHUNK_ELEMENTS at a time,
+ * rather than one call per element.
+ */
+static void ser3_write_vector(VALUE self, VALUE vec) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    VALUE type = rb_ivar_get(vec, id_iv_type);
+    char marker = AMF3_VECTOR_OBJECT_MARKER;
+    long width = 0;
+    if(type == sym_int) {
+        marker = AMF3_VECTOR_INT_MARKER;
+        width = 4;
+    } else if(type == sym_uint) {
+        marker = AMF3_VECTOR_UINT_MARKER;
+        width = 4;
+    } else if(type == sym_double) {
+        marker = AMF3_VECTOR_DOUBLE_MARKER;
+        width = 8;
+    }
+    ser3_write_marker(ser, marker);
+
+    // Write object ref, or cache it
+    if(ser3_write_obj_ref(ser, vec)) return;
+
+    long i, len = RARRAY_LEN(vec);
+    ser_write_int(ser, ((int)len) << 1 | 1);
+    ser_write_byte(ser, RTEST(rb_ivar_get(vec, id_iv_fixed)) ? 1 : 0);
+
+    if(width == 0) {
+        VALUE class_name = rb_ivar_get(vec, id_iv_class_name);
+        ser3_write_utf8vr(ser, NIL_P(class_name) ? rb_str_new2("") : class_name);
+        ser->depth++;
+        for(i = 0; i < RARRAY_LEN(vec); i++) {
+            ser3_serialize(self, RARRAY_PTR(vec)[i]);
+        }
+        ser->depth--;
+        return;
+    }
+
+    char buf[VECTOR_CHUNK_ELEMENTS * 8];
+    char *pos = buf;
+    for(i = 0; i < len; i++) {
+        // Conversion can run ruby code, so re-check the length
+        if(i >= RARRAY_LEN(vec)) rb_raise(rb_eRuntimeError, "vector modified during serialization");
+        VALUE elem = RARRAY_PTR(vec)[i];
+        if(width == 8) {
+            union aligned {
+                double dval;
+                char cval[8];
+            } d;
+            d.dval = NUM2DBL(elem);
+#ifdef WORDS_BIGENDIAN
+            memcpy(pos, d.cval, 8);
+#else
+            int j;
+            for(j = 0; j < 8; j++) pos[j] = d.cval[7 - j];
+#endif
+        } else {
+            LONG_LONG num = NUM2LL(elem);
+            if(marker == AMF3_VECTOR_INT_MARKER ? (num < -2147483648LL || num > 2147483647LL) : (num < 0 || num > 4294967295LL)) {
+                rb_raise(rb_eRangeError, "%lld out of range for %s vector", num, marker == AMF3_VECTOR_INT_MARKER ? "int" : "uint");
+            }
+            ser_store_uint32(pos, (unsigned long)(num & 0xffffffff));
+        }
+        pos += width;
+        if(pos - buf == VECTOR_CHUNK_ELEMENTS * width) {
+            ser_write_bytes(ser, buf, pos - buf);
+            pos = buf;
+        }
+    }
+    if(pos != buf) ser_write_bytes(ser, buf, pos - buf);
+}
+
+/*
+ * Returns a property name as a string or symbol, the way
+ * props_for_serialization stringifies hash keys
+ */
+static VALUE ser_prop_key(VALUE key) {
+    if(SYMBOL_P(key) || TYPE(key) == T_STRING) return key;
+    return rb_obj_as_string(key);
+}
+
+/*
+ * AMF3 property hash write iterator. Skips properties in the args->skip
+ * member set, if given.
  */
-static int ser3_hash_iter(VALUE key, VALUE val, ITER_ARGS *args) {
+static int ser3_hash_iter(VALUE key, VALUE val, VALUE data) {
+    ITER_ARGS *args = (ITER_ARGS *)data;
     AMF_SERIALIZER *ser;
     Data_Get_Struct(args->ser, AMF_SERIALIZER, ser);
 
-    if(args->extra == Qnil || rb_funcall(args->extra, id_haskey, 1, key) == Qfalse) {
+    key = ser_prop_key(key);
+    if(!args->skip || !ser3_member_set_has(args->skip, key)) {
         // Translate snake_case to camelCase
         if (args->translate_case == Qtrue) {
-            key = camelcase_str(key);
+            key = case_camelize(key);
         }
 
         // Write key and value
@@ -542,6 +1361,127 @@ static int ser3_hash_iter(VALUE key, VALUE val, ITER_ARGS *args) {
     return ST_CONTINUE;
 }
 
+/*
+ * Handles trait caching for dynamic traits. Writes a reference and returns 1 if
+ * traits with the class name were already written, or takes the next trait
+ * index for them and returns 0. The deserializer counts every inline trait, so
+ * anonymous traits take up an index even though they can't be referenced.
+ */
+static int ser3_write_trait_ref(AMF_SERIALIZER *ser, VALUE class_name) {
+    if(class_name == Qnil) {
+        ser->trait_index++;
+        return 0;
+    }
+
+    int did_ref = 0;
+    long trait_index;
+    char* name;
+    long name_len;
+    VALUE name_src = ser_get_string(class_name, Qfalse, &name, &name_len);
+    unsigned long hash = str_table_hash(name, name_len);
+    if(str_table_lookup(&ser->trait_cache, name, name_len, hash, &trait_index)) {
+        ser_write_ref(ser, FRAGMENT_TRAIT_REF, trait_index);
+        did_ref = 1;
+    } else {
+        str_table_add(&ser->trait_cache, name, name_len, hash, ser->trait_index);
+        ser->trait_index++;
+    }
+    RB_GC_GUARD(name_src);
+    return did_ref;
+}
+
+#ifdef SORT_PROPS
+static int ser_collect_props_iter(VALUE key, VALUE val, VALUE pairs) {
+    rb_ary_push(pairs, ser_prop_key(key));
+    rb_ary_push(pairs, val);
+    return ST_CONTINUE;
+}
+
+/*
+ * Orders key and value pairs by key bytes, the same as sorting the
+ * stringified pairs in ruby
+ */
+static int ser_prop_cmp(const void *a, const void *b, void *arg) {
+    char *a_str, *b_str;
+    long a_len, b_len;
+    ser_get_string(*(VALUE *)a, Qfalse, &a_str, &a_len);
+    ser_get_string(*(VALUE *)b, Qfalse, &b_str, &b_len);
+    int cmp = memcmp(a_str, b_str, a_len < b_len ? a_len : b_len);
+    if(cmp != 0) return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/*
+ * Writes the dynamic properties in props sorted by key. Sort is required prior
+ * to Ruby 1.9 to pass all the tests, as Ruby 1.8 hashes don't store insert
+ * order.
+ */
+static void ser3_write_sorted_props(VALUE props, ITER_ARGS *args) {
+    VALUE pairs = rb_ary_new();
+    rb_hash_foreach(props, ser_collect_props_iter, pairs);
+    long i, len = RARRAY_LEN(pairs) / 2;
+    ruby_qsort(RARRAY_PTR(pairs), len, sizeof(VALUE) * 2, ser_prop_cmp, 0);
+    for(i = 0; i < len; i++) {
+        ser3_hash_iter(RARRAY_PTR(pairs)[i*2], RARRAY_PTR(pairs)[i*2+1], (VALUE)args);
+    }
+    RB_GC_GUARD(pairs);
+}
+#endif
+
+/*
+ * Finds the AS class name and translate_case option for a plain or typed hash.
+ * The class mapper is asked once per class, or once per type string for typed
+ * hashes, in each top-level call.
+ */
+static VALUE ser_hash_mapping(AMF_SERIALIZER *ser, VALUE obj, VALUE klass, int *translate_case) {
+    VALUE key = klass == cTypedHash ? rb_attr_get(obj, id_iv_type) : klass;
+    long index;
+    if(!ref_table_lookup(&ser->hash_names, key, &index)) {
+        VALUE class_mapper = ser_class_mapper(ser);
+        VALUE class_name = rb_funcall(class_mapper, id_get_as_class_name, 1, obj);
+        VALUE translate = rb_funcall(class_mapper, id_get_as_option, 2, class_name, str_translate_case);
+        if(ser->hash_info == Qnil) ser->hash_info = rb_ary_new();
+        index = RARRAY_LEN(ser->hash_info);
+        rb_ary_push(ser->hash_info, class_name);
+        rb_ary_push(ser->hash_info, translate == Qtrue ? Qtrue : Qfalse);
+        ref_table_add(&ser->hash_names, key, index);
+    }
+    *translate_case = RARRAY_PTR(ser->hash_info)[index+1] == Qtrue;
+    return RARRAY_PTR(ser->hash_info)[index];
+}
+
+/*
+ * Writes a plain or typed hash as a dynamic object straight from its pairs,
+ * which is what props_for_serialization would have handed back
+ */
+static void ser3_write_hash(VALUE self, AMF_SERIALIZER *ser, VALUE obj, VALUE klass) {
+    ser3_write_marker(ser, AMF3_OBJECT_MARKER);
+
+    // Write object ref, or cache it
+    if(ser3_write_obj_ref(ser, obj)) return;
+
+    int translate_case;
+    VALUE class_name = ser_hash_mapping(ser, obj, klass, &translate_case);
+    if(ser3_write_trait_ref(ser, class_name)) {
+        STATS_INC(&ser->stats, trait_hits);
+    } else {
+        STATS_INC(&ser->stats, trait_misses);
+        ser_write_int(ser, 0x0B); // Dynamic, with no sealed members
+        ser3_write_utf8vr(ser, class_name);
+    }
+
+    ITER_ARGS args;
+    args.ser = self;
+    args.skip = NULL;
+    args.translate_case = translate_case ? Qtrue : Qfalse;
+#ifdef SORT_PROPS
+    ser3_write_sorted_props(obj, &args);
+#else
+    rb_hash_foreach(obj, ser3_hash_iter, (VALUE)&args);
+#endif
+    ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_OBJECT);
+}
+
 /*
  * Used for both hashes and objects. Takes the object and the props hash or Qnil,
  * which forces a call to the class mapper for props for serialization. Prop
@@ -551,25 +1491,16 @@ static int ser3_hash_iter(VALUE key, VALUE val, ITER_ARGS *args) {
  * defined members.
  */
 static VALUE ser3_write_object0(VALUE self, VALUE obj, VALUE props, VALUE traits) {
-    static VALUE class_mapper = 0;
-    if(class_mapper == 0) class_mapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    VALUE class_mapper = ser_class_mapper(ser);
     long i;
 
     // Write type marker
-    ser_write_byte(ser, AMF3_OBJECT_MARKER);
+    ser3_write_marker(ser, AMF3_OBJECT_MARKER);
 
     // Write object ref, or cache it
-    VALUE obj_id = rb_obj_id(obj);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return self;
-    } else {
-        st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-    }
+    if(ser3_write_obj_ref(ser, obj)) return self;
 
     // Extract traits data, or use defaults
     VALUE class_name = Qnil;
@@ -587,21 +1518,11 @@ static VALUE ser3_write_object0(VALUE self, VALUE obj, VALUE props, VALUE traits
         externalizable = rb_hash_aref(traits, sym_externalizable);
     }
 
-    // Handle trait caching
-    int did_ref = 0;
-    VALUE trait_index;
-    if(class_name != Qnil) {
-        if(st_lookup(ser->trait_cache, (st_data_t)RSTRING_PTR(class_name), &trait_index)) {
-            ser_write_int(ser, FIX2INT(trait_index) << 2 | 0x01);
-            did_ref = 1;
-        } else {
-            st_add_direct(ser->trait_cache, (st_data_t)strdup(RSTRING_PTR(class_name)), LONG2FIX(ser->trait_index));
-            ser->trait_index++;
-        }
-    }
-
     // Write traits outs if didn't write reference
-    if(!did_ref) {
+    if(ser3_write_trait_ref(ser, class_name)) {
+        STATS_INC(&ser->stats, trait_hits);
+    } else {
+        STATS_INC(&ser->stats, trait_misses);
         // Write out trait header
         int header = 0x03;
         if(dynamic == Qtrue) header |= 0x02 << 2;
@@ -620,47 +1541,154 @@ static VALUE ser3_write_object0(VALUE self, VALUE obj, VALUE props, VALUE traits
 
     // Raise exception if marked externalizable
     if(externalizable == Qtrue) {
-        rb_funcall(obj, rb_intern("write_external"), 1, self);
+        STATS_CALL(&ser->stats, STATS_WRITE_EXTERNAL, rb_funcall(obj, rb_intern("write_external"), 1, self));
         return self;
     }
 
     // Make a request for props hash unless we already have it
     if(props == Qnil) {
-        props = rb_funcall(class_mapper, id_props_for_serialization, 1, obj);
+        STATS_CALL(&ser->stats, STATS_PROPS_FOR_SERIALIZATION, props = rb_funcall(class_mapper, id_props_for_serialization, 1, obj));
     }
 
-    // Write sealed members
-    VALUE skipped_members = members_len ? rb_hash_new() : Qnil;
-    VALUE mem = Qnil;
+    // Write sealed members, keeping their names to skip in the dynamic ones
+    STR_TABLE *skip = NULL;
+    if(members_len && dynamic == Qtrue) skip = ser3_push_member_set(ser);
     for(i = 0; i < members_len; i++) {
+        if(skip) ser3_member_set_add(skip, RARRAY_PTR(members)[i]);
         ser3_serialize(self, rb_hash_aref(props, RARRAY_PTR(members)[i]));
-        rb_hash_aset(skipped_members, RARRAY_PTR(members)[i], Qtrue);
     }
 
     // Write dynamic properties
     if(dynamic == Qtrue) {
         ITER_ARGS args;
         args.ser = self;
-        args.extra = skipped_members;
+        args.skip = skip;
         // Get translate case option for the destination AS class
-        args.translate_case = rb_funcall(class_mapper, id_get_as_option, 2, class_name, rb_str_new2("translate_case"));
+        args.translate_case = rb_funcall(class_mapper, id_get_as_option, 2, class_name, str_translate_case);
 #ifdef SORT_PROPS
-        // Sort is required prior to Ruby 1.9 to pass all the tests, as Ruby 1.8 hashes don't store insert order
-        VALUE sorted_props = rb_funcall(props, rb_intern("sort"), 0);
-        for(i = 0; i < RARRAY_LEN(sorted_props); i++) {
-            VALUE pair = RARRAY_PTR(sorted_props)[i];
-            ser3_hash_iter(RARRAY_PTR(pair)[0], RARRAY_PTR(pair)[1], &args);
-        }
+        ser3_write_sorted_props(props, &args);
 #else
-        rb_hash_foreach(props, ser3_hash_iter, (st_data_t)&args);
+        rb_hash_foreach(props, ser3_hash_iter, (VALUE)&args);
 #endif
 
         ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_OBJECT);
+        if(skip) ser->member_depth--;
     }
 
     return self;
 }
 
+/*
+ * Compile a schema from the traits hash returned by the class mapper
+ */
+static AMF_SCHEMA* ser3_compile_schema(VALUE traits) {
+    VALUE members = rb_hash_aref(traits, sym_members);
+    VALUE getters = rb_hash_aref(traits, sym_getters);
+    Check_Type(members, T_ARRAY);
+    Check_Type(getters, T_ARRAY);
+    long i, len = RARRAY_LEN(members);
+    if(RARRAY_LEN(getters) != len) rb_raise(rb_eArgError, "schema getters don't match members");
+
+    AMF_SCHEMA *schema = ALLOC(AMF_SCHEMA);
+    schema->class_name = rb_hash_aref(traits, sym_class_name);
+    schema->members = rb_ary_dup(members);
+    schema->members_len = len;
+    schema->getters = ALLOC_N(ID, len > 0 ? len : 1);
+    for(i = 0; i < len; i++) {
+        schema->getters[i] = rb_to_id(RARRAY_PTR(getters)[i]);
+    }
+    schema->header = 0x03 | ((int)len) << 4; // Inline sealed traits
+    schema->scope = -1;
+    schema->trait_index = 0;
+    return schema;
+}
+
+/*
+ * Returns the compiled schema for the given class, asking the class mapper for
+ * it the first time the class is seen. Classes without a schema are cached as
+ * NULL.
+ */
+static AMF_SCHEMA* ser3_schema_for(AMF_SERIALIZER *ser, VALUE klass) {
+    VALUE class_mapper = ser_class_mapper(ser);
+
+    st_data_t schema;
+    if(!ser->schemas) ser->schemas = st_init_numtable();
+    if(st_lookup(ser->schemas, (st_data_t)klass, &schema)) return (AMF_SCHEMA*)schema;
+
+    schema = 0;
+    if(rb_respond_to(class_mapper, id_serialization_schema)) {
+        VALUE traits = rb_funcall(class_mapper, id_serialization_schema, 1, klass);
+        if(traits != Qnil) schema = (st_data_t)ser3_compile_schema(traits);
+    }
+    st_add_direct(ser->schemas, (st_data_t)klass, schema);
+    return (AMF_SCHEMA*)schema;
+}
+
+/*
+ * Writes an object with sealed traits from a compiled schema, reading each
+ * member straight from its getter
+ */
+static void ser3_write_sealed(VALUE self, AMF_SERIALIZER *ser, VALUE obj, AMF_SCHEMA *schema) {
+    long i;
+
+    // Write type marker
+    ser3_write_marker(ser, AMF3_OBJECT_MARKER);
+
+    // Write object ref, or cache it
+    if(ser3_write_obj_ref(ser, obj)) return;
+
+    // Write trait reference if already written in this serialization
+    if(schema->class_name != Qnil && schema->scope == ser->scope) {
+        STATS_INC(&ser->stats, trait_hits);
+        ser_write_ref(ser, FRAGMENT_TRAIT_REF, schema->trait_index);
+    } else {
+        STATS_INC(&ser->stats, trait_misses);
+        schema->scope = ser->scope;
+        schema->trait_index = ser->trait_index++;
+        ser_write_int(ser, schema->header);
+        ser3_write_utf8vr(ser, schema->class_name);
+        for(i = 0; i < schema->members_len; i++) {
+            ser3_write_utf8vr(ser, RARRAY_PTR(schema->members)[i]);
+        }
+    }
+
+    // Write sealed members
+    for(i = 0; i < schema->members_len; i++) {
+        ser3_serialize(self, rb_funcall(obj, schema->getters[i], 0));
+    }
+}
+
+/*
+ * Writes a built-in message the way write_object would with the default class
+ * mapper, as a dynamic object with its properties in sorted order, but reading
+ * each straight from its getter
+ */
+static void ser3_write_message(VALUE self, AMF_SERIALIZER *ser, VALUE obj, MSG_CLASS *msg) {
+    long i;
+
+    // Write type marker
+    ser3_write_marker(ser, AMF3_OBJECT_MARKER);
+
+    // Write object ref, or cache it
+    if(ser3_write_obj_ref(ser, obj)) return;
+
+    // Write trait reference, or dynamic traits with no sealed members
+    if(ser3_write_trait_ref(ser, msg->class_name)) {
+        STATS_INC(&ser->stats, trait_hits);
+    } else {
+        STATS_INC(&ser->stats, trait_misses);
+        ser_write_int(ser, 0x03 | 0x02 << 2);
+        ser3_write_utf8vr(ser, msg->class_name);
+    }
+
+    // Write properties as dynamic properties
+    for(i = 0; i < msg->keys_len; i++) {
+        ser3_write_utf8vr(ser, RARRAY_PTR(msg->keys)[i]);
+        ser3_serialize(self, rb_funcall(obj, msg->getters[i], 0));
+    }
+    ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_OBJECT);
+}
+
 /*
  * call-seq:
  *   ser.write_object(obj, props=nil, traits=nil) => ser
@@ -681,75 +1709,47 @@ static VALUE ser3_write_object(int argc, VALUE *argv, VALUE self) {
     return ser3_write_object0(self, obj, props, traits);
 }
 
-static VALUE ser3_write_time(VALUE self, VALUE time) {
+static void ser3_write_time(VALUE self, VALUE time) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
-    ser_write_byte(ser, AMF3_DATE_MARKER);
+    ser3_write_marker(ser, AMF3_DATE_MARKER);
 
     // Write object ref, or cache it
-    VALUE obj_id = rb_obj_id(time);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return;
-    } else {
-        st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-    }
+    if(ser3_write_obj_ref(ser, time)) return;
 
     // Write time
     ser_write_byte(ser, AMF3_NULL_MARKER); // Ref header
-    time = rb_obj_dup(time);
-    rb_funcall(time, id_utc, 0);
-    long tmp_num = NUM2DBL(rb_funcall(time, id_to_f, 0)) * 1000;
-    ser_write_double(ser, (double)tmp_num);
+    ser_write_double(ser, ser_time_millis(time));
 }
 
-static VALUE ser3_write_date(VALUE self, VALUE date) {
+static void ser3_write_date(VALUE self, VALUE date) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
-    ser_write_byte(ser, AMF3_DATE_MARKER);
+    ser3_write_marker(ser, AMF3_DATE_MARKER);
 
     // Write object ref, or cache it
-    VALUE obj_id = rb_obj_id(date);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return;
-    } else {
-        st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-    }
+    if(ser3_write_obj_ref(ser, date)) return;
 
     // Write time
     ser_write_byte(ser, AMF3_NULL_MARKER); // Ref header
-    double tmp_num = rb_str_to_dbl(rb_funcall(date, rb_intern("strftime"), 1, rb_str_new2("%Q")), Qfalse);
-    ser_write_double(ser, tmp_num);
+    ser_write_double(ser, ser_date_millis(date));
 }
 
 static VALUE ser3_write_byte_array(VALUE self, VALUE ba) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
-    ser_write_byte(ser, AMF3_BYTE_ARRAY_MARKER);
+    ser3_write_marker(ser, AMF3_BYTE_ARRAY_MARKER);
 
     // Write object ref, or cache it
-    VALUE obj_id = rb_obj_id(ba);
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj_id, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return;
-    } else {
-        st_add_direct(ser->obj_cache, obj_id, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-    }
+    if(ser3_write_obj_ref(ser, ba)) return;
 
-    // Write byte array
-    VALUE str = rb_funcall(ba, rb_intern("string"), 0);
+    // Write byte array, straight from the struct unless it's a StringIO
+    VALUE str = CLASS_OF(ba) == cByteArray ? byte_array_get(ba)->str : rb_funcall(ba, id_string, 0);
     ser_write_int(ser, RSTRING_LEN(str) << 1 | 1);
-    rb_str_buf_cat(ser->stream, RSTRING_PTR(str), RSTRING_LEN(str));
+    ser_write_bytes(ser, RSTRING_PTR(str), RSTRING_LEN(str));
 }
 
 VALUE ser3_serialize(VALUE self, VALUE obj) {
@@ -758,84 +1758,213 @@ VALUE ser3_serialize(VALUE self, VALUE obj) {
 
     if(ser->depth == 0) {
         // Initialize caches
-        ser->str_cache = st_init_strtable();
-        ser->str_index = 0;
-        ser->trait_cache = st_init_strtable();
-        ser->trait_index = 0;
-        ser->obj_cache = st_init_numtable();
+        ser3_clear_caches(ser);
+        ref_table_clear(&ser->obj_cache);
+        ser_clear_dispatch(ser);
+        ser->scope++;
         ser->obj_index = 0;
     }
     ser->depth++;
+    STATS_ENTER(&ser->stats);
 
     int type = TYPE(obj);
-    VALUE klass = Qnil;
-    if(type == T_OBJECT || type == T_DATA || type == T_ARRAY) {
-        klass = CLASS_OF(obj);
-    }
+    VALUE klass = CLASS_OF(obj);
+    long dispatch = ser_dispatch_for(ser, obj, klass, type);
 
-    if(rb_respond_to(obj, id_encode_amf)) {
-        rb_funcall(obj, id_encode_amf, 1, self);
+    if(dispatch == DISPATCH_CUSTOM) {
+        STATS_CALL(&ser->stats, STATS_ENCODE_AMF, rb_funcall(obj, id_encode_amf, 1, self));
+    } else if(dispatch == DISPATCH_FRAGMENT) {
+        ser_write_fragment(ser, obj, 3);
     } else if(type == T_STRING || type == T_SYMBOL) {
-        ser_write_byte(ser, AMF3_STRING_MARKER);
+        ser3_write_marker(ser, AMF3_STRING_MARKER);
         ser3_write_utf8vr(ser, obj);
     } else if(type == T_FIXNUM) {
-        long tmp_num = FIX2LONG(obj);
-        if(tmp_num < MIN_INTEGER || tmp_num > MAX_INTEGER) {
-            // Outside range so convert to double and serialize as float
-            ser_write_byte(ser, AMF3_DOUBLE_MARKER);
-            ser_write_double(ser, (double)tmp_num);
-        } else {
-            // Inside valid integer range
-            ser_write_byte(ser, AMF3_INTEGER_MARKER);
-            ser_write_int(ser, (int)tmp_num);
-        }
+        ser3_write_fixnum(ser, FIX2LONG(obj));
     } else if(type == T_FLOAT) {
-        ser_write_byte(ser, AMF3_DOUBLE_MARKER);
+        ser3_write_marker(ser, AMF3_DOUBLE_MARKER);
         ser_write_double(ser, RFLOAT_VALUE(obj));
     } else if(type == T_NIL) {
-        ser_write_byte(ser, AMF3_NULL_MARKER);
+        ser3_write_marker(ser, AMF3_NULL_MARKER);
     } else if(type == T_TRUE) {
-        ser_write_byte(ser, AMF3_TRUE_MARKER);
+        ser3_write_marker(ser, AMF3_TRUE_MARKER);
     } else if(type == T_FALSE) {
-        ser_write_byte(ser, AMF3_FALSE_MARKER);
+        ser3_write_marker(ser, AMF3_FALSE_MARKER);
+    } else if(dispatch == DISPATCH_MESSAGE) {
+        ser3_write_message(self, ser, obj, msg_class_for(klass));
+    } else if(dispatch == DISPATCH_VECTOR) {
+        ser3_write_vector(self, obj);
     } else if(type == T_ARRAY) {
         ser3_write_array(self, obj);
+    } else if(dispatch == DISPATCH_HASH) {
+        ser3_write_hash(self, ser, obj, klass);
     } else if(type == T_HASH) {
         ser3_write_object0(self, obj, Qnil, Qnil);
-    } else if(klass == rb_cTime) {
+    } else if(dispatch == DISPATCH_TIME) {
         ser3_write_time(self, obj);
-    } else if(klass == cDate || klass == cDateTime) {
+    } else if(dispatch == DISPATCH_DATE) {
         ser3_write_date(self, obj);
-    } else if(klass == cStringIO) {
+    } else if(dispatch == DISPATCH_BYTE_ARRAY) {
         ser3_write_byte_array(self, obj);
     } else if(type == T_BIGNUM) {
-        ser_write_byte(ser, AMF3_DOUBLE_MARKER);
+        ser3_write_marker(ser, AMF3_DOUBLE_MARKER);
         ser_write_double(ser, rb_big2dbl(obj));
     } else if(type == T_OBJECT) {
-        ser3_write_object0(self, obj, Qnil, Qnil);
+        AMF_SCHEMA *schema = ser3_schema_for(ser, klass);
+        if(schema) {
+            ser3_write_sealed(self, ser, obj, schema);
+        } else {
+            ser3_write_object0(self, obj, Qnil, Qnil);
+        }
     }
 
+    STATS_LEAVE(&ser->stats);
     ser->depth--;
 
     if(ser->depth == 0) {
         // Clean up
-        xfree(ser->str_cache);
-        ser->str_cache = NULL;
-        xfree(ser->trait_cache);
-        ser->trait_cache = NULL;
-        xfree(ser->obj_cache);
-        ser->obj_cache = NULL;
+        ser3_clear_caches(ser);
+        ref_table_clear(&ser->obj_cache);
+        ser_clear_dispatch(ser);
+        ser->obj_index = 0;
     }
     return ser->stream;
 }
 
+/*
+ * call-seq:
+ *   ser.serialize(obj) => str
+ *   ser.serialize(obj) => bytes_written
+ *
+ * Serializes the object and returns the stream, or the number of bytes written
+ * if the serializer is writing to an IO
+ */
+static VALUE ser0_serialize_rb(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    ser0_serialize(self, obj);
+    VALUE ret = ser_finish(ser);
+    if(ser->depth == 0) STATS_FINISH(&ser->stats, &ser->stats_total, STATS_SERIALIZE);
+    return ret;
+}
+
+/*
+ * call-seq:
+ *   ser.serialize(obj) => str
+ *   ser.serialize(obj) => bytes_written
+ *
+ * Serializes the object and returns the stream, or the number of bytes written
+ * if the serializer is writing to an IO
+ */
+static VALUE ser3_serialize_rb(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    ser3_serialize(self, obj);
+    VALUE ret = ser_finish(ser);
+    if(ser->depth == 0) STATS_FINISH(&ser->stats, &ser->stats_total, STATS_SERIALIZE);
+    return ret;
+}
+
+typedef struct {
+    VALUE self;
+    AMF_SERIALIZER *ser;
+    VALUE values;
+    long reset_every;
+    long count;
+} SER_MANY_ARGS;
+
+/*
+ * Writes one value of a batch. Only the object table starts over, so strings
+ * and traits already written are sent by reference, unless the batch has
+ * reached a reset point.
+ */
+static VALUE ser3_serialize_many_i(RB_BLOCK_CALL_FUNC_ARGLIST(obj, data)) {
+    SER_MANY_ARGS *args = (SER_MANY_ARGS *)data;
+    AMF_SERIALIZER *ser = args->ser;
+    if(args->reset_every > 0 && args->count > 0 && args->count % args->reset_every == 0) {
+        ser3_clear_caches(ser);
+        ser->scope++;
+    }
+    ref_table_clear(&ser->obj_cache);
+    ser_clear_dispatch(ser);
+    ser->obj_index = 0;
+    ser3_serialize(args->self, obj);
+    args->count++;
+    return Qnil;
+}
+
+static VALUE ser3_serialize_many_each(VALUE data) {
+    SER_MANY_ARGS *args = (SER_MANY_ARGS *)data;
+    return rb_block_call(args->values, rb_intern("each"), 0, 0, ser3_serialize_many_i, data);
+}
+
+static VALUE ser3_serialize_many_done(VALUE data) {
+    ser_reset_state(((SER_MANY_ARGS *)data)->ser);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   ser.serialize_many(enum) => str
+ *   ser.serialize_many(enum, :reset_every => 100) => bytes_written
+ *
+ * Serializes every value from the enumerable back to back, keeping the string
+ * and trait tables from one value to the next so that repeated keys, class
+ * names and strings are only written once for the whole batch. Each value
+ * still gets its own object table. The result can only be read by a
+ * deserializer that shares the tables the same way, such as
+ * AMF3Deserializer#each_value.
+ *
+ * Options:
+ * [:reset_every] Start the string and trait tables over every this many
+ *                values, to bound how much a reader has to keep. The reader
+ *                must be given the same value.
+ */
+static VALUE ser3_serialize_many(int argc, VALUE *argv, VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    VALUE values, opts;
+    rb_scan_args(argc, argv, "11", &values, &opts);
+    if(ser->depth != 0) rb_raise(rb_eRuntimeError, "cannot serialize_many while serializing");
+
+    SER_MANY_ARGS args;
+    args.self = self;
+    args.ser = ser;
+    args.values = values;
+    args.reset_every = 0;
+    args.count = 0;
+    if(opts != Qnil) {
+        Check_Type(opts, T_HASH);
+        VALUE every = rb_hash_aref(opts, ID2SYM(rb_intern("reset_every")));
+        if(every != Qnil) {
+            args.reset_every = NUM2LONG(every);
+            if(args.reset_every < 0) rb_raise(rb_eArgError, "reset_every can't be negative");
+        }
+    }
+
+    // Hold the depth so the tables survive from one value to the next
+    ser_reset_state(ser);
+    ser->scope++;
+    ser->depth++;
+    rb_ensure(ser3_serialize_many_each, (VALUE)&args, ser3_serialize_many_done, (VALUE)&args);
+
+    VALUE ret = ser_finish(ser);
+    STATS_FINISH(&ser->stats, &ser->stats_total, STATS_SERIALIZE);
+    return ret;
+}
+
 void Init_rocket_amf_serializer() {
     // Define Serializer
     cSerializer = rb_define_class_under(mRocketAMFExt, "Serializer", rb_cObject);
     rb_define_alloc_func(cSerializer, ser_alloc);
+    rb_define_method(cSerializer, "initialize", ser_initialize, -1);
     rb_define_method(cSerializer, "version", ser0_version, 0);
     rb_define_method(cSerializer, "stream", ser_stream, 0);
-    rb_define_method(cSerializer, "serialize", ser0_serialize, 1);
+    rb_define_method(cSerializer, "stats", ser_stats, 0);
+    rb_define_method(cSerializer, "reset", ser_reset, 0);
+    rb_define_method(cSerializer, "take_stream", ser_take_stream, 0);
+    rb_define_method(cSerializer, "serialize", ser0_serialize_rb, 1);
+    rb_define_method(cSerializer, "capture_fragment", ser_capture_fragment, 1);
     rb_define_method(cSerializer, "write_array", ser0_write_array, 1);
     rb_define_method(cSerializer, "write_hash", ser0_write_object, -1);
     rb_define_method(cSerializer, "write_object", ser0_write_object, -1);
@@ -843,21 +1972,41 @@ void Init_rocket_amf_serializer() {
     // Define AMF3Serializer
     cAMF3Serializer = rb_define_class_under(mRocketAMFExt, "AMF3Serializer", rb_cObject);
     rb_define_alloc_func(cAMF3Serializer, ser_alloc);
+    rb_define_method(cAMF3Serializer, "initialize", ser_initialize, -1);
     rb_define_method(cAMF3Serializer, "version", ser3_version, 0);
     rb_define_method(cAMF3Serializer, "stream", ser_stream, 0);
-    rb_define_method(cAMF3Serializer, "serialize", ser3_serialize, 1);
+    rb_define_method(cAMF3Serializer, "stats", ser_stats, 0);
+    rb_define_method(cAMF3Serializer, "reset", ser_reset, 0);
+    rb_define_method(cAMF3Serializer, "take_stream", ser_take_stream, 0);
+    rb_define_method(cAMF3Serializer, "serialize", ser3_serialize_rb, 1);
+    rb_define_method(cAMF3Serializer, "serialize_many", ser3_serialize_many, -1);
+    rb_define_method(cAMF3Serializer, "capture_fragment", ser_capture_fragment, 1);
     rb_define_method(cAMF3Serializer, "write_array", ser3_write_array, 1);
     rb_define_method(cAMF3Serializer, "write_object", ser3_write_object, -1);
 
     // Get refs to commonly used symbols and ids
     id_size = rb_intern("size");
-    id_haskey = rb_intern("has_key?");
     id_encode_amf = rb_intern("encode_amf");
     id_is_array_collection = rb_intern("is_array_collection?");
     id_use_array_collection = rb_intern("use_array_collection");
     id_get_as_class_name = rb_intern("get_as_class_name");
     id_props_for_serialization = rb_intern("props_for_serialization");
-    id_utc = rb_intern("utc");
-    id_to_f = rb_intern("to_f");
+    id_jd = rb_intern("jd");
+    id_to_time = rb_intern("to_time");
     id_get_as_option = rb_intern("get_as_option");
+    id_string = rb_intern("string");
+    id_owner = rb_intern("owner");
+    id_serialization_schema = rb_intern("serialization_schema");
+    id_object_serializers = rb_intern("object_serializers");
+    id_iv_version = rb_intern("@version");
+    id_iv_bytes = rb_intern("@bytes");
+    id_iv_relocations = rb_intern("@relocations");
+    id_iv_string_count = rb_intern("@string_count");
+    id_iv_trait_count = rb_intern("@trait_count");
+    id_iv_object_count = rb_intern("@object_count");
+    sym_getters = ID2SYM(rb_intern("getters"));
+    str_translate_case = rb_obj_freeze(rb_str_new2("translate_case"));
+    rb_global_variable(&str_translate_case);
+    id_write = rb_intern("write");
+    id_call = rb_intern("call");
 }
@@ -5,30 +5,77 @@
 #else
 #include <st.h>
 #endif
+#include "ref_table.h"
+#include "str_table.h"
+#include "stats.h"
+
+/*
+ * Compiled sealed traits for a class, built once from the class mapper's
+ * serialization_schema
+ */
+typedef struct {
+    VALUE class_name;
+    VALUE members;
+    ID* getters;
+    long members_len;
+    int header;
+    long scope;
+    long trait_index;
+} AMF_SCHEMA;
 
 typedef struct {
     VALUE stream;
+    long size_hint;
+    long avg_size;
+    VALUE output;
+    long chunk_size;
+    long max_bytes;
+    long flushed;
     long depth;
-    st_table* str_cache;
+    STR_TABLE str_cache;
+    REF_TABLE str_ids;
     long str_index;
-    st_table* trait_cache;
+    STR_TABLE trait_cache;
     long trait_index;
-    st_table* obj_cache;
+    REF_TABLE obj_cache;
     long obj_index;
+    st_table* schemas;
+    long scope;
+    REF_TABLE dispatch;
+    char immediates[6]; // Dispatch kind plus one for Fixnum, Float, nil, true, false and Symbol, or 0 if not known yet
+    REF_TABLE hash_names; // Plain Hash class or TypedHash type => index into hash_info
+    VALUE hash_info; // AS class name and translate_case pairs for hash_names, or nil
+    VALUE relocs;
+    long reloc_start;
+    VALUE class_mapper; // From the :class_mapper option, or nil to use RocketAMF::ClassMapper
+    STR_TABLE **member_sets; // Sealed members of the objects being written, one per nesting level
+    long member_sets_len;
+    long member_depth;
+#ifdef COLLECT_STATS
+    AMF_STATS stats;
+    AMF_STATS stats_total;
+#endif
 } AMF_SERIALIZER;
 
 typedef struct {
     VALUE ser;
-    VALUE extra;
+    STR_TABLE *skip; // Sealed members already written, or NULL
     VALUE translate_case;
 } ITER_ARGS;
 
+// Writes a value's type marker, counting it when stats are compiled in
+#define ser0_write_marker(ser, marker) do { STATS_VALUE(&(ser)->stats, 0, marker); ser_write_byte(ser, marker); } while(0)
+#define ser3_write_marker(ser, marker) do { STATS_VALUE(&(ser)->stats, 3, marker); ser_write_byte(ser, marker); } while(0)
+
+void ser_set_output(AMF_SERIALIZER *ser, VALUE io, VALUE opts);
+VALUE ser_finish(AMF_SERIALIZER *ser);
+void ser_write_bytes(AMF_SERIALIZER *ser, const char *str, long len);
 void ser_write_byte(AMF_SERIALIZER *ser, char byte);
 void ser_write_int(AMF_SERIALIZER *ser, int num);
 void ser_write_uint16(AMF_SERIALIZER *ser, long num);
 void ser_write_uint32(AMF_SERIALIZER *ser, long num);
 void ser_write_double(AMF_SERIALIZER *ser, double num);
-void ser_get_string(VALUE obj, VALUE encode, char** str, long* len);
+VALUE ser_get_string(VALUE obj, VALUE encode, char** str, long* len);
 
 VALUE ser0_serialize(VALUE self, VALUE obj);
 VALUE ser3_serialize(VALUE self, VALUE obj);
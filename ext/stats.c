@@ -0,0 +1,256 @@
+#include "stats.h"
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+#include <ruby/ractor.h>
+#endif
+
+extern VALUE mRocketAMFExt;
+
+#ifdef COLLECT_STATS
+int stats_enabled = 1;
+static AMF_STATS global_stats[2];
+static VALUE stats_hook = Qnil;
+static VALUE sym_serialize;
+static VALUE sym_deserialize;
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+static rb_ractor_local_key_t stats_home_key; // Set only in the ractor that loaded the extension
+#endif
+
+static const char *callback_names[STATS_CALLBACKS] = {
+    "get_ruby_obj", "populate_ruby_obj", "props_for_serialization", "encode_amf", "read_external", "write_external"
+};
+
+/*
+ * Monotonic seconds, for timing class mapper callbacks
+ */
+double stats_now() {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+/*
+ * Adds the counts in src to dst. The max depth is kept as a maximum.
+ */
+static void stats_add(AMF_STATS *dst, const AMF_STATS *src) {
+    long i, j;
+    dst->bytes += src->bytes;
+    for(i = 0; i < 2; i++) {
+        for(j = 0; j < STATS_MARKERS; j++) dst->values[i][j] += src->values[i][j];
+    }
+    dst->string_hits += src->string_hits;
+    dst->string_misses += src->string_misses;
+    dst->trait_hits += src->trait_hits;
+    dst->trait_misses += src->trait_misses;
+    dst->object_hits += src->object_hits;
+    dst->object_misses += src->object_misses;
+    if(src->max_depth > dst->max_depth) dst->max_depth = src->max_depth;
+    dst->reallocs += src->reallocs;
+    for(i = 0; i < STATS_CALLBACKS; i++) {
+        dst->callbacks[i] += src->callbacks[i];
+        dst->callback_time[i] += src->callback_time[i];
+    }
+}
+
+static VALUE stats_markers_hash(const long *values) {
+    VALUE hash = rb_hash_new();
+    long i;
+    for(i = 0; i < STATS_MARKERS; i++) {
+        if(values[i]) rb_hash_aset(hash, INT2FIX(i), LONG2NUM(values[i]));
+    }
+    return hash;
+}
+
+static void stats_set(VALUE hash, const char *name, VALUE val) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(name)), val);
+}
+
+/*
+ * Builds a hash of the combined counts. See RocketAMF::Ext.stats for the keys.
+ */
+VALUE stats_hash(const AMF_STATS *pending, const AMF_STATS *total) {
+    AMF_STATS sum;
+    memset(&sum, 0, sizeof(AMF_STATS));
+    if(pending) stats_add(&sum, pending);
+    if(total) stats_add(&sum, total);
+
+    VALUE hash = rb_hash_new();
+    stats_set(hash, "bytes", LONG2NUM(sum.bytes));
+    stats_set(hash, "amf0_values", stats_markers_hash(sum.values[0]));
+    stats_set(hash, "amf3_values", stats_markers_hash(sum.values[1]));
+    stats_set(hash, "string_hits", LONG2NUM(sum.string_hits));
+    stats_set(hash, "string_misses", LONG2NUM(sum.string_misses));
+    stats_set(hash, "trait_hits", LONG2NUM(sum.trait_hits));
+    stats_set(hash, "trait_misses", LONG2NUM(sum.trait_misses));
+    stats_set(hash, "object_hits", LONG2NUM(sum.object_hits));
+    stats_set(hash, "object_misses", LONG2NUM(sum.object_misses));
+    stats_set(hash, "max_depth", LONG2NUM(sum.max_depth));
+    stats_set(hash, "reallocs", LONG2NUM(sum.reallocs));
+
+    VALUE callbacks = rb_hash_new();
+    VALUE callback_time = rb_hash_new();
+    long i;
+    for(i = 0; i < STATS_CALLBACKS; i++) {
+        VALUE name = ID2SYM(rb_intern(callback_names[i]));
+        rb_hash_aset(callbacks, name, LONG2NUM(sum.callbacks[i]));
+        rb_hash_aset(callback_time, name, rb_float_new(sum.callback_time[i]));
+    }
+    stats_set(hash, "callbacks", callbacks);
+    stats_set(hash, "callback_time", callback_time);
+    return hash;
+}
+
+/*
+ * Whether this is the ractor that loaded the extension, which owns the global
+ * aggregate and the hook
+ */
+static int stats_home() {
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    VALUE home;
+    return rb_ractor_local_storage_value_lookup(stats_home_key, &home);
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Called when a top-level serialize or deserialize finishes. Folds the pending
+ * counts into the instance totals and the global aggregate, then hands them to
+ * the stats hook if one is set. Calls from other ractors only count towards
+ * the instance totals.
+ */
+void stats_finish(AMF_STATS *pending, AMF_STATS *total, int kind) {
+    stats_add(total, pending);
+    if(!stats_home()) {
+        memset(pending, 0, sizeof(AMF_STATS));
+        return;
+    }
+    stats_add(&global_stats[kind], pending);
+
+    VALUE counts = stats_hook == Qnil ? Qnil : stats_hash(pending, NULL);
+    memset(pending, 0, sizeof(AMF_STATS));
+    if(counts != Qnil) {
+        rb_funcall(stats_hook, rb_intern("call"), 2, kind == STATS_SERIALIZE ? sym_serialize : sym_deserialize, counts);
+    }
+}
+#endif
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats => {:serialize => {...}, :deserialize => {...}}
+ *   RocketAMF::Ext.stats => nil
+ *
+ * Returns the counts from every serializer and deserializer since the last
+ * reset_stats, or nil if the extension was built without
+ * <tt>--enable-stats</tt>. Only the ractor that loaded the extension counts
+ * towards these and calls the hook. Each side is a hash of:
+ *
+ * [:bytes] Bytes written or read
+ * [:amf0_values, :amf3_values] Values by type marker
+ * [:string_hits, :string_misses] AMF3 strings written or read by reference, and inline
+ * [:trait_hits, :trait_misses] Same for AMF3 traits
+ * [:object_hits, :object_misses] Same for the object reference table
+ * [:max_depth] Deepest value nesting
+ * [:reallocs] Times the output buffer grew
+ * [:callbacks, :callback_time] Calls into the class mapper or the object, and seconds spent in them
+ *
+ * Values decoded in two passes (see <tt>:release_gvl_threshold</tt>) only add
+ * to the byte, string and object counts.
+ */
+static VALUE stats_global(VALUE self) {
+#ifdef COLLECT_STATS
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym_serialize, stats_hash(&global_stats[STATS_SERIALIZE], NULL));
+    rb_hash_aset(hash, sym_deserialize, stats_hash(&global_stats[STATS_DESERIALIZE], NULL));
+    return hash;
+#else
+    return Qnil;
+#endif
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.reset_stats => nil
+ *
+ * Zeroes the global counts. Instance counts are left alone.
+ */
+static VALUE stats_reset(VALUE self) {
+#ifdef COLLECT_STATS
+    if(!stats_home()) rb_raise(rb_eRuntimeError, "stats can only be reset from the ractor that loaded the extension");
+    memset(global_stats, 0, sizeof(global_stats));
+#endif
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats_hook = proc {|kind, counts| ... }
+ *
+ * Called after every top-level serialize or deserialize with
+ * <tt>:serialize</tt> or <tt>:deserialize</tt> and a hash of that call's
+ * counts, in the same form as stats. Meant for feeding a metrics client such
+ * as StatsD. Set to nil to remove it.
+ */
+static VALUE stats_set_hook(VALUE self, VALUE hook) {
+#ifdef COLLECT_STATS
+    if(!stats_home()) rb_raise(rb_eRuntimeError, "stats_hook can only be set from the ractor that loaded the extension");
+    stats_hook = hook;
+#endif
+    return hook;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats_enabled? => true or false
+ *
+ * Whether counts are being collected. Always false without
+ * <tt>--enable-stats</tt>.
+ */
+static VALUE stats_is_enabled(VALUE self) {
+#ifdef COLLECT_STATS
+    return stats_enabled ? Qtrue : Qfalse;
+#else
+    return Qfalse;
+#endif
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats_enabled = false
+ *
+ * Switches collection off or back on. Has no effect without
+ * <tt>--enable-stats</tt>.
+ */
+static VALUE stats_set_enabled(VALUE self, VALUE enabled) {
+#ifdef COLLECT_STATS
+    stats_enabled = RTEST(enabled);
+#endif
+    return enabled;
+}
+
+void Init_rocket_amf_stats() {
+    rb_define_singleton_method(mRocketAMFExt, "stats", stats_global, 0);
+    rb_define_singleton_method(mRocketAMFExt, "reset_stats", stats_reset, 0);
+    rb_define_singleton_method(mRocketAMFExt, "stats_hook=", stats_set_hook, 1);
+    rb_define_singleton_method(mRocketAMFExt, "stats_enabled?", stats_is_enabled, 0);
+    rb_define_singleton_method(mRocketAMFExt, "stats_enabled=", stats_set_enabled, 1);
+
+#ifdef COLLECT_STATS
+    rb_global_variable(&stats_hook);
+    sym_serialize = ID2SYM(rb_intern("serialize"));
+    sym_deserialize = ID2SYM(rb_intern("deserialize"));
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    stats_home_key = rb_ractor_local_storage_value_newkey();
+    rb_ractor_local_storage_value_set(stats_home_key, Qtrue);
+#endif
+#endif
+}
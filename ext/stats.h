@@ -0,0 +1,91 @@
+#ifndef ROCKETAMF_STATS_H
+#define ROCKETAMF_STATS_H
+
+#include <ruby.h>
+
+/*
+ * Hot path counters for serializers and deserializers, compiled in with
+ * <tt>ruby extconf.rb --enable-stats</tt>. Without it every STATS_ macro is
+ * empty, or just the wrapped statement for STATS_CALL, so the counters cost
+ * nothing. With it they can still be switched off at runtime through
+ * RocketAMF::Ext.stats_enabled=.
+ *
+ * Counts collect in the instance's pending struct and are folded into its
+ * totals and the global aggregate when a top-level call finishes. Both the
+ * serializer and deserializer headers include this one, so it's guarded.
+ */
+
+#define STATS_GET_RUBY_OBJ            0
+#define STATS_POPULATE_RUBY_OBJ       1
+#define STATS_PROPS_FOR_SERIALIZATION 2
+#define STATS_ENCODE_AMF              3
+#define STATS_READ_EXTERNAL           4
+#define STATS_WRITE_EXTERNAL          5
+#define STATS_CALLBACKS               6
+
+#define STATS_MARKERS 0x12 // One past the highest AMF0 or AMF3 marker
+
+#define STATS_SERIALIZE   0
+#define STATS_DESERIALIZE 1
+
+#ifdef COLLECT_STATS
+
+typedef struct {
+    long bytes;
+    long values[2][STATS_MARKERS]; // By version, then type marker
+    long string_hits;
+    long string_misses;
+    long trait_hits;
+    long trait_misses;
+    long object_hits;
+    long object_misses;
+    long depth; // Current nesting, only used to find max_depth
+    long max_depth;
+    long reallocs;
+    long callbacks[STATS_CALLBACKS];
+    double callback_time[STATS_CALLBACKS];
+} AMF_STATS;
+
+extern int stats_enabled;
+
+double stats_now();
+void stats_finish(AMF_STATS *pending, AMF_STATS *total, int kind);
+VALUE stats_hash(const AMF_STATS *pending, const AMF_STATS *total);
+
+#define STATS_ADD(s, field, n) do { if(stats_enabled) (s)->field += (n); } while(0)
+#define STATS_INC(s, field) STATS_ADD(s, field, 1)
+#define STATS_VALUE(s, version, marker) do { \
+    if(stats_enabled && (unsigned char)(marker) < STATS_MARKERS) (s)->values[(version) == 3][(unsigned char)(marker)]++; \
+} while(0)
+#define STATS_ENTER(s) do { \
+    if(stats_enabled && ++(s)->depth > (s)->max_depth) (s)->max_depth = (s)->depth; \
+} while(0)
+#define STATS_LEAVE(s) do { if((s)->depth > 0) (s)->depth--; } while(0)
+#define STATS_CALL(s, cb, stmt) do { \
+    if(stats_enabled) { \
+        double stats_start = stats_now(); \
+        stmt; \
+        (s)->callbacks[cb]++; \
+        (s)->callback_time[cb] += stats_now() - stats_start; \
+    } else { \
+        stmt; \
+    } \
+} while(0)
+#define STATS_FINISH(s, total, kind) stats_finish(s, total, kind)
+#define STATS_RESULT(s, total) stats_hash(s, total)
+
+#else
+
+// The count is still evaluated, so locals only kept for counting aren't unused
+#define STATS_ADD(s, field, n) do { (void)(n); } while(0)
+#define STATS_INC(s, field) do {} while(0)
+#define STATS_VALUE(s, version, marker) do {} while(0)
+#define STATS_ENTER(s) do {} while(0)
+#define STATS_LEAVE(s) do {} while(0)
+#define STATS_CALL(s, cb, stmt) do { stmt; } while(0)
+#define STATS_FINISH(s, total, kind) do {} while(0)
+#define STATS_RESULT(s, total) Qnil
+
+#endif
+
+#endif
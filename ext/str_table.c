@@ -0,0 +1,141 @@
+#include "str_table.h"
+#include <string.h>
+
+#define STR_TABLE_MIN_CAPA 64
+#define STR_CHUNK_LENGTH 4096
+
+unsigned long str_table_hash(const char *ptr, long len) {
+#ifdef HAVE_RB_MEMHASH
+    return (unsigned long)rb_memhash(ptr, len);
+#else
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    long i;
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char)ptr[i];
+        h *= 16777619UL;
+    }
+    return h;
+#endif
+}
+
+/*
+ * Copy the key into the arena, adding a chunk if the current one is full
+ */
+static const char* str_table_copy(STR_TABLE *table, const char *ptr, long len) {
+    STR_CHUNK *chunk = table->arena;
+    if(!chunk || chunk->capa - chunk->used < len) {
+        long capa = len > STR_CHUNK_LENGTH ? len : STR_CHUNK_LENGTH;
+        chunk = (STR_CHUNK*)xmalloc(sizeof(STR_CHUNK) + capa);
+        chunk->capa = capa;
+        chunk->used = 0;
+        chunk->next = table->arena;
+        table->arena = chunk;
+    }
+    char *dst = chunk->data + chunk->used;
+    memcpy(dst, ptr, len);
+    chunk->used += len;
+    return dst;
+}
+
+static void str_table_insert(STR_TABLE *table, const char *ptr, long len, unsigned long hash, long index) {
+    unsigned long mask = table->capa - 1;
+    unsigned long i = hash & mask;
+    while(table->entries[i].gen == table->gen) i = (i + 1) & mask;
+    table->entries[i].ptr = ptr;
+    table->entries[i].len = len;
+    table->entries[i].hash = hash;
+    table->entries[i].gen = table->gen;
+    table->entries[i].index = index;
+    table->count++;
+}
+
+/*
+ * Allocate entries and rehash the live entries from the old array. Keys stay
+ * where they are in the arena.
+ */
+static void str_table_resize(STR_TABLE *table, long capa) {
+    STR_ENTRY *old = table->entries;
+    long i, old_capa = table->capa;
+
+    table->entries = ALLOC_N(STR_ENTRY, capa);
+    MEMZERO(table->entries, STR_ENTRY, capa);
+    table->capa = capa;
+    table->count = 0;
+    if(!old) return;
+
+    for(i = 0; i < old_capa; i++) {
+        STR_ENTRY *e = &old[i];
+        if(e->gen == table->gen) str_table_insert(table, e->ptr, e->len, e->hash, e->index);
+    }
+    xfree(old);
+}
+
+void str_table_init(STR_TABLE *table) {
+    table->entries = NULL;
+    table->capa = 0;
+    table->count = 0;
+    table->gen = 1;
+    table->arena = NULL;
+}
+
+static void str_table_free_chunks(STR_CHUNK *chunk) {
+    while(chunk) {
+        STR_CHUNK *next = chunk->next;
+        xfree(chunk);
+        chunk = next;
+    }
+}
+
+void str_table_free(STR_TABLE *table) {
+    if(table->entries) xfree(table->entries);
+    str_table_free_chunks(table->arena);
+    str_table_init(table);
+}
+
+/*
+ * Empty the table by starting a new generation. The newest arena chunk is
+ * kept for the next serialization and the rest are released.
+ */
+void str_table_clear(STR_TABLE *table) {
+    if(table->arena) {
+        str_table_free_chunks(table->arena->next);
+        table->arena->next = NULL;
+        table->arena->used = 0;
+    }
+    if(table->count == 0) return;
+    table->count = 0;
+    table->gen++;
+    if(table->gen == 0) {
+        // Wrapped around, so old entries could look current again
+        MEMZERO(table->entries, STR_ENTRY, table->capa);
+        table->gen = 1;
+    }
+}
+
+int str_table_lookup(STR_TABLE *table, const char *ptr, long len, unsigned long hash, long *index) {
+    if(table->count == 0) return 0;
+
+    unsigned long mask = table->capa - 1;
+    unsigned long i = hash & mask;
+    while(table->entries[i].gen == table->gen) {
+        STR_ENTRY *e = &table->entries[i];
+        if(e->hash == hash && e->len == len && memcmp(e->ptr, ptr, len) == 0) {
+            *index = e->index;
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+/*
+ * Copies the key into the arena and adds it without checking if it's already
+ * present
+ */
+void str_table_add(STR_TABLE *table, const char *ptr, long len, unsigned long hash, long index) {
+    if((table->count + 1) * 2 > table->capa) {
+        str_table_resize(table, table->capa ? table->capa * 2 : STR_TABLE_MIN_CAPA);
+    }
+    str_table_insert(table, str_table_copy(table, ptr, len), len, hash, index);
+}
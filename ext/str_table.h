@@ -0,0 +1,38 @@
+#include <ruby.h>
+
+/*
+ * Hash table for interning strings by content. Keys are (ptr, len, hash)
+ * triples copied into an arena owned by the table, so strings with embedded
+ * NULs are handled correctly and every key is released by a single clear.
+ * Like REF_TABLE, entries are stamped with a generation so a clear doesn't
+ * have to touch the entries array.
+ */
+typedef struct {
+    const char* ptr;
+    long len;
+    unsigned long hash;
+    unsigned long gen;
+    long index;
+} STR_ENTRY;
+
+typedef struct STR_CHUNK {
+    struct STR_CHUNK* next;
+    long capa;
+    long used;
+    char data[1];
+} STR_CHUNK;
+
+typedef struct {
+    STR_ENTRY* entries;
+    long capa;
+    long count;
+    unsigned long gen;
+    STR_CHUNK* arena;
+} STR_TABLE;
+
+unsigned long str_table_hash(const char *ptr, long len);
+void str_table_init(STR_TABLE *table);
+void str_table_free(STR_TABLE *table);
+void str_table_clear(STR_TABLE *table);
+int str_table_lookup(STR_TABLE *table, const char *ptr, long len, unsigned long hash, long *index);
+void str_table_add(STR_TABLE *table, const char *ptr, long len, unsigned long hash, long index);
@@ -0,0 +1,571 @@
+#include "tape.h"
+#include "deserializer.h"
+#include "constants.h"
+
+/*
+ * Everything in here may run without the GVL, so memory comes from malloc
+ * rather than ruby and errors are returned rather than raised. Anything at all
+ * unusual fails the parse, and the deserializer then reads the source the
+ * normal way, which raises the same errors it always has.
+ */
+
+#define TAPE_REQUIRE(t, n) if((n) < 0 || (n) > (t)->size - (t)->pos) return TAPE_FAIL;
+
+static const char array_collection[] = "flex.messaging.io.ArrayCollection";
+
+void tape_init(AMF_TAPE *t, const char *buf, long pos, long size, int version) {
+    memset(t, 0, sizeof(AMF_TAPE));
+    t->buf = (const unsigned char *)buf;
+    t->pos = pos;
+    t->size = size;
+    t->version = version;
+}
+
+void tape_free(AMF_TAPE *t) {
+    free(t->entries);
+    free(t->strings);
+    free(t->traits);
+    t->entries = NULL;
+    t->strings = NULL;
+    t->traits = NULL;
+}
+
+/*
+ * Unblocking function for rb_thread_call_without_gvl. The parse gives up at
+ * the next value so the thread can take its interrupt.
+ */
+void tape_interrupt(void *t) {
+    ((AMF_TAPE *)t)->interrupted = 1;
+}
+
+static int tape_grow(void **items, long *capa, long need, size_t size) {
+    if(need <= *capa) return TAPE_OK;
+    long new_capa = *capa == 0 ? 64 : *capa * 2;
+    if(new_capa < need) new_capa = need;
+    void *ptr = realloc(*items, new_capa * size);
+    if(!ptr) return TAPE_FAIL;
+    *items = ptr;
+    *capa = new_capa;
+    return TAPE_OK;
+}
+
+/*
+ * Appends an entry, returning its index or -1 if there's no memory for it.
+ * Entries can move as the tape grows, so they're referred to by index.
+ */
+static long tape_push(AMF_TAPE *t, unsigned char kind) {
+    if(tape_grow((void **)&t->entries, &t->capa, t->count + 1, sizeof(TAPE_ENTRY)) != TAPE_OK) return -1;
+    TAPE_ENTRY *e = &t->entries[t->count];
+    e->kind = kind;
+    e->flag = 0;
+    e->a = 0;
+    e->v.b = 0;
+    return t->count++;
+}
+
+#define TAPE_PUSH(t, var, kind) if((var = tape_push(t, kind)) < 0) return TAPE_FAIL;
+
+/*
+ * Works out the string flags for a run of source bytes
+ */
+static unsigned char tape_coderange(AMF_TAPE *t, long off, long len) {
+#ifdef HAVE_RB_STR_ENCODE
+    int cr = des_utf8_coderange((const char *)t->buf + off, len);
+    if(cr == ENC_CODERANGE_7BIT) return TAPE_CR_7BIT;
+    if(cr == ENC_CODERANGE_VALID) return TAPE_CR_VALID;
+    return TAPE_CR_BROKEN;
+#else
+    return 0;
+#endif
+}
+
+static long tape_uint16(AMF_TAPE *t) {
+    const unsigned char *str = t->buf + t->pos;
+    t->pos += 2;
+    return (str[0] << 8) | str[1];
+}
+
+static long tape_uint32(AMF_TAPE *t) {
+    const unsigned char *str = t->buf + t->pos;
+    t->pos += 4;
+    return ((unsigned long)str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3];
+}
+
+static double tape_double(AMF_TAPE *t) {
+    union aligned {
+        double dval;
+        char cval[8];
+    } d;
+    const unsigned char *str = t->buf + t->pos;
+    t->pos += 8;
+#ifdef WORDS_BIGENDIAN
+    memcpy(d.cval, str, 8);
+#else
+    int i;
+    for(i = 0; i < 8; i++) d.cval[i] = str[7 - i];
+#endif
+    return d.dval;
+}
+
+/*
+ * Reads an AMF3 integer exactly as des_read_int does, sign and all
+ */
+static int tape_int(AMF_TAPE *t, long *out) {
+    long result = 0;
+    int byte_cnt = 0;
+    TAPE_REQUIRE(t, 1);
+    unsigned char byte = t->buf[t->pos++];
+    while(byte & 0x80 && byte_cnt < 3) {
+        result = (result << 7) | (byte & 0x7f);
+        TAPE_REQUIRE(t, 1);
+        byte = t->buf[t->pos++];
+        byte_cnt++;
+    }
+    if(byte_cnt < 3) {
+        result = (result << 7) | (byte & 0x7f);
+    } else {
+        result = (result << 8) | byte;
+    }
+    if(result & 0x10000000) result -= 0x20000000;
+    *out = result;
+    return TAPE_OK;
+}
+
+/*
+ * Reads an AMF3 string into e without adding it to the tape, so callers can
+ * drop the empty strings that end key lists
+ */
+static int tape3_string(AMF_TAPE *t, TAPE_ENTRY *e) {
+    long header;
+    if(tape_int(t, &header) != TAPE_OK) return TAPE_FAIL;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header < 0 || t->str_base + header >= t->str_count) return TAPE_FAIL;
+        e->kind = TAPE_STR_REF;
+        e->a = t->str_base + header;
+        e->v.b = t->strings[e->a * 2 + 1];
+        return TAPE_OK;
+    }
+
+    header >>= 1;
+    TAPE_REQUIRE(t, header);
+    e->kind = TAPE_STRING;
+    e->a = t->pos;
+    e->v.b = header;
+    e->flag = tape_coderange(t, t->pos, header);
+    t->pos += header;
+    if(header > 0) {
+        if(tape_grow((void **)&t->strings, &t->str_capa, (t->str_count + 1) * 2, sizeof(long)) != TAPE_OK) return TAPE_FAIL;
+        t->strings[t->str_count * 2] = e->a;
+        t->strings[t->str_count * 2 + 1] = header;
+        t->str_count++;
+        e->flag |= TAPE_CACHE;
+    }
+    return TAPE_OK;
+}
+
+static int tape3_push_string(AMF_TAPE *t, TAPE_ENTRY *e) {
+    long i;
+    TAPE_PUSH(t, i, e->kind);
+    t->entries[i] = *e;
+    return TAPE_OK;
+}
+
+/*
+ * Reads the header of a value that goes in the object table. References are
+ * added to the tape and returned as -1 through len.
+ */
+static int tape3_header(AMF_TAPE *t, long *len) {
+    long header, i;
+    if(tape_int(t, &header) != TAPE_OK) return TAPE_FAIL;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header < 0 || t->obj_base + header >= t->obj_count) return TAPE_FAIL;
+        TAPE_PUSH(t, i, TAPE_OBJ_REF);
+        t->entries[i].a = t->obj_base + header;
+        *len = -1;
+        return TAPE_OK;
+    }
+    *len = header >> 1;
+    return *len < 0 ? TAPE_FAIL : TAPE_OK;
+}
+
+static int tape3_value(AMF_TAPE *t);
+
+static int tape3_array(AMF_TAPE *t) {
+    long len, i, n, pairs = 0;
+    if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL;
+    if(len < 0) return TAPE_OK;
+
+    TAPE_ENTRY key;
+    memset(&key, 0, sizeof(key));
+    if(tape3_string(t, &key) != TAPE_OK) return TAPE_FAIL;
+    t->obj_count++;
+    TAPE_PUSH(t, n, key.v.b != 0 ? TAPE_MIXED_ARRAY : TAPE_ARRAY);
+    t->entries[n].a = len;
+    while(key.v.b != 0) {
+        if(tape3_push_string(t, &key) != TAPE_OK) return TAPE_FAIL;
+        if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+        pairs++;
+        memset(&key, 0, sizeof(key));
+        if(tape3_string(t, &key) != TAPE_OK) return TAPE_FAIL;
+    }
+    t->entries[n].v.b = pairs;
+    for(i = 0; i < len; i++) {
+        if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+    }
+    return TAPE_OK;
+}
+
+static int tape3_object(AMF_TAPE *t) {
+    long header, i, n, trait_index;
+    if(tape3_header(t, &header) != TAPE_OK) return TAPE_FAIL;
+    if(header < 0) return TAPE_OK;
+
+    TAPE_TRAIT_INFO *trait;
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header >= t->trait_count - t->trait_base) return TAPE_FAIL;
+        trait_index = t->trait_base + header;
+    } else {
+        long members_len = header >> 3;
+        TAPE_REQUIRE(t, members_len);
+        if(tape_grow((void **)&t->traits, &t->trait_capa, t->trait_count + 1, sizeof(TAPE_TRAIT_INFO)) != TAPE_OK) return TAPE_FAIL;
+        trait_index = t->trait_count++;
+        trait = &t->traits[trait_index];
+        trait->members = members_len;
+        trait->externalizable = (header & 2) != 0;
+        trait->dynamic = (header & 4) != 0;
+
+        TAPE_PUSH(t, n, TAPE_TRAIT);
+        t->entries[n].a = members_len;
+        t->entries[n].flag = (trait->externalizable ? TAPE_TRAIT_EXTERNALIZABLE : 0) | (trait->dynamic ? TAPE_TRAIT_DYNAMIC : 0);
+
+        TAPE_ENTRY name;
+        memset(&name, 0, sizeof(name));
+        if(tape3_string(t, &name) != TAPE_OK) return TAPE_FAIL;
+        long name_off = name.kind == TAPE_STRING ? name.a : t->strings[name.a * 2];
+        trait->array_collection = name.v.b == sizeof(array_collection) - 1 && memcmp(t->buf + name_off, array_collection, sizeof(array_collection) - 1) == 0;
+        if(tape3_push_string(t, &name) != TAPE_OK) return TAPE_FAIL;
+        for(i = 0; i < members_len; i++) {
+            TAPE_ENTRY member;
+            memset(&member, 0, sizeof(member));
+            if(tape3_string(t, &member) != TAPE_OK) return TAPE_FAIL;
+            if(tape3_push_string(t, &member) != TAPE_OK) return TAPE_FAIL;
+        }
+    }
+    // Nested objects can move the trait table, so take what's needed now
+    trait = &t->traits[trait_index];
+    long members = trait->members;
+    char dynamic = trait->dynamic, is_collection = trait->array_collection;
+
+    // Only read_external knows how long other externalizable objects are
+    if(trait->externalizable && !is_collection) return TAPE_FAIL;
+
+    TAPE_PUSH(t, n, TAPE_AMF3_OBJECT);
+    t->entries[n].a = trait_index;
+    if(is_collection) {
+        if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+        t->obj_count++;
+        return TAPE_OK;
+    }
+
+    t->obj_count++;
+    for(i = 0; i < members; i++) {
+        if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+    }
+    if(dynamic) {
+        long pairs = 0;
+        while(1) {
+            TAPE_ENTRY key;
+            memset(&key, 0, sizeof(key));
+            if(tape3_string(t, &key) != TAPE_OK) return TAPE_FAIL;
+            if(key.v.b == 0) break;
+            if(tape3_push_string(t, &key) != TAPE_OK) return TAPE_FAIL;
+            if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+            pairs++;
+        }
+        t->entries[n].v.b = pairs;
+    }
+    return TAPE_OK;
+}
+
+static int tape3_vector(AMF_TAPE *t, char type) {
+    long len, i, n;
+    if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL; // Fails lengths with the top bit set
+    if(len < 0) return TAPE_OK;
+
+    TAPE_REQUIRE(t, 1);
+    unsigned char fixed = t->buf[t->pos++] != 0;
+    t->obj_count++;
+
+    if(type == AMF3_VECTOR_OBJECT_MARKER) {
+        TAPE_PUSH(t, n, TAPE_VECTOR_OBJECT);
+        t->entries[n].a = len;
+        t->entries[n].flag = fixed;
+        TAPE_ENTRY name;
+        memset(&name, 0, sizeof(name));
+        if(tape3_string(t, &name) != TAPE_OK) return TAPE_FAIL;
+        if(tape3_push_string(t, &name) != TAPE_OK) return TAPE_FAIL;
+        for(i = 0; i < len; i++) {
+            if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+        }
+        return TAPE_OK;
+    }
+
+    long width = type == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4;
+    if(len > (t->size - t->pos) / width) return TAPE_FAIL; // Before len * width can overflow
+    TAPE_REQUIRE(t, len * width);
+    TAPE_PUSH(t, n, type == AMF3_VECTOR_INT_MARKER ? TAPE_VECTOR_INT : type == AMF3_VECTOR_UINT_MARKER ? TAPE_VECTOR_UINT : TAPE_VECTOR_DOUBLE);
+    t->entries[n].a = len;
+    t->entries[n].v.b = t->pos;
+    t->entries[n].flag = fixed;
+    t->pos += len * width;
+    return TAPE_OK;
+}
+
+static int tape3_value(AMF_TAPE *t) {
+    long i, len;
+    if(t->interrupted || ++t->depth > TAPE_MAX_DEPTH) return TAPE_FAIL;
+    TAPE_REQUIRE(t, 1);
+    char type = t->buf[t->pos++];
+    switch(type) {
+        case AMF3_UNDEFINED_MARKER:
+        case AMF3_NULL_MARKER:
+            TAPE_PUSH(t, i, TAPE_NIL);
+            break;
+        case AMF3_FALSE_MARKER:
+            TAPE_PUSH(t, i, TAPE_FALSE);
+            break;
+        case AMF3_TRUE_MARKER:
+            TAPE_PUSH(t, i, TAPE_TRUE);
+            break;
+        case AMF3_INTEGER_MARKER:
+            if(tape_int(t, &len) != TAPE_OK) return TAPE_FAIL;
+            TAPE_PUSH(t, i, TAPE_INT);
+            t->entries[i].a = len;
+            break;
+        case AMF3_DOUBLE_MARKER:
+            TAPE_REQUIRE(t, 8);
+            TAPE_PUSH(t, i, TAPE_DOUBLE);
+            t->entries[i].v.d = tape_double(t);
+            break;
+        case AMF3_STRING_MARKER: {
+            TAPE_ENTRY str;
+            memset(&str, 0, sizeof(str));
+            if(tape3_string(t, &str) != TAPE_OK) return TAPE_FAIL;
+            if(tape3_push_string(t, &str) != TAPE_OK) return TAPE_FAIL;
+            break;
+        }
+        case AMF3_XML_DOC_MARKER:
+        case AMF3_XML_MARKER:
+            if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL;
+            if(len < 0) break;
+            TAPE_REQUIRE(t, len);
+            TAPE_PUSH(t, i, TAPE_XML);
+            t->entries[i].a = t->pos;
+            t->entries[i].v.b = len;
+            t->entries[i].flag = tape_coderange(t, t->pos, len);
+            if(len > 0) {
+                t->entries[i].flag |= TAPE_CACHE;
+                t->obj_count++;
+            }
+            t->pos += len;
+            break;
+        case AMF3_DATE_MARKER:
+            if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL;
+            if(len < 0) break;
+            TAPE_REQUIRE(t, 8);
+            TAPE_PUSH(t, i, TAPE_DATE);
+            t->entries[i].v.d = tape_double(t);
+            t->entries[i].flag = TAPE_CACHE;
+            t->obj_count++;
+            break;
+        case AMF3_BYTE_ARRAY_MARKER:
+            if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL;
+            if(len < 0) break;
+            TAPE_REQUIRE(t, len);
+            TAPE_PUSH(t, i, TAPE_BYTE_ARRAY);
+            t->entries[i].a = t->pos;
+            t->entries[i].v.b = len;
+            t->obj_count++;
+            t->pos += len;
+            break;
+        case AMF3_ARRAY_MARKER:
+            if(tape3_array(t) != TAPE_OK) return TAPE_FAIL;
+            break;
+        case AMF3_OBJECT_MARKER:
+            if(tape3_object(t) != TAPE_OK) return TAPE_FAIL;
+            break;
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+        case AMF3_VECTOR_OBJECT_MARKER:
+            if(tape3_vector(t, type) != TAPE_OK) return TAPE_FAIL;
+            break;
+        case AMF3_DICT_MARKER: {
+            if(tape3_header(t, &len) != TAPE_OK) return TAPE_FAIL;
+            if(len < 0) break;
+            long skip, n;
+            t->obj_count++;
+            if(tape_int(t, &skip) != TAPE_OK) return TAPE_FAIL; // Skip - don't know what it does
+            TAPE_PUSH(t, n, TAPE_DICT);
+            t->entries[n].a = len;
+            for(i = 0; i < len * 2; i++) {
+                if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+            }
+            break;
+        }
+        default:
+            return TAPE_FAIL;
+    }
+    t->depth--;
+    return TAPE_OK;
+}
+
+static int tape0_value(AMF_TAPE *t, char type);
+
+/*
+ * Reads AMF0 properties up to the empty key, returning how many there were
+ */
+static int tape0_props(AMF_TAPE *t, long *count) {
+    long i;
+    *count = 0;
+    while(1) {
+        TAPE_REQUIRE(t, 2);
+        long len = tape_uint16(t);
+        if(len == 0) {
+            TAPE_REQUIRE(t, 1);
+            t->pos++; // Type byte
+            return TAPE_OK;
+        }
+        TAPE_REQUIRE(t, len + 1);
+        TAPE_PUSH(t, i, TAPE_KEY);
+        t->entries[i].a = t->pos;
+        t->entries[i].v.b = len;
+        t->entries[i].flag = tape_coderange(t, t->pos, len);
+        t->pos += len;
+        if(tape0_value(t, t->buf[t->pos++]) != TAPE_OK) return TAPE_FAIL;
+        (*count)++;
+    }
+}
+
+static int tape0_value(AMF_TAPE *t, char type) {
+    long i, n, len;
+    if(t->interrupted || ++t->depth > TAPE_MAX_DEPTH) return TAPE_FAIL;
+    switch(type) {
+        case AMF0_NUMBER_MARKER:
+            TAPE_REQUIRE(t, 8);
+            TAPE_PUSH(t, i, TAPE_DOUBLE);
+            t->entries[i].v.d = tape_double(t);
+            break;
+        case AMF0_BOOLEAN_MARKER:
+            TAPE_REQUIRE(t, 1);
+            TAPE_PUSH(t, i, t->buf[t->pos++] == 0 ? TAPE_FALSE : TAPE_TRUE);
+            break;
+        case AMF0_STRING_MARKER:
+        case AMF0_LONG_STRING_MARKER:
+        case AMF0_XML_MARKER:
+            if(type == AMF0_STRING_MARKER) {
+                TAPE_REQUIRE(t, 2);
+                len = tape_uint16(t);
+            } else {
+                TAPE_REQUIRE(t, 4);
+                len = tape_uint32(t);
+            }
+            TAPE_REQUIRE(t, len);
+            TAPE_PUSH(t, i, TAPE_STRING);
+            t->entries[i].a = t->pos;
+            t->entries[i].v.b = len;
+            t->entries[i].flag = tape_coderange(t, t->pos, len);
+            t->pos += len;
+            break;
+        case AMF0_NULL_MARKER:
+        case AMF0_UNDEFINED_MARKER:
+        case AMF0_UNSUPPORTED_MARKER:
+            TAPE_PUSH(t, i, TAPE_NIL);
+            break;
+        case AMF0_OBJECT_MARKER:
+            TAPE_PUSH(t, n, TAPE_OBJECT);
+            t->obj_count++;
+            if(tape0_props(t, &len) != TAPE_OK) return TAPE_FAIL;
+            t->entries[n].a = len;
+            break;
+        case AMF0_TYPED_OBJECT_MARKER:
+            TAPE_REQUIRE(t, 2);
+            len = tape_uint16(t);
+            TAPE_REQUIRE(t, len);
+            TAPE_PUSH(t, n, TAPE_TYPED_OBJECT);
+            TAPE_PUSH(t, i, TAPE_STRING);
+            t->entries[i].a = t->pos;
+            t->entries[i].v.b = len;
+            t->entries[i].flag = tape_coderange(t, t->pos, len);
+            t->pos += len;
+            t->obj_count++;
+            if(tape0_props(t, &len) != TAPE_OK) return TAPE_FAIL;
+            t->entries[n].a = len;
+            break;
+        case AMF0_HASH_MARKER:
+            TAPE_REQUIRE(t, 4);
+            t->pos += 4; // Hash size
+            TAPE_PUSH(t, n, TAPE_HASH);
+            t->obj_count++;
+            if(tape0_props(t, &len) != TAPE_OK) return TAPE_FAIL;
+            t->entries[n].a = len;
+            break;
+        case AMF0_STRICT_ARRAY_MARKER:
+            TAPE_REQUIRE(t, 4);
+            len = tape_uint32(t);
+            TAPE_PUSH(t, n, TAPE_ARRAY);
+            t->entries[n].a = len;
+            t->obj_count++;
+            for(i = 0; i < len; i++) {
+                TAPE_REQUIRE(t, 1);
+                if(tape0_value(t, t->buf[t->pos++]) != TAPE_OK) return TAPE_FAIL;
+            }
+            break;
+        case AMF0_REFERENCE_MARKER:
+            TAPE_REQUIRE(t, 2);
+            len = tape_uint16(t);
+            if(len >= t->obj_count) return TAPE_FAIL;
+            TAPE_PUSH(t, i, TAPE_OBJ_REF);
+            t->entries[i].a = len;
+            break;
+        case AMF0_DATE_MARKER:
+            TAPE_REQUIRE(t, 10);
+            TAPE_PUSH(t, i, TAPE_DATE);
+            t->entries[i].v.d = tape_double(t);
+            t->pos += 2; // Timezone - unused
+            break;
+        case AMF0_AMF3_MARKER: {
+            long obj_base = t->obj_base, str_base = t->str_base, trait_base = t->trait_base;
+            TAPE_PUSH(t, i, TAPE_AMF3);
+            t->obj_base = t->obj_count;
+            t->str_base = t->str_count;
+            t->trait_base = t->trait_count;
+            if(tape3_value(t) != TAPE_OK) return TAPE_FAIL;
+            t->obj_count = t->obj_base;
+            t->str_count = t->str_base;
+            t->trait_count = t->trait_base;
+            t->obj_base = obj_base;
+            t->str_base = str_base;
+            t->trait_base = trait_base;
+            break;
+        }
+        default:
+            return TAPE_FAIL;
+    }
+    t->depth--;
+    return TAPE_OK;
+}
+
+/*
+ * Parses one value from the current position onto the tape. On success pos is
+ * just past the value.
+ */
+int tape_parse(AMF_TAPE *t) {
+    if(t->version == 3) return tape3_value(t);
+    TAPE_REQUIRE(t, 1);
+    char type = t->buf[t->pos++];
+    return tape0_value(t, type);
+}
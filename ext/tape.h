@@ -0,0 +1,99 @@
+#include <ruby.h>
+
+/*
+ * First half of two-phase decoding. tape_parse checks a whole AMF value and
+ * flattens it into a tape of fixed size entries, with strings kept as offsets
+ * into the source and references resolved to absolute table indexes. It never
+ * touches the ruby VM - no allocations through ruby, no exceptions - so it can
+ * run without the GVL. The deserializer then builds objects from the tape
+ * without any further checks.
+ */
+
+#define TAPE_OK   0
+#define TAPE_FAIL 1 // Malformed, externalizable, too deep, out of memory or interrupted
+
+#define TAPE_MAX_DEPTH 4096
+
+#define TAPE_NIL           0
+#define TAPE_FALSE         1
+#define TAPE_TRUE          2
+#define TAPE_INT           3  // a - value
+#define TAPE_DOUBLE        4  // v.d - value
+#define TAPE_STRING        5  // a, v.b - offset and length
+#define TAPE_STR_REF       6  // a - string table index
+#define TAPE_XML           7  // a, v.b - offset and length, goes in the object table if flagged
+#define TAPE_OBJ_REF       8  // a - object table index
+#define TAPE_DATE          9  // v.d - milliseconds, goes in the object table if flagged
+#define TAPE_BYTE_ARRAY    10 // a, v.b - offset and length
+#define TAPE_KEY           11 // a, v.b - offset and length of an AMF0 property name
+#define TAPE_OBJECT        12 // a - property count, then key and value pairs
+#define TAPE_TYPED_OBJECT  13 // a - property count, then class name, then pairs
+#define TAPE_HASH          14 // a - property count, then pairs
+#define TAPE_ARRAY         15 // a - length, then values
+#define TAPE_MIXED_ARRAY   16 // a - dense length, v.b - key count, then pairs and dense values
+#define TAPE_TRAIT         17 // a - member count, flag - TAPE_TRAIT_*, then class name and members
+#define TAPE_AMF3_OBJECT   18 // a - trait index, v.b - dynamic property count. Traits seen for the
+                              // first time come first. Then member values and dynamic pairs,
+                              // or just the source value for ArrayCollection
+#define TAPE_VECTOR_INT    19 // a - length, v.b - offset of the data, flag - fixed
+#define TAPE_VECTOR_UINT   20
+#define TAPE_VECTOR_DOUBLE 21
+#define TAPE_VECTOR_OBJECT 22 // a - length, flag - fixed, then class name and values
+#define TAPE_DICT          23 // a - pair count, then keys and values
+#define TAPE_AMF3          24 // An AMF3 value follows, with its own tables
+
+// String, XML and date flags
+#define TAPE_CACHE      0x01 // Goes in the string or object table
+#define TAPE_CR_7BIT    0x02
+#define TAPE_CR_VALID   0x04
+#define TAPE_CR_BROKEN  0x06
+#define TAPE_CR_MASK    0x06
+
+// Trait flags
+#define TAPE_TRAIT_EXTERNALIZABLE 0x01
+#define TAPE_TRAIT_DYNAMIC        0x02
+
+typedef struct {
+    unsigned char kind;
+    unsigned char flag;
+    long a;
+    union {
+        long b;
+        double d;
+    } v;
+} TAPE_ENTRY;
+
+typedef struct {
+    long members;
+    char dynamic;
+    char externalizable;
+    char array_collection;
+} TAPE_TRAIT_INFO;
+
+typedef struct {
+    const unsigned char *buf;
+    long pos;
+    long size;
+    int version;
+    long depth;
+    TAPE_ENTRY *entries;
+    long count;
+    long capa;
+    long cur; // Next entry to materialize
+    long *strings; // Offset and length pairs for the AMF3 string table
+    long str_count;
+    long str_capa;
+    TAPE_TRAIT_INFO *traits;
+    long trait_count;
+    long trait_capa;
+    long obj_count;
+    long obj_base; // Where the current AMF3 body's tables start
+    long str_base;
+    long trait_base;
+    volatile int interrupted;
+} AMF_TAPE;
+
+void tape_init(AMF_TAPE *tape, const char *buf, long pos, long size, int version);
+void tape_free(AMF_TAPE *tape);
+int tape_parse(AMF_TAPE *tape);
+void tape_interrupt(void *tape);
@@ -1,4 +1,9 @@
 // Before RFLOAT_VALUE, value was in a different place in the struct
 #ifndef RFLOAT_VALUE
 #define RFLOAT_VALUE(v) (RFLOAT(v)->value)
-#endif
\ No newline at end of file
+#endif
+
+// Block functions only got their full argument list in 2.1
+#ifndef RB_BLOCK_CALL_FUNC_ARGLIST
+#define RB_BLOCK_CALL_FUNC_ARGLIST(yielded_arg, callback_arg) VALUE yielded_arg, VALUE callback_arg
+#endif
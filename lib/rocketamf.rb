@@ -7,6 +7,8 @@ require 'rocketamf/extensions'
 require 'rocketamf/class_mapping'
 require 'rocketamf/constants'
 require 'rocketamf/remoting'
+require 'rocketamf/fragment'
+require 'rocketamf/feed_io'
 
 # RocketAMF is a full featured AMF0/3 serializer and deserializer with support
 # for Flash -> Ruby and Ruby -> Flash class mapping, custom serializers,
@@ -86,12 +88,20 @@ module RocketAMF
   # data structure and return it
   def self.deserialize source, amf_version = 0
     if amf_version == 0
-      RocketAMF::Deserializer.new.deserialize(source)
+      klass = RocketAMF::Deserializer
     elsif amf_version == 3
-      RocketAMF::AMF3Deserializer.new.deserialize(source)
+      klass = RocketAMF::AMF3Deserializer
     else
       raise AMFError, "unsupported version #{amf_version}"
     end
+
+    # Deserializers are reused per thread. One that's in use is out of the pool,
+    # so a nested call (from read_external, say) gets a fresh one.
+    pool = Thread.current[:__rocketamf_deserializers__] ||= {}
+    des = pool.delete(klass) || klass.new
+    result = des.deserialize(source)
+    pool[klass] = des.reset
+    result
   end
 
   # Serialize the given Ruby data structure _obj_ into an AMF stream using the
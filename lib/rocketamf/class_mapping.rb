@@ -1,5 +1,6 @@
 require 'rocketamf/values/typed_hash'
 require 'rocketamf/values/messages'
+require 'rocketamf/values/vector'
 
 module RocketAMF
   # Handles class name mapping between actionscript and ruby and assists in
@@ -53,6 +54,19 @@ module RocketAMF
   #   end
   #   RocketAMF::ClassMapper.object_serializers << CustomSerializer.new
   #
+  # == Sealed Schemas
+  #
+  # For classes that are serialized in bulk, the properties can be declared up
+  # front with <tt>:members</tt>, or derived once from the class's public
+  # zero-arity instance methods with <tt>:sealed => true</tt>. Instances are then
+  # written as AMF3 sealed objects straight from their getters, skipping
+  # <tt>props_for_serialization</tt> and custom serializers entirely.
+  #
+  #   RocketAMF::ClassMapper.define do |m|
+  #     m.map :as => 'vo.User', :ruby => 'Model::User', :members => [:id, :name]
+  #     m.map :as => 'vo.Point', :ruby => 'Point', :sealed => true
+  #   end
+  #
   # == Complete Replacement
   #
   # In some cases, it may be beneficial to replace the default provider of class
@@ -104,6 +118,10 @@ module RocketAMF
         # Add translate_case option to both sides
         @as_options[params[:as]] = {'translate_case' => !!params[:translate_case]}
         @ruby_options[params[:ruby]] = {'translate_case' => !!params[:translate_case]}
+
+        # Store sealed members, or true to derive them from the class
+        members = params[:members] ? params[:members].map {|m| m.to_s} : params[:sealed]
+        @ruby_options[params[:ruby]]['members'] = members if members
       end
 
       # Returns the AS class name for the given ruby class name, returing nil if
@@ -145,6 +163,7 @@ module RocketAMF
       @object_populators = []
       @object_serializers = []
       @use_array_collection = false
+      @schemas = {}
     end
 
     # Define class mappings in the block. Block is passed a MappingSet object as
@@ -156,12 +175,14 @@ module RocketAMF
     #     m.map :as => 'AsClass', :ruby => 'RubyClass'
     #   end
     def define #:yields: mapping_set
+      @schemas = {}
       yield mappings
     end
 
     # Reset all class mappings except the defaults
     def reset
       @mappings = nil
+      @schemas = {}
     end
 
     # Returns the AS class name for the given ruby object. Will also take a string
@@ -253,7 +274,7 @@ module RocketAMF
       # Fallback serializer
       props = {}
       @ignored_props ||= Object.new.public_methods
-      (ruby_obj.public_methods - @ignored_props).each do |method_name|
+      (ruby_obj.public_methods - @ignored_props).sort.each do |method_name| # Method table order isn't stable
         # Add them to the prop hash if they take no arguments
         method_def = ruby_obj.method(method_name)
         props[method_name.to_s] = ruby_obj.send(method_name) if method_def.arity == 0
@@ -261,9 +282,72 @@ module RocketAMF
       props
     end
 
+    # Returns the sealed schema for the given ruby class as a traits hash with an
+    # extra <tt>:getters</tt> array of method names parallel to <tt>:members</tt>,
+    # or nil if the class wasn't mapped with <tt>:members</tt> or <tt>:sealed</tt>.
+    # Schemas are built once per class and cached until the mappings change.
+    def serialization_schema klass
+      return @schemas[klass] if @schemas.has_key?(klass)
+      @schemas[klass] = build_schema(klass)
+    end
+
     private
     def mappings
       @mappings ||= MappingSet.new
     end
+
+    def build_schema klass
+      ruby_class_name = klass.name
+      members = mappings.get_ruby_option(ruby_class_name, 'members')
+      return nil unless members
+
+      if members == true
+        ignored = Object.public_instance_methods.map {|m| m.to_s}
+        members = klass.public_instance_methods.map {|m| m.to_s}.select do |m|
+          !ignored.include?(m) && klass.instance_method(m).arity == 0
+        end.sort
+      end
+
+      as_members = members
+      if mappings.get_ruby_option(ruby_class_name, 'translate_case')
+        as_members = members.map {|m| CaseTranslation.camelize(m) }
+      end
+
+      {
+        :class_name => mappings.get_as_class_name(ruby_class_name),
+        :members => as_members.map {|m| m.freeze},
+        :getters => members.map {|m| m.to_sym},
+        :dynamic => false,
+        :externalizable => false
+      }
+    end
+  end
+
+  # Memoized key conversion for the <tt>translate_case</tt> option. The same
+  # property names show up over and over, so each one is converted once and the
+  # frozen result is shared. The tables are capped so that hostile input can't
+  # grow them without bound.
+  module CaseTranslation #:nodoc:
+    MAX_ENTRIES = 4096
+
+    @camel = {}
+    @snake = {}
+
+    # Converts a snake_case string or symbol to a frozen camelCase string
+    def self.camelize key
+      @camel[key] || remember(@camel, key, key.to_s.gsub(/(?:_)(.)/) { $1.upcase })
+    end
+
+    # Converts a camelCase string to a frozen snake_case string
+    def self.underscore key
+      @snake[key] || remember(@snake, key, key.gsub(/([A-Z])/) { "_" + $1.downcase })
+    end
+
+    def self.remember table, key, value
+      value.freeze
+      table[key] = value if table.size < MAX_ENTRIES
+      value
+    end
+    private_class_method :remember
   end
 end
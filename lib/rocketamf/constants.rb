@@ -33,6 +33,10 @@ module RocketAMF
   AMF3_OBJECT_MARKER       =  0x0A #"\n"
   AMF3_XML_MARKER          =  0x0B #"\v"
   AMF3_BYTE_ARRAY_MARKER   =  0x0C #"\f"
+  AMF3_VECTOR_INT_MARKER   =  0x0D #"\r"
+  AMF3_VECTOR_UINT_MARKER  =  0x0E #"\016"
+  AMF3_VECTOR_DOUBLE_MARKER = 0x0F #"\017"
+  AMF3_VECTOR_OBJECT_MARKER = 0x10 #"\020"
   AMF3_DICT_MARKER         =  0x11 #"\021"
 
   # Other AMF3 Markers
@@ -43,4 +47,5 @@ module RocketAMF
   # Other Constants
   MAX_INTEGER               = 268435455
   MIN_INTEGER               = -268435456
+  DEFAULT_CHUNK_LENGTH      = 64*1024
 end
\ No newline at end of file
@@ -12,6 +12,15 @@ module RocketAMF
   Deserializer = RocketAMF::Ext::Deserializer
   AMF3Deserializer = RocketAMF::Ext::AMF3Deserializer
 
+  # Import event reader
+  Reader = RocketAMF::Ext::Reader
+
+  # Import memory-mapped source
+  MappedSource = RocketAMF::Ext::MappedSource
+
+  # Import byte array
+  Values::ByteArray = RocketAMF::Ext::ByteArray
+
   # Import serializer
   Serializer = RocketAMF::Ext::Serializer
   AMF3Serializer = RocketAMF::Ext::AMF3Serializer
@@ -22,5 +31,11 @@ module RocketAMF
     remove_method :serialize
     include RocketAMF::Ext::Envelope
   end
+
+  # Generate message IDs in C
+  class Values::AbstractMessage
+    remove_method :rand_uuid
+    include RocketAMF::Ext::AbstractMessage
+  end
   #:startdoc:
 end
\ No newline at end of file
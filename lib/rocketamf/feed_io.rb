@@ -0,0 +1,13 @@
+module RocketAMF
+  # Source handed to the deserializers by <tt>feed</tt>. Reads that come up
+  # short raise EOFError, so a read_external implementation that runs out of
+  # data while the rest of the value is still on its way fails loudly instead
+  # of quietly returning a partial object.
+  class FeedIO < StringIO
+    def read length=nil, *args
+      str = super
+      raise EOFError, "value is not complete yet" if length && length > 0 && (str.nil? || str.bytesize < length)
+      str
+    end
+  end
+end
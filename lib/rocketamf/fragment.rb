@@ -0,0 +1,50 @@
+module RocketAMF
+  # Holds a value that has already been serialized, so that data which rarely
+  # changes can be encoded once and embedded in any number of later messages.
+  # When a fragment is serialized its bytes are copied into the stream as is,
+  # except for reference indices, which are rebased onto the reference tables
+  # of the enclosing stream.
+  #
+  # AMF3 fragments can be embedded in AMF3 streams, or in AMF0 streams where
+  # they are written after an AMF3 switch marker and so keep their own
+  # reference scope. AMF0 fragments can only be embedded in AMF0 streams.
+  #
+  # Example:
+  #
+  #   CATALOG = RocketAMF::Fragment.new(Catalog.load, 3)
+  #
+  #   response.messages << RocketAMF::Message.new(uri, '', CATALOG)
+  class Fragment
+    # Kinds of reference recorded in relocations
+    STRING_REF = 0
+    TRAIT_REF = 1
+    OBJECT_REF = 2
+    AMF0_OBJECT_REF = 3
+
+    # AMF version of the fragment
+    attr_reader :version
+
+    # Serialized bytes, minus the reference headers listed in relocations
+    attr_reader :bytes
+
+    # Flat array of <tt>offset, kind, index</tt> triples, one per reference
+    attr_reader :relocations
+
+    # Number of entries the fragment adds to each reference table
+    attr_reader :string_count, :trait_count, :object_count
+
+    def initialize obj, version=0
+      ser = if version == 0
+              RocketAMF::Serializer.new
+            elsif version == 3
+              RocketAMF::AMF3Serializer.new
+            else
+              raise AMFError, "unsupported version #{version}"
+            end
+      @version = version
+      @bytes, @relocations, @string_count, @trait_count, @object_count = ser.capture_fragment(obj)
+      @bytes.freeze
+      @relocations.freeze
+    end
+  end
+end
@@ -1,6 +1,9 @@
 require 'rocketamf/pure/deserializer'
 require 'rocketamf/pure/serializer'
 require 'rocketamf/pure/remoting'
+require 'rocketamf/pure/reader'
+require 'rocketamf/pure/mapped_source'
+require 'rocketamf/pure/byte_array'
 
 module RocketAMF
   # This module holds all the modules/classes that implement AMF's functionality
@@ -14,6 +17,15 @@ module RocketAMF
   Deserializer = RocketAMF::Pure::Deserializer
   AMF3Deserializer = RocketAMF::Pure::AMF3Deserializer
 
+  # Import event reader
+  Reader = RocketAMF::Pure::Reader
+
+  # Import memory-mapped source
+  MappedSource = RocketAMF::Pure::MappedSource
+
+  # Import byte array
+  Values::ByteArray = RocketAMF::Pure::ByteArray
+
   # Import serializer
   Serializer = RocketAMF::Pure::Serializer
   AMF3Serializer = RocketAMF::Pure::AMF3Serializer
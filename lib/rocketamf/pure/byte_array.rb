@@ -0,0 +1,19 @@
+require 'stringio'
+
+module RocketAMF
+  module Pure
+    # Pure ruby stand-in for RocketAMF::Ext::ByteArray. A StringIO already
+    # reads and writes the way a byte array should, so this only adds slicing.
+    class ByteArray < StringIO
+      # Returns a new byte array over _length_ bytes of this one, starting at
+      # _offset_. Ruby shares the bytes of long slices with the original
+      # string rather than copying them.
+      def slice offset, length
+        bytes = string
+        raise RangeError, "slice out of range" if offset < 0 || length < 0 || offset > bytes.bytesize
+        bytes = bytes.respond_to?(:byteslice) ? bytes.byteslice(offset, length) : bytes[offset, length]
+        ByteArray.new(bytes)
+      end
+    end
+  end
+end
@@ -2,14 +2,137 @@ require 'rocketamf/pure/io_helpers'
 
 module RocketAMF
   module Pure
+    # Push parser shared by both deserializers. Each complete value is read by
+    # a fresh deserializer from a FeedIO, which raises EOFError on short reads
+    # so a partial value is told apart from a complete one.
+    module FeedParser
+      # Instrumentation counters are only in the extension
+      def stats
+        nil
+      end
+
+      # The class mapper given as <tt>:class_mapper</tt>, or the one currently
+      # set as RocketAMF::ClassMapper
+      def class_mapper
+        @options[:class_mapper] || RocketAMF::ClassMapper
+      end
+
+      # Appends the chunk to what's left over from earlier calls and
+      # deserializes every value that is now complete, yielding each one or
+      # returning them all if no block is given.
+      def feed chunk
+        chunk = chunk.dup.force_encoding("ASCII-8BIT") if chunk.respond_to?(:force_encoding)
+        @feed_buffer = @feed_buffer ? @feed_buffer << chunk : chunk.dup
+
+        values = block_given? ? nil : []
+        until @feed_buffer.empty?
+          io = RocketAMF::FeedIO.new(@feed_buffer)
+          begin
+            obj = self.class.new(@options).deserialize(io)
+          rescue EOFError
+            break
+          end
+          @feed_buffer = @feed_buffer[io.pos..-1]
+          values ? values << obj : yield(obj)
+        end
+        values
+      end
+    end
+
+    # Flash's IDataInput, for read_external implementations to read the source
+    # with, matching the extension. Numbers are big-endian.
+    module DataInput
+      def readBoolean
+        data_read(1) != "\0"
+      end
+
+      def readByte
+        data_read(1).unpack('c').first
+      end
+
+      def readUnsignedByte
+        data_read(1).unpack('C').first
+      end
+
+      def readShort
+        (n = readUnsignedShort) >= 0x8000 ? n - 0x10000 : n
+      end
+
+      def readUnsignedShort
+        data_read(2).unpack('n').first
+      end
+
+      def readInt
+        (n = readUnsignedInt) >= 0x80000000 ? n - 0x100000000 : n
+      end
+
+      def readUnsignedInt
+        data_read(4).unpack('N').first
+      end
+
+      def readFloat
+        data_read(4).unpack('g').first
+      end
+
+      def readDouble
+        data_read(8).unpack('G').first
+      end
+
+      def readUTF
+        utf8 data_read(readUnsignedShort)
+      end
+
+      def readUTFBytes length
+        utf8 data_read(length)
+      end
+
+      def readBytes length
+        data_read(length)
+      end
+
+      def readObject
+        deserialize
+      end
+
+      def bytesAvailable
+        @source.size - @source.pos
+      end
+
+      private
+      def data_read length
+        raise ArgumentError, "negative length #{length} given" if length < 0
+        str = @source.read(length) || ""
+        raise RangeError, "reading #{length} bytes is beyond end of source" if str.bytesize < length
+        str
+      end
+    end
+
     # Pure ruby deserializer
     #--
     # AMF0 deserializer, it switches over to AMF3 when it sees the switch flag
     class Deserializer
+      include FeedParser
       attr_accessor :source
 
-      def initialize
+      # Accepts the same options as the extension deserializer so the two can
+      # be swapped freely. <tt>:shared_string_threshold</tt> only has an effect
+      # in the extension, since ruby can't share the middle of a string, and
+      # so does <tt>:release_gvl_threshold</tt>, since ruby code can't run
+      # without the GVL.
+      # <tt>:strict_utf8</tt> raises an EncodingError for strings that aren't
+      # valid UTF-8. <tt>:class_mapper</tt> replaces RocketAMF::ClassMapper.
+      def initialize opts={}
+        @options = opts
+        @strict_utf8 = opts[:strict_utf8]
+        reset
+      end
+
+      # Forgets the current source and every object read from it, so the
+      # deserializer can be reused
+      def reset
+        @source = nil
         @ref_cache = []
+        self
       end
 
       def deserialize(source=nil, type=nil)
@@ -48,7 +171,7 @@ module RocketAMF
         when AMF0_TYPED_OBJECT_MARKER
           read_typed_object
         when AMF0_AMF3_MARKER
-          AMF3Deserializer.new.deserialize(@source)
+          AMF3Deserializer.new(@options).deserialize(@source)
         else
           raise AMFError, "Invalid type: #{type}"
         end
@@ -69,7 +192,7 @@ module RocketAMF
       def read_string long=false
         len = long ? read_word32_network(@source) : read_word16_network(@source)
         str = @source.read(len)
-        str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
+        utf8 str
         str
       end
 
@@ -80,7 +203,7 @@ module RocketAMF
           key = read_string
           type = read_int8 @source
           break if type == AMF0_OBJECT_END_MARKER
-          key.gsub!(/([A-Z])/) { "_" + $1.downcase } if translate_case
+          key = RocketAMF::CaseTranslation.underscore(key) if translate_case
 
           obj[key.to_sym] = deserialize(nil, type)
         end
@@ -93,8 +216,8 @@ module RocketAMF
       end
 
       def read_hash
-        class_name = RocketAMF::ClassMapper.get_as_class_name 'Hash'
-        translate_case = RocketAMF::ClassMapper.get_as_option(class_name, 'translate_case')
+        class_name = class_mapper.get_as_class_name 'Hash'
+        translate_case = class_mapper.get_as_option(class_name, 'translate_case')
 
         len = read_word32_network(@source) # Read and ignore length
         obj = {}
@@ -104,7 +227,7 @@ module RocketAMF
           type = read_int8 @source
           break if type == AMF0_OBJECT_END_MARKER
 
-          key.gsub!(/([A-Z])/) { "_" + $1.downcase } if translate_case
+          key = RocketAMF::CaseTranslation.underscore(key) if translate_case
 
           obj[key] = deserialize(nil, type)
         end
@@ -123,8 +246,7 @@ module RocketAMF
       end
 
       def read_date
-        seconds = read_double(@source).to_f/1000
-        time = Time.at(seconds)
+        time = time_from_millis(read_double(@source))
         tz = read_word16_network(@source) # Unused
         time
       end
@@ -132,9 +254,9 @@ module RocketAMF
       def read_typed_object
         # Create object to add to ref cache
         class_name = read_string
-        translate_case = RocketAMF::ClassMapper.get_as_option(class_name, 'translate_case')
+        translate_case = class_mapper.get_as_option(class_name, 'translate_case')
 
-        obj = RocketAMF::ClassMapper.get_ruby_obj class_name
+        obj = class_mapper.get_ruby_obj class_name
         @ref_cache << obj
 
 
@@ -142,7 +264,7 @@ module RocketAMF
         props = read_object false, translate_case
 
         # Populate object
-        RocketAMF::ClassMapper.populate_ruby_obj obj, props
+        class_mapper.populate_ruby_obj obj, props
         return obj
       end
     end
@@ -150,12 +272,24 @@ module RocketAMF
     # AMF3 implementation of deserializer, loaded automatically by the AMF0
     # deserializer when needed
     class AMF3Deserializer
+      include FeedParser
+      include DataInput
       attr_accessor :source
 
-      def initialize
+      def initialize opts={}
+        @options = opts
+        @strict_utf8 = opts[:strict_utf8]
+        reset
+      end
+
+      # Forgets the current source and every object read from it, so the
+      # deserializer can be reused
+      def reset
+        @source = nil
         @string_cache = []
         @object_cache = []
         @trait_cache = []
+        self
       end
 
       def deserialize(source=nil, opts=nil)
@@ -191,11 +325,37 @@ module RocketAMF
           read_amf3_byte_array
         when AMF3_DICT_MARKER
           read_dict
+        when AMF3_VECTOR_INT_MARKER, AMF3_VECTOR_UINT_MARKER, AMF3_VECTOR_DOUBLE_MARKER, AMF3_VECTOR_OBJECT_MARKER
+          read_vector type
         else
           raise AMFError, "Invalid type: #{type}"
         end
       end
 
+      # Reads the values written by AMF3Serializer#serialize_many one at a time
+      # until the end of the source. <tt>:reset_every</tt> must match what the
+      # serializer was given.
+      def each_value source, opts={}
+        return enum_for(:each_value, source, opts) unless block_given?
+        reset_every = opts[:reset_every] || 0
+        raise ArgumentError, "reset_every can't be negative" if reset_every < 0
+
+        reset
+        @source = StringIO === source ? source : StringIO.new(source.dup) # The block may change the string
+        count = 0
+        until @source.eof?
+          if reset_every > 0 && count > 0 && count % reset_every == 0
+            @string_cache = []
+            @trait_cache = []
+          end
+          @object_cache = []
+          obj = deserialize
+          count += 1
+          yield obj
+        end
+        self
+      end
+
       private
       include RocketAMF::Pure::ReadIOHelpers
 
@@ -244,7 +404,7 @@ module RocketAMF
           str = ""
           if length > 0
             str = @source.read(length)
-            str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
+            utf8 str
             @string_cache << str
           end
           return str
@@ -263,7 +423,7 @@ module RocketAMF
           str = ""
           if length > 0
             str = @source.read(length)
-            str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
+            utf8 str
             @object_cache << str
           end
           return str
@@ -279,12 +439,45 @@ module RocketAMF
           return @object_cache[reference]
         else
           length = type >> 1
-          obj = StringIO.new @source.read(length)
+          obj = Values::ByteArray.new @source.read(length)
           @object_cache << obj
           obj
         end
       end
 
+      def read_vector vector_type
+        type = read_integer
+        isReference = (type & 0x01) == 0
+
+        if isReference
+          reference = type >> 1
+          return @object_cache[reference]
+        end
+
+        length = (type & 0x1fffffff) >> 1 # Lengths are unsigned
+        fixed = read_int8(@source) != 0
+        case vector_type
+        when AMF3_VECTOR_INT_MARKER
+          vec = Values::Vector.new(:int, [], fixed)
+          @object_cache << vec
+          data_read(4 * length).unpack('N*').each {|i| vec << (i >= 2**31 ? i - 2**32 : i) }
+        when AMF3_VECTOR_UINT_MARKER
+          vec = Values::Vector.new(:uint, [], fixed)
+          @object_cache << vec
+          vec.concat data_read(4 * length).unpack('N*')
+        when AMF3_VECTOR_DOUBLE_MARKER
+          vec = Values::Vector.new(:double, [], fixed)
+          @object_cache << vec
+          vec.concat data_read(8 * length).unpack('G*')
+        else
+          vec = Values::Vector.new(:object, [], fixed)
+          @object_cache << vec
+          vec.class_name = read_string
+          length.times { vec << deserialize }
+        end
+        vec
+      end
+
       def read_array
         type = read_integer
         isReference = (type & 0x01) == 0
@@ -359,18 +552,18 @@ module RocketAMF
             return arr
           end
 
-          obj = RocketAMF::ClassMapper.get_ruby_obj traits[:class_name]
+          obj = class_mapper.get_ruby_obj traits[:class_name]
           @object_cache << obj
 
           if traits[:externalizable]
             obj.read_external self
           else
-            translate_case = RocketAMF::ClassMapper.get_as_option(traits[:class_name], 'translate_case')
+            translate_case = class_mapper.get_as_option(traits[:class_name], 'translate_case')
 
             props = {}
             traits[:members].each do |key|
               value = deserialize
-              key.gsub!(/([A-Z])/) { "_" + $1.downcase } if translate_case
+              key = RocketAMF::CaseTranslation.underscore(key) if translate_case
               props[key.to_sym] = value
             end
 
@@ -379,12 +572,12 @@ module RocketAMF
               dynamic_props = {}
               while (key = read_string) && key.length != 0  do # read next key
                 value = deserialize
-                key.gsub!(/([A-Z])/) { "_" + $1.downcase } if translate_case
+                key = RocketAMF::CaseTranslation.underscore(key) if translate_case
                 dynamic_props[key.to_sym] = value
               end
             end
 
-            RocketAMF::ClassMapper.populate_ruby_obj obj, props, dynamic_props
+            class_mapper.populate_ruby_obj obj, props, dynamic_props
           end
           obj
         end
@@ -397,8 +590,7 @@ module RocketAMF
           reference = type >> 1
           return @object_cache[reference]
         else
-          seconds = read_double(@source).to_f/1000
-          time = Time.at(seconds)
+          time = time_from_millis(read_double(@source))
           @object_cache << time
           time
         end
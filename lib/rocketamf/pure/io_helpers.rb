@@ -38,6 +38,22 @@ module RocketAMF
       def byte_order_little?
         (byte_order == :LittleEndian) ? true : false;
       end
+
+      # Marks a string just read as UTF-8. Deserializers created with
+      # <tt>:strict_utf8</tt> raise if it isn't valid.
+      def utf8 str
+        return str unless str.respond_to?(:force_encoding)
+        str.force_encoding("UTF-8")
+        raise EncodingError, "invalid UTF-8 in string" if @strict_utf8 && !str.valid_encoding?
+        str
+      end
+
+      # Builds a Time from milliseconds since the epoch, keeping millisecond
+      # precision for negative and fractional values
+      def time_from_millis milli
+        sec, rem = milli.divmod(1000)
+        Time.at(sec.to_i, (rem * 1000).round)
+      end
     end
 
     module WriteIOHelpers #:nodoc:
@@ -0,0 +1,22 @@
+require 'stringio'
+
+module RocketAMF
+  module Pure
+    # Pure ruby stand-in for RocketAMF::Ext::MappedSource. Ruby can't map a
+    # file into memory, so the whole file is read into a StringIO, which both
+    # deserializers and Envelope#populate_from_stream already accept.
+    class MappedSource < StringIO
+      attr_reader :path
+
+      def initialize path
+        @path = path.respond_to?(:to_path) ? path.to_path : path.to_s
+        super(File.open(@path, 'rb') {|f| f.read }.freeze)
+      end
+
+      # Always false, since the file has been read in
+      def mapped?
+        false
+      end
+    end
+  end
+end
@@ -0,0 +1,297 @@
+require 'rocketamf/pure/io_helpers'
+
+module RocketAMF
+  module Pure
+    # Pure ruby event reader, matching RocketAMF::Ext::Reader. It walks one
+    # value and yields an event for each part of it instead of building the
+    # object graph. AMF0 readers switch over to AMF3 when they see the switch
+    # flag.
+    class Reader
+      def initialize amf_version=0
+        raise ArgumentError, "unsupported version #{amf_version}" unless [0, 3].include?(amf_version)
+        @version = amf_version
+      end
+
+      # Walks one value from the String or StringIO _source_, yielding
+      # <tt>event, value</tt> pairs. See RocketAMF::Ext::Reader#each_event for
+      # the events. Returning <tt>:skip</tt> from the block for a start or key
+      # event walks past that value without yielding anything for it.
+      def each_event source, &block
+        return enum_for(:each_event, source) unless block
+        @source = StringIO === source ? source : StringIO.new(source)
+        @block = block
+        @string_cache = []
+        @trait_cache = []
+        @object_count = 0
+        @version == 3 ? read3_value(true) : read0_value(read_int8(@source), true)
+        self
+      ensure
+        @block = nil
+      end
+
+      private
+      include RocketAMF::Pure::ReadIOHelpers
+
+      def event emit, name, value=nil
+        emit && @block.call(name, value) == :skip ? :skip : nil
+      end
+
+      def enter emit, name, value=nil
+        emit && event(emit, name, value) != :skip
+      end
+
+      def read0_value type, emit
+        case type
+        when AMF0_NUMBER_MARKER
+          event emit, :double, read_double(@source)
+        when AMF0_BOOLEAN_MARKER
+          event emit, :boolean, read_int8(@source) != 0
+        when AMF0_STRING_MARKER
+          event emit, :string, utf8(@source.read(read_word16_network(@source)))
+        when AMF0_LONG_STRING_MARKER
+          event emit, :string, utf8(@source.read(read_word32_network(@source)))
+        when AMF0_XML_MARKER
+          event emit, :xml, utf8(@source.read(read_word32_network(@source)))
+        when AMF0_NULL_MARKER, AMF0_UNDEFINED_MARKER, AMF0_UNSUPPORTED_MARKER
+          event emit, :null
+        when AMF0_OBJECT_MARKER
+          @object_count += 1
+          inner = enter emit, :start_object
+          read0_props inner, true
+          event inner, :end_object
+        when AMF0_TYPED_OBJECT_MARKER
+          class_name = utf8(@source.read(read_word16_network(@source)))
+          @object_count += 1
+          inner = enter emit, :start_object, class_name
+          read0_props inner, true
+          event inner, :end_object
+        when AMF0_HASH_MARKER
+          read_word32_network(@source) # Read and ignore length
+          @object_count += 1
+          inner = enter emit, :start_hash
+          read0_props inner, false
+          event inner, :end_hash
+        when AMF0_STRICT_ARRAY_MARKER
+          len = read_word32_network(@source)
+          @object_count += 1
+          inner = enter emit, :start_array, len
+          len.times { read0_value(read_int8(@source), inner) }
+          event inner, :end_array
+        when AMF0_REFERENCE_MARKER
+          index = read_word16_network(@source)
+          raise AMFError, "reference index beyond end" if index >= @object_count
+          event emit, :reference, index
+        when AMF0_DATE_MARKER
+          time = time_from_millis(read_double(@source))
+          read_word16_network(@source) # Timezone - unused
+          event emit, :date, time
+        when AMF0_AMF3_MARKER
+          # The AMF3 body gets its own tables, dropped once it's done
+          count, strings, traits = @object_count, @string_cache, @trait_cache
+          @object_count, @string_cache, @trait_cache = 0, [], []
+          read3_value emit
+          @object_count, @string_cache, @trait_cache = count, strings, traits
+        else
+          raise AMFError, "Invalid type: #{type}"
+        end
+      end
+
+      def read0_props emit, member
+        while true
+          key = utf8(@source.read(read_word16_network(@source)))
+          type = read_int8 @source
+          break if key.empty?
+          skip = event(emit, :key, member ? key.to_sym : key) == :skip
+          read0_value type, emit && !skip
+        end
+      end
+
+      def read3_integer
+        n = 0
+        b = read_word8(@source) || 0
+        result = 0
+
+        while ((b & 0x80) != 0 && n < 3)
+          result = result << 7
+          result = result | (b & 0x7f)
+          b = read_word8(@source) || 0
+          n = n + 1
+        end
+
+        if (n < 3)
+          result = result << 7
+          result = result | b
+        else
+          result = result << 8
+          result = result | b
+          result -= (1 << 29) if result > MAX_INTEGER
+        end
+        result
+      end
+
+      def read3_string
+        header = read3_integer
+        if (header & 0x01) == 0
+          str = @string_cache[header >> 1]
+          raise AMFError, "str reference index beyond end" unless str
+          str
+        else
+          length = header >> 1
+          return "" if length == 0
+          str = utf8(@source.read(length))
+          @string_cache << str
+          str
+        end
+      end
+
+      # Reads the header of a value in the object table, yielding a reference
+      # and returning nil if it is one
+      def read3_header emit
+        header = read3_integer
+        if (header & 0x01) == 0
+          index = header >> 1
+          raise AMFError, "obj reference index beyond end" if index >= @object_count
+          event emit, :reference, index
+          nil
+        else
+          (header & 0x1fffffff) >> 1 # Lengths are unsigned
+        end
+      end
+
+      def read3_value emit
+        type = read_int8 @source
+        case type
+        when AMF3_UNDEFINED_MARKER, AMF3_NULL_MARKER
+          event emit, :null
+        when AMF3_FALSE_MARKER
+          event emit, :boolean, false
+        when AMF3_TRUE_MARKER
+          event emit, :boolean, true
+        when AMF3_INTEGER_MARKER
+          event emit, :integer, read3_integer
+        when AMF3_DOUBLE_MARKER
+          event emit, :double, read_double(@source)
+        when AMF3_STRING_MARKER
+          event emit, :string, read3_string
+        when AMF3_XML_DOC_MARKER, AMF3_XML_MARKER
+          return unless length = read3_header(emit)
+          @object_count += 1 if length > 0
+          event emit, :xml, utf8(@source.read(length))
+        when AMF3_DATE_MARKER
+          return unless read3_header(emit)
+          @object_count += 1
+          event emit, :date, time_from_millis(read_double(@source))
+        when AMF3_BYTE_ARRAY_MARKER
+          return unless length = read3_header(emit)
+          @object_count += 1
+          event emit, :byte_array, @source.read(length)
+        when AMF3_ARRAY_MARKER
+          read3_array emit
+        when AMF3_OBJECT_MARKER
+          read3_object emit
+        when AMF3_DICT_MARKER
+          return unless length = read3_header(emit)
+          @object_count += 1
+          read3_integer # Skip - don't know what it does
+          inner = enter emit, :start_dictionary, length
+          length.times { read3_value(inner); read3_value(inner) }
+          event inner, :end_dictionary
+        when AMF3_VECTOR_INT_MARKER, AMF3_VECTOR_UINT_MARKER, AMF3_VECTOR_DOUBLE_MARKER, AMF3_VECTOR_OBJECT_MARKER
+          read3_vector emit, type
+        else
+          raise AMFError, "Invalid type: #{type}"
+        end
+      end
+
+      def read3_array emit
+        return unless length = read3_header(emit)
+        @object_count += 1
+        key = read3_string
+        if key != ""
+          # Mixed arrays deserialize to hashes, with the dense part keyed by index
+          inner = enter emit, :start_hash
+          while key != ""
+            skip = event(inner, :key, key) == :skip
+            read3_value inner && !skip
+            key = read3_string
+          end
+          length.times do |i|
+            skip = event(inner, :key, i.to_s) == :skip
+            read3_value inner && !skip
+          end
+          event inner, :end_hash
+        else
+          inner = enter emit, :start_array, length
+          length.times { read3_value inner }
+          event inner, :end_array
+        end
+      end
+
+      def read3_object emit
+        return unless header = read3_header(emit)
+        if (header & 0x01) == 0
+          traits = @trait_cache[header >> 1]
+          raise AMFError, "trait reference index beyond end" unless traits
+        else
+          traits = {
+                    :externalizable => (header & 0x02) != 0,
+                    :dynamic => (header & 0x04) != 0,
+                    :class_name => read3_string
+                   }
+          traits[:members] = Array.new(header >> 3) { read3_string.to_sym }
+          @trait_cache << traits
+        end
+
+        # The deserializer hands ArrayCollections back as their source array
+        if traits[:class_name] == "flex.messaging.io.ArrayCollection"
+          read3_value emit
+          @object_count += 1
+          return
+        end
+
+        @object_count += 1
+        raise AMFError, "can't read externalizable class #{traits[:class_name]} as events" if traits[:externalizable]
+
+        inner = enter emit, :start_object, traits[:class_name] == "" ? nil : traits[:class_name]
+        traits[:members].each do |key|
+          skip = event(inner, :key, key) == :skip
+          read3_value inner && !skip
+        end
+        if traits[:dynamic]
+          while (key = read3_string) != ""
+            skip = event(inner, :key, key.to_sym) == :skip
+            read3_value inner && !skip
+          end
+        end
+        event inner, :end_object
+      end
+
+      def read3_vector emit, type
+        return unless length = read3_header(emit)
+        @object_count += 1
+        read_int8 @source # Fixed flag
+
+        if type == AMF3_VECTOR_OBJECT_MARKER
+          read3_string # Class name
+          raise AMFError, "vector beyond end of source" if length > @source.size - @source.pos # Every value takes a byte
+          inner = enter emit, :start_array, length
+          length.times { read3_value inner }
+        else
+          width = type == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4
+          body = @source.read(width * length)
+          raise AMFError, "vector beyond end of source" if body.nil? || body.length < width * length
+          return unless inner = enter(emit, :start_array, length)
+          case type
+          when AMF3_VECTOR_INT_MARKER
+            body.unpack('N*').each {|i| event inner, :integer, i >= 2**31 ? i - 2**32 : i }
+          when AMF3_VECTOR_UINT_MARKER
+            body.unpack('N*').each {|i| event inner, :integer, i }
+          else
+            body.unpack('G*').each {|d| event inner, :double, d }
+          end
+        end
+        event inner, :end_array
+      end
+    end
+  end
+end
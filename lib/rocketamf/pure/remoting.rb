@@ -1,13 +1,16 @@
 require 'rocketamf/pure/io_helpers'
+require 'rocketamf/pure/reader'
 
 module RocketAMF
   module Pure
     # Included into RocketAMF::Envelope, this module replaces the
     # populate_from_stream and serialize methods with actual working versions
     module Envelope
+      UNKNOWN_LENGTH = 0xFFFFFFFF #:nodoc:
+
       # Included into RocketAMF::Envelope, this method handles deserializing an
       # AMF request/response into the envelope
-      def populate_from_stream stream
+      def populate_from_stream stream, opts={}
         stream = StringIO.new(stream) unless StringIO === stream
 
         # Initialize
@@ -25,7 +28,7 @@ module RocketAMF
           name.force_encoding("UTF-8") if name.respond_to?(:force_encoding)
           must_understand = read_int8(stream) != 0
           length = read_word32_network stream
-          data = RocketAMF.deserialize stream
+          data = RocketAMF::Deserializer.new(opts).deserialize stream
           @headers[name] = RocketAMF::Header.new(name, must_understand, data)
         end
 
@@ -37,19 +40,43 @@ module RocketAMF
           response_uri = stream.read(read_word16_network(stream))
           response_uri.force_encoding("UTF-8") if response_uri.respond_to?(:force_encoding)
           length = read_word32_network stream
-          data = RocketAMF.deserialize stream
-          if data.is_a?(Array) && data.length == 1 && data[0].is_a?(::RocketAMF::Values::AbstractMessage)
-            data = data[0]
+
+          # Leave the body for Message#data. Bodies sent with their length are
+          # sliced off, and the rest are walked past without building them.
+          # Bodies the reader can't walk are read right away.
+          start = stream.pos
+          message = RocketAMF::Message.new(target_uri, response_uri, nil)
+          begin
+            if length != UNKNOWN_LENGTH && length <= stream.string.bytesize - start
+              stream.pos = start + length
+            else
+              RocketAMF::Pure::Reader.new.each_event(stream) { :skip }
+            end
+            message.defer_data stream.string.byteslice(start, stream.pos - start), opts
+          rescue StandardError
+            stream.pos = start
+            data = RocketAMF::Deserializer.new(opts).deserialize stream
+            if data.is_a?(Array) && data.length == 1 && data[0].is_a?(::RocketAMF::Values::AbstractMessage)
+              data = data[0]
+            end
+            message.data = data
           end
-          @messages << RocketAMF::Message.new(target_uri, response_uri, data)
+          message.data if opts[:defer_bodies] == false
+          @messages << message
         end
 
         self
       end
 
       # Included into RocketAMF::Envelope, this method handles serializing an
-      # AMF request/response into the envelope
-      def serialize
+      # AMF request/response into the envelope. Returns the serialized string,
+      # or writes it out in chunks to the given IO or block.
+      def serialize io=nil, opts={}, &block
+        if io.is_a?(Hash)
+          opts = io
+          io = nil
+        end
+        mapper_opts = {:class_mapper => (opts || {})[:class_mapper]}
         stream = ""
 
         # Write version
@@ -63,8 +90,9 @@ module RocketAMF
           stream << pack_int16_network(name_str.bytesize)
           stream << name_str
           stream << pack_int8(h.must_understand ? 1 : 0)
-          stream << pack_word32_network(-1)
-          stream << RocketAMF.serialize(h.data, 0)
+          data = RocketAMF::Serializer.new(mapper_opts).serialize(h.data)
+          stream << pack_word32_network(data.bytesize)
+          stream << data
         end
 
         # Write messages
@@ -80,12 +108,16 @@ module RocketAMF
           stream << pack_int16_network(uri_str.bytesize)
           stream << uri_str
 
-          stream << pack_word32_network(-1)
-          stream << AMF0_AMF3_MARKER if @amf_version == 3
-          stream << RocketAMF.serialize(m.data, @amf_version)
+          data = (@amf_version == 3 ? RocketAMF::AMF3Serializer : RocketAMF::Serializer).new(mapper_opts).serialize(m.data)
+          data = pack_int8(AMF0_AMF3_MARKER) + data if @amf_version == 3
+          stream << pack_word32_network(data.bytesize)
+          stream << data
         end
 
-        stream
+        return stream if io.nil? && block.nil?
+        ser = RocketAMF::Pure::Serializer.new(io, opts, &block)
+        ser.stream << stream
+        ser.send(:finish_output)
       end
 
       private
@@ -2,24 +2,245 @@ require 'rocketamf/pure/io_helpers'
 
 module RocketAMF
   module Pure
+    # Streaming output shared by both serializers. Unlike the C version, which
+    # emits chunks as bytes are written, the pure version buffers each
+    # top-level value and then writes it out in <tt>chunk_size</tt> slices.
+    module StreamOutput #:nodoc:
+      # Instrumentation counters are only in the extension
+      def stats
+        nil
+      end
+
+      # The class mapper given as <tt>:class_mapper</tt>, or the one currently
+      # set as RocketAMF::ClassMapper
+      def class_mapper
+        @class_mapper || RocketAMF::ClassMapper
+      end
+
+      private
+      def setup_output io, opts, block
+        if io.is_a?(Hash)
+          opts = io
+          io = nil
+        end
+        opts ||= {}
+        @output = io || block
+        @chunk_size = opts[:chunk_size] || DEFAULT_CHUNK_LENGTH
+        @max_bytes = opts[:max_bytes]
+        @class_mapper = opts[:class_mapper]
+        @flushed = 0
+        @depth = 0
+        raise ArgumentError, "chunk_size must be positive" if @chunk_size <= 0
+      end
+
+      def finish_output
+        return @stream if @depth > 0
+        if @max_bytes && @flushed + @stream.bytesize > @max_bytes
+          raise RangeError, "serialized output exceeds #{@max_bytes} bytes"
+        end
+        return @stream if @output.nil?
+
+        pos = 0
+        while pos < @stream.bytesize
+          chunk = @stream.byteslice(pos, @chunk_size)
+          @output.respond_to?(:call) ? @output.call(chunk) : @output.write(chunk)
+          pos += chunk.bytesize
+        end
+        @flushed += @stream.bytesize
+        @stream = ""
+        @flushed
+      end
+
+      # Holds the depth while a writer serializes child values, so that calling
+      # write_array or write_object directly keeps a single reference scope
+      def nested
+        @depth += 1
+        yield
+      ensure
+        @depth -= 1
+      end
+    end
+
+    # Flash's IDataOutput, for write_external implementations to write the
+    # stream with, matching the extension. Numbers are big-endian.
+    module DataOutput
+      def writeBoolean value
+        @stream << (value ? "\1" : "\0")
+        self
+      end
+
+      def writeByte num
+        @stream << [num & 0xff].pack('C')
+        self
+      end
+
+      def writeShort num
+        @stream << [num & 0xffff].pack('n')
+        self
+      end
+
+      def writeInt num
+        raise RangeError, "int #{num} out of range" if num < -0x80000000 || num > 0x7fffffff
+        @stream << [num & 0xffffffff].pack('N')
+        self
+      end
+
+      def writeUnsignedInt num
+        raise RangeError, "int #{num} out of range" if num < 0 || num > 0xffffffff
+        @stream << [num].pack('N')
+        self
+      end
+
+      def writeFloat num
+        @stream << [num].pack('g')
+        self
+      end
+
+      def writeDouble num
+        @stream << [num].pack('G')
+        self
+      end
+
+      def writeUTF str
+        str = data_utf8(str)
+        raise RangeError, "string of #{str.bytesize} bytes is too long for writeUTF" if str.bytesize > 0xffff
+        @stream << [str.bytesize].pack('n') << str
+        self
+      end
+
+      def writeUTFBytes str
+        @stream << data_utf8(str)
+        self
+      end
+
+      def writeBytes str
+        @stream << str.to_s.dup.force_encoding("ASCII-8BIT")
+        self
+      end
+
+      def writeObject obj
+        nested { serialize obj }
+        self
+      end
+
+      private
+      def data_utf8 str
+        str = str.to_s
+        str = str.encode("UTF-8") if str.respond_to?(:encode)
+        str.respond_to?(:force_encoding) ? str.dup.force_encoding("ASCII-8BIT") : str
+      end
+    end
+
+    # Fragment capture and embedding shared by both serializers. References are
+    # written through write_ref so they can be recorded while capturing.
+    module FragmentOutput #:nodoc:
+      # Serializes obj in a fresh reference scope for RocketAMF::Fragment.
+      # Returns the bytes without reference headers, the relocations as flat
+      # offset, kind, index triples and the reference table counts.
+      def capture_fragment obj
+        raise "cannot capture a fragment while serializing" if @depth > 0
+        raise "cannot capture a fragment while writing to an IO" if @output
+
+        reset_caches
+        @relocations = []
+        @reloc_start = @stream.bytesize
+        nested { serialize obj }
+        bytes = @stream.byteslice(@reloc_start, @stream.bytesize - @reloc_start)
+        @stream = @stream.byteslice(0, @reloc_start)
+        ret = [bytes, @relocations] + reference_counts
+        @relocations = nil
+        reset_caches
+        ret
+      end
+
+      private
+      def write_ref kind, index
+        if @relocations
+          @relocations.push(@stream.bytesize - @reloc_start, kind, index)
+        else
+          write_ref_bytes kind, index
+        end
+      end
+
+      def write_ref_bytes kind, index
+        case kind
+        when Fragment::TRAIT_REF
+          @stream << pack_integer(index << 2 | 0x01)
+        when Fragment::AMF0_OBJECT_REF
+          raise RangeError, "int #{index} out of range" if index > 0xffff
+          @stream << pack_int16_network(index)
+        else
+          @stream << pack_integer(index << 1)
+        end
+      end
+
+      def write_fragment frag
+        fresh_scope = false
+        if version == 0 && frag.version == 3
+          # The AMF3 switch starts a new reference scope
+          @stream << AMF0_AMF3_MARKER
+          fresh_scope = true
+        elsif version != frag.version
+          raise ArgumentError, "cannot embed an AMF#{frag.version} fragment in an AMF#{version} stream"
+        end
+
+        counts = reference_counts
+        base = counts + [counts[2]]
+        relocs = frag.relocations
+        pos = 0
+        0.step(relocs.length - 1, 3) do |i|
+          offset, kind, index = relocs[i], relocs[i+1], relocs[i+2]
+          @stream << frag.bytes.byteslice(pos, offset - pos)
+          fresh_scope ? write_ref_bytes(kind, index) : write_ref(kind, index + base[kind])
+          pos = offset
+        end
+        @stream << frag.bytes.byteslice(pos, frag.bytes.bytesize - pos)
+
+        skip_references frag.string_count, frag.trait_count, frag.object_count unless fresh_scope
+      end
+    end
+
     # AMF0 implementation of serializer
     class Serializer
+      include StreamOutput
+      include FragmentOutput
       attr_reader :ref_cache, :stream
 
-      def initialize
-        @ref_cache = SerializerCache.new :object
-        @stream = ""
+      def initialize io=nil, opts={}, &block
+        reset
+        setup_output io, opts, block
       end
 
       def version
         0
       end
 
+      # Empties the stream and clears the reference cache so the serializer can
+      # be reused
+      def reset
+        reset_caches
+        @stream = ""
+        @flushed = 0
+        self
+      end
+
+      # Returns the serialized stream and replaces it with an empty one
+      def take_stream
+        stream = @stream
+        @stream = ""
+        stream
+      end
+
       def serialize obj
-        if @ref_cache[obj] != nil
-          write_reference @ref_cache[obj]
+        reset_caches if @depth == 0 # References don't span top-level values
+        @depth += 1
+        ref = @ref_cache[obj]
+        if ref != nil && ref <= 0xffff # AMF0 references are only 16 bits
+          write_reference ref
         elsif obj.respond_to?(:encode_amf)
           obj.encode_amf(self)
+        elsif obj.is_a?(RocketAMF::Fragment)
+          write_fragment obj
         elsif obj.is_a?(NilClass)
           write_null
         elsif obj.is_a?(TrueClass) || obj.is_a?(FalseClass)
@@ -39,7 +260,8 @@ module RocketAMF
         elsif obj.is_a?(Object)
           write_object obj
         end
-        @stream
+        @depth -= 1
+        finish_output
       end
 
       def write_null
@@ -87,35 +309,35 @@ module RocketAMF
 
       def write_reference index
         @stream << AMF0_REFERENCE_MARKER
-        @stream << pack_int16_network(index)
+        write_ref Fragment::AMF0_OBJECT_REF, index
       end
 
       def write_array array
         @ref_cache.add_obj array
         @stream << AMF0_STRICT_ARRAY_MARKER
         @stream << pack_word32_network(array.length)
-        array.each do |elem|
-          serialize elem
+        nested do
+          array.each {|elem| serialize elem }
         end
       end
 
       def write_hash hash
-        class_name = RocketAMF::ClassMapper.get_as_class_name 'Hash'
-        translate_case = RocketAMF::ClassMapper.get_as_option(class_name, 'translate_case')
+        class_name = class_mapper.get_as_class_name 'Hash'
+        translate_case = class_mapper.get_as_option(class_name, 'translate_case')
         @ref_cache.add_obj hash
         @stream << AMF0_HASH_MARKER
         @stream << pack_word32_network(hash.length)
-        write_prop_list RocketAMF::ClassMapper.props_for_serialization(hash), translate_case
+        write_prop_list class_mapper.props_for_serialization(hash), translate_case
       end
 
       def write_object obj, props=nil
         @ref_cache.add_obj obj
 
-        props = RocketAMF::ClassMapper.props_for_serialization obj if props.nil?
+        props = class_mapper.props_for_serialization obj if props.nil?
 
         # Is it a typed object?
-        class_name = RocketAMF::ClassMapper.get_as_class_name obj
-        translate_case = RocketAMF::ClassMapper.get_as_option(class_name, 'translate_case')
+        class_name = class_mapper.get_as_class_name obj
+        translate_case = class_mapper.get_as_option(class_name, 'translate_case')
         if class_name
           class_name = class_name.encode("UTF-8").force_encoding("ASCII-8BIT") if class_name.respond_to?(:encode)
           @stream << AMF0_TYPED_OBJECT_MARKER
@@ -130,15 +352,28 @@ module RocketAMF
 
       private
       include RocketAMF::Pure::WriteIOHelpers
+
+      def reset_caches
+        @ref_cache = SerializerCache.new :object
+      end
+
+      def reference_counts
+        [0, 0, @ref_cache.cache_index]
+      end
+
+      def skip_references strings, traits, objects
+        @ref_cache.skip objects
+      end
+
       def write_prop_list obj, translate_case = false
         # Write prop list
-        props = RocketAMF::ClassMapper.props_for_serialization obj
+        props = class_mapper.props_for_serialization obj
         props.sort.each do |key, value| # Sort keys before writing
           key = key.encode("UTF-8").force_encoding("ASCII-8BIT") if key.respond_to?(:encode)
-          key = key.gsub(/(?:_)(.)/) { $1.upcase } if translate_case
+          key = RocketAMF::CaseTranslation.camelize(key) if translate_case
           @stream << pack_int16_network(key.bytesize)
           @stream << key
-          serialize value
+          nested { serialize value }
         end
 
         # Write end
@@ -149,22 +384,43 @@ module RocketAMF
 
     # AMF3 implementation of serializer
     class AMF3Serializer
+      include StreamOutput
+      include DataOutput
+      include FragmentOutput
       attr_reader :string_cache, :object_cache, :trait_cache, :stream
 
-      def initialize
-        @string_cache = SerializerCache.new :string
-        @object_cache = SerializerCache.new :object
-        @trait_cache = SerializerCache.new :string
-        @stream = ""
+      def initialize io=nil, opts={}, &block
+        reset
+        setup_output io, opts, block
       end
 
       def version
         3
       end
 
+      # Empties the stream and clears the reference caches so the serializer can
+      # be reused
+      def reset
+        reset_caches
+        @stream = ""
+        @flushed = 0
+        self
+      end
+
+      # Returns the serialized stream and replaces it with an empty one
+      def take_stream
+        stream = @stream
+        @stream = ""
+        stream
+      end
+
       def serialize obj
+        reset_caches if @depth == 0 # References don't span top-level values
+        @depth += 1
         if obj.respond_to?(:encode_amf)
           obj.encode_amf(self)
+        elsif obj.is_a?(RocketAMF::Fragment)
+          write_fragment obj
         elsif obj.is_a?(NilClass)
           write_null
         elsif obj.is_a?(TrueClass)
@@ -183,17 +439,47 @@ module RocketAMF
           write_date obj
         elsif obj.is_a?(StringIO)
           write_byte_array obj
+        elsif obj.is_a?(Values::Vector)
+          write_vector obj
         elsif obj.is_a?(Array)
           write_array obj
         elsif obj.is_a?(Hash) || obj.is_a?(Object)
           write_object obj
         end
-        @stream
+        @depth -= 1
+        finish_output
+      end
+
+      # Serializes every value from the enumerable back to back, keeping the
+      # string and trait tables from one value to the next. Each value gets its
+      # own object table. <tt>:reset_every</tt> starts the string and trait
+      # tables over every that many values, and the reader must be given the
+      # same.
+      def serialize_many values, opts={}
+        raise "cannot serialize_many while serializing" if @depth > 0
+        reset_every = opts[:reset_every] || 0
+        raise ArgumentError, "reset_every can't be negative" if reset_every < 0
+
+        begin
+          reset_caches
+          nested do
+            values.each_with_index do |obj, i|
+              if reset_every > 0 && i > 0 && i % reset_every == 0
+                reset_caches
+              else
+                @object_cache = SerializerCache.new :object
+              end
+              serialize obj
+            end
+          end
+        ensure
+          reset_caches
+        end
+        finish_output
       end
 
       def write_reference index
-        header = index << 1 # shift value left to leave a low bit of 0
-        @stream << pack_integer(header)
+        write_ref Fragment::OBJECT_REF, index
       end
 
       def write_null
@@ -275,7 +561,7 @@ module RocketAMF
         if array.respond_to?(:is_array_collection?)
           is_ac = array.is_array_collection?
         else
-          is_ac = RocketAMF::ClassMapper.use_array_collection
+          is_ac = class_mapper.use_array_collection
         end
 
         # Write type marker
@@ -294,7 +580,7 @@ module RocketAMF
         if is_ac
           class_name = "flex.messaging.io.ArrayCollection"
           if @trait_cache[class_name] != nil
-            @stream << pack_integer(@trait_cache[class_name] << 2 | 0x01)
+            write_ref Fragment::TRAIT_REF, @trait_cache[class_name]
           else
             @trait_cache.add_obj class_name
             @stream << "\a" # Externalizable, non-dynamic
@@ -308,8 +594,42 @@ module RocketAMF
         header = header | 1 # set the low bit to 1
         @stream << pack_integer(header)
         @stream << AMF3_CLOSE_DYNAMIC_ARRAY
-        array.each do |elem|
-          serialize elem
+        nested do
+          array.each {|elem| serialize elem }
+        end
+      end
+
+      def write_vector vec
+        @stream << case vec.type
+                   when :int then AMF3_VECTOR_INT_MARKER
+                   when :uint then AMF3_VECTOR_UINT_MARKER
+                   when :double then AMF3_VECTOR_DOUBLE_MARKER
+                   else AMF3_VECTOR_OBJECT_MARKER
+                   end
+
+        # Write reference or cache vector
+        if @object_cache[vec] != nil
+          write_reference @object_cache[vec]
+          return
+        end
+        @object_cache.add_obj vec
+
+        @stream << pack_integer(vec.length << 1 | 1)
+        @stream << (vec.fixed ? 1 : 0)
+        case vec.type
+        when :int
+          vec.each {|i| raise RangeError, "#{i} out of range for int vector" if i < -2**31 || i >= 2**31 }
+          @stream << vec.pack('N*')
+        when :uint
+          vec.each {|i| raise RangeError, "#{i} out of range for uint vector" if i < 0 || i >= 2**32 }
+          @stream << vec.pack('N*')
+        when :double
+          @stream << vec.pack('G*')
+        else
+          write_utf8_vr(vec.class_name || "")
+          nested do
+            vec.each {|elem| serialize elem }
+          end
         end
       end
 
@@ -323,10 +643,16 @@ module RocketAMF
         end
         @object_cache.add_obj obj
 
+        # Use the sealed schema if the class has one
+        if traits.nil? && props.nil? && !obj.is_a?(Hash) && class_mapper.respond_to?(:serialization_schema)
+          traits = class_mapper.serialization_schema(obj.class)
+          props = {} if traits
+        end
+
         # Calculate traits if not given
         if traits.nil?
           traits = {
-                    :class_name => RocketAMF::ClassMapper.get_as_class_name(obj),
+                    :class_name => class_mapper.get_as_class_name(obj),
                     :members => [],
                     :externalizable => false,
                     :dynamic => true
@@ -336,9 +662,11 @@ module RocketAMF
 
         # Write out traits
         if class_name && @trait_cache[class_name] != nil
-          @stream << pack_integer(@trait_cache[class_name] << 2 | 0x01)
+          write_ref Fragment::TRAIT_REF, @trait_cache[class_name]
         else
-          @trait_cache.add_obj class_name if class_name
+          # Anonymous traits can't be referenced, but the deserializer still
+          # counts them
+          @trait_cache.add_obj class_name
 
           # Write out trait header
           header = 0x03 # Not object ref and not trait ref
@@ -356,27 +684,33 @@ module RocketAMF
 
         # If externalizable, take externalized data shortcut
         if traits[:externalizable]
-          obj.write_external(self)
+          nested { obj.write_external(self) }
           return
         end
 
         # Extract properties if not given
-        props = RocketAMF::ClassMapper.props_for_serialization(obj) if props.nil?
+        props = class_mapper.props_for_serialization(obj) if props.nil?
 
-        # Write out sealed properties
-        traits[:members].each do |m|
-          serialize props[m]
-          props.delete(m)
+        # Write out sealed properties, reading them from the getters if given
+        if traits[:getters]
+          nested do
+            traits[:getters].each {|g| serialize obj.send(g) }
+          end
+        else
+          traits[:members].each do |m|
+            nested { serialize props[m] }
+            props.delete(m)
+          end
         end
 
         # Write out dynamic properties
         if traits[:dynamic]
           # Write out dynamic properties
-          translate_case = RocketAMF::ClassMapper.get_as_option(traits[:class_name], 'translate_case')
+          translate_case = class_mapper.get_as_option(traits[:class_name], 'translate_case')
           props.sort.each do |key, val| # Sort props until Ruby 1.9 becomes common
-            key = translate_case ? key.to_s.gsub(/(?:_)(.)/) { $1.upcase } : key.to_s
+            key = translate_case ? RocketAMF::CaseTranslation.camelize(key) : key.to_s
             write_utf8_vr key
-            serialize val
+            nested { serialize val }
           end
 
           # Write close
@@ -387,6 +721,22 @@ module RocketAMF
       private
       include RocketAMF::Pure::WriteIOHelpers
 
+      def reset_caches
+        @string_cache = SerializerCache.new :string
+        @object_cache = SerializerCache.new :object
+        @trait_cache = SerializerCache.new :string
+      end
+
+      def reference_counts
+        [@string_cache.cache_index, @trait_cache.cache_index, @object_cache.cache_index]
+      end
+
+      def skip_references strings, traits, objects
+        @string_cache.skip strings
+        @trait_cache.skip traits
+        @object_cache.skip objects
+      end
+
       def write_utf8_vr str, encode=true
         if str.respond_to?(:encode)
           if encode
@@ -400,7 +750,7 @@ module RocketAMF
         if str == ''
           @stream << AMF3_EMPTY_STRING
         elsif @string_cache[str] != nil
-          write_reference @string_cache[str]
+          write_ref Fragment::STRING_REF, @string_cache[str]
         else
           # Cache string
           @string_cache.add_obj str
@@ -422,10 +772,17 @@ module RocketAMF
       end
 
       class StringCache < Hash #:nodoc:
+        attr_reader :cache_index
+
         def initialize
           @cache_index = 0
         end
 
+        # Reserves indices for entries written without going through the cache
+        def skip count
+          @cache_index += count
+        end
+
         def add_obj str
           self[str] = @cache_index
           @cache_index += 1
@@ -433,10 +790,17 @@ module RocketAMF
       end
 
       class ObjectCache < Hash #:nodoc:
+        attr_reader :cache_index
+
         def initialize
           @cache_index = 0
         end
 
+        # Reserves indices for entries written without going through the cache
+        def skip count
+          @cache_index += count
+        end
+
         def [] obj
           super(obj.object_id)
         end
@@ -15,9 +15,14 @@ module RocketAMF
     # Example:
     #
     #    req = RocketAMF::Envelope.new.populate_from_stream(env['rack.input'].read)
+    #
+    # Accepts the same options as the deserializers, so large uploads can be
+    # shared with the request body instead of copied out of it:
+    #
+    #    req = RocketAMF::Envelope.new.populate_from_stream(body, :shared_string_threshold => 64*1024)
     #--
     # Implemented in pure/remoting.rb RocketAMF::Pure::Envelope
-    def populate_from_stream stream
+    def populate_from_stream stream, opts={}
       raise AMFError, 'Must load "rocketamf/pure"'
     end
 
@@ -132,13 +137,56 @@ module RocketAMF
   end
 
   # RocketAMF::Envelope message
+  #
+  # Bodies read by Envelope#populate_from_stream are only checked for where
+  # they end, and stay as AMF until <tt>data</tt> is first called. A gateway
+  # can route or reject a message on its target_uri and the headers without
+  # paying to decode it. Decoding errors show up when the body is read. Bodies
+  # sent with their length aren't looked at at all, and each one's raw_data
+  # can be decoded on its own, in any order or in parallel. Pass
+  # <tt>:defer_bodies => false</tt> to decode them all up front instead.
   class Message
-    attr_accessor :target_uri, :response_uri, :data
+    attr_accessor :target_uri, :response_uri
+
+    # The AMF0 body, if it hasn't been decoded yet
+    attr_reader :raw_data
 
     def initialize target_uri, response_uri, data
       @target_uri = target_uri
       @response_uri = response_uri
       @data = data
     end
+
+    # Sets the body to the undecoded AMF0 string _amf_, deserialized with the
+    # given deserializer options when data is first called
+    def defer_data amf, opts=nil
+      @raw_data = amf
+      @raw_opts = opts
+      @data = nil
+    end
+
+    # Whether the body has been decoded
+    def data_loaded?
+      @raw_data.nil?
+    end
+
+    def data
+      if @raw_data
+        data = RocketAMF::Deserializer.new(@raw_opts || {}).deserialize(@raw_data)
+
+        # If they're using the flex remoting APIs, remove array wrapper
+        if data.is_a?(Array) && data.length == 1 && data[0].is_a?(::RocketAMF::Values::AbstractMessage)
+          data = data[0]
+        end
+        @data = data
+        @raw_data = @raw_opts = nil
+      end
+      @data
+    end
+
+    def data= data
+      @raw_data = @raw_opts = nil
+      @data = data
+    end
   end
 end
\ No newline at end of file
@@ -0,0 +1,27 @@
+module RocketAMF
+  module Values #:nodoc:
+    # Array that serializes as an AMF3 Vector. <tt>type</tt> is one of
+    # <tt>:int</tt>, <tt>:uint</tt>, <tt>:double</tt> or <tt>:object</tt>. For
+    # object vectors, <tt>class_name</tt> holds the AS3 element type, with an
+    # empty string meaning <tt>Vector.<*></tt>. Vectors are deserialized back
+    # into instances of this class so the type survives a round trip.
+    #
+    # Example:
+    #
+    #   RocketAMF.serialize(RocketAMF::Values::Vector.new(:int, [1, 2, 3]), 3)
+    class Vector < Array
+      TYPES = [:int, :uint, :double, :object]
+
+      attr_reader :type
+      attr_accessor :fixed, :class_name
+
+      def initialize type, values=[], fixed=false, class_name=""
+        raise ArgumentError, "unknown vector type: #{type.inspect}" unless TYPES.include?(type)
+        super(values)
+        @type = type
+        @fixed = fixed
+        @class_name = class_name
+      end
+    end
+  end
+end
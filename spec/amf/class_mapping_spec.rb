@@ -136,4 +136,21 @@ describe RocketAMF::ClassMapping do
       @mapper.props_for_serialization(nil).should == {:success => true}
     end
   end
+
+  describe "sealed schemas" do
+    it "should return nil for classes without a schema" do
+      @mapper.serialization_schema(ClassMappingTest).should be_nil
+    end
+
+    it "should build schemas from declared or derived members" do
+      @mapper.define {|m| m.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_b]}
+      schema = @mapper.serialization_schema(ClassMappingTest)
+      schema[:class_name].should == 'ASClass'
+      schema[:members].should == ['prop_b']
+      schema[:getters].should == [:prop_b]
+
+      @mapper.define {|m| m.map :as => 'ASClass2', :ruby => 'ClassMappingTest2', :sealed => true}
+      @mapper.serialization_schema(ClassMappingTest2)[:members].should == ['prop_a', 'prop_b', 'prop_c']
+    end
+  end
 end
\ No newline at end of file
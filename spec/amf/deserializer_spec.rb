@@ -89,6 +89,57 @@ describe "when deserializing" do
       output.should == '<parent><child prop="test" /></parent>'
     end
 
+    it "should return intact long strings when sharing them with the source" do
+      body = "abc" * 1000
+      input = "\014" + [body.length].pack('N') + body
+      des = RocketAMF::Deserializer.new(:shared_string_threshold => 1024)
+      output = des.deserialize(input)
+      input.replace("\000" * input.length)
+      GC.start
+      output.should == body
+      output.encoding.name.should == "UTF-8" if output.respond_to?(:encoding)
+      output << "d"
+      output.length.should == body.length + 1
+    end
+
+    it "should reject invalid UTF-8 when strict" do
+      input = "\002\000\002\303\050"
+      input.force_encoding("ASCII-8BIT") if input.respond_to?(:force_encoding)
+      RocketAMF::Deserializer.new.deserialize(input).length.should == 2
+      lambda {
+        RocketAMF::Deserializer.new(:strict_utf8 => true).deserialize(input)
+      }.should raise_error(EncodingError) if input.respond_to?(:force_encoding)
+    end
+
+    it "should be reusable after a reset" do
+      des = RocketAMF::Deserializer.new
+      input = object_fixture('amf0-ref-test.bin')
+      first = des.deserialize(input)
+      des.reset.deserialize(input).should == first
+      des.reset.deserialize(object_fixture('amf0-number.bin')).should == 3.5
+    end
+
+    it "should keep AMF0 references intact around an AMF3 value" do
+      amf3 = RocketAMF.serialize(["x", "x"], 3)
+      object = "\003\000\001a\000" + [1.0].pack('G') + "\000\000\011"
+      input = "\012" + [4].pack('N') + object + "\021" + amf3 + "\007\000\001" + "\021" + amf3
+      output = RocketAMF.deserialize(input, 0)
+      output[2].should equal(output[0])
+      output[3].should == ["x", "x"]
+    end
+
+    it "should read the same in two passes when releasing the GVL" do
+      amf3 = RocketAMF.serialize(["x", "x"], 3)
+      object = "\003\000\001a\000" + [1.0].pack('G') + "\000\000\011"
+      input = "\012" + [4].pack('N') + object + "\021" + amf3 + "\007\000\001" + "\021" + amf3
+      output = RocketAMF::Deserializer.new(:release_gvl_threshold => 1).deserialize(input)
+      output.should == RocketAMF.deserialize(input, 0)
+      output[2].should equal(output[0])
+
+      input = object_fixture('amf0-typed-object.bin')
+      RocketAMF::Deserializer.new(:release_gvl_threshold => 1).deserialize(input).should == RocketAMF.deserialize(input, 0)
+    end
+
     it "should deserialize an unmapped object as a dynamic anonymous object" do
       input = object_fixture("amf0-typed-object.bin")
       output = RocketAMF.deserialize(input, 0)
@@ -108,6 +159,15 @@ describe "when deserializing" do
       output.baz.should == nil
     end
 
+    it "should use the class mapper it was given" do
+      mapper = RocketAMF::ClassMapping.new
+      mapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'RubyClass'}
+
+      input = object_fixture("amf0-typed-object.bin")
+      RocketAMF::Deserializer.new(:class_mapper => mapper).deserialize(input).should be_a(RubyClass)
+      RocketAMF.deserialize(input, 0).should be_a(RocketAMF::Values::TypedHash)
+    end
+
     it "should translate case of a hash when explicitly told" do
       input = "\b\000\000\000\002\000\006mooCow\002\000\004oink\000\006fooBar\002\000\003baz\000\000\t"
       expected = {'moo_cow' => 'oink', 'foo_bar' => 'baz'}
@@ -117,6 +177,15 @@ describe "when deserializing" do
       output.should == expected
     end
 
+    it "should translate case of a typed object when explicitly told" do
+      input = "\020\000\025org.rocketAMF.ASClass\000\005propA\002\000\001a\000\000\t"
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'ClassMappingTest', :translate_case => true}
+
+      output = RocketAMF.deserialize(input, 0)
+      output.should be_a(ClassMappingTest)
+      output.prop_a.should == 'a'
+    end
+
     it "should not translate case of a hash when explicitly told" do
       input = "\b\000\000\000\002\000\006mooCow\002\000\004oink\000\006fooBar\002\000\003baz\000\000\t"
       expected = {'mooCow' => 'oink', 'fooBar' => 'baz'}
@@ -211,6 +280,13 @@ describe "when deserializing" do
         output.should == Time.at(0)
       end
 
+      it "should keep millisecond precision for dates" do
+        [Time.at(1234567890, 123000), Time.at(-1, 500000)].each do |time|
+          output = RocketAMF.deserialize(RocketAMF.serialize(time, 3), 3)
+          output.should == time
+        end
+      end
+
       it "should deserialize XML" do
         # XMLDocument tag
         input = object_fixture("amf3-xmlDoc.bin")
@@ -260,6 +336,22 @@ describe "when deserializing" do
         output[1].two.should == 5
       end
 
+      it "should read externalizable objects through IDataInput" do
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'DataExternalizableTest', :ruby => 'DataExternalizableTest'}
+        obj = DataExternalizableTest.new
+        obj.one = 1.5
+        obj.two = -7
+        obj.name = 'テスト'
+        obj.child = ['a', 'a']
+
+        output = RocketAMF.deserialize(RocketAMF.serialize([obj, obj], 3), 3)
+        output[0].one.should == 1.5
+        output[0].two.should == -7
+        output[0].name.should == 'テスト'
+        output[0].child.should == ['a', 'a']
+        output[1].object_id.should == output[0].object_id
+      end
+
       it "should deserialize a hash as a dynamic anonymous object" do
         input = object_fixture("amf3-hash.bin")
         output = RocketAMF.deserialize(input, 3)
@@ -309,12 +401,22 @@ describe "when deserializing" do
         input = object_fixture("amf3-byteArray.bin")
         output = RocketAMF.deserialize(input, 3)
 
-        output.should be_a(StringIO)
+        output.should be_a(RocketAMF::Values::ByteArray)
         expected = "\000\003これtest\100"
         expected.force_encoding("ASCII-8BIT") if expected.respond_to?(:force_encoding)
         output.string.should == expected
       end
 
+      it "should deserialize byte arrays that read like a StringIO" do
+        output = RocketAMF.deserialize(object_fixture("amf3-byteArray.bin"), 3)
+        output.should be_a(RocketAMF::Values::ByteArray)
+        output.size.should == 13
+        output.read(2).should == "\000\003"
+        output.dup.string.should == output.string
+        output.slice(9, 4).string.should == "\000\003これtest\100".unpack('C*')[9, 4].pack('C*')
+        RocketAMF.deserialize(RocketAMF::Values::ByteArray.new("\004\005"), 3).should == 5
+      end
+
       it "should deserialize an empty dictionary" do
         input = object_fixture("amf3-emptyDictionary.bin")
         output = RocketAMF.deserialize(input, 3)
@@ -333,6 +435,36 @@ describe "when deserializing" do
         str_key.should == "bar"
         output[str_key].should == "asdf1"
       end
+
+      it "should deserialize numeric vectors" do
+        output = RocketAMF.deserialize([0x0D, 0x05, 0x01, 1, -1].pack('CCCNN'), 3)
+        output.should be_a(RocketAMF::Values::Vector)
+        output.type.should == :int
+        output.fixed.should == true
+        output.should == [1, -1]
+        RocketAMF.deserialize([0x0E, 0x03, 0x00, 4294967295].pack('CCCN'), 3).should == [4294967295]
+        RocketAMF.deserialize([0x0F, 0x03, 0x00, 1.5].pack('CCCG'), 3).should == [1.5]
+      end
+
+      it "should deserialize object vectors" do
+        output = RocketAMF.deserialize("\020\005\000\rString\006\003a\001", 3)
+        output.type.should == :object
+        output.class_name.should == "String"
+        output.should == ["a", nil]
+      end
+
+      it "should raise on vectors longer than the source" do
+        input = "\011\005\001\r\300\200\200\001\000abc\004\001" # Length has the top bit set
+        lambda { RocketAMF.deserialize(input, 3) }.should raise_error(RangeError)
+        lambda { RocketAMF.deserialize("\016\377\377\377\377\000", 3) }.should raise_error(RangeError)
+      end
+
+      it "should raise on malformed vectors when releasing the GVL" do
+        ["\011\005\001\r\300\200\200\001\000abc\004\001", "\011\003\001\017\377\377\377\177\000abcdefgh"].each do |input|
+          des = RocketAMF::AMF3Deserializer.new(:release_gvl_threshold => 1)
+          lambda { des.deserialize(input) }.should raise_error(RangeError)
+        end
+      end
     end
 
     describe "and implementing the AMF Spec" do
@@ -382,6 +514,16 @@ describe "when deserializing" do
         output[1].foo.should == "bar"
       end
 
+      it "should translate case of sealed members through trait references" do
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'ClassMappingTest', :translate_case => true}
+
+        input = "\t\005\001\n\023\053org.rocketAMF.ASClass\013propA\004\001\n\001\004\002"
+        output = RocketAMF.deserialize(input, 3)
+
+        output.map {|o| o.class }.should == [ClassMappingTest, ClassMappingTest]
+        output.map {|o| o.prop_a }.should == [1, 2]
+      end
+
       it "should keep references of duplicate arrays" do
         input = object_fixture("amf3-arrayRef.bin")
         output = RocketAMF.deserialize(input, 3)
@@ -432,6 +574,20 @@ describe "when deserializing" do
         # parent[:children] = [child1, child2]
       end
 
+      it "should read the same in two passes when releasing the GVL" do
+        des = RocketAMF::AMF3Deserializer.new(:release_gvl_threshold => 1)
+        output = des.deserialize(object_fixture("amf3-graphMember.bin"))
+        output[:children][0][:parent].should === output
+        ["amf3-traitRef.bin", "amf3-mixedArray.bin", "amf3-complexArrayCollection.bin"].each do |fixture|
+          input = object_fixture(fixture)
+          des.reset.deserialize(input).should == RocketAMF.deserialize(input, 3)
+        end
+
+        # Externalizable objects are read the normal way
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'ExternalizableTest', :ruby => 'ExternalizableTest'}
+        des.reset.deserialize(object_fixture("amf3-externalizable.bin"))[1].two.should == 5
+      end
+
       it "should translate case of a hash when explicitly told" do
         input = "\n\v\001\015mooCow\006\toink\015fooBar\006\abaz\001"
         expected = {:moo_cow => 'oink', :foo_bar => 'baz'}
@@ -460,4 +616,89 @@ describe "when deserializing" do
       end
     end
   end
+
+  describe "in batches" do
+    it "should read back every value written by serialize_many" do
+      values = [{:name => 'a', :tags => ['x']}, {:name => 'b', :tags => ['x', 'y']}, 'name']
+      [nil, 2].each do |every|
+        input = RocketAMF::AMF3Serializer.new.serialize_many(values, :reset_every => every)
+        output = []
+        RocketAMF::AMF3Deserializer.new.each_value(input, :reset_every => every) {|obj| output << obj }
+        output.should == values
+      end
+    end
+
+    it "should return an enumerator without a block" do
+      input = RocketAMF::AMF3Serializer.new.serialize_many(['abc', 'abc'])
+      RocketAMF::AMF3Deserializer.new.each_value(StringIO.new(input)).to_a.should == ['abc', 'abc']
+    end
+  end
+
+  describe "from a mapped file" do
+    def mapped_fixture(binary_path)
+      RocketAMF::MappedSource.new(File.dirname(__FILE__) + '/../fixtures/objects/' + binary_path)
+    end
+
+    it "should read in place and update the source pos" do
+      input = mapped_fixture('amf0-hash.bin')
+      RocketAMF.deserialize(input, 0).should == {'a' => 'b', 'c' => 'd'}
+      input.pos.should == input.size
+    end
+
+    it "should let read_external read the source directly" do
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'ExternalizableTest', :ruby => 'ExternalizableTest'}
+      output = RocketAMF.deserialize(mapped_fixture('amf3-externalizable.bin'), 3)
+      output[1].two.should == 5
+    end
+  end
+
+  describe "fed in chunks" do
+    def feed_bytes des, input, size
+      output = []
+      (0...input.length).step(size) {|i| des.feed(input[i, size]) {|obj| output << obj } }
+      output
+    end
+
+    it "should yield AMF0 values as they complete" do
+      input = object_fixture('amf0-number.bin') + object_fixture('amf0-hash.bin') + object_fixture('amf0-string.bin')
+      output = feed_bytes(RocketAMF::Deserializer.new, input, 1)
+      output.should == [3.5, {'a' => 'b', 'c' => 'd'}, 'this is a テスト']
+    end
+
+    it "should yield AMF3 values as they complete" do
+      input = object_fixture('amf3-traitRef.bin') + object_fixture('amf3-mixedArray.bin')
+      expected = [RocketAMF.deserialize(object_fixture('amf3-traitRef.bin'), 3), RocketAMF.deserialize(object_fixture('amf3-mixedArray.bin'), 3)]
+      feed_bytes(RocketAMF::AMF3Deserializer.new, input, 3).should == expected
+    end
+
+    it "should keep partial values until the rest arrives" do
+      des = RocketAMF::AMF3Deserializer.new
+      input = object_fixture('amf3-string.bin')
+      des.feed(input[0, 3]).should == []
+      des.feed(input[3..-1] + input[0, 1]).should == ['String . String']
+      des.feed(input[1..-1]).should == ['String . String']
+    end
+
+    it "should read externalizable objects split across chunks" do
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'ExternalizableTest', :ruby => 'ExternalizableTest'}
+      output = feed_bytes(RocketAMF::AMF3Deserializer.new, object_fixture("amf3-externalizable.bin"), 5)
+      output.length.should == 1
+      output[0][1].two.should == 5
+    end
+
+    it "should raise on bad data inside externalizable objects instead of waiting for more" do
+      next unless defined?(RocketAMF::Ext) # The pure deserializer reads bad references as nil
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'DataExternalizableTest', :ruby => 'DataExternalizableTest'}
+      obj = DataExternalizableTest.new
+      obj.one = 1.5
+      obj.two = 1
+      obj.name = 'x'
+      input = RocketAMF.serialize(obj, 3)
+      input = input[0..-2] + "\n\n" # Child is a reference to an object that was never read
+
+      des = RocketAMF::AMF3Deserializer.new
+      des.feed(input[0, 5]).should == []
+      lambda { des.feed(input[5..-1]) }.should raise_error(RangeError)
+    end
+  end
 end
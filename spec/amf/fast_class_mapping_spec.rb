@@ -32,6 +32,12 @@ describe RocketAMF::Ext::FastClassMapping do
       @mapper.get_ruby_obj('ASClass').should be_a(ANamespace::TestRubyClass)
     end
 
+    it "should instantiate the new class after remapping" do
+      @mapper.get_ruby_obj('ASClass').should be_a(ClassMappingTest)
+      @mapper.define {|m| m.map :as => 'ASClass', :ruby => 'ClassMappingTest2'}
+      @mapper.get_ruby_obj('ASClass').should be_a(ClassMappingTest2)
+    end
+
     it "should return a hash with original type if not mapped" do
       obj = @mapper.get_ruby_obj('UnmappedClass')
       obj.should be_a(RocketAMF::Values::TypedHash)
@@ -79,6 +85,43 @@ describe RocketAMF::Ext::FastClassMapping do
       obj = @mapper.populate_ruby_obj RocketAMF::Values::TypedHash.new('UnmappedClass'), {:prop_a => 'Data'}
       obj[:prop_a].should == 'Data'
     end
+
+    it "should pick up new setters after mappings change" do
+      class ClassMappingTest4; attr_accessor :prop_a; end;
+      @mapper.populate_ruby_obj ClassMappingTest4.new, {:prop_a => 'A', :prop_b => 'B'}
+
+      class ClassMappingTest4; attr_accessor :prop_b; end;
+      @mapper.populate_ruby_obj(ClassMappingTest4.new, {:prop_b => 'B'}).prop_b.should be_nil
+
+      @mapper.define {|m| m.map :as => 'ASClass4', :ruby => 'ClassMappingTest4'}
+      @mapper.populate_ruby_obj(ClassMappingTest4.new, {:prop_b => 'B'}).prop_b.should == 'B'
+    end
+  end
+
+  describe "snapshots" do
+    it "should be frozen" do
+      snapshot = @mapper.snapshot
+      snapshot.frozen?.should == true
+      lambda { snapshot.define {|m| m.map :as => 'Other', :ruby => 'ClassMappingTest'} }.should raise_error(RuntimeError)
+      lambda { snapshot.reset }.should raise_error(RuntimeError)
+    end
+
+    it "should keep the mappings it was taken with" do
+      snapshot = @mapper.snapshot
+      @mapper.define {|m| m.map :as => 'SecondClass', :ruby => 'ClassMappingTest'}
+      snapshot.get_as_class_name(ClassMappingTest.new).should == 'ASClass'
+      snapshot.get_ruby_obj('ASClass').should be_a(ClassMappingTest)
+    end
+
+    it "should serialize and deserialize" do
+      obj = ClassMappingTest.new
+      obj.prop_a = 'Data'
+      snapshot = @mapper.snapshot
+      output = RocketAMF::AMF3Serializer.new(:class_mapper => snapshot).serialize(obj)
+      result = RocketAMF::AMF3Deserializer.new(:class_mapper => snapshot).deserialize(output)
+      result.should be_a(ClassMappingTest)
+      result.prop_a.should == 'Data'
+    end
   end
 
   describe "property extractor" do
@@ -0,0 +1,74 @@
+require "spec_helper.rb"
+
+describe RocketAMF::Reader do
+  def events input, version=0
+    out = []
+    RocketAMF::Reader.new(version).each_event(input) {|event, value| out << [event, value]; nil }
+    out
+  end
+
+  it "should yield events for an AMF0 object" do
+    events(object_fixture('amf0-object.bin')).should == [
+      [:start_object, nil],
+      [:key, :bar], [:double, 3.14],
+      [:key, :foo], [:string, "baz"],
+      [:end_object, nil]
+    ]
+  end
+
+  it "should report AMF0 references by index" do
+    events(object_fixture('amf0-ref-test.bin')).last(3).should == [[:key, "1"], [:reference, 1], [:end_hash, nil]]
+  end
+
+  it "should resolve AMF3 string references" do
+    strings = events(object_fixture('amf3-stringRef.bin'), 3).select {|e, v| e == :string }.map {|e, v| v }
+    strings.should == ["foo", "str", "foo", "str", "foo", "foo"]
+  end
+
+  it "should yield typed object class names and symbol keys" do
+    output = events(object_fixture('amf3-typedObject.bin'), 3)
+    output.first.should == [:start_object, "org.rocketAMF.ASClass"]
+    output.select {|e, v| e == :key }.map {|e, v| v }.should == [:baz, :foo]
+  end
+
+  it "should skip values when the block returns :skip" do
+    output = []
+    RocketAMF::Reader.new(3).each_event(object_fixture('amf3-typedObject.bin')) do |event, value|
+      output << [event, value]
+      :skip if event == :key && value == :baz
+    end
+    output.should == [[:start_object, "org.rocketAMF.ASClass"], [:key, :baz], [:key, :foo], [:string, "bar"], [:end_object, nil]]
+
+    output = []
+    RocketAMF::Reader.new.each_event(object_fixture('amf0-object.bin')) do |event, value|
+      output << [event, value]
+      :skip if event == :key && value == :bar
+    end
+    output.should == [[:start_object, nil], [:key, :bar], [:key, :foo], [:string, "baz"], [:end_object, nil]]
+  end
+
+  it "should raise on vectors longer than the source without starting them" do
+    ["\r\300\200\200\001\000abc", "\020\300\200\200\001\000\001\001"].each do |input|
+      output = []
+      lambda { RocketAMF::Reader.new(3).each_event(input) {|event, value| output << event; nil } }.should raise_error
+      output.should == []
+    end
+  end
+
+  it "should keep tables intact when skipping" do
+    output = []
+    objects = 0
+    RocketAMF::Reader.new(3).each_event(object_fixture('amf3-traitRef.bin')) do |event, value|
+      output << value if objects > 1
+      objects += 1 if event == :start_object
+      :skip if event == :start_object && objects == 1
+    end
+    output.should == [:baz, nil, :foo, "bar", nil, nil]
+  end
+
+  it "should update source pos if source is a StringIO object" do
+    input = StringIO.new(object_fixture('amf3-typedObject.bin'))
+    RocketAMF::Reader.new(3).each_event(input) {|event, value| }
+    input.pos.should == input.string.length
+  end
+end
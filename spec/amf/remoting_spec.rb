@@ -23,6 +23,56 @@ describe RocketAMF::Envelope do
       message.messageId.should == "7B0ACE15-8D57-6AE5-B9D4-99C2D32C8246"
       message.body.should == {}
     end
+    it "should leave message bodies undecoded until data is read" do
+      req = create_envelope("remotingMessage.bin")
+      message = req.messages[0]
+      message.data_loaded?.should == false
+      message.target_uri.should == "null"
+      message.data.should be_a(RocketAMF::Values::RemotingMessage)
+      message.data_loaded?.should == true
+      message.raw_data.should == nil
+    end
+
+    it "should read every message when bodies are left undecoded" do
+      env = RocketAMF::Envelope.new
+      env.messages << RocketAMF::Message.new('/1/onResult', '', [1, {"a" => "b"}])
+      env.messages << RocketAMF::Message.new('/2/onResult', '', 'hello')
+      req = RocketAMF::Envelope.new.populate_from_stream(env.serialize)
+      req.messages.map {|m| m.target_uri }.should == ['/1/onResult', '/2/onResult']
+      req.messages[1].data.should == 'hello'
+      req.messages[0].data.should == [1, {"a" => "b"}]
+    end
+
+    it "should slice bodies using their lengths" do
+      env = RocketAMF::Envelope.new
+      env.messages << RocketAMF::Message.new('/1/onResult', '', 'hello')
+      data = env.serialize
+      data[-12, 4].unpack('N')[0].should == 8 # String marker, length and 'hello'
+
+      # The length is trusted, so the trailing byte is part of the body
+      data[-12, 4] = [9].pack('N')
+      req = RocketAMF::Envelope.new.populate_from_stream(data + "\0")
+      req.messages[0].raw_data.should == data[-8, 8] + "\0"
+      req.messages[0].data.should == 'hello'
+    end
+
+    it "should decode bodies up front if asked" do
+      req = RocketAMF::Envelope.new.populate_from_stream(request_fixture("remotingMessage.bin"), :defer_bodies => false)
+      req.messages[0].data_loaded?.should == true
+      req.messages[0].data.should be_a(RocketAMF::Values::RemotingMessage)
+    end
+
+    it "should raise on malformed bodies of unknown length" do
+      body = "\021\r\300\200\200\001\000abc" # AMF3 vector longer than the body
+      data = "\000\003\000\000\000\001\000\001a\000\001b\377\377\377\377" + body
+      lambda { RocketAMF::Envelope.new.populate_from_stream(data) }.should raise_error(RangeError)
+    end
+
+    it "should not leave its options on deserializers used later" do
+      RocketAMF::Envelope.new.populate_from_stream(request_fixture("remotingMessage.bin"), :strict_utf8 => true, :shared_string_threshold => 1)
+      str = RocketAMF.deserialize("\002\000\002\377\376")
+      str.bytesize.should == 2
+    end
   end
 
   describe 'serializer' do
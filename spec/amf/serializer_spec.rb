@@ -48,6 +48,24 @@ describe "when serializing" do
       output.should == object_fixture('amf0-ref-test.bin')
     end
 
+    it "should serialize shared arrays and hashes as references" do
+      shared = {'a' => ['b']}
+      output = RocketAMF.serialize([shared, shared, shared['a']], 0)
+      output.should == "\n\000\000\000\003\010\000\000\000\001\000\001a\n\000\000\000\001" +
+                       "\002\000\001b\000\000\t\a\000\001\a\000\002"
+
+      result = RocketAMF.deserialize(output, 0)
+      result[0].should equal(result[1])
+      result[2].should equal(result[0]['a'])
+    end
+
+    it "should keep references when writing an array directly" do
+      ary = [1]
+      ser = RocketAMF::Serializer.new
+      ser.write_array([ary, ary])
+      ser.stream.should == RocketAMF.serialize([ary, ary], 0)
+    end
+
     it "should serialize Time objects" do
       output = RocketAMF.serialize(Time.utc(2003, 2, 13, 5), 0)
       output.should == object_fixture('amf0-time.bin')
@@ -63,6 +81,11 @@ describe "when serializing" do
       output.should == object_fixture('amf0-time.bin')
     end
 
+    it "should serialize DateTime objects with an offset" do
+      output = RocketAMF.serialize(DateTime.civil(2003, 2, 13, 7, 0, 0, Rational(2, 24)), 0)
+      output.should == object_fixture('amf0-time.bin')
+    end
+
     it "should serialize hashes" do
       output = RocketAMF.serialize({:a => 'b', 'c' => 'd'}, 0)
       output.should == object_fixture('amf0-hash.bin')
@@ -85,6 +108,17 @@ describe "when serializing" do
       output.should == object_fixture('amf0-typed-object.bin')
     end
 
+    it "should use the class mapper it was given" do
+      obj = RubyClass.new
+      obj.foo = "bar"
+      mapper = RocketAMF::ClassMapping.new
+      mapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'RubyClass'}
+
+      output = RocketAMF::Serializer.new(:class_mapper => mapper).serialize(obj)
+      output.should == object_fixture('amf0-typed-object.bin')
+      RocketAMF.serialize(obj, 0).should == object_fixture('amf0-untyped-object.bin')
+    end
+
     if "".respond_to?(:force_encoding)
       it "should support multiple encodings" do
         shift_str = "\x53\x68\x69\x66\x74\x20\x83\x65\x83\x58\x83\x67".force_encoding("Shift_JIS") # "Shift テスト"
@@ -345,6 +379,62 @@ describe "when serializing" do
         output = RocketAMF.serialize(input, 3)
         output.should == expected
       end
+
+      it "should serialize byte arrays" do
+        expected = object_fixture("amf3-byteArray.bin")
+        RocketAMF.serialize(RocketAMF.deserialize(expected, 3), 3).should == expected
+        RocketAMF.serialize(RocketAMF::Values::ByteArray.new("\001\002"), 3).should == "\f\005\001\002"
+
+        ba = RocketAMF::Values::ByteArray.new("\001\002")
+        ba.read(1)
+        ba.write("\003\004")
+        RocketAMF.serialize(ba, 3).should == "\f\007\001\003\004"
+      end
+
+      it "should serialize numeric vectors" do
+        RocketAMF.serialize(RocketAMF::Values::Vector.new(:int, [1, -1]), 3).should == [0x0D, 0x05, 0x00, 1, -1].pack('CCCNN')
+        RocketAMF.serialize(RocketAMF::Values::Vector.new(:uint, [4294967295], true), 3).should == [0x0E, 0x03, 0x01, 4294967295].pack('CCCN')
+        RocketAMF.serialize(RocketAMF::Values::Vector.new(:double, [1.5]), 3).should == [0x0F, 0x03, 0x00, 1.5].pack('CCCG')
+      end
+
+      it "should serialize object vectors" do
+        vec = RocketAMF::Values::Vector.new(:object, ["a", nil], false, "String")
+        RocketAMF.serialize(vec, 3).should == "\020\005\000\rString\006\003a\001"
+      end
+
+      it "should raise when a vector element is out of range" do
+        lambda { RocketAMF.serialize(RocketAMF::Values::Vector.new(:uint, [-1]), 3) }.should raise_error(RangeError)
+      end
+
+      it "should serialize objects with declared members as sealed" do
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'RubyClass', :members => [:foo, :baz]}
+        obj1 = RubyClass.new
+        obj1.foo = "a"
+        obj2 = RubyClass.new
+        obj2.foo = "b"
+
+        output = RocketAMF.serialize([obj1, obj2], 3)
+        output.should == "\t\005\001\n#+org.rocketAMF.ASClass\007foo\007baz\006\003a\001\n\001\006\003b\001"
+      end
+
+      it "should derive sealed members from the class" do
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'org.rocketAMF.ASClass', :ruby => 'RubyClass', :sealed => true}
+        obj = RubyClass.new
+        obj.foo = "a"
+
+        output = RocketAMF.serialize(obj, 3)
+        output.should == "\n#+org.rocketAMF.ASClass\007baz\007foo\001\006\003a"
+      end
+
+      it "should translate the case of sealed members" do
+        class SealedCaseObj; attr_accessor :first_name; end
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'vo.Sealed', :ruby => 'SealedCaseObj', :members => [:first_name], :translate_case => true}
+        obj = SealedCaseObj.new
+        obj.first_name = "a"
+
+        output = RocketAMF.serialize(obj, 3)
+        output.should == "\n\023\023vo.Sealed\023firstName\006\003a"
+      end
     end
 
     describe "and implementing the AMF Spec" do
@@ -363,6 +453,11 @@ describe "when serializing" do
         output.should == expected
       end
 
+      it "should not confuse strings with embedded nulls" do
+        output = RocketAMF.serialize(["a\000b", "a\000c", "a\000b"], 3)
+        output.should == "\t\a\001\006\aa\000b\006\aa\000c\006\000"
+      end
+
       it "should not reference the empty string" do
         expected = object_fixture("amf3-emptyStringRef.bin")
         input = ""
@@ -392,6 +487,29 @@ describe "when serializing" do
         output.should == expected
       end
 
+      it "should count anonymous traits when referencing traits" do
+        typed = Object.new
+        def typed.encode_amf serializer
+          serializer.write_object(self, {}, {:class_name => 'org.rocketAMF.ASClass', :dynamic => false, :externalizable => false, :members => []})
+        end
+        output = RocketAMF.serialize([{'a' => 1}, typed, typed.clone], 3)
+        output.should == "\t\a\001\n\v\001\003a\004\001\001\n\003+org.rocketAMF.ASClass\n\005"
+      end
+
+      it "should leave sealed members out of the dynamic ones at every depth" do
+        inner = Object.new
+        def inner.encode_amf serializer
+          serializer.write_object(self, {"a" => 2, "z" => 3}, {:class_name => nil, :dynamic => true, :externalizable => false, :members => ["a"]})
+        end
+        outer = Object.new
+        outer.instance_variable_set(:@inner, inner)
+        def outer.encode_amf serializer
+          serializer.write_object(self, {"a" => @inner, "b" => @inner, "c" => 1}, {:class_name => nil, :dynamic => true, :externalizable => false, :members => ["a", "c"]})
+        end
+        output = RocketAMF.serialize(outer, 3)
+        output.should == "\n+\001\003a\003c\n\e\001\000\004\002\003z\004\003\001\004\001\003b\n\002\001"
+      end
+
       it "should keep reference of duplicate object traits" do
         obj1 = RubyClass.new
         obj1.foo = "foo"
@@ -524,5 +642,165 @@ describe "when serializing" do
       output = RocketAMF.serialize(input, 3)
       output.should == expected
     end
+
+    it "should translate case of typed hashes by their type" do
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'vo.Cow', :ruby => 'Cow', :translate_case => true}
+      cow = RocketAMF::Values::TypedHash.new('Cow')
+      cow['moo_cow'] = 'oink'
+      expected = "\t\005\001\n\v\rvo.Cow\rmooCow\006\toink\001\n\001\002\006\004\001"
+
+      output = RocketAMF.serialize([cow, cow.merge('moo_cow' => 'oink')], 3)
+      output.should == expected
+    end
+
+    it "should use a class mapper's own props_for_serialization for hashes" do
+      mapper = Class.new(RocketAMF::ClassMapping) { def props_for_serialization(obj); {'x' => 1}; end }.new
+      output = RocketAMF::AMF3Serializer.new(:class_mapper => mapper).serialize({'a' => 2})
+      output.should == RocketAMF.serialize({'x' => 1}, 3)
+    end
+  end
+
+  describe "fragments" do
+    it "should embed an AMF3 fragment as if serialized in place" do
+      pre = {'p' => 'pre'}
+      data = {'k' => ['v', 'v', {'k' => 1}]}
+      expected = RocketAMF.serialize([pre, data, 'pre', pre], 3)
+      RocketAMF.serialize([pre, RocketAMF::Fragment.new(data, 3), 'pre', pre], 3).should == expected
+    end
+
+    it "should embed an AMF0 fragment as if serialized in place" do
+      shared = {'b' => 2}
+      after = {'c' => 3}
+      expected = RocketAMF.serialize([{'a' => 1}, [shared, shared], after, after], 0)
+      RocketAMF.serialize([{'a' => 1}, RocketAMF::Fragment.new([shared, shared], 0), after, after], 0).should == expected
+    end
+
+    it "should switch to AMF3 for an AMF3 fragment in an AMF0 stream" do
+      RocketAMF.serialize(RocketAMF::Fragment.new(['s', 's'], 3), 0).should == "\021" + RocketAMF.serialize(['s', 's'], 3)
+    end
+
+    it "should not embed an AMF0 fragment in an AMF3 stream" do
+      lambda { RocketAMF.serialize(RocketAMF::Fragment.new('s', 0), 3) }.should raise_error(ArgumentError)
+    end
+  end
+
+  describe "stream management" do
+    it "should accept a size hint" do
+      ser = RocketAMF::AMF3Serializer.new(:size_hint => 4096)
+      ser.serialize("String . String").should == object_fixture('amf3-string.bin')
+    end
+
+    it "should empty the stream on reset" do
+      ser = RocketAMF::AMF3Serializer.new
+      ser.serialize("String . String")
+      ser.reset
+      ser.stream.should == ""
+      ser.serialize(nil).should == object_fixture('amf3-null.bin')
+    end
+
+    it "should start a new stream when the stream is taken" do
+      ser = RocketAMF::Serializer.new
+      ser.serialize(nil)
+      first = ser.take_stream
+      ser.serialize(true)
+      first.should == object_fixture('amf0-null.bin')
+      ser.stream.should == object_fixture('amf0-boolean.bin')
+    end
+    it "should not keep references between serialize calls" do
+      ary = ['a']
+      ser = RocketAMF::AMF3Serializer.new
+      ser.serialize(ary)
+      first = ser.take_stream
+      ser.serialize(ary).should == first
+    end
+
+    it "should share strings but not objects across a batch" do
+      ary = ['abc']
+      ser = RocketAMF::AMF3Serializer.new
+      ser.serialize_many([ary, ary]).should == "\t\003\001\006\aabc\t\003\001\006\000"
+    end
+
+    it "should start the batch tables over every reset_every values" do
+      ser = RocketAMF::AMF3Serializer.new
+      ser.serialize_many(['abc', 'abc', 'abc'], :reset_every => 2).should == "\006\aabc\006\000\006\aabc"
+    end
+
+    it "should pick up encode_amf methods defined between serialize calls" do
+      klass = Class.new(Hash)
+      ser = RocketAMF::AMF3Serializer.new
+      ser.serialize([klass.new, klass.new]).should == "\t\005\001\n\v\001\001\n\v\001\001"
+      klass.send(:define_method, :encode_amf) {|s| s.serialize(nil) }
+      ser.take_stream
+      ser.serialize([klass.new, klass.new]).should == "\t\005\001\001\001"
+    end
+
+    it "should pick up encode_amf methods defined between serialize_many values" do
+      values = Enumerator.new do |y|
+        y << 1
+        Integer.send(:define_method, :encode_amf) {|s| s.serialize(nil) }
+        y << 1
+      end
+      begin
+        RocketAMF::AMF3Serializer.new.serialize_many(values).should == "\004\001\001"
+      ensure
+        Integer.send(:remove_method, :encode_amf)
+      end
+    end
+
+    it "should write to an IO in chunks" do
+      io = StringIO.new
+      ser = RocketAMF::AMF3Serializer.new(io, :chunk_size => 3)
+      ser.serialize("String . String").should == object_fixture('amf3-string.bin').bytesize
+      io.string.should == object_fixture('amf3-string.bin')
+    end
+
+    it "should keep chunks in order when write_external appends to the stream" do
+      obj = ExternalizableTest.new
+      obj.one = 5
+      obj.two = 3
+      expected = RocketAMF.serialize([obj, "String . String"], 3)
+      chunks = []
+      ser = RocketAMF::AMF3Serializer.new(:chunk_size => 4) {|c| chunks << c}
+      ser.serialize([obj, "String . String"]).should == expected.bytesize
+      chunks.join.should == expected
+    end
+
+    it "should yield chunks to a block" do
+      chunks = []
+      ser = RocketAMF::Serializer.new(:chunk_size => 4) {|c| chunks << c}
+      ser.serialize("String . String")
+      chunks.map {|c| c.bytesize}.should == [4, 4, 4, 4, 2]
+      chunks.join.should == RocketAMF.serialize("String . String", 0)
+    end
+
+    it "should raise when the output exceeds max_bytes" do
+      ser = RocketAMF::AMF3Serializer.new(:max_bytes => 4)
+      lambda { ser.serialize("String . String") }.should raise_error(RangeError)
+    end
+
+    it "should count what it writes when built with stats" do
+      ser = RocketAMF::AMF3Serializer.new
+      unless defined?(RocketAMF::Ext) && RocketAMF::Ext.stats_enabled?
+        ser.serialize(["a"])
+        ser.stats.should be_nil
+        next
+      end
+
+      calls = []
+      RocketAMF::Ext.stats_hook = lambda {|kind, counts| calls << [kind, counts[:bytes]] }
+      begin
+        ser.serialize(["a", "a", {}])
+      ensure
+        RocketAMF::Ext.stats_hook = nil
+      end
+      stats = ser.stats
+      stats[:bytes].should == ser.stream.bytesize
+      stats[:amf3_values].should == {0x09 => 1, 0x06 => 2, 0x0a => 1}
+      [stats[:string_hits], stats[:string_misses]].should == [1, 1]
+      [stats[:object_hits], stats[:object_misses], stats[:trait_misses]].should == [0, 2, 1]
+      stats[:max_depth].should == 2
+      stats[:callbacks][:props_for_serialization].should == 0 # Plain hashes skip the class mapper
+      calls.should == [[:serialize, ser.stream.bytesize]]
+    end
   end
 end
@@ -10,6 +10,35 @@ describe RocketAMF::Values::AbstractMessage do
   end
 end
 
+describe RocketAMF::Values::AcknowledgeMessage do
+  before :each do
+    @message = RocketAMF::Values::AcknowledgeMessage.new
+    @message.body = {:result => [1, 'two']}
+  end
+
+  it "should round trip through AMF3" do
+    copy = RocketAMF.deserialize(RocketAMF.serialize(@message, 3), 3)
+    copy.class.should == RocketAMF::Values::AcknowledgeMessage
+    copy.messageId.should == @message.messageId
+    copy.clientId.should == @message.clientId
+    copy.body.should == @message.body
+  end
+
+  it "should still go through custom object serializers" do
+    serializer = Object.new
+    def serializer.can_handle?(obj); obj.is_a?(RocketAMF::Values::AcknowledgeMessage); end
+    def serializer.serialize(obj); {'custom' => true}; end
+    RocketAMF::ClassMapper.object_serializers << serializer
+    begin
+      output = RocketAMF.serialize(@message, 3)
+      output.should =~ /custom/
+      output.should_not =~ /messageId/
+    ensure
+      RocketAMF::ClassMapper.object_serializers.delete(serializer)
+    end
+  end
+end
+
 describe RocketAMF::Values::ErrorMessage do
   before :each do
     @e = Exception.new('Error message')
@@ -58,4 +58,22 @@ class ExternalizableTest
     ser.stream << pack_double(@one)
     ser.stream << pack_double(@two)
   end
+end
+class DataExternalizableTest
+  attr_accessor :one, :two, :name, :child
+
+  def encode_amf serializer
+    serializer.write_object(self, nil, {:class_name => 'DataExternalizableTest', :dynamic => false, :externalizable => true, :members => []})
+  end
+
+  def read_external des
+    @one = des.readDouble
+    @two = des.readInt
+    @name = des.readUTF
+    @child = des.readObject
+  end
+
+  def write_external ser
+    ser.writeDouble(@one).writeInt(@two).writeUTF(@name).writeObject(@child)
+  end
 end
\ No newline at end of file